@@ -0,0 +1,30 @@
+#!/bin/bash
+#
+# Runs the same load alone, then along with each kind of misbehaving connection (see
+# client --slow, --unread and --idle), and reports the latency of the well-behaved
+# connections in each case, along with what the misbehaving ones managed to do.
+#
+# Usage: bench/adverse.sh [connections] [seconds] [adverse] [backend]
+
+curdir=$(dirname $0)/..
+
+connections=${1:-8}
+seconds=${2:-5}
+adverse=${3:-100}
+backend=${4:-epoll}
+
+for mode in none slow unread idle; do
+    options=
+    [ "$mode" != none ] && options="--$mode $adverse"
+
+    "$curdir/server" --backend $backend > /dev/null 2> /dev/null &
+    server_pid=$!
+    sleep 0.5
+
+    echo "$mode:"
+    "$curdir/client" --backend $backend --connections $connections --duration $seconds --chunk 512 --quiet $options 2>&1 \
+        | grep -v "^backend " | sed 's/^/    /'
+
+    kill -INT $server_pid
+    wait $server_pid
+done
@@ -0,0 +1,30 @@
+#!/bin/bash
+#
+# Runs the same workload with the server and the client on each I/O backend, and
+# reports the throughput, the latency from each send to its ack, and the system calls
+# made per ack by each side.
+#
+# Usage: bench/backends.sh [connections] [bytes] [chunk] [backends...]
+
+curdir=$(dirname $0)/..
+
+connections=${1:-20}
+bytes=${2:-20000000}
+chunk=${3:-512}
+shift 3 2> /dev/null
+backends=${@:-epoll poll io_uring}
+
+for backend in $backends; do
+    "$curdir/server" --backend $backend > /dev/null 2> "/tmp/backends-$backend.txt" &
+    server_pid=$!
+    sleep 0.5
+
+    echo "$backend:"
+    "$curdir/client" --backend $backend --connections $connections --bytes $bytes --chunk $chunk --quiet 2>&1 \
+        | sed 's/^backend [a-z_]*: /client: /; s/^/    /'
+
+    kill -INT $server_pid
+    wait $server_pid
+    grep "^backend $backend:" "/tmp/backends-$backend.txt" | sed 's/^backend [a-z_]*: /server: /; s/^/    /'
+    rm -f "/tmp/backends-$backend.txt"
+done
@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Opens mostly idle connections to the server in steps, up to a million by default,
+# and reports at each step the server's resident memory and CPU time per connection,
+# its CPU time per message, which grows with the connection count if the backend's
+# cost does, and the latency of messages sent at a low rate over random connections.
+#
+# Both processes need a descriptor limit above the connection count, which they raise
+# themselves as far as they are allowed to (see fs.nr_open), and the system enough
+# memory for twice as many sockets.
+#
+# Usage: bench/c1m.sh [steps] [seconds] [rate] [backends...]
+
+curdir=$(dirname $0)/..
+
+steps=${1:-10k,100k,250k,500k,1m}
+seconds=${2:-5}
+rate=${3:-1000}
+shift 3 2> /dev/null
+backends=${@:-epoll}
+
+for backend in $backends; do
+    "$curdir/server" --c1m --backend $backend > /dev/null 2> "/tmp/c1m-$backend.txt" &
+    server_pid=$!
+    sleep 0.5
+
+    echo "$backend:"
+    "$curdir/client" --c1m $steps --duration $seconds --rate $rate --server-pid $server_pid 2>&1 \
+        | sed 's/^/    /'
+
+    kill -INT $server_pid
+    wait $server_pid
+    grep "^memory:\|^backend $backend:" "/tmp/c1m-$backend.txt" | sed 's/^backend [a-z_]*: /server: /; s/^/    /'
+    rm -f "/tmp/c1m-$backend.txt"
+done
@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Tells whether a change made things slower: compares the runs recorded by
+ * bench/harness --history under two labels on this machine, scenario by scenario.
+ *
+ * For the throughput and the latency percentiles of each scenario, the runs of the
+ * baseline and of the candidate are compared with a Mann-Whitney U test, which makes no
+ * assumption on how the results are distributed (benchmark results seldom are normal,
+ * with their long tail of disturbed runs). A difference is reported when it is both
+ * significant and larger than the threshold; the exit status is 1 if any of them is a
+ * regression, so that the comparison can gate a merge.
+ *
+ *   bench/harness --runs 7 --history bench/history --label $(git rev-parse --short HEAD)
+ *   bench/compare --baseline 1a2b3c4 --candidate 5d6e7f8
+ *
+ * The exact distribution of U is used when there are no ties and at most 20 runs on
+ * each side, and its normal approximation otherwise. At least 4 runs on each side are
+ * needed for a difference to be significant at 5%.
+ *
+ * Build: cc -O2 -o bench/compare bench/compare.c -lm
+ */
+#include <errno.h>
+#include <getopt.h>     // getopt_long()
+#include <math.h>       // erfc()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "machine.h"
+
+// max number of runs per label and scenario
+#define MAX_RUNS 64
+
+// up to which number of runs the exact distribution of U is computed
+#define EXACT_RUNS 20
+
+#define MAX_LABEL 64
+#define MAX_SCENARIO 256
+
+struct metric
+{
+    const char *key;
+    const char *name;
+    int higher_is_better;
+};
+
+static const struct metric metrics[] =
+{
+    { "throughput_mbps", "throughput", 1 },
+    { "latency_p50_us",  "p50",        0 },
+    { "latency_p99_us",  "p99",        0 },
+    { "latency_p999_us", "p99.9",      0 },
+};
+
+#define METRICS ( (int) ( sizeof(metrics) / sizeof(metrics[0]) ) )
+
+// a run of the history
+struct record
+{
+    char label[MAX_LABEL];
+    char scenario[MAX_SCENARIO];
+    double values[METRICS];
+};
+
+static struct record *records = NULL;
+static int nrecords = 0;
+
+// The string value of "key" in a line of JSON written by the harness, unescaped. Only
+// the escapes the harness writes are understood: \" and \\, and \u00XX.
+static int json_string(const char *line, const char *key, char *value, size_t size)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+
+    const char *c = strstr(line, pattern);
+    if ( NULL == c )
+        return -1;
+    c += strlen(pattern);
+
+    size_t n = 0;
+    while ( '"' != *c )
+    {
+        if ( '\0' == *c || n + 1 >= size )
+            return -1;
+
+        unsigned int code;
+        if ( '\\' != *c )
+        {
+            value[n++] = *c++;
+        }
+        else if ( '"' == c[1] || '\\' == c[1] )
+        {
+            value[n++] = c[1];
+            c += 2;
+        }
+        else if ( 'u' == c[1] && 1 == sscanf(c + 2, "%4x", &code) && code < 0x80 )
+        {
+            value[n++] = (char) code;
+            c += 6;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    value[n] = '\0';
+    return 0;
+}
+
+static int json_number(const char *line, const char *key, double *value)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+
+    const char *start = strstr(line, pattern);
+    if ( NULL == start )
+        return -1;
+
+    char *end;
+    *value = strtod(start + strlen(pattern), &end);
+    return ( end == start + strlen(pattern) ) ? -1 : 0;
+}
+
+static void load_history(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if ( NULL == fp )
+    {
+        fprintf(stderr, "%s: open error (%d)\n", path, errno);
+        exit(1);
+    }
+
+    int size = 0;
+    char line[2048];
+
+    while ( NULL != fgets(line, sizeof(line), fp) )
+    {
+        if ( nrecords == size )
+        {
+            size = ( 0 < size ) ? size * 2 : 256;
+            records = (struct record *) realloc(records, size * sizeof(struct record));
+            if ( NULL == records )
+            {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+
+        struct record *r = &records[nrecords];
+        if ( -1 == json_string(line, "label", r->label, sizeof(r->label))
+             || -1 == json_string(line, "scenario", r->scenario, sizeof(r->scenario)) )
+        {
+            continue;
+        }
+
+        int complete = 1;
+        for ( int m = 0; m < METRICS; m++ )
+            complete &= ( 0 == json_number(line, metrics[m].key, &r->values[m]) );
+
+        if ( complete )
+            nrecords++;
+    }
+
+    fclose(fp);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return ( x > y ) - ( x < y );
+}
+
+static double median(double *values, int n)
+{
+    qsort(values, n, sizeof(double), compare_doubles);
+    return ( n % 2 ) ? values[n / 2] : ( values[n / 2 - 1] + values[n / 2] ) / 2;
+}
+
+// P(U <= u) for samples of n1 and n2 values without ties, by counting the orderings
+// of the two samples that give each U: c(i, j, u) = c(i - 1, j, u - j) + c(i, j - 1, u)
+static double exact_cdf(int n1, int n2, double u)
+{
+    int umax = n1 * n2;
+    double *c = (double *) calloc((size_t) ( n1 + 1 ) * ( n2 + 1 ) * ( umax + 1 ), sizeof(double));
+    if ( NULL == c )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+#define C(i, j, k) c[( (size_t) ( i ) * ( n2 + 1 ) + ( j ) ) * ( umax + 1 ) + ( k )]
+
+    for ( int i = 0; i <= n1; i++ )
+    {
+        for ( int j = 0; j <= n2; j++ )
+        {
+            if ( 0 == i || 0 == j )
+            {
+                C(i, j, 0) = 1;
+                continue;
+            }
+
+            for ( int k = 0; k <= i * j; k++ )
+                C(i, j, k) = ( ( k >= j ) ? C(i - 1, j, k - j) : 0 ) + C(i, j - 1, k);
+        }
+    }
+
+    double below = 0, total = 0;
+    for ( int k = 0; k <= umax; k++ )
+    {
+        total += C(n1, n2, k);
+        if ( k <= u )
+            below += C(n1, n2, k);
+    }
+
+#undef C
+
+    free(c);
+    return below / total;
+}
+
+// two-sided p-value of the Mann-Whitney U test of the samples a and b
+static double mann_whitney(const double *a, int n1, const double *b, int n2)
+{
+    int n = n1 + n2;
+    double values[2 * MAX_RUNS];
+    int from_a[2 * MAX_RUNS];
+
+    for ( int i = 0; i < n1; i++ )
+    {
+        values[i] = a[i];
+        from_a[i] = 1;
+    }
+    for ( int i = 0; i < n2; i++ )
+    {
+        values[n1 + i] = b[i];
+        from_a[n1 + i] = 0;
+    }
+
+    // sort both together, carrying where each value came from
+    for ( int i = 1; i < n; i++ )
+    {
+        for ( int j = i; 0 < j && values[j - 1] > values[j]; j-- )
+        {
+            double v = values[j]; values[j] = values[j - 1]; values[j - 1] = v;
+            int f = from_a[j]; from_a[j] = from_a[j - 1]; from_a[j - 1] = f;
+        }
+    }
+
+    // tied values share the mean of their ranks
+    double rank_sum = 0, ties = 0;
+    for ( int i = 0; i < n; )
+    {
+        int j = i;
+        while ( j + 1 < n && values[j + 1] == values[i] )
+            j++;
+
+        double rank = ( i + j ) / 2.0 + 1;
+        for ( int k = i; k <= j; k++ )
+        {
+            if ( from_a[k] )
+                rank_sum += rank;
+        }
+
+        double t = j - i + 1;
+        ties += t * t * t - t;
+        i = j + 1;
+    }
+
+    double u1 = rank_sum - n1 * ( n1 + 1 ) / 2.0;
+    double u = ( u1 < n1 * n2 - u1 ) ? u1 : n1 * n2 - u1;
+
+    if ( 0 == ties && n1 <= EXACT_RUNS && n2 <= EXACT_RUNS )
+    {
+        double p = 2 * exact_cdf(n1, n2, u);
+        return ( 1 < p ) ? 1 : p;
+    }
+
+    double mean = n1 * n2 / 2.0;
+    double variance = n1 * n2 / 12.0 * ( ( n + 1 ) - ties / ( (double) n * ( n - 1 ) ) );
+    if ( variance <= 0 )
+        return 1;
+
+    // with a continuity correction
+    double z = ( fabs(u1 - mean) - 0.5 ) / sqrt(variance);
+    return ( z <= 0 ) ? 1 : erfc(z / sqrt(2));
+}
+
+// the values of a metric recorded for a label and scenario
+static int samples(const char *label, const char *scenario, int m, double *values)
+{
+    int n = 0;
+
+    for ( int i = 0; i < nrecords && n < MAX_RUNS; i++ )
+    {
+        if ( 0 == strcmp(records[i].label, label) && 0 == strcmp(records[i].scenario, scenario) )
+            values[n++] = records[i].values[m];
+    }
+
+    return n;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s -b|--baseline LABEL [options]\n", prog);
+    fprintf(stderr, "  -b, --baseline LABEL   runs to compare against\n");
+    fprintf(stderr, "  -c, --candidate LABEL  runs to compare (default the last label recorded)\n");
+    fprintf(stderr, "  -H, --history DIR      history written by bench/harness (default bench/history)\n");
+    fprintf(stderr, "  -f, --file PATH        history file, instead of the one of this machine in DIR\n");
+    fprintf(stderr, "  -t, --threshold PCT    smallest change of the median reported (default 5)\n");
+    fprintf(stderr, "  -a, --alpha P          significance level (default 0.05)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *baseline = NULL;
+    const char *candidate = NULL;
+    const char *history_dir = "bench/history";
+    const char *history_path = NULL;
+    double threshold = 5;
+    double alpha = 0.05;
+
+    static const struct option long_options[] =
+    {
+        { "baseline",  required_argument, NULL, 'b' },
+        { "candidate", required_argument, NULL, 'c' },
+        { "history",   required_argument, NULL, 'H' },
+        { "file",      required_argument, NULL, 'f' },
+        { "threshold", required_argument, NULL, 't' },
+        { "alpha",     required_argument, NULL, 'a' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL,        0,                 NULL, 0   }
+    };
+
+    int opt;
+    while ( -1 != ( opt = getopt_long(argc, argv, "b:c:H:f:t:a:h", long_options, NULL) ) )
+    {
+        switch ( opt )
+        {
+            case 'b': baseline = optarg; break;
+            case 'c': candidate = optarg; break;
+            case 'H': history_dir = optarg; break;
+            case 'f': history_path = optarg; break;
+            case 't': threshold = atof(optarg); break;
+            case 'a': alpha = atof(optarg); break;
+
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if ( NULL == baseline )
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    char path[4096];
+    if ( NULL == history_path )
+    {
+        char fingerprint[32];
+        machine_fingerprint(fingerprint, sizeof(fingerprint));
+        snprintf(path, sizeof(path), "%s/%s.jsonl", history_dir, fingerprint);
+        history_path = path;
+    }
+
+    load_history(history_path);
+
+    if ( NULL == candidate )
+    {
+        for ( int i = nrecords - 1; 0 <= i && NULL == candidate; i-- )
+        {
+            if ( 0 != strcmp(records[i].label, baseline) )
+                candidate = records[i].label;
+        }
+
+        if ( NULL == candidate )
+        {
+            fprintf(stderr, "nothing recorded but %s in %s\n", baseline, history_path);
+            exit(1);
+        }
+    }
+
+    printf("baseline %s, candidate %s, threshold %g%%, alpha %g\n", baseline, candidate, threshold, alpha);
+    printf("%-40s %-10s %4s %4s %12s %12s %8s %8s  %s\n",
+           "scenario", "metric", "n1", "n2", "baseline", "candidate", "change", "p", "");
+
+    int regressions = 0, compared = 0;
+
+    // scenarios in the order they were first recorded
+    for ( int i = 0; i < nrecords; i++ )
+    {
+        int seen = 0;
+        for ( int j = 0; j < i && !seen; j++ )
+            seen = ( 0 == strcmp(records[j].scenario, records[i].scenario) );
+        if ( seen )
+            continue;
+
+        const char *scenario = records[i].scenario;
+
+        for ( int m = 0; m < METRICS; m++ )
+        {
+            double a[MAX_RUNS], b[MAX_RUNS];
+            int n1 = samples(baseline, scenario, m, a);
+            int n2 = samples(candidate, scenario, m, b);
+            if ( 0 == n1 || 0 == n2 )
+                break;
+
+            double p = mann_whitney(a, n1, b, n2);
+            double before = median(a, n1);
+            double after = median(b, n2);
+            double change = ( 0 != before ) ? ( after - before ) / before * 100 : 0;
+
+            // positive when the candidate is worse
+            double worse = metrics[m].higher_is_better ? -change : change;
+
+            const char *verdict = "";
+            if ( p < alpha && threshold < fabs(change) )
+            {
+                verdict = ( 0 < worse ) ? "REGRESSION" : "improvement";
+                if ( 0 < worse )
+                    regressions++;
+            }
+
+            printf("%-40s %-10s %4d %4d %12.2f %12.2f %+7.1f%% %8.4f  %s\n",
+                   scenario, metrics[m].name, n1, n2, before, after, change, p, verdict);
+            compared++;
+        }
+    }
+
+    if ( 0 == compared )
+    {
+        fprintf(stderr, "no scenario was recorded under both %s and %s\n", baseline, candidate);
+        exit(1);
+    }
+
+    printf("%d regression%s\n", regressions, ( 1 == regressions ) ? "" : "s");
+    free(records);
+    return ( 0 < regressions ) ? 1 : 0;
+}
@@ -0,0 +1,676 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A benchmark driver: for every combination of the given connection counts, payload
+ * sizes, durations and backends, starts the server, runs the client against it over
+ * the loopback interface, and writes the results as JSON.
+ *
+ * Each result has the client's throughput and send-to-ack latency percentiles, and the
+ * CPU time, peak RSS and system calls per ack of both processes, taken from wait4()
+ * and from the summaries they print. Only the loopback interface is used, and with
+ * --pin the server and the client are pinned to CPUs of their own, so that results
+ * taken on the same machine can be compared with each other.
+ *
+ * With --tuning LIST the server and the client both set the TCP options of each given
+ * profile (see tuning.h), "none" setting none, so that the profiles are compared on the
+ * same workload.
+ *
+ * With --history DIR, each successful run is also appended as one line to
+ * DIR/<machine fingerprint>.jsonl under the given --label (typically the commit), which
+ * is what bench/compare reads to tell whether a change made things slower.
+ *
+ *   bench/harness --connections 1,10,100 --payload 64,512,4096 --duration 5 \
+ *                 --backend epoll,io_uring --output results.json
+ *   bench/harness --connections 100 --tuning none,latency,throughput,bulk-wan
+ *
+ * Build: cc -O2 -o bench/harness bench/harness.c
+ */
+#define _GNU_SOURCE     // sched_setaffinity()
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>     // getopt_long()
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h> // struct rusage
+#include <sys/utsname.h>
+#include <sys/wait.h>   // wait4()
+#include <time.h>
+#include <unistd.h>
+
+#include "machine.h"
+
+#define PORT 8080
+
+// max number of values of each scenario dimension
+#define MAX_VALUES 16
+
+// max number of words of --server-args
+#define MAX_ARGS 16
+
+// how long the server gets to start listening, in ms
+#define STARTUP_TIMEOUT 5000
+
+// a comma separated list of values
+struct list
+{
+    int count;
+    char *values[MAX_VALUES];
+};
+
+struct scenario
+{
+    int connections;
+    size_t payload;
+    double duration;
+    const char *backend;
+    const char *tuning;         // NULL for none
+};
+
+// what was measured of a process
+struct process_result
+{
+    double user;                // CPU time, in seconds
+    double sys;
+    long max_rss;               // in KB
+    int status;
+    unsigned long syscalls;
+    double syscalls_per_ack;
+};
+
+struct client_result
+{
+    struct process_result process;
+    int connections;
+    size_t bytes;
+    double elapsed;
+    double throughput;          // in MB/s
+    unsigned long acks;
+    double latency_mean;        // in us
+    double latency_p50;
+    double latency_p90;
+    double latency_p99;
+    double latency_p999;
+    double latency_max;
+};
+
+struct server_result
+{
+    struct process_result process;
+    unsigned long connections;
+    unsigned long bytes_in;
+    unsigned long acks;
+};
+
+static const char *server_path = "./server";
+static const char *client_path = "./client";
+static char *server_args[MAX_ARGS];
+static int server_nargs = 0;
+static int pin = 0;
+
+static void split_list(char *arg, struct list *list)
+{
+    list->count = 0;
+
+    for ( char *value = strtok(arg, ","); NULL != value; value = strtok(NULL, ",") )
+    {
+        if ( MAX_VALUES == list->count )
+        {
+            fprintf(stderr, "too many values: %s\n", value);
+            exit(1);
+        }
+        list->values[list->count++] = value;
+    }
+}
+
+// pins the calling process to the given CPU, if there are enough of them
+static void pin_to(int cpu)
+{
+    if ( sysconf(_SC_NPROCESSORS_ONLN) <= cpu )
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+// starts path with the given arguments, its stderr going to errfd and its stdout to /dev/null
+static pid_t spawn(const char *path, char **argv, int errfd, int cpu)
+{
+    pid_t pid = fork();
+    if ( -1 == pid )
+    {
+        fprintf(stderr, "fork error (%d)\n", errno);
+        exit(1);
+    }
+
+    if ( 0 == pid )
+    {
+        int nullfd = open("/dev/null", O_WRONLY);
+        if ( -1 == nullfd || -1 == dup2(nullfd, STDOUT_FILENO) || -1 == dup2(errfd, STDERR_FILENO) )
+            _exit(127);
+
+        if ( pin )
+            pin_to(cpu);
+
+        execv(path, argv);
+        fprintf(stderr, "%s: exec error (%d)\n", path, errno);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+// whether a socket listens on PORT, as /proc/net/tcp shows it
+static int listening(void)
+{
+    FILE *fp = fopen("/proc/net/tcp", "r");
+    if ( NULL == fp )
+        return 0;
+
+    int found = 0;
+    char line[256];
+    while ( !found && NULL != fgets(line, sizeof(line), fp) )
+    {
+        unsigned int port, state;
+        if ( 2 == sscanf(line, " %*d: %*x:%x %*x:%*x %x", &port, &state) )
+            found = ( PORT == port && 0x0A == state ); // TCP_LISTEN
+    }
+
+    fclose(fp);
+    return found;
+}
+
+// Waits until the server listens. It is not connected to, which would add a connection
+// of no traffic to the stats it prints.
+static int wait_for_server(pid_t server)
+{
+    for ( int waited = 0; waited < STARTUP_TIMEOUT; waited += 10 )
+    {
+        // an exited server is left to be reaped by collect()
+        siginfo_t info;
+        info.si_pid = 0;
+        if ( 0 == waitid(P_PID, server, &info, WEXITED | WNOHANG | WNOWAIT) && 0 != info.si_pid )
+            return -1;
+
+        if ( listening() )
+            return 0;
+
+        struct timespec ts = { 0, 10000000 };
+        nanosleep(&ts, NULL);
+    }
+
+    return -1;
+}
+
+static void collect(pid_t pid, struct process_result *result)
+{
+    struct rusage usage;
+    int status;
+
+    while ( -1 == wait4(pid, &status, 0, &usage) )
+    {
+        if ( EINTR != errno )
+        {
+            fprintf(stderr, "wait4 error (%d)\n", errno);
+            exit(1);
+        }
+    }
+
+    result->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    result->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    result->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    result->max_rss = usage.ru_maxrss;
+}
+
+// a temporary file for the stderr of a process
+static int temp_output(void)
+{
+    char path[] = "/tmp/harness-XXXXXX";
+    int fd = mkstemp(path);
+    if ( -1 == fd )
+    {
+        fprintf(stderr, "mkstemp error (%d)\n", errno);
+        exit(1);
+    }
+
+    unlink(path);
+    return fd;
+}
+
+static void copy_output(int fd, FILE *out)
+{
+    FILE *fp = fdopen(dup(fd), "r");
+    if ( NULL == fp )
+        return;
+    rewind(fp);
+
+    char line[512];
+    while ( NULL != fgets(line, sizeof(line), fp) )
+        fputs(line, out);
+
+    fclose(fp);
+}
+
+static void parse_client(int fd, struct client_result *r)
+{
+    FILE *fp = fdopen(dup(fd), "r");
+    if ( NULL == fp )
+        return;
+    rewind(fp);
+
+    char line[512];
+    while ( NULL != fgets(line, sizeof(line), fp) )
+    {
+        unsigned long count;
+
+        if ( 0 == strncmp(line, "connections:", 12) )
+        {
+            sscanf(line, "connections:%d, bytes:%zu, elapsed:%lfs, throughput:%lfMB/s",
+                   &r->connections, &r->bytes, &r->elapsed, &r->throughput);
+        }
+        else if ( 0 == strncmp(line, "backend ", 8) )
+        {
+            sscanf(strchr(line, ':') + 1, " acks:%lu, syscalls:%lu, syscalls/ack:%lf",
+                   &r->acks, &r->process.syscalls, &r->process.syscalls_per_ack);
+        }
+        else if ( 0 == strncmp(line, "latency:", 8) )
+        {
+            sscanf(line, "latency: count:%lu, mean:%lfus, p50:%lfus, p90:%lfus, p99:%lfus, p99.9:%lfus, max:%lfus",
+                   &count, &r->latency_mean, &r->latency_p50, &r->latency_p90,
+                   &r->latency_p99, &r->latency_p999, &r->latency_max);
+        }
+    }
+
+    fclose(fp);
+}
+
+static void parse_server(int fd, struct server_result *r)
+{
+    FILE *fp = fdopen(dup(fd), "r");
+    if ( NULL == fp )
+        return;
+    rewind(fp);
+
+    char line[512];
+    while ( NULL != fgets(line, sizeof(line), fp) )
+    {
+        unsigned long restarts;
+
+        if ( 0 == strncmp(line, "total:", 6) )
+        {
+            sscanf(line, "total: connections:%lu, bytes_in:%lu, acks:%lu, restarts:%lu",
+                   &r->connections, &r->bytes_in, &r->acks, &restarts);
+        }
+        else if ( 0 == strncmp(line, "backend ", 8) )
+        {
+            sscanf(strchr(line, ':') + 1, " syscalls:%lu, syscalls/ack:%lf",
+                   &r->process.syscalls, &r->process.syscalls_per_ack);
+        }
+    }
+
+    fclose(fp);
+}
+
+static void run_scenario(const struct scenario *s, struct client_result *client, struct server_result *server)
+{
+    memset(client, 0, sizeof(*client));
+    memset(server, 0, sizeof(*server));
+
+    // server
+
+    char *sargv[MAX_ARGS + 6];
+    int sargc = 0;
+    sargv[sargc++] = (char *) server_path;
+    sargv[sargc++] = "--backend";
+    sargv[sargc++] = (char *) s->backend;
+    if ( NULL != s->tuning )
+    {
+        sargv[sargc++] = "--tuning";
+        sargv[sargc++] = (char *) s->tuning;
+    }
+    for ( int i = 0; i < server_nargs; i++ )
+        sargv[sargc++] = server_args[i];
+    sargv[sargc] = NULL;
+
+    int server_err = temp_output();
+    pid_t server_pid = spawn(server_path, sargv, server_err, 0);
+
+    if ( -1 == wait_for_server(server_pid) )
+    {
+        fprintf(stderr, "the server did not start: ");
+        copy_output(server_err, stderr);
+        kill(server_pid, SIGKILL);
+        collect(server_pid, &server->process);
+        close(server_err);
+        client->process.status = -1;
+        return;
+    }
+
+    // client
+
+    char connections[16], payload[24], duration[24];
+    snprintf(connections, sizeof(connections), "%d", s->connections);
+    snprintf(payload, sizeof(payload), "%zu", s->payload);
+    snprintf(duration, sizeof(duration), "%g", s->duration);
+
+    char *cargv[] =
+    {
+        (char *) client_path, "--quiet", "--backend", (char *) s->backend,
+        "--connections", connections, "--chunk", payload, "--duration", duration,
+        ( NULL != s->tuning ) ? "--tuning" : NULL, (char *) s->tuning, NULL
+    };
+
+    int client_err = temp_output();
+    pid_t client_pid = spawn(client_path, cargv, client_err, 1);
+    collect(client_pid, &client->process);
+
+    // the server prints its stats when it shuts down
+    kill(server_pid, SIGINT);
+    collect(server_pid, &server->process);
+
+    parse_client(client_err, client);
+    parse_server(server_err, server);
+    close(client_err);
+    close(server_err);
+}
+
+// writes a string as the contents of a JSON string, escaped
+static void print_escaped(FILE *out, const char *s)
+{
+    for ( ; '\0' != *s; s++ )
+    {
+        unsigned char c = (unsigned char) *s;
+        if ( '"' == c || '\\' == c )
+            fprintf(out, "\\%c", c);
+        else if ( c < 0x20 )
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+}
+
+static void print_process(FILE *out, const struct process_result *p)
+{
+    fprintf(out, "\"status\": %d, \"cpu_user_s\": %.3f, \"cpu_sys_s\": %.3f, \"max_rss_kb\": %ld, "
+                 "\"syscalls\": %lu, \"syscalls_per_ack\": %.2f",
+            p->status, p->user, p->sys, p->max_rss, p->syscalls, p->syscalls_per_ack);
+}
+
+static void print_result(FILE *out, const struct scenario *s, int run,
+                         const struct client_result *c, const struct server_result *v, int first)
+{
+    fprintf(out, "%s    {\n", first ? "" : ",\n");
+    fprintf(out, "      \"scenario\": { \"connections\": %d, \"payload\": %zu, \"duration\": %g, \"backend\": \"",
+            s->connections, s->payload, s->duration);
+    print_escaped(out, s->backend);
+    fprintf(out, "\", \"tuning\": \"");
+    print_escaped(out, ( NULL != s->tuning ) ? s->tuning : "none");
+    fprintf(out, "\", \"server_args\": \"");
+    for ( int i = 0; i < server_nargs; i++ )
+    {
+        fprintf(out, "%s", ( 0 < i ) ? " " : "");
+        print_escaped(out, server_args[i]);
+    }
+    fprintf(out, "\" },\n");
+    fprintf(out, "      \"run\": %d,\n", run);
+
+    fprintf(out, "      \"client\": { ");
+    print_process(out, &c->process);
+    fprintf(out, ",\n                  \"bytes\": %zu, \"elapsed_s\": %.3f, \"throughput_mbps\": %.2f, \"acks\": %lu,\n",
+            c->bytes, c->elapsed, c->throughput, c->acks);
+    fprintf(out, "                  \"latency_us\": { \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f } },\n",
+            c->latency_mean, c->latency_p50, c->latency_p90, c->latency_p99, c->latency_p999, c->latency_max);
+
+    fprintf(out, "      \"server\": { ");
+    print_process(out, &v->process);
+    fprintf(out, ",\n                  \"connections\": %lu, \"bytes_in\": %lu, \"acks\": %lu }\n",
+            v->connections, v->bytes_in, v->acks);
+    fprintf(out, "    }");
+}
+
+static void print_machine(FILE *out)
+{
+    struct utsname uts;
+    uname(&uts);
+
+    char model[128], fingerprint[32];
+    machine_info("/proc/cpuinfo", "model name", model, sizeof(model));
+    machine_fingerprint(fingerprint, sizeof(fingerprint));
+
+    time_t now = time(NULL);
+    char started[32];
+    strftime(started, sizeof(started), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(out, "  \"started\": \"%s\",\n", started);
+    fprintf(out, "  \"machine\": { \"fingerprint\": \"%s\", \"hostname\": \"", fingerprint);
+    print_escaped(out, uts.nodename);
+    fprintf(out, "\", \"kernel\": \"");
+    print_escaped(out, uts.release);
+    fprintf(out, "\", \"arch\": \"");
+    print_escaped(out, uts.machine);
+    fprintf(out, "\", \"cpu\": \"");
+    print_escaped(out, model);
+    fprintf(out, "\", \"cpus\": %ld, \"pinned\": %s },\n", sysconf(_SC_NPROCESSORS_ONLN), pin ? "true" : "false");
+}
+
+// the name of a scenario in the history
+static void scenario_key(const struct scenario *s, char *key, size_t size)
+{
+    int n = snprintf(key, size, "%s/%dc/%zub/%gs", s->backend, s->connections, s->payload, s->duration);
+
+    // untuned runs keep the key they had before there were profiles
+    if ( NULL != s->tuning && 0 < n && (size_t) n < size )
+        n += snprintf(key + n, size - n, "/%s", s->tuning);
+
+    for ( int i = 0; i < server_nargs && 0 < n && (size_t) n < size; i++ )
+        n += snprintf(key + n, size - n, "%s%s", ( 0 == i ) ? "/" : " ", server_args[i]);
+}
+
+// appends a run to the history of this machine, one JSON object per line
+static void append_history(FILE *history, const char *label, const struct scenario *s, int run,
+                           const struct client_result *c, const struct server_result *v)
+{
+    char key[256];
+    scenario_key(s, key, sizeof(key));
+
+    time_t now = time(NULL);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(history, "{\"label\": \"");
+    print_escaped(history, label);
+    fprintf(history, "\", \"date\": \"%s\", \"scenario\": \"", date);
+    print_escaped(history, key);
+    fprintf(history, "\", \"run\": %d, "
+                     "\"throughput_mbps\": %.3f, \"latency_p50_us\": %.1f, \"latency_p90_us\": %.1f, "
+                     "\"latency_p99_us\": %.1f, \"latency_p999_us\": %.1f, "
+                     "\"client_cpu_s\": %.3f, \"server_cpu_s\": %.3f, "
+                     "\"client_syscalls_per_ack\": %.2f, \"server_syscalls_per_ack\": %.2f}\n",
+            run, c->throughput, c->latency_p50, c->latency_p90, c->latency_p99, c->latency_p999,
+            c->process.user + c->process.sys, v->process.user + v->process.sys,
+            c->process.syscalls_per_ack, v->process.syscalls_per_ack);
+    fflush(history);
+}
+
+static FILE *open_history(const char *dir)
+{
+    char fingerprint[32], path[4096];
+    machine_fingerprint(fingerprint, sizeof(fingerprint));
+    snprintf(path, sizeof(path), "%s/%s.jsonl", dir, fingerprint);
+
+    FILE *history = fopen(path, "a");
+    if ( NULL == history )
+    {
+        fprintf(stderr, "%s: open error (%d)\n", path, errno);
+        exit(1);
+    }
+
+    return history;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  -n, --connections LIST  numbers of connections (default 10)\n");
+    fprintf(stderr, "  -z, --payload LIST      bytes sent at a time (default 512)\n");
+    fprintf(stderr, "  -d, --duration LIST     seconds each client run lasts (default 2)\n");
+    fprintf(stderr, "  -e, --backend LIST      backends of both processes (default epoll)\n");
+    fprintf(stderr, "  -t, --tuning LIST       TCP option profiles of both processes, or none (default none)\n");
+    fprintf(stderr, "  -r, --runs N            runs of each scenario (default 1)\n");
+    fprintf(stderr, "  -a, --server-args ARGS  extra options of the server, e.g. \"--batch\"\n");
+    fprintf(stderr, "  -S, --server PATH       server binary (default ./server)\n");
+    fprintf(stderr, "  -C, --client PATH       client binary (default ./client)\n");
+    fprintf(stderr, "  -p, --pin               pin the server and the client to CPUs 0 and 1\n");
+    fprintf(stderr, "  -o, --output FILE       write the JSON results to FILE instead of stdout\n");
+    fprintf(stderr, "  -H, --history DIR       also append the runs to the history of this machine in DIR\n");
+    fprintf(stderr, "  -l, --label LABEL       what the runs are recorded under in the history (default \"unlabeled\")\n");
+    fprintf(stderr, "LIST is comma separated; every combination of the lists is run.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char default_connections[] = "10", default_payload[] = "512";
+    char default_duration[] = "2", default_backend[] = "epoll", default_tuning[] = "none";
+    char *connections_arg = default_connections, *payload_arg = default_payload;
+    char *duration_arg = default_duration, *backend_arg = default_backend, *tuning_arg = default_tuning;
+    const char *output_path = NULL;
+    const char *history_dir = NULL;
+    const char *label = "unlabeled";
+    int runs = 1;
+
+    static const struct option long_options[] =
+    {
+        { "connections", required_argument, NULL, 'n' },
+        { "payload",     required_argument, NULL, 'z' },
+        { "duration",    required_argument, NULL, 'd' },
+        { "backend",     required_argument, NULL, 'e' },
+        { "tuning",      required_argument, NULL, 't' },
+        { "runs",        required_argument, NULL, 'r' },
+        { "server-args", required_argument, NULL, 'a' },
+        { "server",      required_argument, NULL, 'S' },
+        { "client",      required_argument, NULL, 'C' },
+        { "pin",         no_argument,       NULL, 'p' },
+        { "output",      required_argument, NULL, 'o' },
+        { "history",     required_argument, NULL, 'H' },
+        { "label",       required_argument, NULL, 'l' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL,          0,                 NULL, 0   }
+    };
+
+    int opt;
+    while ( -1 != ( opt = getopt_long(argc, argv, "n:z:d:e:t:r:a:S:C:po:H:l:h", long_options, NULL) ) )
+    {
+        switch ( opt )
+        {
+            case 'n': connections_arg = optarg; break;
+            case 'z': payload_arg = optarg; break;
+            case 'd': duration_arg = optarg; break;
+            case 'e': backend_arg = optarg; break;
+            case 't': tuning_arg = optarg; break;
+            case 'S': server_path = optarg; break;
+            case 'C': client_path = optarg; break;
+            case 'p': pin = 1; break;
+            case 'o': output_path = optarg; break;
+            case 'H': history_dir = optarg; break;
+            case 'l': label = optarg; break;
+
+            case 'r':
+                runs = atoi(optarg);
+                if ( runs < 1 )
+                {
+                    fprintf(stderr, "invalid number of runs: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'a':
+                for ( char *word = strtok(optarg, " "); NULL != word; word = strtok(NULL, " ") )
+                {
+                    if ( MAX_ARGS == server_nargs )
+                    {
+                        fprintf(stderr, "too many server arguments\n");
+                        exit(1);
+                    }
+                    server_args[server_nargs++] = word;
+                }
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    struct list connections, payloads, durations, backends, tunings;
+    split_list(connections_arg, &connections);
+    split_list(payload_arg, &payloads);
+    split_list(duration_arg, &durations);
+    split_list(backend_arg, &backends);
+    split_list(tuning_arg, &tunings);
+
+    FILE *out = stdout;
+    if ( NULL != output_path && NULL == ( out = fopen(output_path, "w") ) )
+    {
+        fprintf(stderr, "%s: open error (%d)\n", output_path, errno);
+        exit(1);
+    }
+
+    FILE *history = ( NULL != history_dir ) ? open_history(history_dir) : NULL;
+
+    // the results are written as they come, so that an interrupted run keeps what it did
+    fprintf(out, "{\n");
+    print_machine(out);
+    fprintf(out, "  \"results\": [\n");
+
+    int first = 1;
+
+    // The runs of a scenario are spread over the whole session rather than back to back,
+    // so that a drift of the machine (heat, another process...) affects all scenarios alike.
+
+    for ( int run = 1; run <= runs; run++ )
+    for ( int b = 0; b < backends.count; b++ )
+    for ( int t = 0; t < tunings.count; t++ )
+    for ( int n = 0; n < connections.count; n++ )
+    for ( int z = 0; z < payloads.count; z++ )
+    for ( int d = 0; d < durations.count; d++ )
+    {
+        struct scenario s;
+        s.connections = atoi(connections.values[n]);
+        s.payload = strtoul(payloads.values[z], NULL, 10);
+        s.duration = atof(durations.values[d]);
+        s.backend = backends.values[b];
+        s.tuning = ( 0 != strcmp(tunings.values[t], "none") ) ? tunings.values[t] : NULL;
+
+        fprintf(stderr, "%s, %s, %d connections, %zu bytes, %gs, run %d... ",
+                s.backend, tunings.values[t], s.connections, s.payload, s.duration, run);
+
+        struct client_result client;
+        struct server_result server;
+        run_scenario(&s, &client, &server);
+
+        fprintf(stderr, "%.2fMB/s, p99 %.1fus\n", client.throughput, client.latency_p99);
+
+        print_result(out, &s, run, &client, &server, first);
+        fflush(out);
+        first = 0;
+
+        if ( NULL != history && 0 == client.process.status && 0 == server.process.status && 0 < client.acks )
+            append_history(history, label, &s, run, &client, &server);
+    }
+
+    if ( NULL != history )
+        fclose(history);
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if ( stdout != out )
+        fclose(out);
+}
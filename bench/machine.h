@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * What the benchmark tools know of the machine they run on. The fingerprint identifies
+ * the hardware and kernel that results were taken on, so that they are only compared
+ * with results taken on the same kind of machine.
+ */
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+// the value of the first line of a /proc file with the given key, e.g. "model name"
+static inline void machine_info(const char *path, const char *key, char *value, size_t size)
+{
+    snprintf(value, size, "unknown");
+
+    FILE *fp = fopen(path, "r");
+    if ( NULL == fp )
+        return;
+
+    char line[256];
+    while ( NULL != fgets(line, sizeof(line), fp) )
+    {
+        if ( 0 == strncmp(line, key, strlen(key)) && NULL != strchr(line, ':') )
+        {
+            char *v = strchr(line, ':') + 1;
+            while ( ' ' == *v || '\t' == *v )
+                v++;
+            v[strcspn(v, "\n")] = '\0';
+            snprintf(value, size, "%s", v);
+            break;
+        }
+    }
+
+    fclose(fp);
+}
+
+// FNV-1a of the CPU model, the number of CPUs, the memory size, the architecture and
+// the kernel release, as 16 hex digits
+static inline void machine_fingerprint(char *fingerprint, size_t size)
+{
+    struct utsname uts;
+    uname(&uts);
+
+    char model[128], memory[64];
+    machine_info("/proc/cpuinfo", "model name", model, sizeof(model));
+    machine_info("/proc/meminfo", "MemTotal", memory, sizeof(memory));
+
+    char description[512];
+    snprintf(description, sizeof(description), "%s|%ld|%s|%s|%s",
+             model, sysconf(_SC_NPROCESSORS_ONLN), memory, uts.machine, uts.release);
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for ( const char *c = description; '\0' != *c; c++ )
+    {
+        hash ^= (unsigned char) *c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    snprintf(fingerprint, size, "%016llx", (unsigned long long) hash);
+}
+
+#endif // MACHINE_H
@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Microbenchmarks of the hot path of server.c, each primitive on its own:
+ *
+ *   recv       the receive-until-EAGAIN loop of a connection, over a socketpair filled
+ *              to capacity beforehand, at several buffer sizes (BUFLEN in server.c)
+ *   sanitize   the per-byte loop of process(), and the branch-free block version of
+ *              --batch, on buffers of BUFLEN bytes
+ *   output     printf() plus fflush() per buffer, as the default mode does, against
+ *              gathering the buffers of an iteration into one writev()
+ *   ack        the 5-byte send() of the acknowledgement, over a socketpair
+ *
+ * Each reports the time per operation, the bytes handled per CPU cycle and the system
+ * calls made per MB. Output goes to /dev/null, where the server's output goes during
+ * benchmarks, so that only the cost of getting it there is measured.
+ *
+ * Cycles are read from the TSC on x86-64; elsewhere they are estimated from the time.
+ *
+ * Build: cc -O2 -o bench/micro bench/micro.c
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>     // getopt_long()
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>    // writev()
+#include <time.h>
+#include <unistd.h>
+
+// the buffer size of server.c
+#define BUFLEN 512
+
+// buffers gathered into one writev(), as many as an event loop iteration can receive
+#define GATHER 20
+
+#define MB ( 1024.0 * 1024.0 )
+
+// what a benchmark measured
+struct measure
+{
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t syscalls;
+    uint64_t ns;
+    uint64_t cycles;
+};
+
+static double cycles_per_ns = 1.0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t cycles(void)
+{
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    return (uint64_t) ( now_ns() * cycles_per_ns );
+#endif
+}
+
+// measures the TSC frequency against the monotonic clock
+static void calibrate(void)
+{
+#if defined(__x86_64__)
+    uint64_t t0 = now_ns(), c0 = cycles();
+    struct timespec ts = { 0, 100000000 };
+    nanosleep(&ts, NULL);
+    uint64_t t1 = now_ns(), c1 = cycles();
+
+    cycles_per_ns = (double) ( c1 - c0 ) / ( t1 - t0 );
+#endif
+}
+
+static void start(struct measure *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->ns = now_ns();
+    m->cycles = cycles();
+}
+
+static void stop(struct measure *m)
+{
+    m->ns = now_ns() - m->ns;
+    m->cycles = cycles() - m->cycles;
+}
+
+static void report(const char *name, struct measure *m)
+{
+    printf("%-24s ops:%-10lu ns/op:%-10.1f bytes/cycle:%-8.3f syscalls/MB:%.1f\n",
+           name, (unsigned long) m->ops, (double) m->ns / m->ops,
+           ( 0 < m->cycles ) ? (double) m->bytes / m->cycles : 0.0,
+           ( 0 < m->bytes ) ? m->syscalls / ( m->bytes / MB ) : 0.0);
+}
+
+static void socket_pair(int fds[2])
+{
+    if ( -1 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) )
+    {
+        fprintf(stderr, "socketpair error (%d)\n", errno);
+        exit(1);
+    }
+}
+
+// fills the socket until EAGAIN and returns the number of bytes written
+static size_t fill(int fd)
+{
+    static char chunk[65536];
+    size_t total = 0;
+    ssize_t n;
+
+    while ( 0 < ( n = send(fd, chunk, sizeof(chunk), MSG_NOSIGNAL) ) )
+        total += n;
+
+    return total;
+}
+
+static void drain(int fd)
+{
+    static char chunk[65536];
+    while ( 0 < recv(fd, chunk, sizeof(chunk), 0) )
+        ;
+}
+
+// The receive loop of libserver: recv() into a buffer of the given size until EAGAIN.
+// Only the receiving side is timed; the socket is filled again between rounds.
+static void bench_recv(size_t buflen, uint64_t total_bytes)
+{
+    int fds[2];
+    socket_pair(fds);
+
+    char *buffer = (char *) malloc(buflen);
+    struct measure m, round;
+    memset(&m, 0, sizeof(m));
+
+    while ( m.bytes < total_bytes )
+    {
+        fill(fds[0]);
+
+        start(&round);
+        ssize_t received;
+        for ( ;; )
+        {
+            received = recv(fds[1], buffer, buflen, 0);
+            round.syscalls++;
+            if ( received <= 0 )
+                break;
+            round.ops++;
+            round.bytes += received;
+        }
+        stop(&round);
+
+        if ( -1 == received && EAGAIN != errno )
+        {
+            fprintf(stderr, "recv error (%d)\n", errno);
+            exit(1);
+        }
+
+        m.ops += round.ops;
+        m.bytes += round.bytes;
+        m.syscalls += round.syscalls;
+        m.ns += round.ns;
+        m.cycles += round.cycles;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "recv %zu", buflen);
+    report(name, &m);
+
+    free(buffer);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// kept in step with sanitize() in server.c
+static void sanitize(char *buffer, size_t len)
+{
+    char *p = buffer;
+    for ( size_t i = 0; i < len; i++ )
+    {
+        if ( *p < ' ' && *p != '\n' ) *p = '.';
+        p++;
+    }
+}
+
+// kept in step with sanitize_block() in server.c
+static inline void sanitize_block(signed char *data, size_t len, uint32_t *sum, unsigned int *lines)
+{
+    for ( size_t i = 0; i < len; i++ )
+    {
+        signed char c = data[i];
+        c = ( c < ' ' && c != '\n' ) ? '.' : c;
+        data[i] = c;
+        *sum += (unsigned char) c;
+        *lines += ( c == '\n' );
+    }
+}
+
+// text with the occasional control character, as the clients send
+static void fill_text(char *buffer, size_t len)
+{
+    for ( size_t i = 0; i < len; i++ )
+        buffer[i] = ( 0 == i % 61 ) ? '\n' : ( 0 == i % 97 ) ? '\t' : 'a' + i % 26;
+}
+
+static void bench_sanitize(size_t buflen, uint64_t total_bytes)
+{
+    char *buffer = (char *) malloc(buflen);
+    struct measure m;
+
+    fill_text(buffer, buflen);
+    start(&m);
+    for ( ; m.bytes < total_bytes; m.bytes += buflen, m.ops++ )
+    {
+        sanitize(buffer, buflen);
+        __asm__ volatile ( "" : : "r" ( buffer ) : "memory" );
+    }
+    stop(&m);
+    report("sanitize", &m);
+
+    uint32_t sum = 0;
+    unsigned int lines = 0;
+
+    fill_text(buffer, buflen);
+    start(&m);
+    for ( ; m.bytes < total_bytes; m.bytes += buflen, m.ops++ )
+    {
+        signed char *data = (signed char *) buffer;
+        size_t i = 0;
+        for ( ; i + 64 <= buflen; i += 64 )
+            sanitize_block(data + i, 64, &sum, &lines);
+        sanitize_block(data + i, buflen - i, &sum, &lines);
+        __asm__ volatile ( "" : : "r" ( buffer ) : "memory" );
+    }
+    stop(&m);
+    __asm__ volatile ( "" : : "r" ( sum ), "r" ( lines ) );
+    report("sanitize batch", &m);
+
+    free(buffer);
+}
+
+// write system calls made so far by this process
+static uint64_t write_syscalls(void)
+{
+    FILE *fp = fopen("/proc/self/io", "r");
+    if ( NULL == fp )
+        return 0;
+
+    char line[128];
+    unsigned long long syscw = 0;
+    while ( NULL != fgets(line, sizeof(line), fp) )
+    {
+        if ( 1 == sscanf(line, "syscw: %llu", &syscw) )
+            break;
+    }
+
+    fclose(fp);
+    return syscw;
+}
+
+static void bench_output(size_t buflen, uint64_t total_bytes)
+{
+    FILE *out = fopen("/dev/null", "w");
+    if ( NULL == out )
+    {
+        fprintf(stderr, "/dev/null open error (%d)\n", errno);
+        exit(1);
+    }
+
+    char *buffers[GATHER];
+    for ( int i = 0; i < GATHER; i++ )
+    {
+        buffers[i] = (char *) malloc(buflen);
+        fill_text(buffers[i], buflen);
+    }
+
+    struct measure m;
+
+    // what the default mode does for each buffer received
+    uint64_t before = write_syscalls();
+    start(&m);
+    for ( ; m.bytes < total_bytes; m.bytes += buflen, m.ops++ )
+    {
+        fprintf(out, "%.*s", (int) buflen, buffers[m.ops % GATHER]);
+        fflush(out);
+    }
+    stop(&m);
+    m.syscalls = write_syscalls() - before;
+    report("printf+fflush", &m);
+
+    // the buffers of an iteration gathered into one system call
+    int nullfd = fileno(out);
+    struct iovec iov[GATHER];
+    for ( int i = 0; i < GATHER; i++ )
+    {
+        iov[i].iov_base = buffers[i];
+        iov[i].iov_len = buflen;
+    }
+
+    before = write_syscalls();
+    start(&m);
+    for ( ; m.bytes < total_bytes; m.bytes += buflen * GATHER, m.ops += GATHER )
+    {
+        if ( -1 == writev(nullfd, iov, GATHER) )
+        {
+            fprintf(stderr, "writev error (%d)\n", errno);
+            exit(1);
+        }
+    }
+    stop(&m);
+    m.syscalls = write_syscalls() - before;
+    report("writev", &m);
+
+    for ( int i = 0; i < GATHER; i++ )
+        free(buffers[i]);
+    fclose(out);
+}
+
+// the acknowledgement of server.c, with its terminating NUL
+static void bench_ack(uint64_t total_bytes)
+{
+    static char ack[] = "Ack\n";
+
+    int fds[2];
+    socket_pair(fds);
+
+    struct measure m, round;
+    memset(&m, 0, sizeof(m));
+
+    while ( m.bytes < total_bytes )
+    {
+        start(&round);
+        for ( int i = 0; i < 1000; i++ )
+        {
+            ssize_t sent = send(fds[0], ack, sizeof(ack), MSG_NOSIGNAL);
+            round.syscalls++;
+            if ( -1 == sent )
+            {
+                if ( EAGAIN != errno )
+                {
+                    fprintf(stderr, "send error (%d)\n", errno);
+                    exit(1);
+                }
+                break;
+            }
+            round.ops++;
+            round.bytes += sent;
+        }
+        stop(&round);
+
+        // the peer is drained outside of the measure
+        drain(fds[1]);
+
+        m.ops += round.ops;
+        m.bytes += round.bytes;
+        m.syscalls += round.syscalls;
+        m.ns += round.ns;
+        m.cycles += round.cycles;
+    }
+
+    report("ack send", &m);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-m|--megabytes N] [-z|--buflen LIST] [BENCHMARK]...\n", prog);
+    fprintf(stderr, "  -m, --megabytes N  data handled by each benchmark (default 256, 8 for ack)\n");
+    fprintf(stderr, "  -z, --buflen LIST  buffer sizes of the recv benchmark (default 64,512,4096,16384,65536)\n");
+    fprintf(stderr, "BENCHMARK is recv, sanitize, output or ack; all of them by default.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    double megabytes = 256;
+    char default_buflens[] = "64,512,4096,16384,65536";
+    char *buflens = default_buflens;
+
+    static const struct option long_options[] =
+    {
+        { "megabytes", required_argument, NULL, 'm' },
+        { "buflen",    required_argument, NULL, 'z' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL,        0,                 NULL, 0   }
+    };
+
+    int opt;
+    while ( -1 != ( opt = getopt_long(argc, argv, "m:z:h", long_options, NULL) ) )
+    {
+        switch ( opt )
+        {
+            case 'm':
+                megabytes = atof(optarg);
+                if ( megabytes <= 0 )
+                {
+                    fprintf(stderr, "invalid size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'z':
+                buflens = optarg;
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    calibrate();
+    printf("%.2f cycles/ns\n", cycles_per_ns);
+
+    uint64_t total = (uint64_t) ( megabytes * MB );
+
+    static const char *all[] = { "recv", "sanitize", "output", "ack" };
+    const char **names = ( optind < argc ) ? (const char **) argv + optind : all;
+    int count = ( optind < argc ) ? argc - optind : 4;
+
+    for ( int i = 0; i < count; i++ )
+    {
+        if ( 0 == strcmp(names[i], "recv") )
+        {
+            for ( char *value = strtok(buflens, ","); NULL != value; value = strtok(NULL, ",") )
+                bench_recv(strtoul(value, NULL, 10), total);
+        }
+        else if ( 0 == strcmp(names[i], "sanitize") )
+        {
+            bench_sanitize(BUFLEN, total);
+        }
+        else if ( 0 == strcmp(names[i], "output") )
+        {
+            bench_output(BUFLEN, total);
+        }
+        else if ( 0 == strcmp(names[i], "ack") )
+        {
+            bench_ack(total / 32);
+        }
+        else
+        {
+            fprintf(stderr, "unknown benchmark: %s\n", names[i]);
+            exit(1);
+        }
+    }
+}
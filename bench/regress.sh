@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# Records runs of the current tree in the history of this machine, under the current
+# commit, then compares them with the runs of a baseline commit recorded earlier the
+# same way. Exits with 1 if anything regressed.
+#
+# Usage: bench/regress.sh [baseline] [runs]
+#
+#   git checkout main && bench/regress.sh          # records the baseline
+#   git checkout feature && bench/regress.sh main  # records the change and compares
+#
+# The scenarios are taken from $CONNECTIONS, $PAYLOAD, $DURATION and $BACKEND, in the
+# comma separated form of bench/harness.
+
+curdir=$(dirname $0)/..
+
+baseline=${1:-}
+runs=${2:-7}
+
+label=$(git -C "$curdir" rev-parse --short HEAD)
+if [ -n "$(git -C "$curdir" status --porcelain --untracked-files=no)" ]; then
+    label="$label-dirty"
+fi
+
+if [ -n "$baseline" ]; then
+    baseline=$(git -C "$curdir" rev-parse --short "$baseline" 2> /dev/null || echo "$baseline")
+fi
+
+mkdir -p "$curdir/bench/history"
+
+"$curdir/bench/harness" --server "$curdir/server" --client "$curdir/client" \
+    --connections ${CONNECTIONS:-1,10} --payload ${PAYLOAD:-64,4096} \
+    --duration ${DURATION:-2} --backend ${BACKEND:-epoll} \
+    --runs $runs --history "$curdir/bench/history" --label "$label" --output /dev/null || exit 1
+
+if [ -n "$baseline" ]; then
+    "$curdir/bench/compare" --history "$curdir/bench/history" --baseline "$baseline" --candidate "$label"
+fi
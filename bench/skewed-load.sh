@@ -0,0 +1,32 @@
+#!/bin/bash
+#
+# Compares the static split of connections across offload threads with work stealing,
+# under a skewed load where 5% of the connections send 90% of the bytes.
+#
+# Usage: bench/skewed-load.sh [threads] [connections] [bytes] [handler work]
+
+curdir=$(dirname $0)/..
+
+threads=${1:-4}
+connections=${2:-100}
+bytes=${3:-50000000}
+work=${4:-20}
+
+for mode in "static" "steal"; do
+    options="--offload $threads --work $work"
+    if [ "$mode" = "steal" ]; then
+        options="$options --steal"
+    fi
+
+    "$curdir/server" $options > /dev/null 2> "/tmp/skewed-load-$mode.txt" &
+    server_pid=$!
+    sleep 0.5
+
+    echo -n "$mode: "
+    "$curdir/client" --connections $connections --bytes $bytes --skew 5:90 --chunk 512 --quiet
+
+    kill -INT $server_pid
+    wait $server_pid
+    grep "^offload worker [0-9]*:" "/tmp/skewed-load-$mode.txt" | sed 's/^/    /'
+    rm -f "/tmp/skewed-load-$mode.txt"
+done
@@ -0,0 +1,32 @@
+#!/bin/bash
+#
+# Runs the same load from 1 up to the given number of client worker processes (see
+# client --workers), pinned to different CPUs, first as fast as it goes and then paced
+# at a fixed rate, to show where a single client process stops keeping up. Paced, the
+# latency is timed from when each chunk was due, so a client that falls behind shows up
+# in it rather than in a lower rate.
+#
+# Usage: bench/workers.sh [max workers] [connections] [seconds] [rate] [backend]
+
+curdir=$(dirname $0)/..
+
+max=${1:-4}
+connections=${2:-16}
+seconds=${3:-5}
+rate=${4:-20000}
+backend=${5:-epoll}
+
+"$curdir/server" --backend $backend > /dev/null 2> /dev/null &
+server_pid=$!
+sleep 0.5
+
+for (( workers = 1; workers <= max; workers *= 2 )); do
+    for options in "" "--rate $rate"; do
+        echo "workers:$workers ${options:-unpaced}"
+        "$curdir/client" --backend $backend --connections $connections --duration $seconds --chunk 512 --quiet \
+            --workers $workers --pin $options 2>&1 | grep -v "^worker " | sed 's/^/    /'
+    done
+done
+
+kill -INT $server_pid
+wait $server_pid
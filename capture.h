@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The format of the traffic recorded by server --capture and replayed by client --replay.
+ *
+ * A capture is a header followed by one record per event, in the order the server saw
+ * them: a connection opened, data received on it, the connection closed. Records are 24
+ * bytes. With CAPTURE_PAYLOAD in the header, a data record is followed by the bytes that
+ * were received; otherwise only their length and hash are kept, and a replay sends filler
+ * of the same length. Times are relative to the start of the capture, and all fields are
+ * in host byte order.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC 0x50414343 // "CCAP"
+#define CAPTURE_VERSION 1
+
+// header flags
+#define CAPTURE_PAYLOAD 0x1     // data records are followed by their bytes
+
+enum capture_type
+{
+    CAPTURE_OPEN = 1,
+    CAPTURE_DATA,
+    CAPTURE_CLOSE
+};
+
+struct capture_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint64_t started;           // wall clock time of the start, in ns since the epoch
+};
+
+struct capture_record
+{
+    uint64_t time;              // since the start of the capture, in ns
+    uint32_t conn;              // connection id, as numbered by the server
+    uint32_t len;               // CAPTURE_DATA: bytes received
+    uint32_t hash;              // CAPTURE_DATA: FNV-1a of the bytes
+    uint16_t type;
+    uint16_t reserved;
+};
+
+_Static_assert(sizeof(struct capture_record) == 24, "capture records are 24 bytes");
+
+static inline uint32_t capture_hash(const char *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for ( size_t i = 0; i < len; i++ )
+        hash = ( hash ^ (unsigned char) data[i] ) * 16777619u;
+    return hash;
+}
+
+#endif // CAPTURE_H
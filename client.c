@@ -2,32 +2,213 @@
  * Copyright (c) Seungyeob Choi
  *
  * A TCP client that manages multiple connections to a server and handles
- * all read and write operations in a single thread using epoll.
+ * all read and write operations in a single thread using epoll, or poll or
+ * io_uring with --backend (see poller.h).
+ *
+ * Each file given on the command line is sent over its own connection. Instead of files,
+ * -n N opens N connections that send generated data, -b bytes in total, which -s P:S
+ * skews so that P% of the connections send S% of the bytes, or with -d keep sending for
+ * the given number of seconds.
+ *
+ * With -q the client prints a summary, with the latency from each send to its ack and
+ * the system calls made per ack.
+ *
+ * With -r RATE the connections of -n send RATE chunks per second in total instead of as
+ * fast as they can, each waiting for the ack of its chunk before the next. The latency is
+ * then measured from when each chunk was due rather than from when it was sent, so that
+ * the time a slow ack held the next chunk back is not left out of it (what is known as
+ * coordinated omission).
+ *
+ * With -w M the client coordinates M worker processes, pinned to different CPUs with -P,
+ * once a single one is the bottleneck. They split the connections of -n, or the rate of
+ * -c, start the load together, and leave their counters and histograms in memory shared
+ * with the coordinator, which prints a line per worker and the summary of all of them
+ * merged, in the same form as that of a single process.
+ *
+ * The connect, send, ack and close paths of the load carry USDT probes; see probes.h.
+ *
+ * With -M STEPS, e.g. -M 10k,100k,1m, the client tests how far the server scales in
+ * connection count: it opens mostly idle connections in steps, from source addresses
+ * spread over 127.0.0.0/8 so that the ephemeral ports of a single address do not run
+ * out, and after each step sends -r messages per second over random connections for -d
+ * seconds. Given the server's pid with -p, it reports at each step the server's resident
+ * memory and CPU time per connection and per message, which shows the cost of the
+ * backend waiting on that many descriptors, along with the latency of the messages.
+ * Run the server with --c1m.
+ *
+ * With -c RATE the client churns through short-lived connections instead, on -t threads:
+ * each connection connects, sends -z bytes, waits for the ack and closes, started on a
+ * fixed schedule of RATE connections per second in total for -d seconds. It reports the
+ * connections per second achieved and the latency distribution of each phase, which is
+ * what the accept and close paths of the server cost.
+ *
+ * Along with the normal load, --slow, --unread and --idle open connections that misbehave:
+ * they send one byte at a time, send without ever reading the acks so that the server's
+ * send buffer fills up, or connect and go silent. They run on a thread of their own, and
+ * the latency reported is that of the well-behaved connections, to be compared with a
+ * run without them.
+ *
+ * With -R PATH the client replays a capture taken by server --capture: it opens, sends
+ * over and closes connections when the captured ones did, or -x times faster, with the
+ * captured data or filler of the same size, and reports how late it kept to the
+ * schedule along with the latency of the acks.
+ *
+ * With -K MS the connections of -n sample getsockopt(TCP_INFO) every MS, a bounded
+ * number at a time, and each one as it closes, and the summary shows their round-trip
+ * times, delivery rates, retransmissions and the time their sends were held back by the
+ * server's receive window or their own send buffer; see tcpinfo.h.
+ *
+ * With -o NAME the connections of -n or of the files, and those of -c, get a profile of
+ * TCP options, "latency", "throughput" or "bulk-wan", to be compared with each other
+ * against a server tuned the same; see tuning.h.
+ *
+ * Build: cc -O2 -pthread -o client client.c poller.c
  */
+#define _GNU_SOURCE     // fopencookie()
 #include <arpa/inet.h>  // inet_addr()
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>     // getopt_long()
+#include <netinet/in.h> // IP_BIND_ADDRESS_NO_PORT
+#include <poll.h>       // poll()
+#include <pthread.h>
+#include <sched.h>      // sched_setaffinity()
+#include <signal.h>     // kill()
 #include <stdio.h>
 #include <stdlib.h>     // exit()
 #include <string.h>     // strncmp()
-#include <sys/epoll.h>
+#include <sys/mman.h>   // mmap()
+#include <sys/resource.h> // getrlimit(), setrlimit()
+#include <sys/socket.h>
+#include <sys/timerfd.h> // timerfd_create()
+#include <sys/wait.h>   // wait()
+#include <time.h>
 #include <unistd.h>     // read(), write(), close()
 
+#include "capture.h"
+#include "histogram.h"
+#include "poller.h"
+#include "probes.h"
+#include "tcpinfo.h"
+#include "tuning.h"
+
 #define BUFLEN 64
 #define PORT 8080
 #define HOST "127.0.0.1"
 
-// max number of events that can be returned by epoll at a time
+// max number of events that can be returned by the backend at a time
 #define MAX_EVENTS 20
 
+// max number of bytes sent at a time
+#define MAX_CHUNK 65536
+
+// With -d, how long after the end to wait for the last acks before giving up on them.
+// A server starved by misbehaving connections may never send them.
+#define DRAIN_SECONDS 5
+
+// Longest data record a replay accepts. The server receives into buffers of a few hundred
+// bytes unless told otherwise, so a longer record is taken for a corrupt capture rather
+// than allocated.
+#define REPLAY_MAX_RECORD ( 64 * 1024 * 1024 )
+
 struct connection_ctx
 {
     int socket_fd;
     FILE* fp;
-    char buffer[BUFLEN];
+    char *buffer;
+    uint64_t sent_at;           // when the last chunk was sent, in ns
+    uint64_t due;               // with -r, when the next chunk is due, in ns
+    int waiting;                // with -r, for the ack of the last chunk
     struct connection_ctx *next;
 };
 
+// number of bytes sent at a time, BUFLEN unless set with -z
+static size_t chunk_size = BUFLEN;
+
+// don't print acks and sends
+static int quiet = 0;
+
+static int backend = POLLER_EPOLL;
+
+// system calls made outside of the backend
+static unsigned long syscalls = 0;
+
+// generated payloads end at this time if set with -d
+static double deadline = 0;
+
+// with -r, the time between the chunks of each connection, in ns
+static uint64_t pace_interval = 0;
+
+// with -K, the sampling period in ms, and what the connections of the load went through
+static int tcpinfo_ms = 0;
+static struct tcp_health load_health;
+
+// the profile of -o, NULL without it
+static const struct tuning *tuning = NULL;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// generated payload, read through a FILE like the files given on the command line
+struct synthetic_payload
+{
+    size_t remaining;
+    char letter;
+};
+
+static ssize_t synthetic_read(void *cookie, char *buf, size_t size)
+{
+    struct synthetic_payload *payload = (struct synthetic_payload *) cookie;
+
+    if ( 0 < deadline && deadline <= now_seconds() )
+        return 0;
+
+    size_t n = ( size < payload->remaining ) ? size : payload->remaining;
+    memset(buf, payload->letter, n);
+    payload->remaining -= n;
+
+    return n;
+}
+
+static int synthetic_close(void *cookie)
+{
+    free(cookie);
+    return 0;
+}
+
+static FILE *open_synthetic(size_t bytes, char letter)
+{
+    struct synthetic_payload *payload = (struct synthetic_payload *) malloc(sizeof(struct synthetic_payload));
+    if ( NULL == payload )
+        return NULL;
+
+    payload->remaining = bytes;
+    payload->letter = letter;
+
+    cookie_io_functions_t functions = { synthetic_read, NULL, NULL, synthetic_close };
+    FILE *fp = fopencookie(payload, "r", functions);
+    if ( NULL == fp )
+    {
+        free(payload);
+        return NULL;
+    }
+
+    // there is nothing to gain from buffering generated data
+    setvbuf(fp, NULL, _IONBF, 0);
+    return fp;
+}
+
 static void clear_connection_ctx_list(struct connection_ctx *head)
 {
     while ( NULL != head )
@@ -53,238 +234,2244 @@ static void clear_connection_ctx_list(struct connection_ctx *head)
         if ( NULL != head->fp )
             fclose(head->fp);
 
-        free(head);
+        free(head->buffer);
+        free(head);
+
+        head = next;
+    }
+}
+
+// reports a failed operation of the backend and exits
+static void backend_error(const char *operation)
+{
+    fprintf(stderr, "%s %s error (%d)\n", poller_name(backend), operation, errno);
+    exit(1);
+}
+
+static int close_connection(struct poller *poller, int connfd)
+{
+    PROBE1(client, close, connfd);
+
+    if ( -1 == poller_del(poller, connfd) )
+        backend_error("del");
+
+    if ( -1 == close(connfd) )
+    {
+        switch ( errno )
+        {
+            case EBADF:
+            case EINTR:
+            case EIO:
+            default:
+                fprintf(stderr, "socket close error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    return 0;
+}
+
+// closes a connection of the load, sampled first with -K
+static void close_load(struct poller *poller, struct connection_ctx *conn)
+{
+    if ( 0 < tcpinfo_ms )
+        tcp_health_sample(&load_health, conn->socket_fd, 1);
+
+    close_connection(poller, conn->socket_fd);
+    conn->socket_fd = 0;
+}
+
+// samples the next connections of the load in turn, as many as the budget allows
+// whatever their number
+static void sample_load(struct connection_ctx *head)
+{
+    static struct connection_ctx *cursor = NULL;
+    int sampled = 0;
+
+    for ( int scanned = 0; scanned < TCPINFO_SCAN && sampled < TCPINFO_BUDGET; scanned++ )
+    {
+        cursor = ( NULL == cursor || NULL == cursor->next ) ? head : cursor->next;
+        if ( NULL == cursor )
+            return;
+
+        if ( 0 != cursor->socket_fd )
+        {
+            tcp_health_sample(&load_health, cursor->socket_fd, 0);
+            sampled++;
+        }
+    }
+}
+
+// connects to the server with the options of a profile if given, returns the
+// non-blocking socket
+static int connect_server(const struct tuning *t)
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if ( -1 == sockfd )
+    {
+        switch ( errno )
+        {
+            case EACCES:
+            case EAFNOSUPPORT:
+            case EINVAL:
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+            case EPROTONOSUPPORT:
+            default:
+                fprintf(stderr, "socket creation error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    // before connect(), for the window scale to allow for them
+    if ( NULL != t && -1 == tuning_set_buffers(t, sockfd) )
+    {
+        fprintf(stderr, "setsockopt error (%d)\n", errno);
+        exit(1);
+    }
+
+    // connect to the server
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(PORT);
+    servaddr.sin_addr.s_addr = inet_addr(HOST);
+
+    if ( -1 == connect(sockfd, (struct sockaddr*) &servaddr, sizeof(servaddr) ))
+    {
+        switch ( errno )
+        {
+            case ECONNREFUSED:
+                fprintf(stderr, "connection refused.\n");
+                exit(1);
+
+            case EADDRNOTAVAIL:
+            case EAFNOSUPPORT:
+            case EALREADY:
+            case EBADF:
+            case EINPROGRESS:
+            case EINTR:
+            case EISCONN:
+            case ENETUNREACH:
+            case ENOTSOCK:
+            case EPROTOTYPE:
+            case ETIMEDOUT:
+            case EIO:
+            case ENOENT:
+            case ENOTDIR:
+            case EACCES:
+            case EADDRINUSE:
+            case ECONNRESET:
+            case EHOSTUNREACH:
+            case EINVAL:
+            case ELOOP:
+            case ENAMETOOLONG:
+            case ENETDOWN:
+            case ENOBUFS:
+            case EOPNOTSUPP:
+            default:
+                fprintf(stderr, "socket connect error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    if ( NULL != t )
+    {
+        if ( -1 == tuning_apply(t, sockfd) )
+        {
+            fprintf(stderr, "setsockopt error (%d)\n", errno);
+            exit(1);
+        }
+
+        // what the first connection got, which the others get as well
+        static int shown = 0;
+        if ( !shown )
+        {
+            tuning_print(stderr, t, sockfd);
+            shown = 1;
+        }
+    }
+
+    // set non-blocking
+
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if ( -1 == flags )
+    {
+        switch ( errno )
+        {
+            case EACCES:
+            case EAGAIN:
+            case EBADF:
+            case EINTR:
+            case EINVAL:
+            case EMFILE:
+            case ENOLCK:
+            case EOVERFLOW:
+            default:
+                fprintf(stderr, "select fcntl error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    if ( -1 == fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) )
+    {
+        switch ( errno )
+        {
+            case EACCES:
+            case EAGAIN:
+            case EBADF:
+            case EINTR:
+            case EINVAL:
+            case EMFILE:
+            case ENOLCK:
+            case EOVERFLOW:
+            default:
+                fprintf(stderr, "select fcntl error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    return sockfd;
+}
+
+// connects to the server; the connection will send what is read from fp
+static struct connection_ctx *open_connection(FILE *fp)
+{
+    int sockfd = connect_server(tuning);
+    PROBE1(client, connect, sockfd);
+
+    // store the socket in connection_ctx
+
+    struct connection_ctx *new_conn = (struct connection_ctx *) malloc(sizeof(struct connection_ctx));
+    if ( NULL != new_conn )
+    {
+        new_conn->socket_fd = sockfd;
+        new_conn->fp = fp;
+        new_conn->buffer = (char *) malloc(chunk_size);
+        new_conn->sent_at = 0;
+        new_conn->due = 0;
+        new_conn->waiting = 0;
+        new_conn->next = NULL;
+
+        if ( NULL == new_conn->buffer )
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    return new_conn;
+}
+
+// Sends the next chunk of a connection, or at the end of its data closes it if there
+// is no ack left to wait for. Returns the number of bytes sent, or -1 if it was closed.
+static int send_next(struct poller *poller, struct connection_ctx *conn, int acknowledged)
+{
+    size_t nbytes;
+    nbytes = fread(conn->buffer, sizeof(char), chunk_size, conn->fp);
+    if ( 0 != nbytes )
+    {
+        conn->sent_at = now_ns();
+        conn->waiting = 1;
+        syscalls++;
+        int sent = send(conn->socket_fd, conn->buffer, nbytes, 0);
+        if ( -1 == sent )
+        {
+            switch ( errno )
+            {
+                case EACCES:
+                case EWOULDBLOCK:
+                case EBADF:
+                case ECONNRESET:
+                case EDESTADDRREQ:
+                case EFAULT:
+                case EINTR:
+                case EINVAL:
+                case EISCONN:
+                case EMSGSIZE:
+                case ENOBUFS:
+                case ENOMEM:
+                case ENOTCONN:
+                case ENOTSOCK:
+                case EOPNOTSUPP:
+                case EPIPE:
+                default:
+                    fprintf(stderr, "socket send error (%d)\n", errno);
+                    exit(1);
+            }
+        }
+
+        // the chunk is complete
+        tuning_push(tuning, conn->socket_fd);
+
+        // reached to end-of-file
+        // beware: there is corner case that the buffer ends exactly at the end-of-file
+        // in that case, the end-of-file is not detected here, and will be taken care of
+        // in the next EPOLLOUT
+        if ( nbytes < chunk_size )
+        {
+            fclose(conn->fp);
+            conn->fp = NULL;
+        }
+
+        PROBE2(client, send, conn->socket_fd, sent);
+
+        if ( !quiet )
+            fprintf(stderr, "sock:%d, fread:%lu, sent:%d\n", conn->socket_fd, nbytes, sent);
+
+        return sent;
+    }
+
+    // already end-of-file
+    // we reach here in case the send buffer ends exactly at the end-of-file
+    // and the end-of-file was not detected in the previous EPOLLOUT
+
+    fclose(conn->fp);
+    conn->fp = NULL;
+
+    // nothing to wait for if nothing was ever sent; a paced connection is only sent to
+    // once its last chunk has been acknowledged
+    if ( 0 != acknowledged || 0 == conn->sent_at || 0 < pace_interval )
+    {
+        close_load(poller, conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+// With -r, sends the chunks that are due, and at the end closes the connections that
+// are not waiting for an ack. Returns when the next one is due in ns, or 0 if none is.
+static uint64_t pace(struct poller *poller, struct connection_ctx *head, size_t *total_bytes, int *conn_cnt)
+{
+    uint64_t now = now_ns();
+    int ended = 0 < deadline && deadline <= now_seconds();
+    uint64_t next = 0;
+
+    for ( struct connection_ctx *conn = head; conn != NULL; conn = conn->next )
+    {
+        if ( NULL == conn->fp || 0 == conn->socket_fd || conn->waiting )
+            continue;
+
+        if ( ended || conn->due <= now )
+        {
+            int sent = send_next(poller, conn, 0);
+            if ( -1 == sent )
+                (*conn_cnt)--;
+            else
+                *total_bytes += sent;
+        }
+        else if ( 0 == next || conn->due < next )
+        {
+            next = conn->due;
+        }
+    }
+
+    return next;
+}
+
+// With -M, the connections are opened from 127.0.0.1 up, moving to the next address
+// after this many: connect() takes longer to find a free port as the default ephemeral
+// range of 28232 ports fills up.
+#define C1M_PER_ADDRESS 10000
+
+// max number of connect() in progress at a time
+#define C1M_CONNECT_WINDOW 256
+
+// max time to wait for the acks still outstanding at the end of a step, in ms
+#define C1M_DRAIN_MS 1000
+
+// what the connections of -M send
+#define C1M_PAYLOAD 'x'
+
+// the state of -M, per connection: the socket (-1 once closed) and when its message
+// was sent (0 if none is outstanding, C1M_CONNECTING until the connect completes)
+#define C1M_CONNECTING ( (uint64_t) -1 )
+static int *c1m_fds = NULL;
+static uint64_t *c1m_sent = NULL;
+
+static int c1m_connecting = 0;
+static int c1m_outstanding = 0;
+static unsigned long c1m_acks = 0;
+static unsigned long c1m_lost = 0;
+static int c1m_error = 0;              // errno of the first connect that failed
+static struct histogram c1m_latency;
+
+// Lifts the descriptor limit up to fs.nr_open, or if the process is not allowed to raise
+// its hard limit, up to that, and returns it.
+static unsigned long raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if ( -1 == getrlimit(RLIMIT_NOFILE, &rl) )
+    {
+        fprintf(stderr, "getrlimit error (%d)\n", errno);
+        exit(1);
+    }
+
+    struct rlimit raised = rl;
+
+    FILE *fp = fopen("/proc/sys/fs/nr_open", "r");
+    if ( NULL != fp )
+    {
+        unsigned long nr_open;
+        if ( 1 == fscanf(fp, "%lu", &nr_open) )
+            raised.rlim_cur = raised.rlim_max = nr_open;
+        fclose(fp);
+    }
+
+    if ( -1 == setrlimit(RLIMIT_NOFILE, &raised) )
+    {
+        switch ( errno )
+        {
+            case EPERM:
+                // not privileged, the hard limit is as far as it goes
+                raised.rlim_cur = raised.rlim_max = rl.rlim_max;
+                if ( 0 == setrlimit(RLIMIT_NOFILE, &raised) )
+                    break;
+                // fall through
+
+            case EFAULT:
+            case EINVAL:
+            default:
+                fprintf(stderr, "setrlimit error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    return raised.rlim_cur;
+}
+
+// the resident set size of a process in KB, 0 if it cannot be read
+static unsigned long process_rss(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+
+    FILE *fp = fopen(path, "r");
+    if ( NULL == fp )
+        return 0;
+
+    unsigned long rss = 0;
+    char line[128];
+    while ( NULL != fgets(line, sizeof(line), fp) )
+    {
+        if ( 1 == sscanf(line, "VmRSS: %lu", &rss) )
+            break;
+    }
+
+    fclose(fp);
+    return rss;
+}
+
+// the CPU time of a process in seconds, user and system, all threads
+static double process_cpu(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+
+    FILE *fp = fopen(path, "r");
+    if ( NULL == fp )
+        return 0;
+
+    char line[1024];
+    unsigned long utime = 0, stime = 0;
+
+    // the command name may contain spaces, the fields are counted from its closing parenthesis
+    if ( NULL != fgets(line, sizeof(line), fp) && NULL != strrchr(line, ')') )
+        sscanf(strrchr(line, ')') + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+
+    fclose(fp);
+    return (double) ( utime + stime ) / sysconf(_SC_CLK_TCK);
+}
+
+// the memory of the TCP socket buffers of the whole system, in bytes
+static unsigned long tcp_memory(void)
+{
+    FILE *fp = fopen("/proc/net/sockstat", "r");
+    if ( NULL == fp )
+        return 0;
+
+    unsigned long pages = 0;
+    char line[256];
+    while ( NULL != fgets(line, sizeof(line), fp) )
+    {
+        if ( 1 == sscanf(line, "TCP: inuse %*u orphan %*u tw %*u alloc %*u mem %lu", &pages) )
+            break;
+    }
+
+    fclose(fp);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Starts connecting the i-th connection. Returns -1 with errno set if the system ran out
+// of a resource, which ends the test.
+static int c1m_connect(struct poller *poller, int i)
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if ( -1 == sockfd )
+    {
+        switch ( errno )
+        {
+            case EMFILE:
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+                return -1;
+
+            case EACCES:
+            case EAFNOSUPPORT:
+            case EINVAL:
+            case EPROTONOSUPPORT:
+            default:
+                fprintf(stderr, "socket creation error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    // Binding without a port leaves the choice of the port to connect(), which then only
+    // needs it to be unique for the destination, instead of for the source address alone.
+
+    int on = 1;
+    if ( -1 == setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on)) )
+    {
+        fprintf(stderr, "setsockopt error (%d)\n", errno);
+        exit(1);
+    }
+
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i / C1M_PER_ADDRESS);
+
+    if ( -1 == bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) )
+    {
+        fprintf(stderr, "socket bind error (%d)\n", errno);
+        exit(1);
+    }
+
+    struct sockaddr_in servaddr = { 0 };
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(PORT);
+    servaddr.sin_addr.s_addr = inet_addr(HOST);
+
+    if ( -1 == connect(sockfd, (struct sockaddr*) &servaddr, sizeof(servaddr)) && EINPROGRESS != errno )
+    {
+        int err = errno;
+        close(sockfd);
+
+        switch ( err )
+        {
+            case EADDRNOTAVAIL:
+            case ENOBUFS:
+            case ENOMEM:
+                errno = err;
+                return -1;
+
+            case ECONNREFUSED:
+                fprintf(stderr, "connection refused.\n");
+                exit(1);
+
+            default:
+                fprintf(stderr, "socket connect error (%d)\n", err);
+                exit(1);
+        }
+    }
+
+    union poller_data data = { .u64 = (uint64_t) i };
+    if ( -1 == poller_add(poller, sockfd, POLLER_OUT, data) )
+        backend_error("add");
+
+    c1m_fds[i] = sockfd;
+    c1m_sent[i] = C1M_CONNECTING;
+    c1m_connecting++;
+    return 0;
+}
+
+static void c1m_close(struct poller *poller, int i)
+{
+    close_connection(poller, c1m_fds[i]);
+    c1m_fds[i] = -1;
+
+    if ( C1M_CONNECTING == c1m_sent[i] )
+        c1m_connecting--;
+    else if ( 0 != c1m_sent[i] )
+        c1m_outstanding--;
+
+    c1m_sent[i] = 0;
+    c1m_lost++;
+}
+
+// waits up to timeout_ms for completed connects and acks
+static void c1m_wait(struct poller *poller, int timeout_ms)
+{
+    struct poller_event events[MAX_EVENTS];
+
+    int nfds = poller_wait(poller, events, MAX_EVENTS, timeout_ms);
+    if ( -1 == nfds )
+    {
+        switch ( errno )
+        {
+            case EINTR:
+                // A signal was caught
+                fprintf(stderr, "shutting down...\n");
+                exit(0);
+
+            default:
+                backend_error("wait");
+        }
+    }
+
+    for ( int j = 0; j < nfds; j++ )
+    {
+        int i = (int) events[j].data.u64;
+
+        if ( C1M_CONNECTING == c1m_sent[i] )
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c1m_fds[i], SOL_SOCKET, SO_ERROR, &err, &len);
+
+            if ( 0 != err )
+            {
+                if ( 0 == c1m_error )
+                    c1m_error = err;
+                c1m_close(poller, i);
+                continue;
+            }
+
+            union poller_data data = { .u64 = (uint64_t) i };
+            if ( -1 == poller_mod(poller, c1m_fds[i], POLLER_IN, data) )
+                backend_error("mod");
+
+            c1m_sent[i] = 0;
+            c1m_connecting--;
+            continue;
+        }
+
+        char buffer[BUFLEN];
+        ssize_t received = recv(c1m_fds[i], buffer, sizeof(buffer), 0);
+
+        if ( 0 < received )
+        {
+            if ( 0 != c1m_sent[i] )
+            {
+                hist_record(&c1m_latency, now_ns() - c1m_sent[i]);
+                c1m_sent[i] = 0;
+                c1m_outstanding--;
+                c1m_acks++;
+            }
+        }
+        else if ( 0 == received || ECONNRESET == errno )
+        {
+            // closed by the server
+            c1m_close(poller, i);
+        }
+        else if ( EAGAIN != errno )
+        {
+            fprintf(stderr, "socket recv error (%d)\n", errno);
+            exit(1);
+        }
+    }
+}
+
+// opens connections up to the given count, returns how many could be opened
+static int c1m_open(struct poller *poller, int opened, int count)
+{
+    while ( ( opened < count && 0 == c1m_error ) || 0 < c1m_connecting )
+    {
+        while ( opened < count && 0 == c1m_error && c1m_connecting < C1M_CONNECT_WINDOW )
+        {
+            if ( -1 == c1m_connect(poller, opened) )
+                c1m_error = errno;
+            else
+                opened++;
+        }
+
+        c1m_wait(poller, 100);
+    }
+
+    return opened;
+}
+
+// sends rate messages per second over random connections among the first count for the
+// given time, then waits for the acks still outstanding
+static void c1m_trickle(struct poller *poller, int count, double seconds, int rate)
+{
+    static char payload[MAX_CHUNK];
+    memset(payload, C1M_PAYLOAD, chunk_size - 1);
+    payload[chunk_size - 1] = '\n';
+
+    uint64_t interval = 1000000000ULL / rate;
+    uint64_t started = now_ns();
+    uint64_t end = started + (uint64_t) ( seconds * 1e9 );
+    uint64_t next = started;
+    uint64_t random = started | 1;
+
+    for ( uint64_t now = started; now < end; now = now_ns() )
+    {
+        for ( ; next <= now; next += interval )
+        {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            int i = (int) ( random % count );
+
+            // still waiting for the previous ack, it counts as a message the server missed
+            if ( -1 == c1m_fds[i] || 0 != c1m_sent[i] )
+                continue;
+
+            if ( -1 == send(c1m_fds[i], payload, chunk_size, MSG_NOSIGNAL) )
+            {
+                switch ( errno )
+                {
+                    case EAGAIN:
+                        break;
+
+                    case ECONNRESET:
+                    case EPIPE:
+                        c1m_close(poller, i);
+                        break;
+
+                    default:
+                        fprintf(stderr, "socket send error (%d)\n", errno);
+                        exit(1);
+                }
+                continue;
+            }
+
+            c1m_sent[i] = now;
+            c1m_outstanding++;
+        }
+
+        c1m_wait(poller, (int) ( ( next - now + 999999 ) / 1000000 ));
+    }
+
+    for ( uint64_t drained = now_ns() + C1M_DRAIN_MS * 1000000ULL; 0 < c1m_outstanding && now_ns() < drained; )
+        c1m_wait(poller, 10);
+}
+
+// opens connections in steps and measures the server at each of them
+static void run_c1m(const int *steps, int nsteps, double seconds, int rate, pid_t server_pid)
+{
+    int max = steps[nsteps - 1];
+    unsigned long limit = raise_fd_limit();
+    if ( limit < (unsigned long) max + 16 )
+        fprintf(stderr, "the descriptor limit of %lu allows fewer than %d connections\n", limit, max);
+
+    c1m_fds = (int *) malloc(max * sizeof(int));
+    c1m_sent = (uint64_t *) calloc(max, sizeof(uint64_t));
+    if ( NULL == c1m_fds || NULL == c1m_sent )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    struct poller *poller = poller_create(backend);
+    if ( NULL == poller )
+        backend_error("create");
+
+    unsigned long base_rss = ( 0 < server_pid ) ? process_rss(server_pid) : 0;
+    unsigned long base_tcp = tcp_memory();
+
+    printf("%11s %9s %12s %12s %12s %12s %8s %8s %8s %8s %8s\n",
+           "connections", "conn/s", "rss/conn", "tcpmem/conn", "cpu/conn", "cpu/msg",
+           "acks", "p50", "p99", "p99.9", "max");
+    printf("%11s %9s %12s %12s %12s %12s %8s %8s %8s %8s %8s\n",
+           "", "", "B", "B", "us", "us", "", "us", "us", "us", "us");
+
+    int opened = 0;
+    for ( int s = 0; s < nsteps && 0 == c1m_error; s++ )
+    {
+        double cpu = ( 0 < server_pid ) ? process_cpu(server_pid) : 0;
+        double started = now_seconds();
+
+        int from = opened;
+        opened = c1m_open(poller, opened, steps[s]);
+
+        double connect_time = now_seconds() - started;
+        double connect_cpu = ( 0 < server_pid ) ? process_cpu(server_pid) - cpu : 0;
+        int open = opened - (int) c1m_lost;
+
+        // sampled before the messages, whose buffers would otherwise be counted
+        unsigned long rss = ( 0 < server_pid ) ? process_rss(server_pid) : 0;
+        unsigned long tcp = tcp_memory();
+
+        memset(&c1m_latency, 0, sizeof(c1m_latency));
+        unsigned long acks = c1m_acks;
+        cpu = ( 0 < server_pid ) ? process_cpu(server_pid) : 0;
+
+        if ( 0 < open )
+            c1m_trickle(poller, opened, seconds, rate);
+
+        double trickle_cpu = ( 0 < server_pid ) ? process_cpu(server_pid) - cpu : 0;
+        acks = c1m_acks - acks;
+
+        char rss_conn[16] = "-", cpu_conn[16] = "-", cpu_msg[16] = "-";
+        if ( 0 < server_pid && 0 < open )
+        {
+            snprintf(rss_conn, sizeof(rss_conn), "%.0f", ( (double) rss - base_rss ) * 1024 / open);
+            if ( from < opened )
+                snprintf(cpu_conn, sizeof(cpu_conn), "%.2f", connect_cpu * 1e6 / ( opened - from ));
+            if ( 0 < acks )
+                snprintf(cpu_msg, sizeof(cpu_msg), "%.2f", trickle_cpu * 1e6 / acks);
+        }
+
+        // both ends of the connections are counted, which are all on this machine
+        printf("%11d %9.0f %12s %12.0f %12s %12s %8lu %8.1f %8.1f %8.1f %8.1f\n",
+               open, ( opened - from ) / connect_time, rss_conn,
+               ( 0 < open ) ? ( (double) tcp - base_tcp ) / open : 0.0, cpu_conn, cpu_msg, acks,
+               hist_percentile(&c1m_latency, 50) / 1e3, hist_percentile(&c1m_latency, 99) / 1e3,
+               hist_percentile(&c1m_latency, 99.9) / 1e3, c1m_latency.max / 1e3);
+        fflush(stdout);
+    }
+
+    if ( 0 != c1m_error )
+        fprintf(stderr, "stopped at %d connections: connect error (%d)\n", opened - (int) c1m_lost, c1m_error);
+    if ( 0 < c1m_lost )
+        fprintf(stderr, "%lu connections failed or were closed by the server\n", c1m_lost);
+
+    poller_destroy(poller);
+}
+
+// max number of worker processes of -w
+#define MAX_WORKERS 256
+
+// What a run of -n or -c measured. With -w, each worker fills its own in memory shared
+// with the coordinator, which merges them into one.
+struct run_result
+{
+    int ready;                  // the worker's connections are open
+    int cpu;                    // the worker is pinned to, or -1
+    unsigned long connections;
+    unsigned long failed;
+    int error;                  // errno of the first failure
+    size_t bytes;
+    unsigned long acks;
+    unsigned long syscalls;
+    double elapsed;
+    struct histogram latency;   // -n: from each send, or with -r from when it was due, to its ack
+    struct histogram setup;     // -c: the phases of each connection
+    struct histogram transfer;
+    struct histogram teardown;
+    struct histogram total;
+    struct tcp_health tcp;      // -n with -K
+};
+
+// with -w, the results of all workers, and of this one in a worker
+static struct run_result *worker_results = NULL;
+static struct run_result *worker_result = NULL;
+static int workers = 0;
+
+// the share of total that falls to worker i of n
+static unsigned long worker_share(unsigned long total, int i, int n)
+{
+    return total / n + ( (unsigned long) i < total % n );
+}
+
+// The i-th CPU the process may run on, wrapping around, or -1. Pinning the workers to
+// different CPUs keeps them from being moved around, and from sharing one.
+static int worker_cpu(int i)
+{
+    cpu_set_t set;
+    if ( -1 == sched_getaffinity(0, sizeof(set), &set) || 0 == CPU_COUNT(&set) )
+        return -1;
+
+    int n = i % CPU_COUNT(&set);
+    for ( int cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+    {
+        if ( CPU_ISSET(cpu, &set) && 0 == n-- )
+            return cpu;
+    }
+
+    return -1;
+}
+
+// In a worker, once its connections are open, waits for those of the others so that
+// the load starts at the same time in all of them. Does nothing without -w.
+static void worker_ready(void)
+{
+    if ( NULL == worker_result )
+        return;
+
+    __atomic_store_n(&worker_result->ready, 1, __ATOMIC_RELEASE);
+
+    for ( int i = 0; i < workers; i++ )
+    {
+        while ( 0 == __atomic_load_n(&worker_results[i].ready, __ATOMIC_ACQUIRE) )
+        {
+            struct timespec ts = { 0, 100000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+// Forks n workers, pinned to different CPUs with pin, which return from here with their
+// index and go on to run their share of the load. The coordinator returns -1 once they
+// have all finished, with their results in worker_results.
+static int start_workers(int n, int pin)
+{
+    workers = n;
+    worker_results = (struct run_result *) mmap(NULL, n * sizeof(struct run_result), PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( MAP_FAILED == worker_results )
+    {
+        fprintf(stderr, "mmap error (%d)\n", errno);
+        exit(1);
+    }
+
+    pid_t *pids = (pid_t *) calloc(n, sizeof(pid_t));
+    if ( NULL == pids )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    // what is buffered now would otherwise be printed by every worker
+    fflush(stdout);
+    fflush(stderr);
+
+    for ( int i = 0; i < n; i++ )
+    {
+        worker_results[i].cpu = pin ? worker_cpu(i) : -1;
+
+        pids[i] = fork();
+        if ( -1 == pids[i] )
+        {
+            fprintf(stderr, "fork error (%d)\n", errno);
+            exit(1);
+        }
+
+        if ( 0 == pids[i] )
+        {
+            free(pids);
+            worker_result = &worker_results[i];
+
+            if ( 0 <= worker_result->cpu )
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(worker_result->cpu, &set);
+                if ( -1 == sched_setaffinity(0, sizeof(set), &set) )
+                {
+                    fprintf(stderr, "sched_setaffinity error (%d)\n", errno);
+                    exit(1);
+                }
+            }
+
+            return i;
+        }
+    }
+
+    // a worker that fails leaves the others waiting for it, or with half the load
+    for ( int remaining = n; 0 < remaining; remaining-- )
+    {
+        int status;
+        pid_t pid = wait(&status);
+        if ( -1 == pid )
+        {
+            fprintf(stderr, "wait error (%d)\n", errno);
+            exit(1);
+        }
+
+        if ( !WIFEXITED(status) || 0 != WEXITSTATUS(status) )
+        {
+            for ( int i = 0; i < n; i++ )
+            {
+                if ( pid == pids[i] )
+                    fprintf(stderr, "worker %d failed\n", i);
+                else
+                    kill(pids[i], SIGTERM);
+            }
+            exit(1);
+        }
+    }
+
+    free(pids);
+    return -1;
+}
+
+// the results of all workers in one, with the time of the longest
+static void merge_results(struct run_result *merged)
+{
+    memset(merged, 0, sizeof(*merged));
+
+    for ( int i = 0; i < workers; i++ )
+    {
+        struct run_result *r = &worker_results[i];
+
+        merged->connections += r->connections;
+        merged->failed += r->failed;
+        if ( 0 == merged->error )
+            merged->error = r->error;
+        merged->bytes += r->bytes;
+        merged->acks += r->acks;
+        merged->syscalls += r->syscalls;
+        if ( merged->elapsed < r->elapsed )
+            merged->elapsed = r->elapsed;
+
+        hist_merge(&merged->latency, &r->latency);
+        hist_merge(&merged->setup, &r->setup);
+        hist_merge(&merged->transfer, &r->transfer);
+        hist_merge(&merged->teardown, &r->teardown);
+        hist_merge(&merged->total, &r->total);
+        tcp_health_merge(&merged->tcp, &r->tcp);
+    }
+}
+
+// a line per worker, to show how evenly they shared the load
+static void print_workers(int churn)
+{
+    for ( int i = 0; i < workers; i++ )
+    {
+        struct run_result *r = &worker_results[i];
+        struct histogram *h = churn ? &r->total : &r->latency;
+
+        fprintf(stderr, "worker %d: cpu:", i);
+        if ( 0 <= r->cpu )
+            fprintf(stderr, "%d", r->cpu);
+        else
+            fprintf(stderr, "any");
+        fprintf(stderr, ", connections:%lu, %s:%lu, elapsed:%.3fs, p99:%.1fus\n",
+                r->connections, churn ? "failed" : "acks", churn ? r->failed : r->acks, r->elapsed,
+                hist_percentile(h, 99) / 1000.0);
+    }
+}
+
+// the summary of -n, in the form bench/harness reads
+static void print_load(struct run_result *r, int rate)
+{
+    fprintf(stderr, "connections:%lu, bytes:%zu, elapsed:%.3fs, throughput:%.2fMB/s\n",
+            r->connections, r->bytes, r->elapsed, r->bytes / r->elapsed / 1e6);
+    fprintf(stderr, "backend %s: acks:%lu, syscalls:%lu, syscalls/ack:%.2f\n",
+            poller_name(backend), r->acks, r->syscalls, ( 0 < r->acks ) ? (double) r->syscalls / r->acks : 0.0);
+    if ( 0 < rate )
+        fprintf(stderr, "paced: target:%d/s, acks:%.0f/s\n", rate, r->acks / r->elapsed);
+    hist_print(stderr, "latency", &r->latency, 1000.0, "us");
+    if ( 0 < tcpinfo_ms )
+        tcp_health_print(stderr, &r->tcp);
+}
+
+// the summary of -c
+static void print_churn(struct run_result *r, int nthreads, int rate)
+{
+    fprintf(stderr, "churn: threads:%d, connections:%lu, failed:%lu, elapsed:%.3fs, rate:%.0f/s, target:%d/s\n",
+            nthreads, r->connections, r->failed, r->elapsed, r->connections / r->elapsed, rate);
+    hist_print(stderr, "setup", &r->setup, 1000.0, "us");
+    hist_print(stderr, "transfer", &r->transfer, 1000.0, "us");
+    hist_print(stderr, "teardown", &r->teardown, 1000.0, "us");
+    hist_print(stderr, "total", &r->total, 1000.0, "us");
+
+    if ( 0 < r->failed )
+        fprintf(stderr, "first failure: error (%d)\n", r->error);
+}
+
+// max number of threads of -c
+#define CHURN_MAX_THREADS 256
+
+// a thread of -c, with what it measured
+struct churn_thread
+{
+    pthread_t thread;
+    uint64_t start;             // when its first connection is due, in ns
+    uint64_t interval;          // between its connections
+    uint64_t end;
+    unsigned long connections;
+    unsigned long failed;
+    int error;                  // errno of the first failure
+    struct histogram setup;     // socket() and connect()
+    struct histogram transfer;  // from the send to the ack
+    struct histogram teardown;  // close()
+    struct histogram total;     // from when the connection was due to its close
+};
+
+// one short-lived connection, returns -1 with errno set if it failed
+static int churn_connection(struct churn_thread *t, const char *payload)
+{
+    uint64_t started = now_ns();
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if ( -1 == sockfd )
+        return -1;
+
+    struct sockaddr_in servaddr = { 0 };
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(PORT);
+    servaddr.sin_addr.s_addr = inet_addr(HOST);
+
+    int result = -1;
+    char buffer[BUFLEN];
+
+    if ( NULL != tuning && -1 == tuning_set_buffers(tuning, sockfd) )
+        goto error;
+
+    if ( -1 == connect(sockfd, (struct sockaddr*) &servaddr, sizeof(servaddr)) )
+        goto error;
+
+    if ( NULL != tuning && -1 == tuning_apply(tuning, sockfd) )
+        goto error;
+
+    uint64_t connected = now_ns();
+
+    if ( -1 == send(sockfd, payload, chunk_size, MSG_NOSIGNAL) )
+        goto error;
+    tuning_push(tuning, sockfd);
+
+    ssize_t received = recv(sockfd, buffer, sizeof(buffer), 0);
+    if ( received <= 0 )
+    {
+        // closed before the ack
+        if ( 0 == received )
+            errno = ECONNRESET;
+        goto error;
+    }
+
+    uint64_t acknowledged = now_ns();
+
+    result = close(sockfd);
+    sockfd = -1;
+    if ( -1 == result )
+        goto error;
+
+    uint64_t closed = now_ns();
+
+    hist_record(&t->setup, connected - started);
+    hist_record(&t->transfer, acknowledged - connected);
+    hist_record(&t->teardown, closed - acknowledged);
+
+error:
+    if ( -1 != sockfd )
+    {
+        int err = errno;
+        close(sockfd);
+        errno = err;
+    }
+
+    return result;
+}
+
+static void *churn_thread(void *arg)
+{
+    struct churn_thread *t = (struct churn_thread *) arg;
+
+    char *payload = (char *) malloc(chunk_size);
+    if ( NULL == payload )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(payload, 'c', chunk_size - 1);
+    payload[chunk_size - 1] = '\n';
+
+    // The connections are due on a fixed schedule, whether or not the previous one took
+    // longer than the interval, so that the total includes the time spent behind it.
+
+    for ( uint64_t due = t->start; due < t->end; due += t->interval )
+    {
+        struct timespec ts = { (time_t) ( due / 1000000000 ), (long) ( due % 1000000000 ) };
+        while ( EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) )
+            ;
+
+        if ( -1 == churn_connection(t, payload) )
+        {
+            if ( 0 == t->failed++ )
+                t->error = errno;
+            continue;
+        }
+
+        hist_record(&t->total, now_ns() - due);
+        t->connections++;
+    }
+
+    free(payload);
+    return NULL;
+}
+
+// opens and closes rate connections per second on nthreads threads for the given time
+static void run_churn(int rate, int nthreads, double seconds)
+{
+    struct churn_thread *threads = (struct churn_thread *) calloc(nthreads, sizeof(struct churn_thread));
+    if ( NULL == threads )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    worker_ready();
+
+    // each thread takes every nthreads-th slot of the schedule, and with -w the workers
+    // take turns within each slot
+    uint64_t interval = 1000000000ULL * nthreads / rate;
+    uint64_t started = now_ns();
+    uint64_t end = started + (uint64_t) ( seconds * 1e9 );
+    uint64_t offset = ( NULL != worker_result ) ? interval / nthreads * ( worker_result - worker_results ) / workers : 0;
+
+    for ( int i = 0; i < nthreads; i++ )
+    {
+        threads[i].start = started + offset + interval * i / nthreads;
+        threads[i].interval = interval;
+        threads[i].end = end;
+
+        int err = pthread_create(&threads[i].thread, NULL, churn_thread, &threads[i]);
+        if ( 0 != err )
+        {
+            fprintf(stderr, "pthread_create error (%d)\n", err);
+            exit(1);
+        }
+    }
+
+    // with -w, into the worker's slot for the coordinator to print
+    static struct run_result single;
+    struct run_result *result = ( NULL != worker_result ) ? worker_result : &single;
+
+    for ( int i = 0; i < nthreads; i++ )
+    {
+        pthread_join(threads[i].thread, NULL);
+
+        result->connections += threads[i].connections;
+        result->failed += threads[i].failed;
+        if ( 0 == result->error )
+            result->error = threads[i].error;
+
+        hist_merge(&result->setup, &threads[i].setup);
+        hist_merge(&result->transfer, &threads[i].transfer);
+        hist_merge(&result->teardown, &threads[i].teardown);
+        hist_merge(&result->total, &threads[i].total);
+    }
+
+    result->elapsed = ( now_ns() - started ) / 1e9;
+
+    if ( NULL == worker_result )
+        print_churn(result, nthreads, rate);
+
+    free(threads);
+}
+
+// connections that misbehave along with the normal load
+enum adverse_kind
+{
+    ADVERSE_SLOW,       // sends one byte at a time
+    ADVERSE_UNREAD,     // sends as fast as it can and never reads the acks
+    ADVERSE_IDLE,       // connects and goes silent
+    ADVERSE_KINDS
+};
+
+static const char *adverse_names[ADVERSE_KINDS] = { "slow", "unread", "idle" };
+
+// how many of each kind to open
+static int adverse_counts[ADVERSE_KINDS] = { 0 };
+
+// between the bytes sent by each slow connection, in ms
+static int trickle_ms = 100;
+
+// sends by an unread connection per wakeup
+#define ADVERSE_BURST 64
+
+struct adverse_conn
+{
+    int fd;             // -1 once closed
+    int kind;
+};
+
+static struct adverse_conn *adverse = NULL;
+static int adverse_total = 0;
+static pthread_t adverse_thread;
+static int adverse_stop = 0;
+
+// what the misbehaving connections did, read once their thread is joined
+static unsigned long adverse_bytes[ADVERSE_KINDS];
+static unsigned long adverse_closed[ADVERSE_KINDS];    // by the server
+static unsigned long adverse_stalls;                   // sends of unread connections that found the buffer full
+
+static void adverse_close(struct poller *poller, struct adverse_conn *conn)
+{
+    close_connection(poller, conn->fd);
+    conn->fd = -1;
+    adverse_closed[conn->kind]++;
+}
+
+static void *run_adverse(void *arg)
+{
+    struct poller *poller = (struct poller *) arg;
+
+    static char payload[MAX_CHUNK];
+    memset(payload, 'u', chunk_size);
+
+    struct poller_event events[MAX_EVENTS];
+    uint64_t next_trickle = now_ns();
+
+    while ( !__atomic_load_n(&adverse_stop, __ATOMIC_RELAXED) )
+    {
+        uint64_t now = now_ns();
+        if ( next_trickle <= now )
+        {
+            for ( int i = 0; i < adverse_total; i++ )
+            {
+                struct adverse_conn *conn = &adverse[i];
+                if ( ADVERSE_SLOW != conn->kind || -1 == conn->fd )
+                    continue;
+
+                if ( 1 == send(conn->fd, ".", 1, MSG_NOSIGNAL) )
+                    adverse_bytes[ADVERSE_SLOW]++;
+                else if ( EAGAIN != errno )
+                    adverse_close(poller, conn);
+            }
+
+            next_trickle = now + trickle_ms * 1000000ULL;
+        }
+
+        // woken up now and then to see whether the normal load is done
+        int timeout = (int) ( ( next_trickle - now + 999999 ) / 1000000 );
+        int nfds = poller_wait(poller, events, MAX_EVENTS, ( timeout < 100 ) ? timeout : 100);
+        if ( -1 == nfds )
+        {
+            if ( EINTR == errno )
+                continue;
+            backend_error("wait");
+        }
+
+        for ( int j = 0; j < nfds; j++ )
+        {
+            struct adverse_conn *conn = &adverse[events[j].data.u64];
+            if ( -1 == conn->fd )
+                continue;
+
+            if ( ADVERSE_UNREAD == conn->kind )
+            {
+                // Sends until the server stops taking any more, but no more than a burst
+                // per wakeup: a server that keeps reading would otherwise hold the thread
+                // here for good. The registration is level-triggered, so a connection
+                // cut short is reported again by the next wait.
+                ssize_t sent = 0;
+                for ( int n = 0; n < ADVERSE_BURST && !__atomic_load_n(&adverse_stop, __ATOMIC_RELAXED); n++ )
+                {
+                    sent = send(conn->fd, payload, chunk_size, MSG_NOSIGNAL);
+                    if ( sent <= 0 )
+                        break;
+                    adverse_bytes[ADVERSE_UNREAD] += sent;
+                }
+
+                if ( -1 == sent && EAGAIN == errno )
+                    adverse_stalls++;
+                else if ( -1 == sent && EINTR != errno )
+                    adverse_close(poller, conn);
+                continue;
+            }
+
+            // the acks of the slow connections, or the server closing them
+            char buffer[BUFLEN];
+            ssize_t received;
+            while ( 0 < ( received = recv(conn->fd, buffer, sizeof(buffer), 0) ) )
+                ;
+
+            if ( 0 == received || EAGAIN != errno )
+                adverse_close(poller, conn);
+        }
+    }
+
+    return poller;
+}
+
+// opens the misbehaving connections and starts their thread
+static void start_adverse(void)
+{
+    for ( int k = 0; k < ADVERSE_KINDS; k++ )
+        adverse_total += adverse_counts[k];
+
+    if ( 0 == adverse_total )
+        return;
+
+    adverse = (struct adverse_conn *) malloc(adverse_total * sizeof(struct adverse_conn));
+    if ( NULL == adverse )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    struct poller *poller = poller_create(backend);
+    if ( NULL == poller )
+        backend_error("create");
+
+    int i = 0;
+    for ( int k = 0; k < ADVERSE_KINDS; k++ )
+    {
+        for ( int n = 0; n < adverse_counts[k]; n++, i++ )
+        {
+            adverse[i].fd = connect_server(NULL);
+            adverse[i].kind = k;
+
+            // an unread connection is only ever told that it can send
+            union poller_data data = { .u64 = (uint64_t) i };
+            uint32_t events = ( ADVERSE_UNREAD == k ) ? POLLER_OUT : POLLER_IN;
+            if ( -1 == poller_add(poller, adverse[i].fd, events, data) )
+                backend_error("add");
+        }
+    }
+
+    int err = pthread_create(&adverse_thread, NULL, run_adverse, poller);
+    if ( 0 != err )
+    {
+        fprintf(stderr, "pthread_create error (%d)\n", err);
+        exit(1);
+    }
+}
+
+// stops the misbehaving connections once the normal load is done, and reports on them
+static void stop_adverse(void)
+{
+    if ( 0 == adverse_total )
+        return;
+
+    __atomic_store_n(&adverse_stop, 1, __ATOMIC_RELAXED);
+
+    void *poller;
+    pthread_join(adverse_thread, &poller);
+
+    for ( int k = 0; k < ADVERSE_KINDS; k++ )
+    {
+        if ( 0 == adverse_counts[k] )
+            continue;
+
+        fprintf(stderr, "%s: connections:%d, bytes:%lu, closed by server:%lu",
+                adverse_names[k], adverse_counts[k], adverse_bytes[k], adverse_closed[k]);
+        if ( ADVERSE_UNREAD == k )
+            fprintf(stderr, ", stalls:%lu", adverse_stalls);
+        fprintf(stderr, "\n");
+    }
+
+    for ( int i = 0; i < adverse_total; i++ )
+    {
+        if ( -1 != adverse[i].fd )
+            close_connection((struct poller *) poller, adverse[i].fd);
+    }
+
+    poller_destroy((struct poller *) poller);
+    free(adverse);
+}
+
+// a connection of -R, indexed by its id in the capture
+struct replay_conn
+{
+    int fd;                     // -1 unless open
+    uint64_t sent_at;           // when the oldest data not acknowledged yet was sent, or 0
+};
+
+static struct replay_conn *replay_conns = NULL;
+static size_t replay_size = 0;
+
+static int replay_outstanding = 0;
+static unsigned long replay_acks = 0;
+static struct histogram replay_latency;
+
+// the connection of the given id, growing the table as needed
+static struct replay_conn *replay_conn(uint32_t id)
+{
+    if ( replay_size <= id )
+    {
+        // in size_t, where doubling past the largest id cannot wrap
+        size_t size = ( 0 < replay_size ) ? replay_size : 1024;
+        while ( size <= id )
+            size *= 2;
+
+        struct replay_conn *conns = NULL;
+        if ( size <= SIZE_MAX / sizeof(struct replay_conn) )
+            conns = (struct replay_conn *) realloc(replay_conns, size * sizeof(struct replay_conn));
+        if ( NULL == conns )
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        for ( size_t i = replay_size; i < size; i++ )
+        {
+            conns[i].fd = -1;
+            conns[i].sent_at = 0;
+        }
+
+        replay_conns = conns;
+        replay_size = size;
+    }
+
+    return &replay_conns[id];
+}
+
+static void replay_close(struct poller *poller, struct replay_conn *conn)
+{
+    close_connection(poller, conn->fd);
+    conn->fd = -1;
+
+    if ( 0 != conn->sent_at )
+        replay_outstanding--;
+    conn->sent_at = 0;
+}
+
+// waits up to timeout_ms for acks
+static void replay_wait(struct poller *poller, int timeout_ms)
+{
+    struct poller_event events[MAX_EVENTS];
+
+    int nfds = poller_wait(poller, events, MAX_EVENTS, timeout_ms);
+    if ( -1 == nfds )
+    {
+        switch ( errno )
+        {
+            case EINTR:
+                // A signal was caught
+                fprintf(stderr, "shutting down...\n");
+                exit(0);
+
+            default:
+                backend_error("wait");
+        }
+    }
+
+    for ( int i = 0; i < nfds; i++ )
+    {
+        struct replay_conn *conn = &replay_conns[events[i].data.u64];
+        if ( -1 == conn->fd )
+            continue;
+
+        char buffer[BUFLEN];
+        ssize_t received = recv(conn->fd, buffer, sizeof(buffer), 0);
+
+        if ( 0 < received )
+        {
+            if ( 0 != conn->sent_at )
+            {
+                hist_record(&replay_latency, now_ns() - conn->sent_at);
+                conn->sent_at = 0;
+                replay_outstanding--;
+                replay_acks++;
+            }
+        }
+        else if ( 0 == received || ECONNRESET == errno )
+        {
+            // closed by the server
+            replay_close(poller, conn);
+        }
+        else if ( EAGAIN != errno )
+        {
+            fprintf(stderr, "socket recv error (%d)\n", errno);
+            exit(1);
+        }
+    }
+}
+
+// sends all of the data, waiting for the socket to drain if it has to
+static void replay_send(struct poller *poller, struct replay_conn *conn, const char *data, size_t len)
+{
+    while ( 0 < len )
+    {
+        ssize_t sent = send(conn->fd, data, len, MSG_NOSIGNAL);
+        if ( -1 == sent )
+        {
+            switch ( errno )
+            {
+                case EAGAIN:
+                {
+                    struct pollfd pfd = { conn->fd, POLLOUT, 0 };
+                    poll(&pfd, 1, -1);
+                    continue;
+                }
+
+                case EINTR:
+                    continue;
+
+                case ECONNRESET:
+                case EPIPE:
+                    replay_close(poller, conn);
+                    return;
+
+                default:
+                    fprintf(stderr, "socket send error (%d)\n", errno);
+                    exit(1);
+            }
+        }
+
+        data += sent;
+        len -= sent;
+    }
+}
+
+// replays the capture at path, speed times faster than it was taken
+static void run_replay(const char *path, double speed)
+{
+    FILE *fp = fopen(path, "rb");
+    if ( NULL == fp )
+    {
+        fprintf(stderr, "capture open error (%d)\n", errno);
+        exit(1);
+    }
+
+    struct capture_header header;
+    if ( 1 != fread(&header, sizeof(header), 1, fp) || CAPTURE_MAGIC != header.magic || CAPTURE_VERSION != header.version )
+    {
+        fprintf(stderr, "invalid capture: %s\n", path);
+        exit(1);
+    }
+
+    struct poller *poller = poller_create(backend);
+    if ( NULL == poller )
+        backend_error("create");
+
+    char *data = NULL;
+    size_t data_size = 0;
+
+    // how late each event was replayed
+    static struct histogram lag;
+    unsigned long connections = 0, sends = 0;
+    size_t total_bytes = 0;
+
+    uint64_t started = now_ns();
+    struct capture_record record;
+
+    while ( 1 == fread(&record, sizeof(record), 1, fp) )
+    {
+        if ( CAPTURE_DATA == record.type )
+        {
+            if ( REPLAY_MAX_RECORD < record.len )
+            {
+                fprintf(stderr, "invalid capture: %s: record of %u bytes\n", path, record.len);
+                exit(1);
+            }
+
+            if ( data_size < record.len )
+            {
+                data_size = record.len;
+                data = (char *) realloc(data, data_size);
+                if ( NULL == data )
+                {
+                    fprintf(stderr, "out of memory\n");
+                    exit(1);
+                }
+            }
+
+            if ( header.flags & CAPTURE_PAYLOAD )
+            {
+                if ( 0 < record.len && 1 != fread(data, record.len, 1, fp) )
+                    break;
+            }
+            else
+            {
+                memset(data, 'r', record.len);
+            }
+        }
+
+        // the last fraction of a millisecond is waited for without sleeping, as the
+        // timeout of the backend would round it up
+        uint64_t due = started + (uint64_t) ( record.time / speed );
+        for ( uint64_t now = now_ns(); now < due; now = now_ns() )
+            replay_wait(poller, (int) ( ( due - now ) / 1000000 ));
+
+        hist_record(&lag, now_ns() - due);
+
+        struct replay_conn *conn = replay_conn(record.conn);
+
+        switch ( record.type )
+        {
+            case CAPTURE_OPEN:
+            {
+                if ( -1 != conn->fd )
+                    replay_close(poller, conn);
+
+                conn->fd = connect_server(NULL);
+                connections++;
+
+                union poller_data pdata = { .u64 = record.conn };
+                if ( -1 == poller_add(poller, conn->fd, POLLER_IN, pdata) )
+                    backend_error("add");
+                break;
+            }
+
+            case CAPTURE_DATA:
+                // a connection that was open before the capture started, or closed by the server since
+                if ( -1 == conn->fd )
+                    break;
+
+                if ( 0 == conn->sent_at )
+                {
+                    conn->sent_at = now_ns();
+                    replay_outstanding++;
+                }
+
+                replay_send(poller, conn, data, record.len);
+                sends++;
+                total_bytes += record.len;
+                break;
+
+            case CAPTURE_CLOSE:
+            {
+                // The server acknowledged what it received before it saw the close, so
+                // the captured peer may well have waited for the ack before closing.
+                uint64_t limit = now_ns() + DRAIN_SECONDS * 1000000000ULL;
+                while ( -1 != conn->fd && 0 != conn->sent_at && now_ns() < limit )
+                    replay_wait(poller, 1);
+
+                if ( -1 != conn->fd )
+                    replay_close(poller, conn);
+                break;
+            }
+        }
+    }
+
+    if ( !feof(fp) )
+        fprintf(stderr, "the capture is truncated\n");
+    fclose(fp);
+
+    for ( uint64_t drained = now_ns() + DRAIN_SECONDS * 1000000000ULL; 0 < replay_outstanding && now_ns() < drained; )
+        replay_wait(poller, 10);
+
+    double elapsed = ( now_ns() - started ) / 1e9;
 
-        head = next;
+    for ( size_t id = 0; id < replay_size; id++ )
+    {
+        if ( -1 != replay_conns[id].fd )
+            replay_close(poller, &replay_conns[id]);
     }
+
+    fprintf(stderr, "replay: connections:%lu, sends:%lu, acks:%lu, bytes:%zu, elapsed:%.3fs, speed:%gx, throughput:%.2fMB/s\n",
+            connections, sends, replay_acks, total_bytes, elapsed, speed, total_bytes / elapsed / 1e6);
+    hist_print(stderr, "lag", &lag, 1000.0, "us");
+    hist_print(stderr, "latency", &replay_latency, 1000.0, "us");
+
+    poller_destroy(poller);
+    free(data);
+    free(replay_conns);
 }
 
-static int close_connection(int epollfd, int connfd)
+// parses a comma-separated list of ascending counts with optional k and m suffixes
+static int parse_steps(const char *list, int *steps, int max_steps)
 {
-    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_DEL, connfd, NULL) )
+    int n = 0;
+    const char *p = list;
+
+    while ( '\0' != *p && n < max_steps )
     {
-        switch ( errno )
+        char *end;
+        double count = strtod(p, &end);
+        if ( 'k' == *end || 'K' == *end )
         {
-            case EBADF:
-            case EEXIST:
-            case EINVAL:
-            case ENOENT:
-            case ENOMEM:
-            case ENOSPC:
-            case EPERM:
-            default:
-                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
-                exit(1);
+            count *= 1000;
+            end++;
         }
-    }
-
-    if ( -1 == close(connfd) )
-    {
-        switch ( errno )
+        else if ( 'm' == *end || 'M' == *end )
         {
-            case EBADF:
-            case EINTR:
-            case EIO:
-            default:
-                fprintf(stderr, "socket close error (%d)\n", errno);
-                exit(1);
+            count *= 1000000;
+            end++;
         }
+
+        if ( end == p || ( ',' != *end && '\0' != *end ) || count < 1 || 16777216 < count
+             || ( 0 < n && count <= steps[n - 1] ) )
+            return -1;
+
+        steps[n++] = (int) count;
+        p = ( ',' == *end ) ? end + 1 : end;
     }
 
-    return 0;
+    return ( '\0' == *p ) ? n : -1;
 }
 
-int main(int argc, char* argv[])
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] [filename]...\n", prog);
+    fprintf(stderr, "  -n, --connections N  open N connections sending generated data instead of files\n");
+    fprintf(stderr, "  -b, --bytes N        total number of bytes sent by the N connections\n");
+    fprintf(stderr, "  -s, --skew P:S       P%% of the connections send S%% of the bytes\n");
+    fprintf(stderr, "  -d, --duration S     send generated data for S seconds instead of -b bytes\n");
+    fprintf(stderr, "  -z, --chunk N        send N bytes at a time (default %d)\n", BUFLEN);
+    fprintf(stderr, "  -e, --backend NAME   wait for events with epoll (default), poll or io_uring\n");
+    fprintf(stderr, "  -q, --quiet          print a summary instead of every send and ack\n");
+    fprintf(stderr, "  -M, --c1m STEPS      open idle connections in steps, e.g. 10k,100k,1m, and\n");
+    fprintf(stderr, "                       send messages over them for -d seconds (default 5) at each\n");
+    fprintf(stderr, "  -r, --rate N         chunks per second sent by the connections of -n, paced and\n");
+    fprintf(stderr, "                       timed from when each is due, or messages per second\n");
+    fprintf(stderr, "                       sent with -M (default 1000)\n");
+    fprintf(stderr, "  -p, --server-pid P   report the memory and CPU time of the server at each step\n");
+    fprintf(stderr, "  -c, --churn RATE     open, use and close RATE connections per second for -d\n");
+    fprintf(stderr, "                       seconds (default 5), each sending -z bytes\n");
+    fprintf(stderr, "  -t, --threads N      threads sharing the connections of -c (default 4)\n");
+    fprintf(stderr, "  -L, --slow N         along with the load, N connections sending a byte at a time\n");
+    fprintf(stderr, "  -T, --trickle MS     between the bytes of each --slow connection (default 100)\n");
+    fprintf(stderr, "  -U, --unread N       along with the load, N connections never reading their acks\n");
+    fprintf(stderr, "  -I, --idle N         along with the load, N connections that stay silent\n");
+    fprintf(stderr, "  -R, --replay PATH    replay the traffic captured with server --capture\n");
+    fprintf(stderr, "  -x, --speed X        replay X times faster than captured (default 1)\n");
+    fprintf(stderr, "  -w, --workers M      split -n or -c over M processes and merge their results\n");
+    fprintf(stderr, "  -P, --pin            pin each worker to a different CPU\n");
+    fprintf(stderr, "  -K, --tcp-info MS    sample TCP_INFO of %d connections of -n every MS and of\n", TCPINFO_BUDGET);
+    fprintf(stderr, "                       each one at close, shown in the summary\n");
+    fprintf(stderr, "  -o, --tuning NAME    set the TCP options of a profile on the connections of -n,\n");
+    fprintf(stderr, "                       the files and -c: ");
+    tuning_names(stderr);
+    fprintf(stderr, "\n");
+}
+
+// appends a connection to the list
+static void add_connection(struct connection_ctx **head, struct connection_ctx **tail, struct connection_ctx *conn)
 {
-    if ( argc <= 1 )
+    if ( NULL == conn )
+        return;
+
+    if ( NULL != *tail )
     {
-        fprintf(stderr, "Usage: %s [filename]...\n", argv[0]);
-        exit(0);
+        (*tail)->next = conn;
     }
+    *tail = conn;
 
-    struct connection_ctx *connection_head = NULL;
-    struct connection_ctx *connection_tail = NULL;
-    int conn_cnt = 0;
+    if ( NULL == *head )
+        *head = conn;
+}
+
+int main(int argc, char* argv[])
+{
+    int synthetic_conns = 0;
+    size_t synthetic_bytes = 1000000;
+    double duration = 0;
+    int skew_conns = 0, skew_bytes = 0;
+    int c1m_steps[64];
+    int c1m_nsteps = 0;
+    int rate = 0;
+    pid_t server_pid = 0;
+    int churn_rate = 0;
+    int churn_threads = 4;
+    const char *replay_path = NULL;
+    double speed = 1;
+    int nworkers = 0;
+    int pin = 0;
 
-    for ( int i = 1; i < argc; i++ )
+    static const struct option long_options[] =
     {
-        FILE* fp = fopen(argv[i], "r");
-        if ( fp )
+        { "connections", required_argument, NULL, 'n' },
+        { "bytes",       required_argument, NULL, 'b' },
+        { "skew",        required_argument, NULL, 's' },
+        { "duration",    required_argument, NULL, 'd' },
+        { "chunk",       required_argument, NULL, 'z' },
+        { "backend",     required_argument, NULL, 'e' },
+        { "quiet",       no_argument,       NULL, 'q' },
+        { "c1m",         required_argument, NULL, 'M' },
+        { "rate",        required_argument, NULL, 'r' },
+        { "server-pid",  required_argument, NULL, 'p' },
+        { "churn",       required_argument, NULL, 'c' },
+        { "threads",     required_argument, NULL, 't' },
+        { "slow",        required_argument, NULL, 'L' },
+        { "trickle",     required_argument, NULL, 'T' },
+        { "unread",      required_argument, NULL, 'U' },
+        { "idle",        required_argument, NULL, 'I' },
+        { "replay",      required_argument, NULL, 'R' },
+        { "speed",       required_argument, NULL, 'x' },
+        { "workers",     required_argument, NULL, 'w' },
+        { "pin",         no_argument,       NULL, 'P' },
+        { "tcp-info",    required_argument, NULL, 'K' },
+        { "tuning",      required_argument, NULL, 'o' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL,          0,                 NULL, 0   }
+    };
+
+    int opt;
+    while ( -1 != ( opt = getopt_long(argc, argv, "n:b:s:d:z:e:qM:r:p:c:t:L:T:U:I:R:x:w:PK:o:h", long_options, NULL) ) )
+    {
+        switch ( opt )
         {
-            int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-            if ( -1 == sockfd )
-            {
-                switch ( errno )
+            case 'n':
+                synthetic_conns = atoi(optarg);
+                break;
+
+            case 'b':
+                synthetic_bytes = strtoull(optarg, NULL, 10);
+                break;
+
+            case 's':
+                if ( 2 != sscanf(optarg, "%d:%d", &skew_conns, &skew_bytes)
+                     || skew_conns <= 0 || 100 <= skew_conns || skew_bytes < 0 || 100 < skew_bytes )
                 {
-                    case EACCES:
-                    case EAFNOSUPPORT:
-                    case EINVAL:
-                    case ENFILE:
-                    case ENOBUFS:
-                    case ENOMEM:
-                    case EPROTONOSUPPORT:
-                    default:
-                        fprintf(stderr, "socket creation error (%d)\n", errno);
-                        exit(1);
+                    fprintf(stderr, "invalid skew: %s\n", optarg);
+                    exit(1);
                 }
-            }
+                break;
 
-            // connect to the server
+            case 'd':
+                duration = atof(optarg);
+                if ( duration <= 0 )
+                {
+                    fprintf(stderr, "invalid duration: %s\n", optarg);
+                    exit(1);
+                }
+                break;
 
-            struct sockaddr_in servaddr;
-            servaddr.sin_family = AF_INET;
-            servaddr.sin_port = htons(PORT);
-            servaddr.sin_addr.s_addr = inet_addr(HOST);
+            case 'z':
+                chunk_size = strtoul(optarg, NULL, 10);
+                if ( 0 == chunk_size || MAX_CHUNK < chunk_size )
+                {
+                    fprintf(stderr, "invalid chunk size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
 
-            if ( -1 == connect(sockfd, (struct sockaddr*) &servaddr, sizeof(servaddr) ))
-            {
-                switch ( errno )
+            case 'e':
+                backend = poller_find(optarg);
+                if ( -1 == backend )
                 {
-                    case ECONNREFUSED:
-                        fprintf(stderr, "connection refused.\n");
-                        exit(1);
+                    fprintf(stderr, "invalid backend: %s\n", optarg);
+                    exit(1);
+                }
+                break;
 
-                    case EADDRNOTAVAIL:
-                    case EAFNOSUPPORT:
-                    case EALREADY:
-                    case EBADF:
-                    case EINPROGRESS:
-                    case EINTR:
-                    case EISCONN:
-                    case ENETUNREACH:
-                    case ENOTSOCK:
-                    case EPROTOTYPE:
-                    case ETIMEDOUT:
-                    case EIO:
-                    case ENOENT:
-                    case ENOTDIR:
-                    case EACCES:
-                    case EADDRINUSE:
-                    case ECONNRESET:
-                    case EHOSTUNREACH:
-                    case EINVAL:
-                    case ELOOP:
-                    case ENAMETOOLONG:
-                    case ENETDOWN:
-                    case ENOBUFS:
-                    case EOPNOTSUPP:
-                    default:
-                        fprintf(stderr, "socket connect error (%d)\n", errno);
-                        exit(1);
+            case 'q':
+                quiet = 1;
+                break;
+
+            case 'M':
+                c1m_nsteps = parse_steps(optarg, c1m_steps, sizeof(c1m_steps) / sizeof(c1m_steps[0]));
+                if ( c1m_nsteps <= 0 )
+                {
+                    fprintf(stderr, "invalid steps: %s\n", optarg);
+                    exit(1);
                 }
-            }
+                break;
+
+            case 'r':
+                rate = atoi(optarg);
+                if ( rate <= 0 )
+                {
+                    fprintf(stderr, "invalid rate: %s\n", optarg);
+                    exit(1);
+                }
+                break;
 
-            // set non-blocking
+            case 'p':
+                server_pid = (pid_t) atoi(optarg);
+                break;
 
-            int flags = fcntl(sockfd, F_GETFL, 0);
-            if ( -1 == flags )
-            {
-                switch ( errno )
+            case 'c':
+                churn_rate = atoi(optarg);
+                if ( churn_rate <= 0 )
                 {
-                    case EACCES:
-                    case EAGAIN:
-                    case EBADF:
-                    case EINTR:
-                    case EINVAL:
-                    case EMFILE:
-                    case ENOLCK:
-                    case EOVERFLOW:
-                    default:
-                        fprintf(stderr, "select fcntl error (%d)\n", errno);
-                        exit(1);
+                    fprintf(stderr, "invalid rate: %s\n", optarg);
+                    exit(1);
                 }
-            }
+                break;
+
+            case 't':
+                churn_threads = atoi(optarg);
+                if ( churn_threads < 1 || CHURN_MAX_THREADS < churn_threads )
+                {
+                    fprintf(stderr, "invalid number of threads: %s\n", optarg);
+                    exit(1);
+                }
+                break;
 
-            if ( -1 == fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) )
+            case 'L':
+            case 'U':
+            case 'I':
             {
-                switch ( errno )
+                int kind = ( 'L' == opt ) ? ADVERSE_SLOW : ( 'U' == opt ) ? ADVERSE_UNREAD : ADVERSE_IDLE;
+                adverse_counts[kind] = atoi(optarg);
+                if ( adverse_counts[kind] < 0 )
                 {
-                    case EACCES:
-                    case EAGAIN:
-                    case EBADF:
-                    case EINTR:
-                    case EINVAL:
-                    case EMFILE:
-                    case ENOLCK:
-                    case EOVERFLOW:
-                    default:
-                        fprintf(stderr, "select fcntl error (%d)\n", errno);
-                        exit(1);
+                    fprintf(stderr, "invalid number of %s connections: %s\n", adverse_names[kind], optarg);
+                    exit(1);
                 }
+                break;
             }
 
-            // store the socket in connection_ctx
+            case 'T':
+                trickle_ms = atoi(optarg);
+                if ( trickle_ms <= 0 )
+                {
+                    fprintf(stderr, "invalid trickle interval: %s\n", optarg);
+                    exit(1);
+                }
+                break;
 
-            struct connection_ctx *new_conn = (struct connection_ctx *) malloc(sizeof(struct connection_ctx));
-            if ( NULL != new_conn )
-            {
-                new_conn->socket_fd = sockfd;
-                new_conn->fp = fp;
-                new_conn->next = NULL;
+            case 'R':
+                replay_path = optarg;
+                break;
 
-                if ( NULL != connection_tail )
+            case 'x':
+                speed = atof(optarg);
+                if ( speed <= 0 )
                 {
-                    connection_tail->next = new_conn;
+                    fprintf(stderr, "invalid speed: %s\n", optarg);
+                    exit(1);
                 }
-                connection_tail = new_conn;
+                break;
 
-                if ( NULL == connection_head )
-                    connection_head = new_conn;
-            }
+            case 'w':
+                nworkers = atoi(optarg);
+                if ( nworkers < 1 || MAX_WORKERS < nworkers )
+                {
+                    fprintf(stderr, "invalid number of workers: %s\n", optarg);
+                    exit(1);
+                }
+                break;
 
-            ++conn_cnt;
+            case 'P':
+                pin = 1;
+                break;
+
+            case 'K':
+                tcpinfo_ms = atoi(optarg);
+                if ( tcpinfo_ms < 1 )
+                {
+                    fprintf(stderr, "invalid sampling period: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'o':
+                tuning = tuning_find(optarg);
+                if ( NULL == tuning )
+                {
+                    fprintf(stderr, "unknown tuning profile: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+
+            default:
+                usage(argv[0]);
+                exit(1);
         }
     }
 
-    // epoll
+    // the idle connections of -M are to stay small, and a replay keeps the timing of the
+    // captured sends, which a corked socket would not
+    if ( NULL != tuning && ( 0 < c1m_nsteps || NULL != replay_path ) )
+    {
+        fprintf(stderr, "--tuning applies to the connections of -n, files or -c only\n");
+        exit(1);
+    }
 
-    int epollfd = epoll_create1(0);
-    if ( -1 == epollfd )
+    if ( 0 < tcpinfo_ms && ( 0 < c1m_nsteps || NULL != replay_path || 0 < churn_rate ) )
     {
-        switch ( errno )
+        fprintf(stderr, "--tcp-info samples the connections of -n or files only\n");
+        exit(1);
+    }
+
+    if ( 0 < c1m_nsteps )
+    {
+        run_c1m(c1m_steps, c1m_nsteps, ( 0 < duration ) ? duration : 5, ( 0 < rate ) ? rate : 1000, server_pid);
+        exit(0);
+    }
+
+    if ( NULL != replay_path )
+    {
+        run_replay(replay_path, speed);
+        exit(0);
+    }
+
+    // each connection sends every this often to make up the rate, whichever worker it is in
+    if ( 0 < rate )
+        pace_interval = 1000000000ULL * ( synthetic_conns + argc - optind ) / rate;
+
+    int adverse_any = 0;
+    for ( int kind = 0; kind < ADVERSE_KINDS; kind++ )
+        adverse_any += adverse_counts[kind];
+
+    // The workers split the connections, or the churn rate, between them. Each then goes
+    // on as a client of its own.
+    if ( 0 < nworkers )
+    {
+        int load = ( 0 < churn_rate ) ? churn_rate : synthetic_conns;
+        if ( load < nworkers || optind < argc || 0 < adverse_any )
         {
-            case EINVAL:
-            case EMFILE:
-            case ENFILE:
-            case ENOMEM:
-            default:
-                fprintf(stderr, "epoll create1 error (%d)\n", errno);
-                exit(1);
+            fprintf(stderr, "--workers takes at least as many --connections or --churn per second, and no files\n");
+            exit(1);
+        }
+
+        int worker = start_workers(nworkers, pin);
+        if ( -1 == worker )
+        {
+            static struct run_result merged;
+            merge_results(&merged);
+
+            fprintf(stderr, "coordinator: workers:%d, pinned:%s\n", nworkers, pin ? "yes" : "no");
+            print_workers(0 < churn_rate);
+            if ( 0 < churn_rate )
+                print_churn(&merged, churn_threads * nworkers, churn_rate);
+            else
+                print_load(&merged, rate);
+            exit(0);
         }
+
+        unsigned long conns = worker_share(synthetic_conns, worker, nworkers);
+        synthetic_bytes = (size_t) ( (double) synthetic_bytes * conns / ( 0 < synthetic_conns ? synthetic_conns : 1 ) );
+        synthetic_conns = (int) conns;
+        churn_rate = (int) worker_share(churn_rate, worker, nworkers);
+    }
+
+    if ( 0 < churn_rate )
+    {
+        run_churn(churn_rate, churn_threads, ( 0 < duration ) ? duration : 5);
+        exit(0);
+    }
+
+    if ( optind >= argc && 0 >= synthetic_conns )
+    {
+        usage(argv[0]);
+        exit(0);
     }
 
-    // register sockets
+    struct connection_ctx *connection_head = NULL;
+    struct connection_ctx *connection_tail = NULL;
+    int conn_cnt = 0;
+    size_t total_bytes = 0;
+
+    double started = now_seconds();
 
-    struct epoll_event ev;
+    // the connections send until the deadline however many bytes it takes
+    if ( 0 < duration )
+        synthetic_bytes = (size_t) -1 / 2;
 
-    for ( struct connection_ctx *conn = connection_head; conn != NULL; conn = conn->next )
+    for ( int i = optind; i < argc; i++ )
     {
-        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-        ev.data.ptr = conn;
+        FILE* fp = fopen(argv[i], "r");
+        if ( fp )
+        {
+            add_connection(&connection_head, &connection_tail, open_connection(fp));
+            ++conn_cnt;
+        }
+    }
+
+    if ( 0 < synthetic_conns )
+    {
+        // the heavy connections come first and share skew_bytes% of the bytes
 
-        if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->socket_fd, &ev) )
+        int heavy = ( skew_conns * synthetic_conns + 50 ) / 100;
+        if ( 0 < skew_conns && 0 == heavy )
+            heavy = 1;
+        if ( heavy >= synthetic_conns )
+            heavy = 0;
+
+        size_t heavy_bytes = ( 0 < heavy ) ? synthetic_bytes / 100 * skew_bytes / heavy : 0;
+        size_t light_bytes = ( synthetic_bytes - heavy_bytes * heavy ) / ( synthetic_conns - heavy );
+
+        for ( int i = 0; i < synthetic_conns; i++ )
         {
-            switch ( errno )
+            size_t bytes = ( i < heavy ) ? heavy_bytes : light_bytes;
+
+            FILE *fp = open_synthetic(bytes, 'a' + i % 26);
+            if ( NULL == fp )
             {
-                case EBADF:
-                case EEXIST:
-                case EINVAL:
-                case ENOENT:
-                case ENOMEM:
-                case ENOSPC:
-                case EPERM:
-                default:
-                    fprintf(stderr, "epoll_ctl error (%d)\n", errno);
-                    exit(1);
+                fprintf(stderr, "out of memory\n");
+                exit(1);
             }
+
+            add_connection(&connection_head, &connection_tail, open_connection(fp));
+            ++conn_cnt;
+        }
+    }
+
+    int total_conns = conn_cnt;
+
+    // the misbehaving connections are in place before the normal load starts
+    start_adverse();
+
+    // with -w, the load starts in all workers together
+    worker_ready();
+
+    // the duration, and the elapsed time, start once all connections are open
+    if ( 0 < duration || NULL != worker_result )
+        started = now_seconds();
+    if ( 0 < duration )
+        deadline = started + duration;
+
+    struct poller *poller = poller_create(backend);
+    if ( NULL == poller )
+        backend_error("create");
+
+    // register sockets, with the first chunks of paced connections spread over the
+    // interval, and over the workers
+
+    uint64_t first = now_ns();
+    if ( NULL != worker_result && 0 < conn_cnt )
+        first += pace_interval / conn_cnt * ( worker_result - worker_results ) / workers;
+    int k = 0;
+
+    for ( struct connection_ctx *conn = connection_head; conn != NULL; conn = conn->next )
+    {
+        union poller_data data = { .ptr = conn };
+        conn->due = first + pace_interval * k++ / conn_cnt;
+
+        if ( -1 == poller_add(poller, conn->socket_fd, POLLER_IN | POLLER_OUT | POLLER_EDGE, data) )
+            backend_error("add");
+    }
+
+    // with -r, wakes the loop up when the next chunk is due
+    int timerfd = -1;
+    uint64_t timer_due = 0;
+    if ( 0 < pace_interval )
+    {
+        timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if ( -1 == timerfd )
+        {
+            fprintf(stderr, "timerfd_create error (%d)\n", errno);
+            exit(1);
         }
+
+        union poller_data data = { .ptr = NULL };
+        if ( -1 == poller_add(poller, timerfd, POLLER_IN, data) )
+            backend_error("add");
     }
 
-    struct epoll_event events[MAX_EVENTS];
+    // from each send, or with -r from when it was due, to its ack
+    static struct histogram latency;
+    unsigned long acks = 0;
+
+    uint64_t tcpinfo_due = now_ns();
+
+    struct poller_event events[MAX_EVENTS];
 
     while ( 0 < conn_cnt )
     {
-        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        int timeout = -1;
+        if ( 0 < deadline )
+        {
+            double remaining = deadline + DRAIN_SECONDS - now_seconds();
+            if ( remaining <= 0 )
+                break;
+            timeout = (int) ( remaining * 1000 ) + 1;
+        }
+
+        if ( 0 < tcpinfo_ms )
+        {
+            uint64_t now = now_ns();
+            if ( tcpinfo_due <= now )
+            {
+                sample_load(connection_head);
+                tcpinfo_due += tcpinfo_ms * 1000000ULL;
+                if ( tcpinfo_due <= now )
+                    tcpinfo_due = now + tcpinfo_ms * 1000000ULL;
+            }
+
+            int until = (int) ( ( tcpinfo_due - now ) / 1000000 ) + 1;
+            if ( -1 == timeout || until < timeout )
+                timeout = until;
+        }
+
+        if ( 0 < pace_interval )
+        {
+            uint64_t next = pace(poller, connection_head, &total_bytes, &conn_cnt);
+            if ( 0 == conn_cnt )
+                break;
+
+            // a millisecond timeout would wake up late, or poll until the chunk is due
+            if ( next != timer_due )
+            {
+                struct itimerspec its = { { 0, 0 }, { (time_t) ( next / 1000000000 ), (long) ( next % 1000000000 ) } };
+                syscalls++;
+                if ( -1 == timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) )
+                {
+                    fprintf(stderr, "timerfd_settime error (%d)\n", errno);
+                    exit(1);
+                }
+                timer_due = next;
+            }
+        }
+
+        int nfds = poller_wait(poller, events, MAX_EVENTS, timeout);
         if ( -1 == nfds )
         {
             switch ( errno )
@@ -295,12 +2482,8 @@ int main(int argc, char* argv[])
                     clear_connection_ctx_list(connection_head);
                     exit(0);
 
-                case EBADF:
-                case EFAULT:
-                case EINVAL:
                 default:
-                    fprintf(stderr, "epoll_wait error (%d)\n", errno);
-                    exit(1);
+                    backend_error("wait");
             }
         }
 
@@ -308,22 +2491,38 @@ int main(int argc, char* argv[])
         {
             struct connection_ctx *conn = (struct connection_ctx *) events[i].data.ptr;
 
+            if ( NULL == conn )
+            {
+                // the timer of -r, whose chunks are sent at the top of the loop
+                uint64_t expirations;
+                syscalls++;
+                if ( -1 == read(timerfd, &expirations, sizeof(expirations)) && EAGAIN != errno )
+                {
+                    fprintf(stderr, "timerfd read error (%d)\n", errno);
+                    exit(1);
+                }
+                continue;
+            }
+
             // This is declared here to pass it from EPOLLIN to EPOLLOUT in this test implementation.
             // In most other cases, it would likely be placed inside EPOLLIN block.
             size_t total_bytes_in = 0;
             int acknowledged = 0;
 
-            if ( events[i].events & EPOLLIN )
+            if ( events[i].events & POLLER_IN )
             {
                 // socket has data to read
 
                 char buffer[BUFLEN];
                 ssize_t received;
 
-                while ( 0 < ( received = recv(conn->socket_fd, buffer, sizeof(buffer), 0) ) )
+                while ( ++syscalls, 0 < ( received = recv(conn->socket_fd, buffer, sizeof(buffer), 0) ) )
                 {
-                    printf("sock:%d, %.*s", conn->socket_fd, (int) received, buffer);
-                    fflush(stdout);
+                    if ( !quiet )
+                    {
+                        printf("sock:%d, %.*s", conn->socket_fd, (int) received, buffer);
+                        fflush(stdout);
+                    }
 
                     total_bytes_in += received;
                 }
@@ -335,12 +2534,13 @@ int main(int argc, char* argv[])
                         {
                             case EAGAIN:
                                 // no data available right now, try again later...
+                                PROBE1(client, recv_eagain, conn->socket_fd);
+                                tuning_rearm(tuning, conn->socket_fd);
                                 break;
 
                             case ECONNRESET:
                                 // connection reset by the peer
-                                close_connection(epollfd, conn->socket_fd);
-                                conn->socket_fd = 0;
+                                close_load(poller, conn);
                                 conn_cnt--;
                                 break;
 
@@ -364,8 +2564,7 @@ int main(int argc, char* argv[])
                             // The stream socket peer has performed an orderly shutdown.
                             // recv returning 0 is a socket-closed notification.
 
-                            close_connection(epollfd, conn->socket_fd);
-                            conn->socket_fd = 0;
+                            close_load(poller, conn);
                             conn_cnt--;
                         }
                 }
@@ -376,90 +2575,76 @@ int main(int argc, char* argv[])
                 if ( 0 == strncmp(buffer, "Ack\n", 4) )
                 {
                     acknowledged = 1;
+                    acks++;
+
+                    // Paced, the latency runs from when the chunk was due rather than
+                    // from when it was sent, which a slow ack may have held back.
+                    uint64_t took = now_ns() - ( ( 0 < pace_interval ) ? conn->due : conn->sent_at );
+                    hist_record(&latency, took);
+                    PROBE2(client, ack, conn->socket_fd, took);
+                    if ( 0 < pace_interval )
+                        conn->due += pace_interval;
+                    conn->waiting = 0;
 
                     // if this acknowledgement is after all data have been sent
                     if ( NULL == conn->fp )
                     {
-                        close_connection(epollfd, conn->socket_fd);
-                        conn->socket_fd = 0;
+                        close_load(poller, conn);
                         conn_cnt--;
                     }
                 }
             }
 
-            if ( events[i].events & EPOLLOUT )
+            if ( events[i].events & POLLER_OUT )
             {
-                if ( NULL != conn->fp && 0 != conn->socket_fd )
+                if ( NULL != conn->fp && 0 != conn->socket_fd
+                     && ( 0 == pace_interval || ( !conn->waiting && conn->due <= now_ns() ) ) )
                 {
-                    size_t nbytes;
-                    nbytes = fread(conn->buffer, sizeof(char), BUFLEN, conn->fp);
-                    if ( 0 != nbytes )
-                    {
-                        int sent = send(conn->socket_fd, conn->buffer, nbytes, 0);
-                        if ( -1 == sent )
-                        {
-                            switch ( errno )
-                            {
-                                case EACCES:
-                                case EWOULDBLOCK:
-                                case EBADF:
-                                case ECONNRESET:
-                                case EDESTADDRREQ:
-                                case EFAULT:
-                                case EINTR:
-                                case EINVAL:
-                                case EISCONN:
-                                case EMSGSIZE:
-                                case ENOBUFS:
-                                case ENOMEM:
-                                case ENOTCONN:
-                                case ENOTSOCK:
-                                case EOPNOTSUPP:
-                                case EPIPE:
-                                default:
-                                    fprintf(stderr, "socket send error (%d)\n", errno);
-                                    exit(1);
-                            }
-                        }
-
-                        // reached to end-of-file
-                        // beware: there is corner case that the buffer ends exactly at the end-of-file
-                        // in that case, the end-of-file is not detected here, and will be taken care of
-                        // in the next EPOLLOUT
-                        if ( nbytes < BUFLEN )
-                        {
-                            fclose(conn->fp);
-                            conn->fp = NULL;
-                        }
-
-                        fprintf(stderr, "sock:%d, fread:%lu, sent:%d\n", conn->socket_fd, nbytes, sent);
-                    }
+                    int sent = send_next(poller, conn, acknowledged);
+                    if ( -1 == sent )
+                        conn_cnt--;
                     else
-                    {
-                        // already end-of-file
-                        // we reach here in case the send buffer ends exactly at the end-of-file
-                        // and the end-of-file was not detected in the previous EPOLLOUT
-
-                        fclose(conn->fp);
-                        conn->fp = NULL;
-
-                        if ( 0 != acknowledged )
-                        {
-                            close_connection(epollfd, conn->socket_fd);
-                            conn->socket_fd = 0;
-                            conn_cnt--;
-                        }
-                    }
+                        total_bytes += sent;
                 }
             }
 
-            if ( events[i].events & EPOLLERR )
+            if ( events[i].events & POLLER_ERR )
             {
                 // error condition
-                fprintf(stderr, "EPOLLERR\n");
+                fprintf(stderr, "POLLER_ERR\n");
             }
         }
     }
 
+    double elapsed = now_seconds() - started;
+
+    if ( 0 < conn_cnt )
+        fprintf(stderr, "%d connections still waiting for an ack %ds after the end\n", conn_cnt, DRAIN_SECONDS);
+
+    struct poller_stats stats;
+    poller_get_stats(poller, &stats);
+
+    // with -w, into the worker's slot for the coordinator to print
+    static struct run_result single;
+    struct run_result *result = ( NULL != worker_result ) ? worker_result : &single;
+
+    result->connections = total_conns;
+    result->bytes = total_bytes;
+    result->elapsed = elapsed;
+    result->acks = acks;
+    result->syscalls = syscalls + stats.syscalls;
+    hist_merge(&result->latency, &latency);
+    tcp_health_merge(&result->tcp, &load_health);
+
+    if ( quiet && NULL == worker_result )
+        print_load(result, rate);
+
+    stop_adverse();
+
+    if ( -1 != timerfd )
+        close(timerfd);
+
+    poller_destroy(poller);
+
     clear_connection_ctx_list(connection_head);
 }
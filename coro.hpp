@@ -0,0 +1,589 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A C++20 coroutine facade over the event loop of libserver.h, so that a protocol handler
+ * can be written as straight-line code instead of a set of callbacks sharing state:
+ *
+ *   coro::task echo(coro::connection &conn)
+ *   {
+ *       char buffer[512];
+ *       std::size_t n;
+ *       while ( 0 < ( n = co_await conn.read(buffer, sizeof(buffer)) ) )
+ *           co_await conn.write(buffer, n);
+ *   }
+ *
+ *   coro::reactor r(echo);
+ *   r.listen(8080);
+ *   r.run();
+ *
+ * A handler is started for each accepted connection and runs on the event loop thread.
+ * read() completes with 0 once the peer has closed the connection, write() completes once
+ * the data has been handed to the kernel, and sleep() after the given time. The connection
+ * is closed when its handler returns.
+ *
+ * Nothing is allocated per operation: awaiters live in the coroutine frame, received
+ * buffers are kept by reference and chained through their own link, sleeping coroutines
+ * are linked through their awaiter, and coroutine frames and connections come from
+ * per-thread pools that only grow.
+ *
+ * Build: cc -O2 -c libserver.c poller.c && c++ -std=c++20 -O2 app.cpp libserver.o poller.o
+ */
+#ifndef CORO_HPP
+#define CORO_HPP
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <vector>
+
+#include <time.h>
+
+#include "libserver.h"
+
+namespace coro
+{
+
+// Coroutine frames, recycled by size class on the thread that freed them.
+class frame_pool
+{
+public:
+    static frame_pool &local()
+    {
+        thread_local frame_pool pool;
+        return pool;
+    }
+
+    void *allocate(std::size_t size)
+    {
+        std::size_t c = size_class(size);
+        if ( classes <= c )
+            return ::operator new(size);
+
+        if ( nullptr != free_[c] )
+        {
+            node *n = free_[c];
+            free_[c] = n->next;
+            return n;
+        }
+
+        return ::operator new(min_size << c);
+    }
+
+    void deallocate(void *p, std::size_t size) noexcept
+    {
+        std::size_t c = size_class(size);
+        if ( classes <= c )
+        {
+            ::operator delete(p);
+            return;
+        }
+
+        node *n = static_cast<node *>(p);
+        n->next = free_[c];
+        free_[c] = n;
+    }
+
+    ~frame_pool()
+    {
+        for ( std::size_t c = 0; c < classes; c++ )
+        {
+            while ( nullptr != free_[c] )
+            {
+                node *n = free_[c];
+                free_[c] = n->next;
+                ::operator delete(n);
+            }
+        }
+    }
+
+private:
+    struct node
+    {
+        node *next;
+    };
+
+    // from 64 bytes to 8 KB
+    static constexpr std::size_t min_size = 64;
+    static constexpr std::size_t classes = 8;
+
+    static std::size_t size_class(std::size_t size)
+    {
+        std::size_t c = 0;
+        while ( c < classes && ( min_size << c ) < size )
+            c++;
+        return c;
+    }
+
+    node *free_[classes] = {};
+};
+
+class connection;
+class reactor;
+
+// A coroutine that is started right away and left to run on its own.
+// Its frame is freed when it returns.
+struct task
+{
+    struct promise_type
+    {
+        promise_type() = default;
+
+        // a handler, whose connection is closed when it returns
+        template <typename... Args>
+        promise_type(connection &conn, Args &...) : conn(&conn) {}
+
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+
+        // runs once the locals of the coroutine are gone
+        struct final_awaiter
+        {
+            promise_type *promise;
+
+            bool await_ready() noexcept;
+            void await_suspend(std::coroutine_handle<>) noexcept {}
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return { this }; }
+
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+
+        static void *operator new(std::size_t size) { return frame_pool::local().allocate(size); }
+        static void operator delete(void *p, std::size_t size) noexcept { frame_pool::local().deallocate(p, size); }
+
+        connection *conn = nullptr;
+    };
+};
+
+class connection
+{
+public:
+    int fd() const { return fd_; }
+    bool is_open() const { return open_; }
+
+    // bytes received and not read yet
+    std::size_t available() const { return queued_; }
+
+    struct read_awaiter
+    {
+        connection &c;
+        char *buffer;
+        std::size_t len;
+        std::size_t result = 0;
+
+        bool await_ready() noexcept
+        {
+            if ( 0 == c.queued_ && c.open_ )
+                return false;
+
+            result = c.take(buffer, len);
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            c.reader_ = this;
+            c.waiting_ = h;
+        }
+
+        std::size_t await_resume() const noexcept { return result; }
+    };
+
+    // reads up to len bytes, 0 once the peer has closed the connection
+    read_awaiter read(void *buffer, std::size_t len) { return { *this, static_cast<char *>(buffer), len }; }
+
+    struct write_awaiter
+    {
+        connection &c;
+        const void *data;
+        std::size_t len;
+        int result = 0;
+
+        bool await_ready() noexcept
+        {
+            if ( !c.open_ )
+            {
+                result = -1;
+                return true;
+            }
+
+            result = server_send(c.srv_, c.fd_, data, len);
+            return -1 == result || !server_pending(c.srv_, c.fd_);
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept { c.waiting_ = h; }
+
+        int await_resume() const noexcept { return c.open_ ? result : -1; }
+    };
+
+    // writes all of data; -1 if the connection was closed first
+    write_awaiter write(const void *data, std::size_t len) { return { *this, data, len }; }
+
+    void close()
+    {
+        if ( open_ )
+            server_close(srv_, fd_);
+    }
+
+private:
+    friend class reactor;
+    friend struct task::promise_type::final_awaiter;
+
+    struct server *srv_ = nullptr;
+    reactor *reactor_ = nullptr;
+    int fd_ = -1;
+    bool open_ = false;
+
+    // received and not read yet, chained through the buffers' own link
+    server_buffer *head_ = nullptr;
+    server_buffer *tail_ = nullptr;
+    std::size_t offset_ = 0;
+    std::size_t queued_ = 0;
+
+    // the handler, if it is waiting for this connection
+    std::coroutine_handle<> waiting_;
+    read_awaiter *reader_ = nullptr;
+
+    static server_buffer *next(server_buffer *buf)
+    {
+        // the link is the first member of the buffer
+        return reinterpret_cast<server_buffer *>(buf->link.next);
+    }
+
+    void push(server_buffer *buf)
+    {
+        server_buffer_retain(buf);
+        buf->link.next = nullptr;
+
+        if ( nullptr == tail_ )
+            head_ = buf;
+        else
+            tail_->link.next = &buf->link;
+        tail_ = buf;
+
+        queued_ += buf->len;
+    }
+
+    std::size_t take(char *dst, std::size_t len)
+    {
+        std::size_t n = 0;
+
+        while ( n < len && nullptr != head_ )
+        {
+            std::size_t chunk = head_->len - offset_;
+            if ( len - n < chunk )
+                chunk = len - n;
+
+            std::memcpy(dst + n, head_->data + offset_, chunk);
+            n += chunk;
+            offset_ += chunk;
+
+            if ( offset_ == head_->len )
+            {
+                server_buffer *buf = head_;
+                head_ = next(buf);
+                if ( nullptr == head_ )
+                    tail_ = nullptr;
+                offset_ = 0;
+                server_buffer_release(buf);
+            }
+        }
+
+        queued_ -= n;
+        return n;
+    }
+
+    void drop()
+    {
+        while ( nullptr != head_ )
+        {
+            server_buffer *buf = head_;
+            head_ = next(buf);
+            server_buffer_release(buf);
+        }
+
+        tail_ = nullptr;
+        offset_ = 0;
+        queued_ = 0;
+    }
+};
+
+class reactor
+{
+public:
+    using handler = task (*)(connection &);
+
+    explicit reactor(handler h) : handler_(h), srv_(server_create())
+    {
+        if ( nullptr == srv_ )
+            throw std::bad_alloc();
+
+        static const server_callbacks callbacks =
+        {
+            .on_connect = on_connect,
+            .on_data = on_data,
+            .on_writable = on_writable,
+            .on_close = on_close,
+            .on_iteration = on_iteration,
+            .on_wakeup = nullptr,
+        };
+        server_set_callbacks(srv_, &callbacks, this);
+    }
+
+    ~reactor()
+    {
+        server_destroy(srv_);
+        for ( connection *c : free_ )
+            delete c;
+    }
+
+    reactor(const reactor &) = delete;
+    reactor &operator=(const reactor &) = delete;
+
+    // the underlying event loop, for what the facade does not cover
+    struct server *native() { return srv_; }
+
+    int listen(int port) { return server_listen(srv_, port); }
+
+    int run()
+    {
+        current_ = this;
+        int result = server_run(srv_);
+        current_ = nullptr;
+        return result;
+    }
+
+    // can be called from a signal handler
+    void stop() { server_stop(srv_); }
+
+    // the reactor running on this thread
+    static reactor *current() { return current_; }
+
+    struct sleep_awaiter
+    {
+        reactor &r;
+        std::uint64_t deadline;
+        std::coroutine_handle<> h;
+        sleep_awaiter *prev = nullptr;
+        sleep_awaiter *next = nullptr;
+
+        bool await_ready() const noexcept { return deadline <= now_ns(); }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept
+        {
+            h = handle;
+            r.add_timer(this);
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    sleep_awaiter sleep(std::chrono::nanoseconds duration)
+    {
+        return { *this, now_ns() + static_cast<std::uint64_t>(duration.count()), nullptr, nullptr, nullptr };
+    }
+
+private:
+    friend struct task::promise_type::final_awaiter;
+
+    handler handler_;
+    struct server *srv_;
+
+    // open connections, by descriptor
+    std::vector<connection *> connections_;
+
+    // connections whose handler has returned, for reuse
+    std::vector<connection *> free_;
+
+    // sleeping coroutines, by deadline
+    sleep_awaiter *timers_head_ = nullptr;
+    sleep_awaiter *timers_tail_ = nullptr;
+
+    static inline thread_local reactor *current_ = nullptr;
+
+    static std::uint64_t now_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    // Sleeps tend to be of the same length, so the new one usually goes last
+    // and the list is searched from its end.
+    void add_timer(sleep_awaiter *t)
+    {
+        sleep_awaiter *after = timers_tail_;
+        while ( nullptr != after && t->deadline < after->deadline )
+            after = after->prev;
+
+        t->prev = after;
+        t->next = ( nullptr != after ) ? after->next : timers_head_;
+
+        if ( nullptr != t->next )
+            t->next->prev = t;
+        else
+            timers_tail_ = t;
+
+        if ( nullptr != after )
+            after->next = t;
+        else
+            timers_head_ = t;
+    }
+
+    static void on_connect(struct server *srv, int fd, void *arg)
+    {
+        reactor *r = static_cast<reactor *>(arg);
+
+        connection *c;
+        if ( r->free_.empty() )
+        {
+            c = new connection();
+        }
+        else
+        {
+            c = r->free_.back();
+            r->free_.pop_back();
+        }
+
+        c->srv_ = srv;
+        c->reactor_ = r;
+        c->fd_ = fd;
+        c->open_ = true;
+
+        if ( r->connections_.size() <= static_cast<std::size_t>(fd) )
+            r->connections_.resize(fd + 1);
+        r->connections_[fd] = c;
+
+        r->handler_(*c);
+    }
+
+    static void on_data(struct server *srv, int fd, server_buffer *buf, void *arg)
+    {
+        (void) srv;
+        connection *c = static_cast<reactor *>(arg)->connections_[fd];
+
+        if ( nullptr == c->reader_ )
+        {
+            c->push(buf);
+            return;
+        }
+
+        connection::read_awaiter *reader = c->reader_;
+        c->reader_ = nullptr;
+
+        if ( 0 == c->queued_ && buf->len <= reader->len )
+        {
+            // straight to the reader, the buffer is not kept
+            std::memcpy(reader->buffer, buf->data, buf->len);
+            reader->result = buf->len;
+        }
+        else
+        {
+            c->push(buf);
+            reader->result = c->take(reader->buffer, reader->len);
+        }
+
+        std::coroutine_handle<> h = c->waiting_;
+        c->waiting_ = nullptr;
+        h.resume();
+    }
+
+    static void on_writable(struct server *srv, int fd, void *arg)
+    {
+        (void) srv;
+        connection *c = static_cast<reactor *>(arg)->connections_[fd];
+
+        // a reader waits for data, not for the connection to be writable
+        if ( !c->waiting_ || nullptr != c->reader_ )
+            return;
+
+        std::coroutine_handle<> h = c->waiting_;
+        c->waiting_ = nullptr;
+        h.resume();
+    }
+
+    static void on_close(struct server *srv, int fd, void *arg)
+    {
+        (void) srv;
+        reactor *r = static_cast<reactor *>(arg);
+        connection *c = r->connections_[fd];
+
+        r->connections_[fd] = nullptr;
+        c->open_ = false;
+        c->drop();
+
+        if ( nullptr != c->reader_ )
+        {
+            c->reader_->result = 0;
+            c->reader_ = nullptr;
+        }
+
+        // The handler may return and its connection be reused once resumed,
+        // so nothing is touched after this.
+        std::coroutine_handle<> h = c->waiting_;
+        c->waiting_ = nullptr;
+        if ( h )
+            h.resume();
+    }
+
+    static void on_iteration(struct server *srv, void *arg)
+    {
+        reactor *r = static_cast<reactor *>(arg);
+
+        std::uint64_t now = now_ns();
+
+        while ( nullptr != r->timers_head_ && r->timers_head_->deadline <= now )
+        {
+            sleep_awaiter *t = r->timers_head_;
+
+            r->timers_head_ = t->next;
+            if ( nullptr != r->timers_head_ )
+                r->timers_head_->prev = nullptr;
+            else
+                r->timers_tail_ = nullptr;
+
+            t->h.resume();
+        }
+
+        // wake up in time for the next deadline
+        if ( nullptr == r->timers_head_ )
+        {
+            server_set_timeout(srv, -1);
+        }
+        else
+        {
+            std::uint64_t wait = r->timers_head_->deadline - now_ns();
+            server_set_timeout(srv, static_cast<int>(( wait + 999999 ) / 1000000));
+        }
+    }
+};
+
+inline bool task::promise_type::final_awaiter::await_ready() noexcept
+{
+    connection *c = promise->conn;
+    if ( nullptr != c )
+    {
+        c->close();
+
+        c->fd_ = -1;
+        c->reactor_->free_.push_back(c);
+    }
+
+    // nothing waits for the coroutine, so its frame goes right away
+    return true;
+}
+
+// co_await coro::sleep(std::chrono::milliseconds(100)) in a coroutine running on a reactor
+inline reactor::sleep_awaiter sleep(std::chrono::nanoseconds duration)
+{
+    return reactor::current()->sleep(duration);
+}
+
+} // namespace coro
+
+#endif // CORO_HPP
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The server's protocol written as a coroutine on top of coro.hpp, to compare the
+ * facade with the callbacks of server.c: it prints what it receives, sanitized, and
+ * acknowledges each burst.
+ *
+ * Build: cc -O2 -c libserver.c poller.c phases.c recorder.c && c++ -std=c++20 -O2 -o coro_server coro_server.cpp libserver.o poller.o phases.o recorder.o
+ */
+#include <errno.h>
+#include <signal.h>     // sigaction()
+#include <stdio.h>
+#include <stdlib.h>     // exit()
+
+#include "coro.hpp"
+
+#define BUFLEN 512
+#define PORT 8080
+
+static coro::reactor *running = nullptr;
+
+static void signal_handler(int signo)
+{
+    (void) signo;
+
+    if ( nullptr != running )
+        running->stop();
+}
+
+// replaces control characters other than newline so that the output stays readable
+static void sanitize(char *buffer, size_t len)
+{
+    char *p = buffer;
+    for ( size_t i = 0; i < len; i++ )
+    {
+        if ( *p < ' ' && *p != '\n' ) *p = '.';
+        p++;
+    }
+}
+
+static coro::task serve(coro::connection &conn)
+{
+    static const char ack[] = "Ack\n";
+    char buffer[BUFLEN];
+    size_t received;
+
+    while ( 0 < ( received = co_await conn.read(buffer, sizeof(buffer)) ) )
+    {
+        sanitize(buffer, received);
+        printf("%.*s", (int) received, buffer);
+        fflush(stdout);
+
+        // like the server, once everything received so far has been handled
+        if ( 0 == conn.available() )
+            co_await conn.write(ack, sizeof(ack));
+    }
+}
+
+int main()
+{
+    coro::reactor reactor(serve);
+    running = &reactor;
+
+    struct sigaction sa;
+    sa.sa_handler = signal_handler;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    server_set_buffer_size(reactor.native(), BUFLEN);
+
+    if ( -1 == reactor.listen(PORT) )
+    {
+        fprintf(stderr, "socket listen error (%d)\n", errno);
+        exit(1);
+    }
+
+    if ( -1 == reactor.run() )
+    {
+        fprintf(stderr, "event loop error (%d)\n", errno);
+        exit(1);
+    }
+
+    fprintf(stderr, "shutting down...\n");
+    return 0;
+}
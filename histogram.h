@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A log-linear histogram in the spirit of HdrHistogram: every power of two is split into
+ * 16 linear sub-buckets, so any recorded value is reported within about 6% over the whole
+ * 64-bit range, with a fixed 8 KB footprint and no allocation.
+ *
+ * Each histogram has a single writer. Updates are relaxed atomic stores, so another
+ * thread can read a histogram while it is being written and see a slightly stale but
+ * never torn value. Histograms recorded by different threads or processes are combined
+ * with hist_merge().
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT ( 1 << HIST_SUB_BITS )
+#define HIST_BUCKETS ( ( 64 - HIST_SUB_BITS + 1 ) * HIST_SUB_COUNT )
+
+struct histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t counts[HIST_BUCKETS];
+};
+
+static inline int hist_index(uint64_t value)
+{
+    if ( value < HIST_SUB_COUNT )
+        return (int) value;
+
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return ( ( shift + 1 ) << HIST_SUB_BITS ) + (int) ( ( value >> shift ) & ( HIST_SUB_COUNT - 1 ) );
+}
+
+// the highest value that falls into the bucket
+static inline uint64_t hist_value(int index)
+{
+    if ( index < HIST_SUB_COUNT )
+        return (uint64_t) index;
+
+    int shift = ( index >> HIST_SUB_BITS ) - 1;
+    uint64_t low = (uint64_t) ( HIST_SUB_COUNT + ( index & ( HIST_SUB_COUNT - 1 ) ) ) << shift;
+    return low + ( ( (uint64_t) 1 << shift ) - 1 );
+}
+
+#define HIST_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define HIST_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static inline void hist_record(struct histogram *h, uint64_t value)
+{
+    int index = hist_index(value);
+
+    HIST_STORE(h->counts[index], h->counts[index] + 1);
+    HIST_STORE(h->count, h->count + 1);
+    HIST_STORE(h->sum, h->sum + value);
+    if ( h->max < value )
+        HIST_STORE(h->max, value);
+}
+
+static inline void hist_merge(struct histogram *to, struct histogram *from)
+{
+    for ( int i = 0; i < HIST_BUCKETS; i++ )
+        to->counts[i] += HIST_LOAD(from->counts[i]);
+
+    to->count += HIST_LOAD(from->count);
+    to->sum += HIST_LOAD(from->sum);
+    if ( to->max < HIST_LOAD(from->max) )
+        to->max = HIST_LOAD(from->max);
+}
+
+// percentile is in [0, 100]
+static inline uint64_t hist_percentile(struct histogram *h, double percentile)
+{
+    uint64_t count = HIST_LOAD(h->count);
+    if ( 0 == count )
+        return 0;
+
+    uint64_t rank = (uint64_t) ( percentile / 100.0 * count + 0.5 );
+    if ( 0 == rank )
+        rank = 1;
+
+    uint64_t seen = 0;
+    for ( int i = 0; i < HIST_BUCKETS; i++ )
+    {
+        seen += HIST_LOAD(h->counts[i]);
+        if ( seen >= rank )
+        {
+            uint64_t value = hist_value(i);
+            uint64_t max = HIST_LOAD(h->max);
+            return ( value < max ) ? value : max;
+        }
+    }
+
+    return HIST_LOAD(h->max);
+}
+
+static inline double hist_mean(struct histogram *h)
+{
+    uint64_t count = HIST_LOAD(h->count);
+    return ( 0 == count ) ? 0.0 : (double) HIST_LOAD(h->sum) / count;
+}
+
+// one line summary, values divided by scale (e.g. 1000 to print nanoseconds as microseconds)
+static inline void hist_print(FILE *out, const char *name, struct histogram *h, double scale, const char *unit)
+{
+    fprintf(out, "%s: count:%lu, mean:%.1f%s, p50:%.1f%s, p90:%.1f%s, p99:%.1f%s, p99.9:%.1f%s, max:%.1f%s\n",
+            name, (unsigned long) HIST_LOAD(h->count),
+            hist_mean(h) / scale, unit,
+            hist_percentile(h, 50.0) / scale, unit,
+            hist_percentile(h, 90.0) / scale, unit,
+            hist_percentile(h, 99.0) / scale, unit,
+            hist_percentile(h, 99.9) / scale, unit,
+            HIST_LOAD(h->max) / scale, unit);
+}
+
+#endif // HISTOGRAM_H
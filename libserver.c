@@ -0,0 +1,772 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The event loop of the server as a library. See libserver.h.
+ */
+#define _GNU_SOURCE     // accept4()
+#include <errno.h>
+#include <fcntl.h>      // open()
+#include <netinet/in.h> // struct sockaddr_in
+#include <signal.h>     // sig_atomic_t
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>   // mmap()
+#include <sys/resource.h> // getrlimit()
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "libserver.h"
+#include "phases.h"
+#include "poller.h"
+#include "probes.h"
+#include "recorder.h"
+
+// max number of events that can be returned by the backend at a time
+#define MAX_EVENTS 20
+
+#define DEFAULT_BUFFER_SIZE 512
+
+enum fd_kind
+{
+    FD_NONE,
+    FD_CONNECTION,
+    FD_LISTENER,
+    FD_WATCH,
+    FD_WAKE
+};
+
+// data that could not be sent right away
+struct server_output
+{
+    struct server_output *next;
+    size_t len;
+    size_t sent;
+    char data[];
+};
+
+// per-descriptor state, kept small as there may be a million of them
+struct server_fd
+{
+    int kind;
+    int registered;             // connections are only registered once on_connect returned
+    union
+    {
+        struct                  // FD_WATCH
+        {
+            server_watch_fn watch;
+            void *watch_arg;
+        };
+        struct                  // FD_CONNECTION
+        {
+            struct server_output *out_head;
+            struct server_output *out_tail;
+        };
+    };
+};
+
+struct server
+{
+    struct poller *poller;
+    int wakefd;
+    int sparefd;                // given up to take a connection when out of descriptors
+    int listenfd;
+    int timeout;
+    volatile sig_atomic_t stopped;
+
+    struct server_callbacks callbacks;
+    void *arg;
+
+    // indexed by descriptor, sized to the descriptor limit
+    struct server_fd *fds;
+    int max_fds;
+    int highest_fd;
+
+    // buffers released by their last owner, possibly on other threads
+    size_t buffer_size;
+    struct mpsc_list free_buffers;
+
+    // the buffer the next receive goes to
+    struct server_buffer *current;
+
+    // the descriptor whose event is being handled, or -1
+    int current_fd;
+
+    // system calls made by the event loop outside of the backend
+    unsigned long iterations;
+    unsigned long syscalls;
+
+    // connections closed as soon as accepted, for lack of descriptors
+    unsigned long rejected;
+};
+
+struct server *server_create(void)
+{
+    struct server *srv = (struct server *) calloc(1, sizeof(struct server));
+    if ( NULL == srv )
+        return NULL;
+
+    srv->listenfd = -1;
+    srv->timeout = -1;
+    srv->highest_fd = -1;
+    srv->current_fd = -1;
+    srv->buffer_size = DEFAULT_BUFFER_SIZE;
+    mpsc_init(&srv->free_buffers);
+
+    // The table is an anonymous mapping, so only the pages of descriptors
+    // actually in use get backed by memory.
+
+    struct rlimit rl;
+    if ( -1 == getrlimit(RLIMIT_NOFILE, &rl) )
+    {
+        free(srv);
+        return NULL;
+    }
+    srv->max_fds = ( RLIM_INFINITY == rl.rlim_cur || 1048576 < rl.rlim_cur ) ? 1048576 : (int) rl.rlim_cur;
+
+    srv->fds = mmap(NULL, srv->max_fds * sizeof(struct server_fd),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( MAP_FAILED == srv->fds )
+    {
+        free(srv);
+        return NULL;
+    }
+
+    srv->sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    srv->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( -1 == srv->wakefd || -1 == server_set_backend(srv, POLLER_EPOLL) )
+    {
+        server_destroy(srv);
+        return NULL;
+    }
+    srv->fds[srv->wakefd].kind = FD_WAKE;
+
+    return srv;
+}
+
+static union poller_data fd_data(int fd)
+{
+    union poller_data data;
+    data.u64 = 0;
+    data.fd = fd;
+    return data;
+}
+
+int server_set_backend(struct server *srv, int backend)
+{
+    // nothing can be registered yet but the wakeup descriptor
+    for ( int fd = 0; fd <= srv->highest_fd; fd++ )
+    {
+        if ( FD_NONE != srv->fds[fd].kind && FD_WAKE != srv->fds[fd].kind )
+        {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    struct poller *poller = poller_create(backend);
+    if ( NULL == poller )
+        return -1;
+
+    if ( -1 == poller_add(poller, srv->wakefd, POLLER_IN, fd_data(srv->wakefd)) )
+    {
+        int err = errno;
+        poller_destroy(poller);
+        errno = err;
+        return -1;
+    }
+
+    if ( NULL != srv->poller )
+        poller_destroy(srv->poller);
+    srv->poller = poller;
+
+    return 0;
+}
+
+const char *server_backend(struct server *srv)
+{
+    return poller_name(poller_backend(srv->poller));
+}
+
+void server_get_counters(struct server *srv, struct server_counters *counters)
+{
+    struct poller_stats stats;
+    poller_get_stats(srv->poller, &stats);
+
+    counters->iterations = srv->iterations;
+    counters->events = stats.events;
+    counters->syscalls = srv->syscalls + stats.syscalls;
+    counters->rejected = srv->rejected;
+}
+
+int server_current_fd(struct server *srv)
+{
+    return srv->current_fd;
+}
+
+// drops what was queued for a connection and stops watching it
+static void forget(struct server *srv, int fd)
+{
+    struct server_fd *f = &srv->fds[fd];
+
+    if ( f->registered )
+        poller_del(srv->poller, fd);
+
+    while ( FD_CONNECTION == f->kind && NULL != f->out_head )
+    {
+        struct server_output *out = f->out_head;
+        f->out_head = out->next;
+        free(out);
+    }
+
+    f->out_head = NULL;
+    f->out_tail = NULL;
+    f->kind = FD_NONE;
+    f->registered = 0;
+}
+
+void server_destroy(struct server *srv)
+{
+    if ( MAP_FAILED != srv->fds )
+    {
+        for ( int fd = 0; fd <= srv->highest_fd; fd++ )
+        {
+            if ( FD_CONNECTION == srv->fds[fd].kind )
+                server_close(srv, fd);
+        }
+    }
+
+    server_close_listener(srv);
+
+    if ( NULL != srv->poller )
+        poller_destroy(srv->poller);
+    if ( 0 < srv->wakefd )
+        close(srv->wakefd);
+    if ( 0 < srv->sparefd )
+        close(srv->sparefd);
+
+    free(srv->current);
+
+    // buffers still retained by the caller are theirs to release before this
+    struct mpsc_link *link;
+    while ( NULL != ( link = mpsc_pop(&srv->free_buffers) ) )
+        free(link);
+
+    if ( MAP_FAILED != srv->fds )
+        munmap(srv->fds, srv->max_fds * sizeof(struct server_fd));
+
+    free(srv);
+}
+
+void server_set_callbacks(struct server *srv, const struct server_callbacks *callbacks, void *arg)
+{
+    srv->callbacks = *callbacks;
+    srv->arg = arg;
+}
+
+void server_set_buffer_size(struct server *srv, size_t size)
+{
+    srv->buffer_size = size;
+}
+
+void server_set_timeout(struct server *srv, int timeout_ms)
+{
+    srv->timeout = timeout_ms;
+}
+
+int server_create_listener(int port, int backlog)
+{
+    int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if ( -1 == listenfd )
+        return -1;
+
+    int reuse = 1;
+    if ( -1 == setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) )
+        goto error;
+
+    struct sockaddr_in servaddr = { 0 };
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(port);
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if ( -1 == bind(listenfd, (struct sockaddr*) &servaddr, sizeof(servaddr)) )
+        goto error;
+
+    if ( -1 == listen(listenfd, backlog) )
+        goto error;
+
+    return listenfd;
+
+error:
+    {
+        int err = errno;
+        close(listenfd);
+        errno = err;
+    }
+    return -1;
+}
+
+// registers a descriptor of the given kind for input
+static int watch_fd(struct server *srv, int fd, int kind, uint32_t events)
+{
+    if ( srv->max_fds <= fd )
+    {
+        errno = EMFILE;
+        return -1;
+    }
+
+    if ( -1 == poller_add(srv->poller, fd, events, fd_data(fd)) )
+        return -1;
+
+    srv->fds[fd].kind = kind;
+    srv->fds[fd].registered = 1;
+
+    if ( srv->highest_fd < fd )
+        srv->highest_fd = fd;
+
+    return 0;
+}
+
+int server_listen(struct server *srv, int port)
+{
+    int listenfd = server_create_listener(port, SOMAXCONN);
+    if ( -1 == listenfd )
+        return -1;
+
+    if ( -1 == server_set_listener(srv, listenfd, 0) )
+    {
+        close(listenfd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int server_set_listener(struct server *srv, int listenfd, int exclusive)
+{
+    if ( -1 == watch_fd(srv, listenfd, FD_LISTENER, POLLER_IN | ( exclusive ? POLLER_EXCLUSIVE : 0 )) )
+        return -1;
+
+    srv->listenfd = listenfd;
+    return 0;
+}
+
+int server_listener(struct server *srv)
+{
+    return srv->listenfd;
+}
+
+void server_close_listener(struct server *srv)
+{
+    if ( -1 == srv->listenfd )
+        return;
+
+    forget(srv, srv->listenfd);
+    close(srv->listenfd);
+    srv->listenfd = -1;
+}
+
+int server_watch(struct server *srv, int fd, server_watch_fn fn, void *arg)
+{
+    if ( -1 == watch_fd(srv, fd, FD_WATCH, POLLER_IN) )
+        return -1;
+
+    srv->fds[fd].watch = fn;
+    srv->fds[fd].watch_arg = arg;
+    return 0;
+}
+
+void server_unwatch(struct server *srv, int fd)
+{
+    if ( fd < srv->max_fds && FD_WATCH == srv->fds[fd].kind )
+        forget(srv, fd);
+}
+
+int server_adopt(struct server *srv, int fd)
+{
+    return watch_fd(srv, fd, FD_CONNECTION, POLLER_IN | POLLER_OUT | POLLER_EDGE);
+}
+
+void server_detach(struct server *srv, int fd)
+{
+    if ( fd < srv->max_fds && FD_CONNECTION == srv->fds[fd].kind )
+        forget(srv, fd);
+}
+
+void server_close(struct server *srv, int fd)
+{
+    if ( srv->max_fds <= fd || FD_CONNECTION != srv->fds[fd].kind )
+        return;
+
+    PROBE1(libserver, close, fd);
+
+    if ( NULL != srv->callbacks.on_close )
+        srv->callbacks.on_close(srv, fd, srv->arg);
+
+    forget(srv, fd);
+    close(fd);
+}
+
+int server_send(struct server *srv, int fd, const void *data, size_t len)
+{
+    struct server_fd *f = &srv->fds[fd];
+    if ( FD_CONNECTION != f->kind )
+        return -1;
+
+    size_t sent = 0;
+
+    // send right away unless something is already waiting, which must go first
+    if ( NULL == f->out_head )
+    {
+        struct phase_mark mark;
+        phase_begin(&mark, PHASE_SEND);
+        srv->syscalls++;
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        phase_end(&mark);
+        if ( -1 == n )
+        {
+            if ( EAGAIN != errno && EINTR != errno )
+            {
+                record(RECORD_ERROR, 0, fd, errno);
+                server_close(srv, fd);
+                return -1;
+            }
+            n = 0;
+        }
+
+        sent = n;
+        PROBE2(libserver, send, fd, sent);
+        if ( sent == len )
+            return 0;
+
+        PROBE2(libserver, send_eagain, fd, len - sent);
+        record(RECORD_EAGAIN, 0, fd, len - sent);
+        poller_rearm(srv->poller, fd);
+    }
+
+    // the rest goes out once the connection is writable
+    struct server_output *out = (struct server_output *) malloc(sizeof(struct server_output) + len - sent);
+    if ( NULL == out )
+        return -1;
+
+    out->next = NULL;
+    out->len = len - sent;
+    out->sent = 0;
+    memcpy(out->data, (const char *) data + sent, len - sent);
+
+    if ( NULL == f->out_tail )
+        f->out_head = out;
+    else
+        f->out_tail->next = out;
+    f->out_tail = out;
+
+    return 0;
+}
+
+int server_pending(struct server *srv, int fd)
+{
+    return fd < srv->max_fds && FD_CONNECTION == srv->fds[fd].kind && NULL != srv->fds[fd].out_head;
+}
+
+// sends what was queued; returns 1 once nothing is left
+static int flush_output(struct server *srv, int fd)
+{
+    struct server_fd *f = &srv->fds[fd];
+    int queued = ( NULL != f->out_head );
+
+    while ( NULL != f->out_head )
+    {
+        struct server_output *out = f->out_head;
+
+        struct phase_mark mark;
+        phase_begin(&mark, PHASE_SEND);
+        srv->syscalls++;
+        ssize_t n = send(fd, out->data + out->sent, out->len - out->sent, MSG_NOSIGNAL);
+        phase_end(&mark);
+        if ( -1 == n )
+        {
+            if ( EINTR == errno )
+                continue;
+            if ( EAGAIN != errno )
+            {
+                record(RECORD_ERROR, 0, fd, errno);
+                server_close(srv, fd);
+            }
+            else
+            {
+                PROBE2(libserver, send_eagain, fd, out->len - out->sent);
+                poller_rearm(srv->poller, fd);
+            }
+            return 0;
+        }
+
+        PROBE2(libserver, send, fd, n);
+        out->sent += n;
+        if ( out->sent < out->len )
+        {
+            PROBE2(libserver, send_eagain, fd, out->len - out->sent);
+            poller_rearm(srv->poller, fd);
+            return 0;
+        }
+
+        f->out_head = out->next;
+        if ( NULL == f->out_head )
+            f->out_tail = NULL;
+        free(out);
+    }
+
+    if ( queued )
+        record(RECORD_DRAINED, 0, fd, 0);
+    return 1;
+}
+
+static struct server_buffer *get_buffer(struct server *srv)
+{
+    struct server_buffer *buf = (struct server_buffer *) mpsc_pop(&srv->free_buffers);
+
+    if ( NULL == buf )
+    {
+        buf = (struct server_buffer *) malloc(sizeof(struct server_buffer) + srv->buffer_size);
+        if ( NULL == buf )
+            return NULL;
+        buf->srv = srv;
+    }
+
+    buf->refs = 1;
+    return buf;
+}
+
+void server_buffer_retain(struct server_buffer *buf)
+{
+    __atomic_fetch_add(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+void server_buffer_release(struct server_buffer *buf)
+{
+    if ( 1 == __atomic_fetch_sub(&buf->refs, 1, __ATOMIC_ACQ_REL) )
+        mpsc_push(&buf->srv->free_buffers, &buf->link);
+}
+
+static int accept_connection(struct server *srv)
+{
+    srv->syscalls++;
+    int connfd = accept4(srv->listenfd, NULL, NULL, SOCK_NONBLOCK);
+    if ( -1 == connfd )
+    {
+        switch ( errno )
+        {
+            case EAGAIN:
+                // another process has already taken the connection
+            case ECONNABORTED:
+            case EINTR:
+                return 0;
+
+            case EMFILE:
+            case ENFILE:
+                // The connection would stay queued, and the listener ready, until a
+                // descriptor is freed, so it is accepted on the spare one and shed.
+                record(RECORD_ERROR, 0, -1, errno);
+                if ( -1 == srv->sparefd )
+                    return 0;
+
+                close(srv->sparefd);
+                connfd = accept4(srv->listenfd, NULL, NULL, 0);
+                if ( -1 != connfd )
+                {
+                    close(connfd);
+                    srv->rejected++;
+                }
+                srv->sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                srv->syscalls += 4;
+                return 0;
+
+            default:
+                return -1;
+        }
+    }
+
+    if ( srv->max_fds <= connfd )
+    {
+        close(connfd);
+        srv->rejected++;
+        return 0;
+    }
+
+    PROBE1(libserver, accept, connfd);
+
+    struct server_fd *f = &srv->fds[connfd];
+    f->kind = FD_CONNECTION;
+    f->registered = 0;
+
+    if ( srv->highest_fd < connfd )
+        srv->highest_fd = connfd;
+
+    if ( NULL != srv->callbacks.on_connect )
+        srv->callbacks.on_connect(srv, connfd, srv->arg);
+
+    // taken over or closed by the callback
+    if ( FD_CONNECTION != f->kind )
+        return 0;
+
+    if ( -1 == poller_add(srv->poller, connfd, POLLER_IN | POLLER_OUT | POLLER_EDGE, fd_data(connfd)) )
+    {
+        server_close(srv, connfd);
+        return 0;
+    }
+    f->registered = 1;
+
+    return 0;
+}
+
+// receives until EAGAIN
+static void read_connection(struct server *srv, int fd)
+{
+    struct server_fd *f = &srv->fds[fd];
+
+    while ( FD_CONNECTION == f->kind )
+    {
+        struct server_buffer *buf = srv->current;
+        if ( NULL == buf )
+        {
+            buf = srv->current = get_buffer(srv);
+            if ( NULL == buf )
+            {
+                server_close(srv, fd);
+                return;
+            }
+        }
+
+        struct phase_mark mark;
+        phase_begin(&mark, PHASE_RECV);
+        srv->syscalls++;
+        ssize_t received = recv(fd, buf->data, srv->buffer_size, 0);
+        phase_end(&mark);
+
+        if ( 0 < received )
+        {
+            PROBE2(libserver, recv, fd, received);
+            buf->len = received;
+            if ( NULL != srv->callbacks.on_data )
+                srv->callbacks.on_data(srv, fd, buf, srv->arg);
+
+            // the buffer is reused for the next receive unless the callback kept it
+            if ( 1 != __atomic_load_n(&buf->refs, __ATOMIC_ACQUIRE) )
+            {
+                srv->current = NULL;
+                server_buffer_release(buf);
+            }
+            continue;
+        }
+
+        if ( 0 == received )
+        {
+            // The stream socket peer has performed an orderly shutdown.
+            server_close(srv, fd);
+            return;
+        }
+
+        switch ( errno )
+        {
+            case EAGAIN:
+                // no data available right now, try again later...
+                PROBE1(libserver, recv_eagain, fd);
+                return;
+
+            case EINTR:
+                continue;
+
+            case ECONNRESET:
+            default:
+                record(RECORD_ERROR, 0, fd, errno);
+                server_close(srv, fd);
+                return;
+        }
+    }
+}
+
+int server_run(struct server *srv)
+{
+    struct poller_event events[MAX_EVENTS];
+
+    while ( !srv->stopped )
+    {
+        struct phase_mark mark;
+        phase_begin(&mark, PHASE_WAIT);
+        int nfds = poller_wait(srv->poller, events, MAX_EVENTS, srv->timeout);
+        phase_end(&mark);
+        srv->iterations++;
+        if ( -1 == nfds )
+        {
+            if ( EINTR != errno )
+                return -1;
+
+            // a signal was caught, on_iteration is where the caller gets to react
+            nfds = 0;
+        }
+
+        if ( NULL != srv->callbacks.on_wakeup )
+            srv->callbacks.on_wakeup(srv, nfds, srv->arg);
+
+        for ( int i = 0; i < nfds; i++ )
+        {
+            int fd = events[i].data.fd;
+            struct server_fd *f = &srv->fds[fd];
+            srv->current_fd = fd;
+
+            switch ( f->kind )
+            {
+                case FD_CONNECTION:
+                    if ( events[i].events & ( POLLER_IN | POLLER_ERR | POLLER_HUP ) )
+                        read_connection(srv, fd);
+
+                    if ( ( events[i].events & POLLER_OUT ) && FD_CONNECTION == f->kind && flush_output(srv, fd)
+                         && NULL != srv->callbacks.on_writable )
+                    {
+                        srv->callbacks.on_writable(srv, fd, srv->arg);
+                    }
+                    break;
+
+                case FD_LISTENER:
+                    if ( -1 == accept_connection(srv) )
+                        return -1;
+                    break;
+
+                case FD_WATCH:
+                    f->watch(srv, fd, f->watch_arg);
+                    break;
+
+                case FD_WAKE:
+                {
+                    uint64_t value;
+                    srv->syscalls++;
+                    if ( -1 == read(fd, &value, sizeof(value)) && EAGAIN != errno )
+                        return -1;
+                    break;
+                }
+
+                default:
+                    // closed by an earlier event of this iteration
+                    break;
+            }
+        }
+
+        srv->current_fd = -1;
+
+        if ( NULL != srv->callbacks.on_iteration )
+            srv->callbacks.on_iteration(srv, srv->arg);
+    }
+
+    srv->stopped = 0;
+    return 0;
+}
+
+void server_stop(struct server *srv)
+{
+    srv->stopped = 1;
+
+    // wake the event loop if it is waiting; write() is async-signal-safe
+    uint64_t one = 1;
+    ssize_t written = write(srv->wakefd, &one, sizeof(one));
+    (void) written;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The event loop of the server as a library, for programs that want to handle the
+ * connections themselves rather than read the server's output.
+ *
+ *   struct server *srv = server_create();
+ *   server_set_callbacks(srv, &callbacks, arg);
+ *   server_listen(srv, 8080);
+ *   server_run(srv);                // until server_stop()
+ *   server_destroy(srv);
+ *
+ * Connections are identified by their descriptor. Everything runs on the thread that
+ * calls server_run(), callbacks included, and the functions below are to be called from
+ * that thread, except server_stop() and server_buffer_release().
+ *
+ * Received data is passed to on_data in a buffer owned by the library, which is reused
+ * for the next receive once the callback returns. A callback that wants to keep the data
+ * takes a reference with server_buffer_retain() and drops it with server_buffer_release()
+ * when done, possibly from another thread; the data is never copied.
+ *
+ * The loop waits with epoll by default; server_set_backend() switches it to another
+ * backend of poller.h.
+ *
+ * Build: cc -O2 -c libserver.c poller.c phases.c recorder.c && ar rcs libserver.a libserver.o poller.o phases.o recorder.o
+ */
+#ifndef LIBSERVER_H
+#define LIBSERVER_H
+
+#include <stddef.h>
+
+#include "queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct server;
+
+struct server_buffer
+{
+    struct mpsc_link link;      // in the free list, private
+    struct server *srv;         // private
+    int refs;                   // private
+    size_t len;
+    char data[];
+};
+
+struct server_callbacks
+{
+    // a connection was accepted; it can be taken over with server_detach()
+    void (*on_connect)(struct server *srv, int fd, void *arg);
+
+    // data was received
+    void (*on_data)(struct server *srv, int fd, struct server_buffer *buf, void *arg);
+
+    // the connection can be written to, and everything queued by server_send() has been sent
+    void (*on_writable)(struct server *srv, int fd, void *arg);
+
+    // the connection is about to be closed, by the peer or by server_close()
+    void (*on_close)(struct server *srv, int fd, void *arg);
+
+    // after the events of each wakeup have been handled, including wakeups by a signal
+    void (*on_iteration)(struct server *srv, void *arg);
+
+    // when the backend returned, before the events are handled
+    void (*on_wakeup)(struct server *srv, int nevents, void *arg);
+};
+
+typedef void (*server_watch_fn)(struct server *srv, int fd, void *arg);
+
+// what the event loop did so far
+struct server_counters
+{
+    unsigned long iterations;   // wakeups
+    unsigned long events;       // events returned by the backend
+    unsigned long syscalls;     // system calls, those of the backend included
+    unsigned long rejected;     // connections shed for lack of descriptors
+};
+
+struct server *server_create(void);
+void server_destroy(struct server *srv);
+
+// configuration; callbacks left NULL are not called
+void server_set_callbacks(struct server *srv, const struct server_callbacks *callbacks, void *arg);
+void server_set_buffer_size(struct server *srv, size_t size);
+
+// Selects the backend of the event loop, one of enum poller_backend (see poller_find()).
+// Must be called before anything is registered.
+int server_set_backend(struct server *srv, int backend);
+const char *server_backend(struct server *srv);
+
+void server_get_counters(struct server *srv, struct server_counters *counters);
+
+// The descriptor whose event the loop is handling, or -1, for diagnostics; a signal
+// handler on the loop's thread may call it.
+int server_current_fd(struct server *srv);
+
+// max time to wait for events before calling on_iteration, -1 (the default) for no limit
+void server_set_timeout(struct server *srv, int timeout_ms);
+
+// creates a non-blocking listener on the given port, which can be shared by several processes
+int server_create_listener(int port, int backlog);
+
+// listens on the given port
+int server_listen(struct server *srv, int port);
+
+// Accepts on an existing non-blocking listener. With exclusive, only one of the
+// processes waiting on a shared listener is woken for each connection.
+int server_set_listener(struct server *srv, int listenfd, int exclusive);
+
+// the listener, or -1
+int server_listener(struct server *srv);
+
+// stops accepting and closes the listener
+void server_close_listener(struct server *srv);
+
+// calls fn on the event loop whenever fd is readable
+int server_watch(struct server *srv, int fd, server_watch_fn fn, void *arg);
+void server_unwatch(struct server *srv, int fd);
+
+// serves a connection that was not accepted here; on_connect is not called
+int server_adopt(struct server *srv, int fd);
+
+// forgets a connection without closing it; what was queued for it is dropped
+void server_detach(struct server *srv, int fd);
+
+// Sends data on a connection, or queues what cannot be sent right away.
+// Returns -1 if the connection has been closed.
+int server_send(struct server *srv, int fd, const void *data, size_t len);
+
+// non-zero while data queued by server_send() is waiting for the connection to be writable
+int server_pending(struct server *srv, int fd);
+
+// closes a connection
+void server_close(struct server *srv, int fd);
+
+// Runs the event loop until server_stop(). Returns 0 when stopped, -1 on error.
+int server_run(struct server *srv);
+
+// makes server_run() return; can be called from any thread or a signal handler
+void server_stop(struct server *srv);
+
+void server_buffer_retain(struct server_buffer *buf);
+void server_buffer_release(struct server_buffer *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBSERVER_H
@@ -0,0 +1,531 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A pool of worker threads that runs CPU-heavy handlers off the event loop thread.
+ * See offload.h.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>      // sched_yield()
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "offload.h"
+#include "profiler.h"
+#include "queue.h"
+
+// Number of connection tasks with OFFLOAD_STEAL. Connections whose descriptors collide
+// share a task, which serializes them with each other but never reorders anything.
+#define OFFLOAD_TASKS 4096
+
+// max number of jobs handled for a task before the worker looks at its other tasks
+#define OFFLOAD_TASK_BUDGET 32
+
+struct offload_task
+{
+    struct mpsc_list jobs;
+
+    // set while the task sits in a worker's ring or deque, or is being run
+    int scheduled;
+};
+
+struct offload_worker
+{
+    struct offload_pool *pool;
+    pthread_t thread;
+    int index;
+
+    // jobs from the event loop, or tasks with OFFLOAD_STEAL
+    struct spsc_ring ring;
+
+    // scheduled tasks, OFFLOAD_STEAL only
+    struct ws_deque deque;
+
+    // set while the worker waits on wakefd
+    int sleeping;
+    int wakefd;
+
+    // written by the event loop
+    size_t max_depth;
+    unsigned long submitted;
+
+    // written by the worker
+    unsigned long handled;
+    unsigned long tasks;
+    unsigned long steals;
+
+    // written by the worker: time from submission to the start of the handler
+    struct histogram handoff;
+};
+
+struct offload_pool
+{
+    int nworkers;
+    enum offload_policy policy;
+    offload_handler handler;
+    struct offload_worker *workers;
+
+    // OFFLOAD_STEAL only
+    struct offload_task *tasks;
+    int nsleeping;
+
+    // finished jobs from all workers
+    struct mpmc_queue done;
+    int eventfd;
+
+    // set by the first worker that signals eventfd, cleared by the event loop
+    int signaled;
+
+    // free jobs, only touched by the event loop
+    int njobs;
+    struct offload_job *jobs;
+    struct offload_job **free_jobs;
+    int nfree;
+
+    // written by the event loop: time from submission to completion
+    struct histogram roundtrip;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t round_up_pow2(size_t n)
+{
+    size_t p = 1;
+    while ( p < n )
+        p <<= 1;
+    return p;
+}
+
+// runs the handler and posts the job back to the event loop
+static void run_job(struct offload_worker *w, struct offload_job *job)
+{
+    struct offload_pool *pool = w->pool;
+
+    job->started_ns = now_ns();
+    hist_record(&w->handoff, job->started_ns - job->submitted_ns);
+
+    pool->handler(job);
+    HIST_STORE(w->handled, w->handled + 1);
+
+    // cannot be full, it has room for every job of the pool
+    while ( -1 == mpmc_push(&pool->done, job) )
+        sched_yield();
+
+    if ( 0 == __atomic_exchange_n(&pool->signaled, 1, __ATOMIC_ACQ_REL) )
+    {
+        uint64_t one = 1;
+        if ( -1 == write(pool->eventfd, &one, sizeof(one)) )
+        {
+            fprintf(stderr, "offload eventfd write error (%d)\n", errno);
+            exit(1);
+        }
+    }
+}
+
+static void wake(struct offload_worker *w)
+{
+    uint64_t one = 1;
+    if ( -1 == write(w->wakefd, &one, sizeof(one)) )
+    {
+        fprintf(stderr, "offload eventfd write error (%d)\n", errno);
+        exit(1);
+    }
+}
+
+// blocks until woken
+static void sleep_on(struct offload_worker *w)
+{
+    uint64_t value;
+    if ( -1 == read(w->wakefd, &value, sizeof(value)) && EINTR != errno )
+    {
+        fprintf(stderr, "offload eventfd read error (%d)\n", errno);
+        exit(1);
+    }
+}
+
+// wakes one sleeping worker, if any, so that it can steal from self
+static void wake_thief(struct offload_worker *self)
+{
+    struct offload_pool *pool = self->pool;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ( 0 == __atomic_load_n(&pool->nsleeping, __ATOMIC_RELAXED) )
+        return;
+
+    for ( int i = 0; i < pool->nworkers; i++ )
+    {
+        struct offload_worker *w = &pool->workers[i];
+        if ( w != self && __atomic_load_n(&w->sleeping, __ATOMIC_RELAXED) )
+        {
+            wake(w);
+            return;
+        }
+    }
+}
+
+static void *static_worker_main(void *arg)
+{
+    struct offload_worker *w = (struct offload_worker *) arg;
+    profiler_thread("offload");
+
+    while ( 1 )
+    {
+        struct offload_job *job = (struct offload_job *) spsc_pop(&w->ring);
+        if ( NULL == job )
+        {
+            // Announce that we are going to sleep, then look again, so that a job
+            // submitted in between is either seen here or followed by a wakeup.
+
+            __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            job = (struct offload_job *) spsc_pop(&w->ring);
+            if ( NULL == job )
+            {
+                sleep_on(w);
+                __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+        }
+
+        run_job(w, job);
+    }
+
+    return NULL;
+}
+
+// the next task to run: from our own ring and deque first, then from the others' deques
+static struct offload_task *find_task(struct offload_worker *w)
+{
+    struct offload_pool *pool = w->pool;
+    struct offload_task *task;
+    int moved = 0;
+
+    // tasks in the ring cannot be stolen, so move them to the deque right away
+    while ( NULL != ( task = (struct offload_task *) spsc_pop(&w->ring) ) )
+    {
+        // cannot be full, a task is never in more than one place
+        ws_push(&w->deque, task);
+        moved++;
+    }
+
+    if ( 1 < moved )
+        wake_thief(w);
+
+    task = (struct offload_task *) ws_take(&w->deque);
+    if ( NULL != task )
+        return task;
+
+    for ( int k = 1; k < pool->nworkers; k++ )
+    {
+        struct offload_worker *victim = &pool->workers[( w->index + k ) % pool->nworkers];
+
+        do
+        {
+            task = (struct offload_task *) ws_steal(&victim->deque);
+        }
+        while ( WS_ABORT == task );
+
+        if ( NULL != task )
+        {
+            HIST_STORE(w->steals, w->steals + 1);
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+// handles the pending jobs of a task, then gives it up or keeps it scheduled
+static void run_task(struct offload_worker *w, struct offload_task *task)
+{
+    HIST_STORE(w->tasks, w->tasks + 1);
+
+    int n = 0;
+    struct mpsc_link *link;
+
+    while ( n < OFFLOAD_TASK_BUDGET && NULL != ( link = mpsc_pop(&task->jobs) ) )
+    {
+        run_job(w, (struct offload_job *) link);
+        n++;
+    }
+
+    if ( OFFLOAD_TASK_BUDGET == n )
+    {
+        // let the other tasks have their turn; this one stays scheduled, and stealable
+        ws_push(&w->deque, task);
+        wake_thief(w);
+        return;
+    }
+
+    // Give up the task, then look again: the event loop only schedules a task it
+    // finds unscheduled, so a job queued in between would otherwise be stranded.
+
+    __atomic_store_n(&task->scheduled, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if ( mpsc_pending(&task->jobs) && 0 == __atomic_exchange_n(&task->scheduled, 1, __ATOMIC_ACQ_REL) )
+        ws_push(&w->deque, task);
+}
+
+// true if any worker has a task that could be run or stolen
+static int has_work(struct offload_pool *pool, struct offload_worker *self)
+{
+    if ( 0 != spsc_size(&self->ring) )
+        return 1;
+
+    for ( int i = 0; i < pool->nworkers; i++ )
+    {
+        if ( 0 != ws_size(&pool->workers[i].deque) )
+            return 1;
+    }
+
+    return 0;
+}
+
+static void *steal_worker_main(void *arg)
+{
+    struct offload_worker *w = (struct offload_worker *) arg;
+    struct offload_pool *pool = w->pool;
+    profiler_thread("offload");
+
+    while ( 1 )
+    {
+        struct offload_task *task = find_task(w);
+        if ( NULL != task )
+        {
+            run_task(w, task);
+            continue;
+        }
+
+        // same as in the static worker, except that work may also show up in
+        // another worker's deque, whose owner then wakes us
+
+        __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&pool->nsleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if ( !has_work(pool, w) )
+            sleep_on(w);
+
+        __atomic_fetch_sub(&pool->nsleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+struct offload_pool *offload_create(int nworkers, size_t queue_depth, enum offload_policy policy,
+                                    offload_handler handler)
+{
+    struct offload_pool *pool = (struct offload_pool *) calloc(1, sizeof(struct offload_pool));
+    if ( NULL == pool )
+        return NULL;
+
+    queue_depth = round_up_pow2(queue_depth);
+
+    // enough jobs to fill every ring, plus as many again in completion
+    int njobs = nworkers * queue_depth * 2;
+
+    pool->njobs = njobs;
+    pool->nworkers = nworkers;
+    pool->policy = policy;
+    pool->handler = handler;
+    pool->workers = (struct offload_worker *) calloc(nworkers, sizeof(struct offload_worker));
+    pool->jobs = (struct offload_job *) calloc(njobs, sizeof(struct offload_job));
+    pool->free_jobs = (struct offload_job **) calloc(njobs, sizeof(struct offload_job *));
+
+    if ( NULL == pool->workers || NULL == pool->jobs || NULL == pool->free_jobs
+         || -1 == mpmc_init(&pool->done, round_up_pow2(njobs)) )
+    {
+        return NULL;
+    }
+
+    for ( int i = 0; i < njobs; i++ )
+        pool->free_jobs[i] = &pool->jobs[i];
+    pool->nfree = njobs;
+
+    if ( OFFLOAD_STEAL == policy )
+    {
+        pool->tasks = (struct offload_task *) calloc(OFFLOAD_TASKS, sizeof(struct offload_task));
+        if ( NULL == pool->tasks )
+            return NULL;
+
+        for ( int i = 0; i < OFFLOAD_TASKS; i++ )
+            mpsc_init(&pool->tasks[i].jobs);
+
+        // every task may end up in the same ring or deque
+        if ( queue_depth < OFFLOAD_TASKS )
+            queue_depth = OFFLOAD_TASKS;
+    }
+
+    pool->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( -1 == pool->eventfd )
+        return NULL;
+
+    for ( int i = 0; i < nworkers; i++ )
+    {
+        struct offload_worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+
+        w->wakefd = eventfd(0, EFD_CLOEXEC);
+        if ( -1 == w->wakefd || -1 == spsc_init(&w->ring, queue_depth) )
+            return NULL;
+
+        if ( OFFLOAD_STEAL == policy && -1 == ws_init(&w->deque, queue_depth) )
+            return NULL;
+    }
+
+    for ( int i = 0; i < nworkers; i++ )
+    {
+        struct offload_worker *w = &pool->workers[i];
+
+        int err = pthread_create(&w->thread, NULL,
+                                 ( OFFLOAD_STEAL == policy ) ? steal_worker_main : static_worker_main, w);
+        if ( 0 != err )
+        {
+            errno = err;
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+int offload_eventfd(struct offload_pool *pool)
+{
+    return pool->eventfd;
+}
+
+struct offload_job *offload_get(struct offload_pool *pool, offload_completion done, void *arg)
+{
+    while ( 0 == pool->nfree )
+    {
+        if ( 0 == offload_complete(pool, done, arg) )
+            sched_yield();
+    }
+
+    return pool->free_jobs[--pool->nfree];
+}
+
+void offload_put(struct offload_pool *pool, struct offload_job *job)
+{
+    pool->free_jobs[pool->nfree++] = job;
+}
+
+void offload_submit(struct offload_pool *pool, struct offload_job *job, offload_completion done, void *arg)
+{
+    // the same connection always goes to the same worker, which keeps its jobs in order
+    struct offload_worker *w = &pool->workers[(unsigned int) job->fd % pool->nworkers];
+    void *item = job;
+
+    job->submitted_ns = now_ns();
+
+    if ( OFFLOAD_STEAL == pool->policy )
+    {
+        // queue the job on its connection's task, and schedule the task if no worker has it
+        struct offload_task *task = &pool->tasks[(unsigned int) job->fd % OFFLOAD_TASKS];
+
+        mpsc_push(&task->jobs, &job->link);
+        if ( 0 != __atomic_exchange_n(&task->scheduled, 1, __ATOMIC_ACQ_REL) )
+            return;
+
+        // if the connection's usual worker is busy, prefer one that has nothing to do
+        for ( int i = 0; i < pool->nworkers && !__atomic_load_n(&w->sleeping, __ATOMIC_RELAXED); i++ )
+        {
+            if ( __atomic_load_n(&pool->workers[i].sleeping, __ATOMIC_RELAXED) )
+                w = &pool->workers[i];
+        }
+
+        item = task;
+    }
+
+    while ( -1 == spsc_push(&w->ring, item) )
+    {
+        // the worker is behind; make progress on our side while it catches up
+        if ( 0 == offload_complete(pool, done, arg) )
+            sched_yield();
+    }
+
+    w->submitted++;
+
+    size_t depth = spsc_size(&w->ring) + ws_size(&w->deque);
+    if ( w->max_depth < depth )
+        w->max_depth = depth;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ( __atomic_load_n(&w->sleeping, __ATOMIC_RELAXED) )
+        wake(w);
+}
+
+int offload_complete(struct offload_pool *pool, offload_completion done, void *arg)
+{
+    // Consume the notification before clearing the flag: a worker that finds the
+    // flag cleared signals again, and that signal must not be lost.
+
+    uint64_t value;
+    if ( -1 == read(pool->eventfd, &value, sizeof(value)) && EAGAIN != errno )
+    {
+        fprintf(stderr, "offload eventfd read error (%d)\n", errno);
+        exit(1);
+    }
+
+    __atomic_store_n(&pool->signaled, 0, __ATOMIC_SEQ_CST);
+
+    int completed = 0;
+    struct offload_job *job;
+
+    while ( NULL != ( job = (struct offload_job *) mpmc_pop(&pool->done) ) )
+    {
+        done(job, arg);
+        hist_record(&pool->roundtrip, now_ns() - job->submitted_ns);
+
+        pool->free_jobs[pool->nfree++] = job;
+        completed++;
+    }
+
+    return completed;
+}
+
+void offload_flush(struct offload_pool *pool, offload_completion done, void *arg)
+{
+    while ( pool->nfree < pool->njobs )
+    {
+        if ( 0 == offload_complete(pool, done, arg) )
+            sched_yield();
+    }
+}
+
+void offload_print_stats(struct offload_pool *pool, FILE *out)
+{
+    for ( int i = 0; i < pool->nworkers; i++ )
+    {
+        struct offload_worker *w = &pool->workers[i];
+        char name[64];
+
+        fprintf(out, "offload worker %d: submitted:%lu, handled:%lu, depth:%lu, max_depth:%lu",
+                i, w->submitted, HIST_LOAD(w->handled),
+                (unsigned long) ( spsc_size(&w->ring) + ws_size(&w->deque) ), (unsigned long) w->max_depth);
+        if ( OFFLOAD_STEAL == pool->policy )
+            fprintf(out, ", tasks:%lu, steals:%lu", HIST_LOAD(w->tasks), HIST_LOAD(w->steals));
+        fprintf(out, "\n");
+
+        snprintf(name, sizeof(name), "offload worker %d handoff", i);
+        hist_print(out, name, &w->handoff, 1000.0, "us");
+    }
+
+    fprintf(out, "offload completion queue depth:%lu\n", (unsigned long) mpmc_size(&pool->done));
+    hist_print(out, "offload roundtrip", &pool->roundtrip, 1000.0, "us");
+}
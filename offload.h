@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A pool of worker threads that runs CPU-heavy handlers off the event loop thread.
+ *
+ * The event loop takes a job from the pool, points it at the received data and submits
+ * it; the data itself is not copied. Jobs are routed to a worker by connection, through one bounded single-producer
+ * ring per worker, so the jobs of a connection are handled in order by the same worker.
+ * Workers post finished jobs to one bounded multi-producer queue and signal an eventfd,
+ * which the event loop polls along with its sockets, and the event loop completes them
+ * in the order each worker finished them.
+ *
+ * That static split leaves workers idle while others are stuck with a few heavy
+ * connections. With OFFLOAD_STEAL, jobs are instead queued on a task per connection, and
+ * a task is scheduled on at most one worker at a time, which keeps the connection's
+ * jobs in order. Each worker keeps its scheduled tasks in a Chase-Lev deque, and an idle
+ * worker steals whole tasks, i.e. all pending jobs of a connection, from the others.
+ *
+ * Everything except the handler runs on the event loop thread.
+ */
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "queue.h"
+
+enum offload_policy
+{
+    OFFLOAD_STATIC,     // a connection always goes to the same worker
+    OFFLOAD_STEAL       // idle workers steal connections from busy ones
+};
+
+struct offload_job
+{
+    struct mpsc_link link;  // in the queue of its connection's task, OFFLOAD_STEAL only
+    int fd;
+    unsigned long conn_id;
+    uint64_t submitted_ns;
+    uint64_t started_ns;
+    char *data;
+    size_t len;
+    void *buffer;           // what data belongs to, left to the caller
+};
+
+struct offload_pool;
+
+typedef void (*offload_handler)(struct offload_job *job);
+typedef void (*offload_completion)(struct offload_job *job, void *arg);
+
+// queue_depth is the capacity of each worker's ring, rounded up to a power of two
+struct offload_pool *offload_create(int nworkers, size_t queue_depth, enum offload_policy policy,
+                                    offload_handler handler);
+
+// the descriptor to poll for completions
+int offload_eventfd(struct offload_pool *pool);
+
+// Returns a free job. While all of them are in flight, waits for completions
+// and passes them to done.
+struct offload_job *offload_get(struct offload_pool *pool, offload_completion done, void *arg);
+
+// returns a job that was not submitted
+void offload_put(struct offload_pool *pool, struct offload_job *job);
+
+// Hands the job to the worker of its connection, or to its connection's task.
+// Waits, draining completions through done, while the worker's ring is full.
+void offload_submit(struct offload_pool *pool, struct offload_job *job, offload_completion done, void *arg);
+
+// Calls done for every finished job and frees it. Returns the number of jobs completed.
+int offload_complete(struct offload_pool *pool, offload_completion done, void *arg);
+
+// waits until every submitted job has been completed through done
+void offload_flush(struct offload_pool *pool, offload_completion done, void *arg);
+
+// queue depths, handoff latencies and steals
+void offload_print_stats(struct offload_pool *pool, FILE *out);
+
+#endif // OFFLOAD_H
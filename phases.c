@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Per-phase cycle accounting. See phases.h.
+ */
+#define _GNU_SOURCE     // pthread_getname_np(), gettid()
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>   // mmap()
+#include <sys/syscall.h> // SYS_perf_event_open
+#include <unistd.h>
+
+#include "phases.h"
+
+// how long the time stamp counter is measured against the clock for its frequency
+#define PHASE_CALIBRATION_NS 20000000
+
+static const char *phase_names[PHASES] = { "wait", "recv", "sanitize", "output", "send" };
+
+struct phase_table
+{
+    struct phase_counts phases[PHASES];
+    pid_t tid;
+    char name[16];
+
+    // the hardware counters, closed when the thread exits while the counts are kept
+    int counting;
+    int fds[PHASE_COUNTERS];
+    struct perf_event_mmap_page *pages[PHASE_COUNTERS];
+
+    struct phase_table *next;
+};
+
+int phases_enabled = 0;
+int phases_profiling = 0;
+int phases_counters = 0;
+__thread struct phase_table *phase_table = NULL;
+__thread volatile enum phase phase_current = PHASE_NONE;
+
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct phase_table *tables = NULL;
+static pthread_key_t table_key;
+static pthread_once_t calibrated = PTHREAD_ONCE_INIT;
+static double cycles_per_ns = 1;
+
+// the counts are written by their thread only, and read while they are by phases_print()
+#define PHASE_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define PHASE_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static uint64_t clock_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Opens the counters of the calling thread and maps the pages through which they are
+// read with rdpmc. Returns -1 with errno set if any of them cannot be read that way.
+static int open_counters(struct phase_table *table)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const uint64_t configs[PHASE_COUNTERS] = { PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES };
+
+    for ( int i = 0; i < PHASE_COUNTERS; i++ )
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;    // allowed with kernel.perf_event_paranoid up to 2
+        attr.exclude_hv = 1;
+
+        table->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if ( -1 == table->fds[i] )
+            return -1;
+
+        table->pages[i] = (struct perf_event_mmap_page *) mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                                                               table->fds[i], 0);
+        if ( MAP_FAILED == table->pages[i] )
+        {
+            table->pages[i] = NULL;
+            return -1;
+        }
+
+        if ( !table->pages[i]->cap_user_rdpmc )
+        {
+            errno = EPERM;
+            return -1;
+        }
+    }
+
+    table->counting = 1;
+    return 0;
+#else
+    (void) table;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void close_counters(struct phase_table *table)
+{
+    table->counting = 0;
+
+    for ( int i = 0; i < PHASE_COUNTERS; i++ )
+    {
+        if ( NULL != table->pages[i] )
+            munmap(table->pages[i], sysconf(_SC_PAGESIZE));
+        if ( -1 != table->fds[i] )
+            close(table->fds[i]);
+        table->pages[i] = NULL;
+        table->fds[i] = -1;
+    }
+}
+
+// called when a thread with a table exits
+static void detach(void *arg)
+{
+    close_counters((struct phase_table *) arg);
+}
+
+// the time stamp counter ticks at a fixed rate, measured here to convert to time
+static void calibrate(void)
+{
+    uint64_t start_ns = clock_now();
+    uint64_t start = phase_cycles();
+    while ( clock_now() - start_ns < PHASE_CALIBRATION_NS )
+        ;
+    cycles_per_ns = (double) ( phase_cycles() - start ) / ( clock_now() - start_ns );
+}
+
+double phase_cycles_per_ns(void)
+{
+    pthread_once(&calibrated, calibrate);
+    return cycles_per_ns;
+}
+
+void phases_enable(int counters, FILE *out)
+{
+    pthread_key_create(&table_key, detach);
+    phase_cycles_per_ns();
+
+    phases_counters = counters;
+    phases_profiling = 1;
+    phases_enabled = 1;
+
+    // tried on this thread first, so that the other threads need not find out one by one
+    if ( counters )
+    {
+        struct phase_table *table = phase_attach();
+        if ( NULL == table || !table->counting )
+        {
+            fprintf(out, "phase counters unavailable (%d), counting cycles only\n", errno);
+            phases_counters = 0;
+        }
+    }
+}
+
+void phases_track(void)
+{
+    phases_enabled = 1;
+}
+
+const char *phase_name(enum phase phase)
+{
+    return ( PHASE_NONE == phase ) ? "loop" : phase_names[phase];
+}
+
+struct phase_table *phase_attach(void)
+{
+    struct phase_table *table = (struct phase_table *) calloc(1, sizeof(struct phase_table));
+    if ( NULL == table )
+        return NULL;
+
+    table->tid = gettid();
+    pthread_getname_np(pthread_self(), table->name, sizeof(table->name));
+    for ( int i = 0; i < PHASE_COUNTERS; i++ )
+        table->fds[i] = -1;
+
+    if ( phases_counters && -1 == open_counters(table) )
+    {
+        int err = errno;
+        close_counters(table);
+        errno = err;
+    }
+
+    pthread_setspecific(table_key, table);
+
+    pthread_mutex_lock(&tables_lock);
+    table->next = tables;
+    tables = table;
+    pthread_mutex_unlock(&tables_lock);
+
+    phase_table = table;
+    return table;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The count of a counter of the calling thread, as the kernel documents it for
+// perf_event_mmap_page: retried if the kernel updated the page in the meantime.
+static uint64_t read_counter(struct perf_event_mmap_page *page)
+{
+    uint32_t seq;
+    uint64_t count;
+
+    do
+    {
+        seq = __atomic_load_n(&page->lock, __ATOMIC_ACQUIRE);
+        count = page->offset;
+
+        uint32_t index = page->index;
+        if ( 0 != index )
+        {
+            int shift = 64 - page->pmc_width;
+            count += (uint64_t) ( (int64_t) ( __rdpmc(index - 1) << shift ) >> shift );
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }
+    while ( __atomic_load_n(&page->lock, __ATOMIC_RELAXED) != seq );
+
+    return count;
+}
+#endif
+
+void phase_read(struct phase_table *table, struct phase_mark *mark)
+{
+    mark->cycles = phase_cycles();
+
+#if defined(__x86_64__) || defined(__i386__)
+    if ( table->counting )
+    {
+        for ( int i = 0; i < PHASE_COUNTERS; i++ )
+            mark->counters[i] = read_counter(table->pages[i]);
+        return;
+    }
+#endif
+
+    for ( int i = 0; i < PHASE_COUNTERS; i++ )
+        mark->counters[i] = 0;
+}
+
+void phase_add(struct phase_table *table, struct phase_mark *begin)
+{
+    struct phase_counts *c = &table->phases[begin->phase];
+
+    if ( phases_counters )
+    {
+        struct phase_mark end;
+        phase_read(table, &end);
+
+        for ( int i = 0; i < PHASE_COUNTERS; i++ )
+            PHASE_STORE(c->counters[i], c->counters[i] + ( end.counters[i] - begin->counters[i] ));
+        PHASE_STORE(c->cycles, c->cycles + ( end.cycles - begin->cycles ));
+    }
+    else
+    {
+        PHASE_STORE(c->cycles, c->cycles + ( phase_cycles() - begin->cycles ));
+    }
+
+    PHASE_STORE(c->calls, c->calls + 1);
+}
+
+static void print_phases(FILE *out, struct phase_counts *phases)
+{
+    uint64_t total = 0;
+    for ( int p = 0; p < PHASES; p++ )
+        total += phases[p].cycles;
+
+    for ( int p = 0; p < PHASES; p++ )
+    {
+        struct phase_counts *c = &phases[p];
+        if ( 0 == c->calls )
+            continue;
+
+        fprintf(out, "    %s: calls:%lu, cycles/call:%.0f, ns/call:%.1f, time:%.1fms, share:%.1f%%",
+                phase_names[p], (unsigned long) c->calls, (double) c->cycles / c->calls,
+                c->cycles / cycles_per_ns / c->calls, c->cycles / cycles_per_ns / 1e6, 100.0 * c->cycles / total);
+        if ( phases_counters )
+            fprintf(out, ", instructions/call:%.0f, misses/call:%.2f",
+                    (double) c->counters[PHASE_INSTRUCTIONS] / c->calls, (double) c->counters[PHASE_MISSES] / c->calls);
+        fprintf(out, "\n");
+    }
+}
+
+void phases_print(FILE *out)
+{
+    if ( !phases_profiling )
+        return;
+
+    struct phase_counts all[PHASES];
+    memset(all, 0, sizeof(all));
+    int threads = 0;
+
+    pthread_mutex_lock(&tables_lock);
+
+    for ( struct phase_table *table = tables; NULL != table; table = table->next )
+        threads++;
+
+    fprintf(out, "phases: threads:%d, tsc:%.2fGHz, counters:%s\n", threads, cycles_per_ns,
+            phases_counters ? "instructions,misses" : "none");
+
+    for ( struct phase_table *table = tables; NULL != table; table = table->next )
+    {
+        // a copy, as the thread may be updating it
+        struct phase_counts phases[PHASES];
+        for ( int p = 0; p < PHASES; p++ )
+        {
+            phases[p].calls = PHASE_LOAD(table->phases[p].calls);
+            phases[p].cycles = PHASE_LOAD(table->phases[p].cycles);
+            for ( int i = 0; i < PHASE_COUNTERS; i++ )
+                phases[p].counters[i] = PHASE_LOAD(table->phases[p].counters[i]);
+
+            all[p].calls += phases[p].calls;
+            all[p].cycles += phases[p].cycles;
+            for ( int i = 0; i < PHASE_COUNTERS; i++ )
+                all[p].counters[i] += phases[p].counters[i];
+        }
+
+        fprintf(out, "  thread %d (%s):\n", (int) table->tid, table->name);
+        print_phases(out, phases);
+    }
+
+    pthread_mutex_unlock(&tables_lock);
+
+    if ( 1 < threads )
+    {
+        fprintf(out, "  all threads:\n");
+        print_phases(out, all);
+    }
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Per-phase cycle accounting: what the server's loop spends in each phase of handling
+ * a connection, measured with the time stamp counter around every wait, recv, handler,
+ * output and send, and with --counters also in instructions and cache misses read from
+ * the hardware counters with rdpmc, without a system call.
+ *
+ * Each thread that goes through a phase gets a table of its own on first use, so that
+ * the counts are updated without atomics or sharing a cache line, and the tables are
+ * printed per thread and in total by phases_print(). When neither profiling nor
+ * tracking is on, bracketing a phase costs a load and a branch. Tracking only keeps the
+ * phase each thread is in, for the watchdog to tell where a stalled loop is stuck.
+ *
+ *   struct phase_mark mark;
+ *   phase_begin(&mark, PHASE_RECV);
+ *   n = recv(...);
+ *   phase_end(&mark);
+ *
+ * Build: add phases.c to the sources of anything linking libserver.c
+ */
+#ifndef PHASES_H
+#define PHASES_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // __rdtsc()
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum phase
+{
+    PHASE_NONE = -1,    // between phases
+    PHASE_WAIT,         // waiting for events
+    PHASE_RECV,         // recv()
+    PHASE_SANITIZE,     // the handler
+    PHASE_OUTPUT,       // printf() and fflush() of what was received
+    PHASE_SEND,         // send() of the acks
+    PHASES
+};
+
+// the hardware counters read along with the time stamp counter
+enum phase_counter
+{
+    PHASE_INSTRUCTIONS,
+    PHASE_MISSES,       // last level cache misses
+    PHASE_COUNTERS
+};
+
+struct phase_counts
+{
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t counters[PHASE_COUNTERS];
+};
+
+struct phase_mark
+{
+    enum phase phase;
+    uint64_t cycles;
+    uint64_t counters[PHASE_COUNTERS];
+};
+
+struct phase_table;
+
+// set once by phases_enable() or phases_track(), before the threads they apply to start
+extern int phases_enabled;
+extern int phases_profiling;
+extern int phases_counters;
+
+// the table of the calling thread, NULL until it first goes through a phase
+extern __thread struct phase_table *phase_table;
+
+// with tracking, the phase the thread is in
+extern __thread volatile enum phase phase_current;
+
+// Turns profiling on, with the hardware counters if counters is set and they can be
+// read from user space, which is reported on out.
+void phases_enable(int counters, FILE *out);
+
+// turns tracking of the current phase on, whether or not profiling is
+void phases_track(void);
+
+const char *phase_name(enum phase phase);
+
+// the rate of phase_cycles(), measured against the clock on the first call
+double phase_cycles_per_ns(void);
+
+// the table of the calling thread, created if needed; NULL if out of memory
+struct phase_table *phase_attach(void);
+
+// reads the time stamp counter, and the hardware counters of the calling thread
+void phase_read(struct phase_table *table, struct phase_mark *mark);
+
+void phase_add(struct phase_table *table, struct phase_mark *begin);
+
+// prints the phases of every thread, then of all of them together
+void phases_print(FILE *out);
+
+static inline uint64_t phase_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    __asm__ volatile ( "mrs %0, cntvct_el0" : "=r" ( value ) );
+    return value;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline void phase_begin(struct phase_mark *mark, enum phase phase)
+{
+    if ( __builtin_expect(!phases_enabled, 1) )
+        return;
+
+    mark->phase = phase;
+    phase_current = phase;
+    if ( !phases_profiling )
+        return;
+
+    struct phase_table *table = ( NULL != phase_table ) ? phase_table : phase_attach();
+    if ( NULL == table )
+        return;
+
+    if ( phases_counters )
+        phase_read(table, mark);
+    else
+        mark->cycles = phase_cycles();
+}
+
+static inline void phase_end(struct phase_mark *mark)
+{
+    if ( __builtin_expect(!phases_enabled, 1) )
+        return;
+
+    phase_current = PHASE_NONE;
+    if ( phases_profiling && NULL != phase_table )
+        phase_add(phase_table, mark);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PHASES_H
@@ -0,0 +1,836 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The epoll, poll and io_uring backends of the event loops. See poller.h.
+ *
+ * io_uring is driven through the raw system calls and the rings mapped from the kernel,
+ * without liburing.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>   // mmap()
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "poller.h"
+
+// submission queue size; a full queue is submitted before more changes are queued
+#define URING_SQ_ENTRIES 256
+
+// completion queue size, large enough for a multishot poll completion per connection
+#define URING_CQ_ENTRIES 4096
+
+// user_data of submissions whose completion is of no interest
+#define URING_IGNORE ( ~(uint64_t) 0 )
+
+// per-descriptor registration, for the backends that keep the interest set themselves
+struct poller_fd
+{
+    int registered;
+    uint32_t events;
+    union poller_data data;
+    int index;                  // poll: in the pollfd array
+    int out_armed;              // poll: edge-triggered output not reported since armed
+    uint32_t gen;               // io_uring: tells the completions of earlier registrations apart
+    int lost;                   // io_uring: its poll could not be queued again, see uring_wait()
+};
+
+struct poller_ops
+{
+    int (*init)(struct poller *p);
+    void (*fini)(struct poller *p);
+    int (*add)(struct poller *p, int fd, uint32_t events, union poller_data data);
+    int (*mod)(struct poller *p, int fd, uint32_t events, union poller_data data);
+    int (*del)(struct poller *p, int fd);
+    void (*rearm)(struct poller *p, int fd);
+    int (*wait)(struct poller *p, struct poller_event *events, int max_events, int timeout_ms);
+};
+
+struct poller
+{
+    enum poller_backend backend;
+    const struct poller_ops *ops;
+    struct poller_stats stats;
+
+    // epoll
+    int epollfd;
+
+    // poll and io_uring, indexed by descriptor
+    struct poller_fd *fds;
+    int nfds;
+
+    // poll
+    struct pollfd *pollfds;
+    int npollfds;
+    int pollfds_size;
+    int next_scan;
+
+    // io_uring
+    int ringfd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     // queued but not yet published to the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    int nlost;                  // registrations whose poll is to be queued again
+};
+
+static const char *backend_names[POLLER_BACKENDS] = { "epoll", "poll", "io_uring" };
+
+// returns the registration of fd, growing the table as needed
+static struct poller_fd *get_fd(struct poller *p, int fd)
+{
+    if ( fd < 0 )
+    {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if ( p->nfds <= fd )
+    {
+        int nfds = ( 0 < p->nfds ) ? p->nfds : 64;
+        while ( nfds <= fd )
+            nfds *= 2;
+
+        struct poller_fd *fds = (struct poller_fd *) realloc(p->fds, nfds * sizeof(struct poller_fd));
+        if ( NULL == fds )
+            return NULL;
+
+        memset(fds + p->nfds, 0, ( nfds - p->nfds ) * sizeof(struct poller_fd));
+        p->fds = fds;
+        p->nfds = nfds;
+    }
+
+    return &p->fds[fd];
+}
+
+// the registration of fd, or NULL if it is not registered
+static struct poller_fd *find_fd(struct poller *p, int fd)
+{
+    if ( fd < 0 || p->nfds <= fd || !p->fds[fd].registered )
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    return &p->fds[fd];
+}
+
+// epoll
+
+static int epoll_init(struct poller *p)
+{
+    p->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    return ( -1 == p->epollfd ) ? -1 : 0;
+}
+
+static void epoll_fini(struct poller *p)
+{
+    if ( -1 != p->epollfd )
+        close(p->epollfd);
+}
+
+static int epoll_ctl_events(struct poller *p, int op, int fd, uint32_t events, union poller_data data)
+{
+    struct epoll_event ev;
+    ev.events = ( ( events & POLLER_IN ) ? EPOLLIN : 0 )
+              | ( ( events & POLLER_OUT ) ? EPOLLOUT : 0 )
+              | ( ( events & POLLER_EDGE ) ? EPOLLET : 0 )
+              | ( ( events & POLLER_EXCLUSIVE ) ? EPOLLEXCLUSIVE : 0 );
+    ev.data.u64 = data.u64;
+
+    p->stats.syscalls++;
+    return epoll_ctl(p->epollfd, op, fd, &ev);
+}
+
+static int epoll_add(struct poller *p, int fd, uint32_t events, union poller_data data)
+{
+    return epoll_ctl_events(p, EPOLL_CTL_ADD, fd, events, data);
+}
+
+static int epoll_mod(struct poller *p, int fd, uint32_t events, union poller_data data)
+{
+    return epoll_ctl_events(p, EPOLL_CTL_MOD, fd, events, data);
+}
+
+static int epoll_del(struct poller *p, int fd)
+{
+    p->stats.syscalls++;
+    return epoll_ctl(p->epollfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void epoll_rearm(struct poller *p, int fd)
+{
+    // an edge-triggered registration already reports the next change
+    (void) p;
+    (void) fd;
+}
+
+static int epoll_wait_events(struct poller *p, struct poller_event *events, int max_events, int timeout_ms)
+{
+    struct epoll_event ev[max_events];
+
+    p->stats.syscalls++;
+    int n = epoll_wait(p->epollfd, ev, max_events, timeout_ms);
+
+    for ( int i = 0; i < n; i++ )
+    {
+        events[i].events = ( ( ev[i].events & EPOLLIN ) ? POLLER_IN : 0 )
+                         | ( ( ev[i].events & EPOLLOUT ) ? POLLER_OUT : 0 )
+                         | ( ( ev[i].events & EPOLLERR ) ? POLLER_ERR : 0 )
+                         | ( ( ev[i].events & EPOLLHUP ) ? POLLER_HUP : 0 );
+        events[i].data.u64 = ev[i].data.u64;
+    }
+
+    return n;
+}
+
+static const struct poller_ops epoll_ops =
+{
+    epoll_init, epoll_fini, epoll_add, epoll_mod, epoll_del, epoll_rearm, epoll_wait_events
+};
+
+// poll
+
+static int poll_init(struct poller *p)
+{
+    (void) p;
+    return 0;
+}
+
+static void poll_fini(struct poller *p)
+{
+    free(p->pollfds);
+}
+
+static int poll_add(struct poller *p, int fd, uint32_t events, union poller_data data)
+{
+    struct poller_fd *f = get_fd(p, fd);
+    if ( NULL == f )
+        return -1;
+
+    if ( f->registered )
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if ( p->npollfds == p->pollfds_size )
+    {
+        int size = ( 0 < p->pollfds_size ) ? p->pollfds_size * 2 : 64;
+        struct pollfd *pollfds = (struct pollfd *) realloc(p->pollfds, size * sizeof(struct pollfd));
+        if ( NULL == pollfds )
+            return -1;
+
+        p->pollfds = pollfds;
+        p->pollfds_size = size;
+    }
+
+    f->registered = 1;
+    f->events = events;
+    f->data = data;
+    f->index = p->npollfds++;
+    f->out_armed = 1;
+
+    p->pollfds[f->index].fd = fd;
+    p->pollfds[f->index].events = 0;
+    p->pollfds[f->index].revents = 0;
+
+    return 0;
+}
+
+static int poll_mod(struct poller *p, int fd, uint32_t events, union poller_data data)
+{
+    struct poller_fd *f = find_fd(p, fd);
+    if ( NULL == f )
+        return -1;
+
+    f->events = events;
+    f->data = data;
+    f->out_armed = 1;
+    return 0;
+}
+
+static int poll_del(struct poller *p, int fd)
+{
+    struct poller_fd *f = find_fd(p, fd);
+    if ( NULL == f )
+        return -1;
+
+    // the last entry takes the place of the removed one
+    int last = --p->npollfds;
+    if ( f->index != last )
+    {
+        p->pollfds[f->index] = p->pollfds[last];
+        p->fds[p->pollfds[f->index].fd].index = f->index;
+    }
+
+    f->registered = 0;
+    return 0;
+}
+
+static void poll_rearm(struct poller *p, int fd)
+{
+    struct poller_fd *f = find_fd(p, fd);
+    if ( NULL != f )
+        f->out_armed = 1;
+}
+
+static int poll_wait(struct poller *p, struct poller_event *events, int max_events, int timeout_ms)
+{
+    // An edge-triggered descriptor is only polled for output until it has been reported
+    // writable once, or it would make poll() return right away for as long as it is.
+
+    for ( int i = 0; i < p->npollfds; i++ )
+    {
+        struct poller_fd *f = &p->fds[p->pollfds[i].fd];
+
+        p->pollfds[i].events = ( ( f->events & POLLER_IN ) ? POLLIN : 0 )
+                             | ( ( ( f->events & POLLER_OUT ) && ( !( f->events & POLLER_EDGE ) || f->out_armed ) ) ? POLLOUT : 0 );
+    }
+
+    p->stats.syscalls++;
+    int ready = poll(p->pollfds, p->npollfds, timeout_ms);
+    if ( ready <= 0 )
+        return ready;
+
+    // the scan starts where the previous one stopped, so that no descriptor is starved
+    // when more are ready than fit in events
+
+    int n = 0;
+    int count = p->npollfds;
+    int start = ( p->next_scan < count ) ? p->next_scan : 0;
+
+    for ( int j = 0; j < count && n < max_events && 0 < ready; j++ )
+    {
+        int i = ( start + j ) % count;
+        short revents = p->pollfds[i].revents;
+        if ( 0 == revents )
+            continue;
+
+        ready--;
+        struct poller_fd *f = &p->fds[p->pollfds[i].fd];
+
+        uint32_t ev = ( ( revents & POLLIN ) ? POLLER_IN : 0 )
+                    | ( ( revents & POLLOUT ) ? POLLER_OUT : 0 )
+                    | ( ( revents & ( POLLERR | POLLNVAL ) ) ? POLLER_ERR : 0 )
+                    | ( ( revents & POLLHUP ) ? POLLER_HUP : 0 );
+
+        if ( f->events & POLLER_EDGE )
+        {
+            if ( ev & POLLER_OUT )
+                f->out_armed = 0;
+            else if ( f->events & POLLER_OUT )
+                ev |= POLLER_OUT;
+        }
+
+        events[n].events = ev;
+        events[n].data = f->data;
+        n++;
+
+        p->next_scan = i + 1;
+    }
+
+    return n;
+}
+
+static const struct poller_ops poll_ops =
+{
+    poll_init, poll_fini, poll_add, poll_mod, poll_del, poll_rearm, poll_wait
+};
+
+// io_uring
+
+static int uring_enter(struct poller *p, unsigned to_submit, unsigned min_complete, unsigned flags,
+                       void *arg, size_t argsz)
+{
+    p->stats.syscalls++;
+    return (int) syscall(__NR_io_uring_enter, p->ringfd, to_submit, min_complete, flags, arg, argsz);
+}
+
+// number of queued submissions the kernel has not consumed yet
+static unsigned uring_unsubmitted(struct poller *p)
+{
+    return p->sq_local_tail - __atomic_load_n(p->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void uring_publish(struct poller *p)
+{
+    __atomic_store_n(p->sq_tail, p->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct poller *p)
+{
+    if ( uring_unsubmitted(p) == p->sq_entries )
+    {
+        uring_publish(p);
+        if ( -1 == uring_enter(p, p->sq_entries, 0, 0, NULL, 0) && EINTR != errno )
+            return NULL;
+
+        if ( uring_unsubmitted(p) == p->sq_entries )
+        {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &p->sqes[p->sq_local_tail & p->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    p->sq_local_tail++;
+    return sqe;
+}
+
+static int uring_queue_poll(struct poller *p, int fd, struct poller_fd *f)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(p);
+    if ( NULL == sqe )
+        return -1;
+
+    // A multishot poll posts a completion on every wakeup of the descriptor, which is
+    // edge-triggered; a one-shot poll is queued again once its completion has been
+    // returned, which makes it level-triggered.
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = ( ( f->events & POLLER_IN ) ? POLLIN : 0 ) | ( ( f->events & POLLER_OUT ) ? POLLOUT : 0 );
+    sqe->len = ( f->events & POLLER_EDGE ) ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = ( (uint64_t) f->gen << 32 ) | (uint32_t) fd;
+    return 0;
+}
+
+// Queues the poll of a registration again, from uring_wait() with the completions before
+// next taken. A full submission queue is submitted first; if the kernel cannot take it,
+// as its completions are backed up, those taken so far are handed back to make room and
+// the queue is submitted once more.
+static int uring_requeue(struct poller *p, int fd, struct poller_fd *f, unsigned next)
+{
+    if ( 0 == uring_queue_poll(p, fd, f) )
+        return 0;
+
+    __atomic_store_n(p->cq_head, next, __ATOMIC_RELEASE);
+    if ( 0 == uring_queue_poll(p, fd, f) )
+        return 0;
+
+    f->lost = 1;
+    p->nlost++;
+    return -1;
+}
+
+static void uring_forget_lost(struct poller *p, struct poller_fd *f)
+{
+    if ( f->lost )
+    {
+        f->lost = 0;
+        p->nlost--;
+    }
+}
+
+// Queues again the polls of the registrations that lost theirs, and reports in error
+// those that still cannot be, until they can or the caller removes them.
+static int uring_retry_lost(struct poller *p, struct poller_event *events, int max_events)
+{
+    int n = 0;
+
+    for ( int fd = 0; fd < p->nfds && 0 < p->nlost; fd++ )
+    {
+        struct poller_fd *f = &p->fds[fd];
+        if ( !f->registered || !f->lost )
+            continue;
+
+        if ( 0 == uring_queue_poll(p, fd, f) )
+        {
+            uring_forget_lost(p, f);
+        }
+        else if ( n < max_events )
+        {
+            events[n].events = POLLER_ERR;
+            events[n].data = f->data;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+static int uring_init(struct poller *p)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    p->ringfd = (int) syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    if ( -1 == p->ringfd )
+        return -1;
+
+    if ( !( params.features & IORING_FEAT_NODROP ) || !( params.features & IORING_FEAT_EXT_ARG ) )
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    p->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    p->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        if ( p->sq_ring_size < p->cq_ring_size )
+            p->sq_ring_size = p->cq_ring_size;
+        p->cq_ring_size = 0;
+    }
+
+    p->sq_ring = mmap(NULL, p->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      p->ringfd, IORING_OFF_SQ_RING);
+    if ( MAP_FAILED == p->sq_ring )
+        return -1;
+
+    if ( 0 == p->cq_ring_size )
+    {
+        p->cq_ring = p->sq_ring;
+    }
+    else
+    {
+        p->cq_ring = mmap(NULL, p->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          p->ringfd, IORING_OFF_CQ_RING);
+        if ( MAP_FAILED == p->cq_ring )
+            return -1;
+    }
+
+    p->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    p->sqes = mmap(NULL, p->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   p->ringfd, IORING_OFF_SQES);
+    if ( MAP_FAILED == p->sqes )
+        return -1;
+
+    char *sq = (char *) p->sq_ring;
+    p->sq_head = (unsigned *) ( sq + params.sq_off.head );
+    p->sq_tail = (unsigned *) ( sq + params.sq_off.tail );
+    p->sq_mask = *(unsigned *) ( sq + params.sq_off.ring_mask );
+    p->sq_entries = params.sq_entries;
+    p->sq_local_tail = *p->sq_tail;
+
+    // submissions are always taken in order, from the slot of the same index
+    unsigned *array = (unsigned *) ( sq + params.sq_off.array );
+    for ( unsigned i = 0; i < params.sq_entries; i++ )
+        array[i] = i;
+
+    char *cq = (char *) p->cq_ring;
+    p->cq_head = (unsigned *) ( cq + params.cq_off.head );
+    p->cq_tail = (unsigned *) ( cq + params.cq_off.tail );
+    p->cq_mask = *(unsigned *) ( cq + params.cq_off.ring_mask );
+    p->cqes = (struct io_uring_cqe *) ( cq + params.cq_off.cqes );
+
+    return 0;
+}
+
+static void uring_fini(struct poller *p)
+{
+    if ( NULL != p->sqes && MAP_FAILED != p->sqes )
+        munmap(p->sqes, p->sqes_size);
+    if ( 0 != p->cq_ring_size && NULL != p->cq_ring && MAP_FAILED != p->cq_ring )
+        munmap(p->cq_ring, p->cq_ring_size);
+    if ( NULL != p->sq_ring && MAP_FAILED != p->sq_ring )
+        munmap(p->sq_ring, p->sq_ring_size);
+    if ( -1 != p->ringfd )
+        close(p->ringfd);
+}
+
+static int uring_add(struct poller *p, int fd, uint32_t events, union poller_data data)
+{
+    struct poller_fd *f = get_fd(p, fd);
+    if ( NULL == f )
+        return -1;
+
+    if ( f->registered )
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    f->registered = 1;
+    f->events = events;
+    f->data = data;
+    f->gen++;
+
+    if ( -1 == uring_queue_poll(p, fd, f) )
+    {
+        f->registered = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int uring_del(struct poller *p, int fd)
+{
+    struct poller_fd *f = find_fd(p, fd);
+    if ( NULL == f )
+        return -1;
+
+    // Completions of the removed poll that are already queued are told apart by the
+    // generation. The removal is submitted right away, along with the changes queued
+    // before it: the poll holds a reference to the file, which would otherwise stay open
+    // after the caller closes the descriptor, e.g. a listener keeping its port bound.
+
+    struct io_uring_sqe *sqe = uring_get_sqe(p);
+    if ( NULL == sqe )
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = ( (uint64_t) f->gen << 32 ) | (uint32_t) fd;
+    sqe->user_data = URING_IGNORE;
+
+    uring_forget_lost(p, f);
+    f->registered = 0;
+    f->gen++;
+
+    uring_publish(p);
+    if ( -1 == uring_enter(p, uring_unsubmitted(p), 0, 0, NULL, 0) && EINTR != errno && EBUSY != errno )
+        return -1;
+
+    return 0;
+}
+
+static int uring_mod(struct poller *p, int fd, uint32_t events, union poller_data data)
+{
+    struct poller_fd *f = find_fd(p, fd);
+    if ( NULL == f )
+        return -1;
+
+    // the new poll is queued behind the removal of the old one
+    struct io_uring_sqe *sqe = uring_get_sqe(p);
+    if ( NULL == sqe )
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = ( (uint64_t) f->gen << 32 ) | (uint32_t) fd;
+    sqe->user_data = URING_IGNORE;
+
+    uring_forget_lost(p, f);
+    f->registered = 0;
+    return uring_add(p, fd, events, data);
+}
+
+static void uring_rearm(struct poller *p, int fd)
+{
+    // a multishot poll already reports the next change
+    (void) p;
+    (void) fd;
+}
+
+static int uring_wait(struct poller *p, struct poller_event *events, int max_events, int timeout_ms)
+{
+    // what is reported in error is not waited for
+    int n = ( 0 < p->nlost ) ? uring_retry_lost(p, events, max_events) : 0;
+    if ( 0 < n )
+        timeout_ms = 0;
+
+    uring_publish(p);
+
+    unsigned head = *p->cq_head;
+    unsigned to_submit = uring_unsubmitted(p);
+
+    if ( head == __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE) )
+    {
+        // submit the queued changes and wait, in one call
+
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+
+        if ( 0 <= timeout_ms )
+        {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = ( timeout_ms % 1000 ) * 1000000L;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+
+        if ( -1 == uring_enter(p, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) )
+        {
+            if ( ETIME != errno && EBUSY != errno )
+                return -1;
+        }
+    }
+    else if ( 0 < to_submit )
+    {
+        if ( -1 == uring_enter(p, to_submit, 0, 0, NULL, 0) && EBUSY != errno && EINTR != errno )
+            return -1;
+    }
+
+    unsigned tail = __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE);
+
+    for ( ; head != tail && n < max_events; head++ )
+    {
+        struct io_uring_cqe *cqe = &p->cqes[head & p->cq_mask];
+        if ( URING_IGNORE == cqe->user_data )
+            continue;
+
+        int fd = (int) (uint32_t) cqe->user_data;
+        uint32_t gen = (uint32_t) ( cqe->user_data >> 32 );
+        if ( p->nfds <= fd || !p->fds[fd].registered || p->fds[fd].gen != gen )
+            continue;
+
+        struct poller_fd *f = &p->fds[fd];
+        int32_t res = cqe->res;
+        uint32_t flags = cqe->flags;
+
+        // A registration whose poll cannot be queued again would never be reported
+        // again: it is reported in error instead, and queued again on the next wait.
+        int lost = 0;
+        if ( !( flags & IORING_CQE_F_MORE ) && -1 == uring_requeue(p, fd, f, head + 1) )
+            lost = 1;
+
+        uint32_t ev;
+        if ( lost )
+        {
+            ev = POLLER_ERR;
+        }
+        else if ( 0 <= res )
+        {
+            ev = ( ( res & POLLIN ) ? POLLER_IN : 0 )
+               | ( ( res & POLLOUT ) ? POLLER_OUT : 0 )
+               | ( ( res & ( POLLERR | POLLNVAL ) ) ? POLLER_ERR : 0 )
+               | ( ( res & POLLHUP ) ? POLLER_HUP : 0 );
+        }
+        else if ( -ECANCELED == res )
+        {
+            // a multishot poll ended by the kernel, queued again above
+            continue;
+        }
+        else
+        {
+            ev = POLLER_ERR;
+        }
+
+        // a completion only carries the events of the wakeup that posted it
+        if ( ( f->events & POLLER_EDGE ) && ( f->events & POLLER_OUT ) && !( ev & POLLER_OUT ) )
+            ev |= POLLER_OUT;
+
+        events[n].events = ev;
+        events[n].data = f->data;
+        n++;
+    }
+
+    __atomic_store_n(p->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+static const struct poller_ops uring_ops =
+{
+    uring_init, uring_fini, uring_add, uring_mod, uring_del, uring_rearm, uring_wait
+};
+
+static const struct poller_ops *backend_ops[POLLER_BACKENDS] = { &epoll_ops, &poll_ops, &uring_ops };
+
+struct poller *poller_create(enum poller_backend backend)
+{
+    if ( backend < 0 || POLLER_BACKENDS <= backend )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct poller *p = (struct poller *) calloc(1, sizeof(struct poller));
+    if ( NULL == p )
+        return NULL;
+
+    p->backend = backend;
+    p->ops = backend_ops[backend];
+    p->epollfd = -1;
+    p->ringfd = -1;
+
+    if ( -1 == p->ops->init(p) )
+    {
+        int err = errno;
+        poller_destroy(p);
+        errno = err;
+        return NULL;
+    }
+
+    return p;
+}
+
+void poller_destroy(struct poller *p)
+{
+    p->ops->fini(p);
+    free(p->fds);
+    free(p);
+}
+
+int poller_find(const char *name)
+{
+    for ( int i = 0; i < POLLER_BACKENDS; i++ )
+    {
+        if ( 0 == strcmp(name, backend_names[i]) )
+            return i;
+    }
+
+    return -1;
+}
+
+const char *poller_name(enum poller_backend backend)
+{
+    return ( 0 <= backend && backend < POLLER_BACKENDS ) ? backend_names[backend] : "unknown";
+}
+
+enum poller_backend poller_backend(struct poller *p)
+{
+    return p->backend;
+}
+
+int poller_add(struct poller *p, int fd, uint32_t events, union poller_data data)
+{
+    p->stats.changes++;
+    return p->ops->add(p, fd, events, data);
+}
+
+int poller_mod(struct poller *p, int fd, uint32_t events, union poller_data data)
+{
+    p->stats.changes++;
+    return p->ops->mod(p, fd, events, data);
+}
+
+int poller_del(struct poller *p, int fd)
+{
+    p->stats.changes++;
+    return p->ops->del(p, fd);
+}
+
+void poller_rearm(struct poller *p, int fd)
+{
+    p->ops->rearm(p, fd);
+}
+
+int poller_wait(struct poller *p, struct poller_event *events, int max_events, int timeout_ms)
+{
+    p->stats.waits++;
+
+    int n = p->ops->wait(p, events, max_events, timeout_ms);
+    if ( 0 < n )
+        p->stats.events += n;
+
+    return n;
+}
+
+void poller_get_stats(struct poller *p, struct poller_stats *stats)
+{
+    *stats = p->stats;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The I/O backend of the event loops: registers interest in descriptors and waits for
+ * them to become ready, with epoll, poll or io_uring chosen at runtime.
+ *
+ *   epoll     epoll_ctl() per change, epoll_wait() per wakeup
+ *   poll      the interest set is kept in user space and passed to every poll()
+ *   io_uring  registrations are queued as IORING_OP_POLL_ADD submissions and handed to
+ *             the kernel together with the wait, in a single io_uring_enter(); removals
+ *             are submitted right away so that the descriptor can be closed after them
+ *
+ * The interface is readiness-only, on every backend io_uring included: it says when a
+ * descriptor can be read or written, and the data itself is still moved with recv() and
+ * send(), so that the event loops need not care which backend is used. io_uring thus
+ * saves the system calls of registration, not those of the transfers.
+ *
+ * Submitting the transfers themselves (IORING_OP_RECV and IORING_OP_SEND, with the result
+ * returned as a completion) is not implemented. It would take a completion event beside
+ * the readiness ones, buffers owned by the backend until their completion, an emulation
+ * for epoll and poll that does the transfer once the descriptor is ready, and both event
+ * loops rewritten around completions rather than reading until EAGAIN.
+ *
+ * A registration is either level-triggered or, with POLLER_EDGE, edge-triggered, in
+ * which case the caller must read until EAGAIN. As with epoll, an edge-triggered
+ * descriptor that becomes readable is also reported writable if output was asked for;
+ * a caller whose send() returned EAGAIN calls poller_rearm() to be told when it can
+ * write again. Only epoll supports POLLER_EXCLUSIVE; the others ignore it.
+ *
+ * io_uring queues a poll again after each completion of a level-triggered registration.
+ * If the kernel cannot take it, the descriptor is reported with POLLER_ERR instead, and
+ * the poll is queued again on every later wait until it is taken or the registration
+ * is removed.
+ */
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// requested and returned events
+#define POLLER_IN        0x01
+#define POLLER_OUT       0x02
+#define POLLER_ERR       0x04   // returned only
+#define POLLER_HUP       0x08   // returned only
+
+// registration flags
+#define POLLER_EDGE      0x10
+#define POLLER_EXCLUSIVE 0x20
+
+enum poller_backend
+{
+    POLLER_EPOLL,
+    POLLER_POLL,
+    POLLER_URING,
+    POLLER_BACKENDS
+};
+
+union poller_data
+{
+    void *ptr;
+    int fd;
+    uint64_t u64;
+};
+
+struct poller_event
+{
+    uint32_t events;
+    union poller_data data;
+};
+
+// what the backend cost so far
+struct poller_stats
+{
+    unsigned long waits;        // calls to poller_wait()
+    unsigned long changes;      // registrations, modifications and removals
+    unsigned long events;       // events returned
+    unsigned long syscalls;     // system calls made by the backend
+};
+
+struct poller;
+
+// returns NULL with errno set, ENOSYS if the backend is not available on this system
+struct poller *poller_create(enum poller_backend backend);
+void poller_destroy(struct poller *p);
+
+// returns the backend of the given name ("epoll", "poll", "io_uring"), or -1
+int poller_find(const char *name);
+const char *poller_name(enum poller_backend backend);
+enum poller_backend poller_backend(struct poller *p);
+
+int poller_add(struct poller *p, int fd, uint32_t events, union poller_data data);
+int poller_mod(struct poller *p, int fd, uint32_t events, union poller_data data);
+int poller_del(struct poller *p, int fd);
+
+// after EAGAIN on an edge-triggered descriptor, asks to be told when it is writable again
+void poller_rearm(struct poller *p, int fd);
+
+// Waits up to timeout_ms (-1 for no limit) and returns the number of events, 0 on
+// timeout, or -1 with errno set, EINTR if a signal was caught.
+int poller_wait(struct poller *p, struct poller_event *events, int max_events, int timeout_ms);
+
+void poller_get_stats(struct poller *p, struct poller_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // POLLER_H
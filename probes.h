@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * USDT probes on the hot paths of the server and the client, for bpftrace and perf to
+ * attach to on a running process without a rebuild, e.g.
+ *
+ *   bpftrace -e 'usdt:./server:libserver:recv { @bytes = hist(arg1); }'
+ *   perf probe -x ./server sdt_libserver:recv
+ *
+ * A probe is a single nop in the code, with its location and the location of its
+ * arguments in an ELF note, so that it costs nothing until a tracer turns it into a
+ * breakpoint. The arguments are only computed for the nop to refer to them, so they are
+ * kept to values at hand. They need <sys/sdt.h> (systemtap-sdt-dev or
+ * systemtap-sdt-devel); without it, or with -DNO_PROBES, the probes compile to nothing.
+ *
+ *   libserver:accept(fd)                  a connection was accepted
+ *   libserver:recv(fd, bytes)             each recv() that returned data
+ *   libserver:recv_eagain(fd)             the connection was read dry
+ *   libserver:send(fd, bytes)             each send(), of what it took
+ *   libserver:send_eagain(fd, unsent)     the send buffer is full, unsent bytes are queued
+ *   libserver:close(fd)                   the loop closes a connection
+ *   server:sanitize_start()               the handler starts on a buffer, or a batch
+ *   server:sanitize_end(buffers, bytes)   and is done with it
+ *   server:ack(fd, bytes)                 an ack for bytes received was sent
+ *   server:close(fd, id, bytes, accepted) a connection closes, with what it received and
+ *                                         when it was accepted, in seconds of the epoch
+ *   client:connect(fd)                    a connection of the load is connected
+ *   client:send(fd, bytes)                a chunk was sent
+ *   client:ack(fd, latency)               an ack arrived, latency in ns as reported
+ *   client:recv_eagain(fd)                the connection was read dry
+ *   client:close(fd)                      a connection closes
+ *
+ * See trace/ for bpftrace scripts built on them.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+
+#define PROBE0(provider, name) DTRACE_PROBE(provider, name)
+#define PROBE1(provider, name, a) DTRACE_PROBE1(provider, name, a)
+#define PROBE2(provider, name, a, b) DTRACE_PROBE2(provider, name, a, b)
+#define PROBE4(provider, name, a, b, c, d) DTRACE_PROBE4(provider, name, a, b, c, d)
+
+#else
+
+// the arguments are not evaluated, but still count as used
+#define PROBE0(provider, name) do { } while ( 0 )
+#define PROBE1(provider, name, a) do { (void) sizeof(a); } while ( 0 )
+#define PROBE2(provider, name, a, b) do { (void) sizeof(a); (void) sizeof(b); } while ( 0 )
+#define PROBE4(provider, name, a, b, c, d) \
+    do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); (void) sizeof(d); } while ( 0 )
+
+#endif
+
+#endif // PROBES_H
@@ -0,0 +1,528 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A sampling profiler. See profiler.h.
+ */
+#define _GNU_SOURCE     // dladdr(), pthread_getattr_np(), gettid()
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>       // ElfW()
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>   // mmap()
+#include <sys/stat.h>
+#include <sys/syscall.h> // SYS_perf_event_open
+#include <sys/time.h>   // setitimer()
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "profiler.h"
+
+enum profiler_source
+{
+    PROFILER_OFF,
+    PROFILER_PERF,      // a software clock event per thread
+    PROFILER_TIMER      // ITIMER_PROF for the whole process
+};
+
+static const char *source_names[] = { "off", "perf", "timer" };
+
+// A sample is written by the signal handler of the thread it was taken on. Its sequence
+// number is odd while it is, and the reader takes it only if it is the same even number
+// before and after copying it, as it may be overwritten meanwhile.
+struct sample
+{
+    uint64_t seq;
+    int32_t tid;
+    int32_t depth;
+    uintptr_t pcs[PROFILER_DEPTH];  // the interrupted instruction, then the return addresses
+};
+
+static enum profiler_source source = PROFILER_OFF;
+static int rate = PROFILER_HZ;
+static struct sample *samples = NULL;
+static uint64_t head = 0;
+static int threads = 0;
+static pthread_key_t thread_key;
+
+// The names the threads registered with, as those that have exited by the time the
+// samples are written are gone from /proc. Each is written once, its tid last.
+#define PROFILER_THREADS 256
+
+static struct
+{
+    pid_t tid;
+    char name[16];
+} thread_names[PROFILER_THREADS];
+
+// set by profiler_thread(), and read by the signal handler on the same thread
+static __thread pid_t thread_tid = 0;
+static __thread uintptr_t stack_low = 0;
+static __thread uintptr_t stack_high = 0;
+
+// The frames of the interrupted thread, followed through the frame pointers for as long
+// as they stay within its stack and go up it. Returns the number of addresses.
+static int unwind(ucontext_t *uc, uintptr_t *pcs)
+{
+#if defined(__x86_64__)
+    uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+    uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+    uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    uintptr_t pc = uc->uc_mcontext.pc;
+    uintptr_t fp = uc->uc_mcontext.regs[29];
+    uintptr_t sp = uc->uc_mcontext.sp;
+#else
+    (void) uc;
+    (void) pcs;
+    return 0;
+#endif
+
+#if defined(__x86_64__) || defined(__aarch64__)
+    int depth = 0;
+    pcs[depth++] = pc;
+
+    // interrupted on a stack other than the thread's, or the thread is not registered
+    if ( sp < stack_low || stack_high <= sp )
+        return depth;
+
+    // each frame starts with the frame pointer of its caller, then the return address
+    while ( depth < PROFILER_DEPTH && sp <= fp && fp + 2 * sizeof(uintptr_t) <= stack_high
+            && 0 == fp % sizeof(uintptr_t) )
+    {
+        uintptr_t *frame = (uintptr_t *) fp;
+        if ( 0 == frame[1] )
+            break;
+
+        pcs[depth++] = frame[1];
+        if ( frame[0] <= fp )
+            break;
+        fp = frame[0];
+    }
+
+    return depth;
+#endif
+}
+
+static void take_sample(int signo, siginfo_t *info, void *context)
+{
+    (void) signo;
+    (void) info;
+    int err = errno;
+
+    uint64_t i = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    struct sample *s = &samples[i % PROFILER_SAMPLES];
+
+    __atomic_store_n(&s->seq, 2 * i + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    s->tid = ( 0 != thread_tid ) ? thread_tid : gettid();
+    s->depth = unwind((ucontext_t *) context, s->pcs);
+
+    __atomic_store_n(&s->seq, 2 * i + 2, __ATOMIC_RELEASE);
+    errno = err;
+}
+
+// A clock event counting the CPU time of the calling thread, which signals it each time
+// a period has run. Returns -1 with errno set.
+static int open_event(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    attr.sample_period = 1000000000 / rate;
+    attr.wakeup_events = 1;
+
+    // the time in system calls counts too where it may, as it does with ITIMER_PROF
+    int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if ( -1 == fd && ( EACCES == errno || EPERM == errno ) )
+    {
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    if ( -1 == fd )
+        return -1;
+
+    struct f_owner_ex owner = { F_OWNER_TID, gettid() };
+    if ( -1 == fcntl(fd, F_SETFL, O_ASYNC) || -1 == fcntl(fd, F_SETSIG, SIGPROF)
+         || -1 == fcntl(fd, F_SETOWN_EX, &owner) )
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+// called when a registered thread exits, with its event
+static void unregister(void *arg)
+{
+    close((int) (intptr_t) arg - 1);
+}
+
+// registers the calling thread, with an event of its own if that is the source
+static int register_thread(const char *name)
+{
+    pthread_attr_t attr;
+    if ( 0 == pthread_getattr_np(pthread_self(), &attr) )
+    {
+        void *addr;
+        size_t size;
+        if ( 0 == pthread_attr_getstack(&attr, &addr, &size) )
+        {
+            stack_low = (uintptr_t) addr;
+            stack_high = (uintptr_t) addr + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    thread_tid = gettid();
+
+    if ( PROFILER_PERF == source )
+    {
+        int fd = open_event();
+        if ( -1 == fd )
+            return -1;
+        pthread_setspecific(thread_key, (void *) (intptr_t) ( fd + 1 ));
+    }
+
+    int n = __atomic_fetch_add(&threads, 1, __ATOMIC_RELAXED);
+    if ( NULL != name && n < PROFILER_THREADS )
+    {
+        snprintf(thread_names[n].name, sizeof(thread_names[n].name), "%s", name);
+        __atomic_store_n(&thread_names[n].tid, thread_tid, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+int profiler_start(int hz, int per_thread)
+{
+    rate = hz;
+
+    samples = (struct sample *) mmap(NULL, PROFILER_SAMPLES * sizeof(struct sample), PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( MAP_FAILED == samples )
+    {
+        samples = NULL;
+        return -1;
+    }
+
+    if ( 0 != pthread_key_create(&thread_key, unregister) )
+        return -1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = take_sample;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if ( -1 == sigaction(SIGPROF, &sa, NULL) )
+        return -1;
+
+    // a thread's own event if asked for and permitted, tried on this thread first
+    if ( per_thread )
+    {
+        source = PROFILER_PERF;
+        if ( 0 == register_thread(NULL) )
+            return 0;
+    }
+
+    source = PROFILER_TIMER;
+    if ( -1 == register_thread(NULL) )
+        return -1;
+
+    long usec = 1000000 / hz;
+    struct itimerval timer = { { usec / 1000000, usec % 1000000 }, { usec / 1000000, usec % 1000000 } };
+    if ( -1 == setitimer(ITIMER_PROF, &timer, NULL) )
+    {
+        source = PROFILER_OFF;
+        return -1;
+    }
+
+    return 0;
+}
+
+void profiler_thread(const char *name)
+{
+    // the root of the thread's stacks, which would otherwise be named after the process
+    pthread_setname_np(pthread_self(), name);
+
+    if ( PROFILER_OFF == source )
+        return;
+
+    // threads are commonly started with every signal blocked, to leave them to the loop
+    sigset_t prof;
+    sigemptyset(&prof);
+    sigaddset(&prof, SIGPROF);
+    pthread_sigmask(SIG_UNBLOCK, &prof, NULL);
+
+    register_thread(name);
+}
+
+// the functions of the executable, static ones included, sorted by address
+struct symbol
+{
+    uintptr_t addr;
+    size_t size;
+    const char *name;
+};
+
+static struct symbol *symbols = NULL;
+static size_t nsymbols = 0;
+static uintptr_t exe_base = 0;
+
+static int by_address(const void *a, const void *b)
+{
+    const struct symbol *x = (const struct symbol *) a, *y = (const struct symbol *) b;
+    return ( x->addr > y->addr ) - ( x->addr < y->addr );
+}
+
+// Reads the symbol table of the executable, which stays mapped for the names. Without
+// one, in a stripped executable, the functions are named by dladdr() alone.
+static void load_symbols(void)
+{
+    static int loaded = 0;
+    if ( loaded )
+        return;
+    loaded = 1;
+
+    int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    if ( -1 == fd )
+        return;
+
+    struct stat st;
+    if ( -1 == fstat(fd, &st) || (size_t) st.st_size < sizeof(ElfW(Ehdr)) )
+    {
+        close(fd);
+        return;
+    }
+
+    const char *file = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( MAP_FAILED == file )
+        return;
+
+    const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *) file;
+    if ( 0 != memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+         || ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)) > (size_t) st.st_size )
+        return;
+
+    const ElfW(Shdr) *shdrs = (const ElfW(Shdr) *) ( file + ehdr->e_shoff );
+    for ( int i = 0; i < ehdr->e_shnum; i++ )
+    {
+        if ( SHT_SYMTAB != shdrs[i].sh_type || shdrs[i].sh_link >= ehdr->e_shnum )
+            continue;
+
+        const ElfW(Sym) *syms = (const ElfW(Sym) *) ( file + shdrs[i].sh_offset );
+        size_t count = shdrs[i].sh_size / sizeof(ElfW(Sym));
+        const char *names = file + shdrs[shdrs[i].sh_link].sh_offset;
+
+        symbols = (struct symbol *) malloc(count * sizeof(struct symbol));
+        if ( NULL == symbols )
+            return;
+
+        for ( size_t j = 0; j < count; j++ )
+        {
+            if ( STT_FUNC == ELF64_ST_TYPE(syms[j].st_info) && 0 != syms[j].st_value )
+                symbols[nsymbols++] = (struct symbol) { syms[j].st_value, syms[j].st_size, names + syms[j].st_name };
+        }
+        qsort(symbols, nsymbols, sizeof(struct symbol), by_address);
+        break;
+    }
+
+    // where the executable was loaded, if it is position independent
+    Dl_info info;
+    if ( ET_DYN == ehdr->e_type && 0 != dladdr((void *) load_symbols, &info) )
+        exe_base = (uintptr_t) info.dli_fbase;
+}
+
+static const char *symbolize(uintptr_t pc, char *buf, size_t size)
+{
+    // the last function starting at or before pc, if pc is within it
+    size_t low = 0, high = nsymbols;
+    while ( low < high )
+    {
+        size_t mid = ( low + high ) / 2;
+        if ( symbols[mid].addr + exe_base <= pc )
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if ( 0 < low && pc < symbols[low - 1].addr + exe_base + symbols[low - 1].size )
+        return symbols[low - 1].name;
+
+    Dl_info info;
+    if ( 0 != dladdr((void *) pc, &info) )
+    {
+        if ( NULL != info.dli_sname )
+            return info.dli_sname;
+
+        if ( NULL != info.dli_fname )
+        {
+            const char *name = strrchr(info.dli_fname, '/');
+            snprintf(buf, size, "[%s+0x%lx]", ( NULL != name ) ? name + 1 : info.dli_fname,
+                     (unsigned long) ( pc - (uintptr_t) info.dli_fbase ));
+            return buf;
+        }
+    }
+
+    snprintf(buf, size, "[0x%lx]", (unsigned long) pc);
+    return buf;
+}
+
+// the name of a thread of this process, as the root of its stacks
+static const char *thread_name(pid_t tid, char *buf, size_t size)
+{
+    // the latest registration, as the tid of an exited thread can be reused
+    int n = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+    if ( PROFILER_THREADS < n )
+        n = PROFILER_THREADS;
+    while ( 0 < n-- )
+    {
+        if ( tid == __atomic_load_n(&thread_names[n].tid, __ATOMIC_ACQUIRE) )
+            break;
+    }
+
+    if ( 0 <= n )
+    {
+        snprintf(buf, size, "%s", thread_names[n].name);
+    }
+    else
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/task/%d/comm", (int) tid);
+
+        FILE *fp = fopen(path, "r");
+        if ( NULL == fp || NULL == fgets(buf, size, fp) )
+            snprintf(buf, size, "thread-%d", (int) tid);
+        if ( NULL != fp )
+            fclose(fp);
+    }
+
+    buf[strcspn(buf, "\n")] = '\0';
+
+    // spaces and semicolons separate the fields of a folded stack
+    for ( char *p = buf; '\0' != *p; p++ )
+    {
+        if ( ' ' == *p || ';' == *p )
+            *p = '_';
+    }
+    return buf;
+}
+
+static int by_stack(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+int profiler_write(FILE *out)
+{
+    if ( NULL == samples )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    load_symbols();
+
+    uint64_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint64_t begin = ( PROFILER_SAMPLES < end ) ? end - PROFILER_SAMPLES : 0;
+
+    char **stacks = (char **) malloc(( end - begin ) * sizeof(char *) + 1);
+    if ( NULL == stacks )
+        return -1;
+    size_t nstacks = 0;
+
+    // the names of the threads seen so far
+    struct { pid_t tid; char name[32]; } names[64];
+    int nnames = 0;
+
+    for ( uint64_t i = begin; i < end; i++ )
+    {
+        struct sample *slot = &samples[i % PROFILER_SAMPLES];
+        struct sample s;
+
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if ( 2 * i + 2 != seq )
+            continue;
+        memcpy(&s, slot, sizeof(s));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ( seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) || s.depth < 1 || PROFILER_DEPTH < s.depth )
+            continue;
+
+        const char *name = NULL;
+        for ( int n = 0; n < nnames && NULL == name; n++ )
+        {
+            if ( names[n].tid == s.tid )
+                name = names[n].name;
+        }
+        char buf[32];
+        if ( NULL == name )
+        {
+            name = thread_name(s.tid, buf, sizeof(buf));
+            if ( nnames < 64 )
+            {
+                names[nnames].tid = s.tid;
+                snprintf(names[nnames].name, sizeof(names[nnames].name), "%s", buf);
+                nnames++;
+            }
+        }
+
+        char *line = NULL;
+        size_t len = 0;
+        FILE *fp = open_memstream(&line, &len);
+        if ( NULL == fp )
+            break;
+
+        fputs(name, fp);
+        for ( int f = s.depth - 1; 0 <= f; f-- )
+        {
+            // a return address is past the call, which may be the last instruction of its function
+            char frame[256];
+            fprintf(fp, ";%s", symbolize(( 0 == f ) ? s.pcs[f] : s.pcs[f] - 1, frame, sizeof(frame)));
+        }
+        fclose(fp);
+
+        stacks[nstacks++] = line;
+    }
+
+    qsort(stacks, nstacks, sizeof(char *), by_stack);
+
+    int distinct = 0;
+    for ( size_t i = 0; i < nstacks; )
+    {
+        size_t j = i + 1;
+        while ( j < nstacks && 0 == strcmp(stacks[i], stacks[j]) )
+            j++;
+
+        fprintf(out, "%s %lu\n", stacks[i], (unsigned long) ( j - i ));
+        distinct++;
+        i = j;
+    }
+
+    for ( size_t i = 0; i < nstacks; i++ )
+        free(stacks[i]);
+    free(stacks);
+
+    return distinct;
+}
+
+void profiler_print_stats(FILE *out)
+{
+    if ( PROFILER_OFF == source )
+        return;
+
+    uint64_t taken = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    fprintf(out, "sampler: source:%s, rate:%dHz, threads:%d, samples:%lu, kept:%lu\n", source_names[source], rate,
+            __atomic_load_n(&threads, __ATOMIC_RELAXED), (unsigned long) taken,
+            (unsigned long) ( ( PROFILER_SAMPLES < taken ) ? PROFILER_SAMPLES : taken ));
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A sampling profiler for where perf is not allowed: every thread that runs is
+ * interrupted a number of times per second of CPU time, with SIGPROF, and its stack is
+ * taken by following the frame pointers from the interrupted context into a ring of
+ * samples allocated up front, without a system call or an allocation in the handler.
+ *
+ * A process-wide ITIMER_PROF drives it, and the kernel signals whichever thread is
+ * running, at most once per tick of its clock, commonly 250 or 1000 per second. Asked
+ * for per-thread sampling where perf_event_open() is permitted, each registered thread
+ * gets a software clock event of its own instead that signals it on overflow, at any
+ * rate; the events are switched with the threads, though, which adds to the cost of
+ * every context switch. Threads register with profiler_thread() when they start, so
+ * that their stack bounds are known; the stacks of a thread that did not are not
+ * followed past the interrupted instruction. Registering also names the thread, for the
+ * root of its stacks, and unblocks SIGPROF, which a thread started with every signal
+ * blocked would otherwise never take.
+ *
+ * profiler_write() prints the latest PROFILER_SAMPLES samples as folded stacks, one
+ * line per distinct stack with the thread's name at its root and the number of samples
+ * at its end, for flamegraph.pl:
+ *
+ *   server;main;run_event_loop;server_run;read_connection;on_data;process 812
+ *
+ * Functions are named from the symbol table of the executable, which has its static
+ * functions, then with dladdr(), which needs the program linked with -rdynamic. Stacks
+ * are only as deep as the code was built with -fno-omit-frame-pointer; the C library
+ * usually is not, and its frames end a stack early.
+ */
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+
+// the samples kept, the latest ones, and the frames of each
+#define PROFILER_SAMPLES 32768
+#define PROFILER_DEPTH 60
+
+// a prime, so that the samples do not fall in step with something periodic
+#define PROFILER_HZ 997
+
+// Starts sampling at hz per second of CPU time, with the calling thread registered, with
+// an event per thread if per_thread and permitted. Returns -1 with errno set.
+int profiler_start(int hz, int per_thread);
+
+// Names the calling thread, of at most 15 characters, and if the profiler was started
+// registers it and unblocks SIGPROF on it.
+void profiler_thread(const char *name);
+
+// Prints the samples as folded stacks. Returns the number of distinct stacks, or -1
+// with errno set.
+int profiler_write(FILE *out);
+
+// prints nothing unless the profiler was started in this process
+void profiler_print_stats(FILE *out);
+
+#endif // PROFILER_H
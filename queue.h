@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Lock-free queues used to pass work between threads.
+ *
+ * spsc_ring  - single producer, single consumer ring of pointers.
+ * mpmc_queue - multi-producer, multi-consumer queue of pointers (Dmitry Vyukov's
+ *              bounded queue). Items pushed by one producer are popped in the order
+ *              they were pushed, which is what keeps per-connection ordering when
+ *              several workers post their results to one consumer.
+ * ws_deque   - Chase-Lev work-stealing deque: the owner pushes and takes at the bottom,
+ *              other threads steal from the top.
+ * mpsc_list  - unbounded intrusive multi-producer, single-consumer list (Dmitry Vyukov's),
+ *              for items that already carry their link.
+ *
+ * Capacities of the bounded ones must be powers of two. Push returns -1 when the queue
+ * is full and pop returns NULL when it is empty; neither ever blocks.
+ */
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#define CACHELINE 64
+
+// so that the header can be included from C++ as well
+#ifdef __cplusplus
+#define CACHELINE_ALIGNED alignas(CACHELINE)
+#else
+#define CACHELINE_ALIGNED _Alignas(CACHELINE)
+#endif
+
+struct spsc_ring
+{
+    size_t mask;
+    void **slots;
+
+    // written by the producer only
+    CACHELINE_ALIGNED size_t tail;
+    size_t cached_head;
+
+    // written by the consumer only
+    CACHELINE_ALIGNED size_t head;
+    size_t cached_tail;
+};
+
+static inline int spsc_init(struct spsc_ring *r, size_t capacity)
+{
+    r->slots = (void **) calloc(capacity, sizeof(void *));
+    if ( NULL == r->slots )
+        return -1;
+
+    r->mask = capacity - 1;
+    r->head = r->tail = 0;
+    r->cached_head = r->cached_tail = 0;
+    return 0;
+}
+
+static inline int spsc_push(struct spsc_ring *r, void *item)
+{
+    size_t tail = r->tail;
+
+    // only look at the consumer's index when the cached copy says the ring is full
+    if ( tail - r->cached_head > r->mask )
+    {
+        r->cached_head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if ( tail - r->cached_head > r->mask )
+            return -1;
+    }
+
+    r->slots[tail & r->mask] = item;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline void *spsc_pop(struct spsc_ring *r)
+{
+    size_t head = r->head;
+
+    if ( head == r->cached_tail )
+    {
+        r->cached_tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if ( head == r->cached_tail )
+            return NULL;
+    }
+
+    void *item = r->slots[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+// approximate when called concurrently with push or pop
+static inline size_t spsc_size(struct spsc_ring *r)
+{
+    return __atomic_load_n(&r->tail, __ATOMIC_RELAXED) - __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+}
+
+struct mpmc_cell
+{
+    size_t seq;
+    void *data;
+};
+
+struct mpmc_queue
+{
+    size_t mask;
+    struct mpmc_cell *cells;
+
+    CACHELINE_ALIGNED size_t enqueue_pos;
+    CACHELINE_ALIGNED size_t dequeue_pos;
+};
+
+static inline int mpmc_init(struct mpmc_queue *q, size_t capacity)
+{
+    q->cells = (struct mpmc_cell *) calloc(capacity, sizeof(struct mpmc_cell));
+    if ( NULL == q->cells )
+        return -1;
+
+    for ( size_t i = 0; i < capacity; i++ )
+        q->cells[i].seq = i;
+
+    q->mask = capacity - 1;
+    q->enqueue_pos = q->dequeue_pos = 0;
+    return 0;
+}
+
+static inline int mpmc_push(struct mpmc_queue *q, void *item)
+{
+    size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+    while ( 1 )
+    {
+        struct mpmc_cell *cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) pos;
+
+        if ( 0 == diff )
+        {
+            // the cell is free, try to claim it
+            if ( __atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+            {
+                cell->data = item;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+            // pos has been reloaded by the failed exchange
+        }
+        else if ( diff < 0 )
+        {
+            // full
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static inline void *mpmc_pop(struct mpmc_queue *q)
+{
+    size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+
+    while ( 1 )
+    {
+        struct mpmc_cell *cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) ( pos + 1 );
+
+        if ( 0 == diff )
+        {
+            if ( __atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+            {
+                void *item = cell->data;
+                __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return item;
+            }
+        }
+        else if ( diff < 0 )
+        {
+            // empty
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// approximate when called concurrently with push or pop
+static inline size_t mpmc_size(struct mpmc_queue *q)
+{
+    size_t tail = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    return ( tail > head ) ? tail - head : 0;
+}
+
+struct ws_deque
+{
+    long mask;
+    void **slots;
+
+    CACHELINE_ALIGNED long top;
+    CACHELINE_ALIGNED long bottom;
+};
+
+// returned by ws_steal() when it lost a race with another thief or the owner
+#define WS_ABORT ( (void *) -1 )
+
+static inline int ws_init(struct ws_deque *d, size_t capacity)
+{
+    d->slots = (void **) calloc(capacity, sizeof(void *));
+    if ( NULL == d->slots )
+        return -1;
+
+    d->mask = (long) capacity - 1;
+    d->top = d->bottom = 0;
+    return 0;
+}
+
+// owner only
+static inline int ws_push(struct ws_deque *d, void *item)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+    if ( b - t > d->mask )
+        return -1;
+
+    __atomic_store_n(&d->slots[b & d->mask], item, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// owner only
+static inline void *ws_take(struct ws_deque *d)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    void *item = NULL;
+
+    if ( t <= b )
+    {
+        item = __atomic_load_n(&d->slots[b & d->mask], __ATOMIC_RELAXED);
+        if ( t == b )
+        {
+            // the last item, race the thieves for it
+            if ( !__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) )
+                item = NULL;
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return item;
+}
+
+// any thread; returns NULL if empty and WS_ABORT if the race was lost
+static inline void *ws_steal(struct ws_deque *d)
+{
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+    if ( t >= b )
+        return NULL;
+
+    void *item = __atomic_load_n(&d->slots[t & d->mask], __ATOMIC_RELAXED);
+    if ( !__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) )
+        return WS_ABORT;
+
+    return item;
+}
+
+// approximate when called concurrently
+static inline long ws_size(struct ws_deque *d)
+{
+    long size = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    return ( 0 < size ) ? size : 0;
+}
+
+struct mpsc_link
+{
+    struct mpsc_link *next;
+};
+
+struct mpsc_list
+{
+    struct mpsc_link *head;     // last pushed, written by producers
+    struct mpsc_link *tail;     // next to pop, owned by the consumer
+    struct mpsc_link stub;
+};
+
+static inline void mpsc_init(struct mpsc_list *l)
+{
+    l->stub.next = NULL;
+    l->head = l->tail = &l->stub;
+}
+
+static inline void mpsc_push(struct mpsc_list *l, struct mpsc_link *link)
+{
+    __atomic_store_n(&link->next, NULL, __ATOMIC_RELAXED);
+    struct mpsc_link *prev = __atomic_exchange_n(&l->head, link, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, link, __ATOMIC_RELEASE);
+}
+
+// Returns NULL when empty, and also while a push is half way through;
+// the producer that is pushing is expected to notice that the consumer may have missed it.
+static inline struct mpsc_link *mpsc_pop(struct mpsc_list *l)
+{
+    // tail is only touched by the consumer, but the consumer may change from one
+    // thread to another, hence the atomic accesses
+    struct mpsc_link *tail = __atomic_load_n(&l->tail, __ATOMIC_RELAXED);
+    struct mpsc_link *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if ( &l->stub == tail )
+    {
+        if ( NULL == next )
+            return NULL;
+        __atomic_store_n(&l->tail, next, __ATOMIC_RELAXED);
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if ( NULL != next )
+    {
+        __atomic_store_n(&l->tail, next, __ATOMIC_RELAXED);
+        return tail;
+    }
+
+    if ( tail != __atomic_load_n(&l->head, __ATOMIC_ACQUIRE) )
+        return NULL;
+
+    // tail is the last item: put the stub behind it so that it can be unlinked
+    mpsc_push(l, &l->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if ( NULL != next )
+    {
+        __atomic_store_n(&l->tail, next, __ATOMIC_RELAXED);
+        return tail;
+    }
+
+    return NULL;
+}
+
+// true if something was pushed and not popped yet
+static inline int mpsc_pending(struct mpsc_list *l)
+{
+    struct mpsc_link *tail = __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE);
+    return NULL != __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE)
+           || &l->stub != tail || tail != __atomic_load_n(&l->head, __ATOMIC_ACQUIRE);
+}
+
+#endif // QUEUE_H
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A flight recorder of the lifecycle of connections. See recorder.h.
+ */
+#define _GNU_SOURCE     // pthread_getname_np(), gettid()
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>   // mmap()
+#include <time.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+struct recorder_header *recorder_file = NULL;
+__thread struct recorder_ring *recorder_ring = NULL;
+
+// set on the threads that came after all the rings were taken, which do not record
+static __thread int unrecorded = 0;
+
+static char recorder_path[4096];
+
+int recorder_open(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ( -1 == fd )
+        return -1;
+
+    // Allocated up front rather than left sparse, as a store to a page that cannot be
+    // allocated, on a full disk, would kill the server with SIGBUS.
+    int err = posix_fallocate(fd, 0, RECORDER_FILE_SIZE);
+    if ( 0 != err )
+    {
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    void *file = mmap(NULL, RECORDER_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( MAP_FAILED == file )
+        return -1;
+
+    struct recorder_header *header = (struct recorder_header *) file;
+    header->version = RECORDER_VERSION;
+    header->threads = RECORDER_THREADS;
+    header->events = RECORDER_EVENTS;
+    header->pid = getpid();
+    header->tsc_per_ns = phase_cycles_per_ns();
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header->started_tsc = phase_cycles();
+    header->started = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    // last, so that a file with the magic has a header a decoder can rely on
+    __atomic_store_n(&header->magic, RECORDER_MAGIC, __ATOMIC_RELEASE);
+
+    snprintf(recorder_path, sizeof(recorder_path), "%s", path);
+    recorder_file = header;
+    return 0;
+}
+
+void recorder_discard(void)
+{
+    if ( NULL != recorder_file )
+        unlink(recorder_path);
+}
+
+struct recorder_ring *recorder_attach(void)
+{
+    if ( unrecorded )
+        return NULL;
+
+    uint32_t i = __atomic_fetch_add(&recorder_file->rings, 1, __ATOMIC_RELAXED);
+    if ( RECORDER_THREADS <= i )
+    {
+        unrecorded = 1;
+        return NULL;
+    }
+
+    struct recorder_ring *ring = recorder_ring_at(recorder_file, i);
+    ring->tid = gettid();
+    pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+
+    recorder_ring = ring;
+    return ring;
+}
+
+void recorder_print_stats(FILE *out)
+{
+    if ( NULL == recorder_file )
+        return;
+
+    uint32_t rings = __atomic_load_n(&recorder_file->rings, __ATOMIC_RELAXED);
+    if ( RECORDER_THREADS < rings )
+        rings = RECORDER_THREADS;
+
+    uint64_t events = 0;
+    for ( uint32_t i = 0; i < rings; i++ )
+        events += __atomic_load_n(&recorder_ring_at(recorder_file, i)->head, __ATOMIC_RELAXED);
+
+    fprintf(out, "recorder: path:%s, threads:%u, events:%lu\n", recorder_path, rings, (unsigned long) events);
+}
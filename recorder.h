@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A flight recorder of the lifecycle of connections: every thread that handles them
+ * appends fixed-size binary events to a ring of its own, in a file mapped into memory,
+ * so that what happened before a throughput dip or a crash can be read back afterwards
+ * with trace/flight. The pages of the file belong to the kernel's page cache, so the
+ * events survive the process being killed or crashing, though not the machine.
+ *
+ * Recording an event costs a read of the time stamp counter and a few stores to memory,
+ * no system call and no atomic instruction, so the recorder can be left on in production;
+ * when it is off, a load and a branch. A ring keeps the latest RECORDER_EVENTS events of
+ * its thread, the older ones being overwritten.
+ *
+ * The file is a header followed by RECORDER_THREADS rings, each a ring header followed by
+ * its events, all in host byte order. Events are stamped with the time stamp counter
+ * (see phase_cycles() in phases.h), whose rate and value at a known wall clock time are
+ * in the header. Events recorded where only the descriptor is known, in libserver.c,
+ * have a connection id of 0; the decoder finds it from the accept before them on the
+ * same descriptor in the same ring.
+ *
+ *   recorder_open("/var/tmp/server.flight");
+ *   record(RECORD_ACCEPT, id, fd, 0);
+ *
+ * Build: add recorder.c to the sources of anything linking libserver.c
+ */
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "phases.h"     // phase_cycles()
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RECORDER_MAGIC 0x54474c46 // "FLGT"
+#define RECORDER_VERSION 1
+
+// rings in a file, one per thread that records, and the events of each, a power of two
+#define RECORDER_THREADS 8
+#define RECORDER_EVENTS 65536
+
+enum recorder_type
+{
+    RECORD_ACCEPT = 1,          // or taken over from elsewhere; arg: 0
+    RECORD_FIRST_BYTE,          // arg: bytes of the first receive
+    RECORD_ACK,                 // arg: bytes acknowledged
+    RECORD_EAGAIN,              // a send left data queued, a burst starts; arg: bytes queued
+    RECORD_DRAINED,             // what was queued is sent, the burst is over; arg: 0
+    RECORD_ERROR,               // arg: errno
+    RECORD_CLOSE,               // arg: bytes received, at most UINT32_MAX
+    RECORD_TYPES
+};
+
+struct recorder_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t threads;           // rings in the file
+    uint32_t events;            // events of each ring
+    int32_t pid;
+    uint64_t started;           // wall clock time of the start, in ns since the epoch
+    uint64_t started_tsc;       // the time stamp counter at the same time
+    double tsc_per_ns;
+    uint32_t rings;             // rings taken by a thread so far
+    uint32_t reserved[5];
+};
+
+struct recorder_ring
+{
+    uint64_t head;              // events ever recorded; the next one goes at head % events
+    int32_t tid;
+    uint32_t reserved;
+    char name[16];              // of the thread
+    uint64_t padding[4];
+};
+
+struct recorder_event
+{
+    uint64_t tsc;
+    uint32_t conn;              // connection id, as numbered by the server, 0 if unknown
+    int32_t fd;
+    uint32_t arg;
+    uint16_t type;
+    uint16_t reserved;
+};
+
+_Static_assert(sizeof(struct recorder_header) == 64, "the recorder header is 64 bytes");
+_Static_assert(sizeof(struct recorder_ring) == 64, "a ring header is 64 bytes");
+_Static_assert(sizeof(struct recorder_event) == 24, "recorder events are 24 bytes");
+
+#define RECORDER_RING_SIZE ( sizeof(struct recorder_ring) + RECORDER_EVENTS * sizeof(struct recorder_event) )
+#define RECORDER_FILE_SIZE ( sizeof(struct recorder_header) + RECORDER_THREADS * RECORDER_RING_SIZE )
+
+static inline struct recorder_ring *recorder_ring_at(void *file, int i)
+{
+    return (struct recorder_ring *) ( (char *) file + sizeof(struct recorder_header) + i * RECORDER_RING_SIZE );
+}
+
+static inline struct recorder_event *recorder_events(struct recorder_ring *ring)
+{
+    return (struct recorder_event *) ( ring + 1 );
+}
+
+// the mapped file, NULL unless recorder_open() succeeded in this process
+extern struct recorder_header *recorder_file;
+
+// the ring of the calling thread, NULL until it first records
+extern __thread struct recorder_ring *recorder_ring;
+
+// Creates the file and maps it, before the threads that record start. Returns -1 with
+// errno set.
+int recorder_open(const char *path);
+
+// Removes the file, at a clean exit when nothing in it is to be kept; the events still
+// go to the mapping.
+void recorder_discard(void);
+
+// the ring of the calling thread, taken if needed; NULL once all of them are taken
+struct recorder_ring *recorder_attach(void);
+
+// prints nothing unless the recorder was opened in this process
+void recorder_print_stats(FILE *out);
+
+static inline void record(enum recorder_type type, unsigned long conn, int fd, uint64_t arg)
+{
+    if ( __builtin_expect(NULL == recorder_file, 1) )
+        return;
+
+    struct recorder_ring *ring = ( NULL != recorder_ring ) ? recorder_ring : recorder_attach();
+    if ( NULL == ring )
+        return;
+
+    uint64_t head = ring->head;
+    struct recorder_event *e = &recorder_events(ring)[head & ( RECORDER_EVENTS - 1 )];
+    e->tsc = phase_cycles();
+    e->conn = (uint32_t) conn;
+    e->fd = fd;
+    e->arg = ( UINT32_MAX < arg ) ? UINT32_MAX : (uint32_t) arg;
+    e->type = (uint16_t) type;
+
+    // the event is complete before it is counted, as far as a reader of the file can tell
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RECORDER_H
@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A load generator inside the server. See selftest.h.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>     // pthread_sigmask()
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "poller.h"
+#include "profiler.h"
+#include "selftest.h"
+
+// max number of events returned by the backend at a time
+#define MAX_EVENTS 64
+
+// how long to wait for the last acks once the time is up
+#define SELFTEST_DRAIN_NS 1000000000ULL
+
+// the server's "Ack\n", sent with the terminating NUL of its string
+#define SELFTEST_ACK_LEN 5
+
+// What the acks sent so far acknowledge, published by the server before each one: their
+// number in the high bits, and the bytes they acknowledge, wrapping, in the low ones.
+#define ACKED_BYTES_BITS 40
+#define ACKED_BYTES_MASK ( ( (uint64_t) 1 << ACKED_BYTES_BITS ) - 1 )
+#define ACKED_COUNT_MASK ( ( (uint64_t) 1 << ( 64 - ACKED_BYTES_BITS ) ) - 1 )
+
+struct selftest_pair
+{
+    int fd;                 // the generator's end, -1 once closed by the server
+    int server_fd;
+    uint64_t sent_at;       // when the payload waiting for its ack was sent, 0 if none
+    size_t offset;          // of the payload, sent so far; the rest waits for POLLER_OUT
+    uint64_t sent;          // bytes sent in all
+    uint64_t acks;          // acks received in all
+    int ack_bytes;          // of the ack being received
+
+    uint64_t acked;         // see ACKED_BYTES_BITS
+};
+
+static struct selftest_pair *pairs = NULL;
+static int npairs = 0;
+
+// the pairs by the descriptor of the server's end, -1 for other descriptors
+static int *pair_of_fd = NULL;
+static int max_fd = -1;
+
+static const char *payload = NULL;
+static size_t payload_len = 0;
+static uint64_t duration_ns = 0;
+static void (*done_fn)(void *arg) = NULL;
+static void *done_arg = NULL;
+
+static pthread_t generator;
+
+// what the generator measured, read once it is done
+static unsigned long messages = 0;
+static unsigned long failures = 0;
+static uint64_t elapsed_ns = 0;
+static struct histogram round_trip;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int selftest_create(int n, int *fds)
+{
+    pairs = (struct selftest_pair *) calloc(n, sizeof(struct selftest_pair));
+    if ( NULL == pairs )
+        return -1;
+
+    for ( npairs = 0; npairs < n; npairs++ )
+    {
+        int sv[2];
+        if ( -1 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) )
+        {
+            int err = errno;
+            while ( 0 < npairs-- )
+            {
+                close(fds[npairs]);
+                close(pairs[npairs].fd);
+            }
+            free(pairs);
+            pairs = NULL;
+            errno = err;
+            return -1;
+        }
+
+        fds[npairs] = sv[0];
+        pairs[npairs].fd = sv[1];
+        pairs[npairs].server_fd = sv[0];
+        if ( max_fd < sv[0] )
+            max_fd = sv[0];
+    }
+
+    pair_of_fd = (int *) malloc(( max_fd + 1 ) * sizeof(int));
+    if ( NULL == pair_of_fd )
+        return -1;
+    memset(pair_of_fd, -1, ( max_fd + 1 ) * sizeof(int));
+    for ( int i = 0; i < npairs; i++ )
+        pair_of_fd[fds[i]] = i;
+
+    return 0;
+}
+
+void selftest_acking(int fd, unsigned long bytes)
+{
+    if ( fd < 0 || max_fd < fd || -1 == pair_of_fd[fd] )
+        return;
+
+    // by whichever thread acks the connection, one at a time
+    struct selftest_pair *p = &pairs[pair_of_fd[fd]];
+    uint64_t acked = __atomic_load_n(&p->acked, __ATOMIC_RELAXED);
+    uint64_t count = ( ( acked >> ACKED_BYTES_BITS ) + 1 ) & ACKED_COUNT_MASK;
+    __atomic_store_n(&p->acked, ( count << ACKED_BYTES_BITS ) | ( ( acked + bytes ) & ACKED_BYTES_MASK ),
+                     __ATOMIC_RELEASE);
+}
+
+// Whether the ack just received completes the payload in flight. The server only acks
+// what it received since its last ack, so no ack follows one that acknowledged all that
+// was sent: if another one was sent, the one received did not.
+static int payload_acked(struct selftest_pair *p)
+{
+    uint64_t acked = __atomic_load_n(&p->acked, __ATOMIC_ACQUIRE);
+
+    return ( acked >> ACKED_BYTES_BITS ) == ( p->acks & ACKED_COUNT_MASK )
+           && ( acked & ACKED_BYTES_MASK ) == ( p->sent & ACKED_BYTES_MASK );
+}
+
+// Sends what is left of the payload. What the socket cannot take yet is sent once the
+// poller reports it writable, rather than spun on, which would take the CPU from the
+// server being measured.
+static void send_rest(struct poller *poller, struct selftest_pair *p, int i)
+{
+    while ( p->offset < payload_len )
+    {
+        ssize_t n = send(p->fd, payload + p->offset, payload_len - p->offset, MSG_NOSIGNAL);
+        if ( -1 == n )
+        {
+            if ( EINTR == errno )
+                continue;
+
+            if ( EAGAIN == errno )
+            {
+                union poller_data pdata = { .u64 = (uint64_t) i };
+                if ( -1 != poller_mod(poller, p->fd, POLLER_IN | POLLER_OUT, pdata) )
+                    return;
+            }
+
+            failures++;
+            p->sent_at = 0;
+            p->offset = payload_len;
+            return;
+        }
+
+        p->offset += n;
+        p->sent += n;
+    }
+}
+
+static void send_payload(struct poller *poller, struct selftest_pair *p, int i)
+{
+    p->sent_at = now_ns();
+    p->offset = 0;
+    send_rest(poller, p, i);
+}
+
+static void *generate(void *arg)
+{
+    struct poller *poller = (struct poller *) arg;
+    struct poller_event events[MAX_EVENTS];
+    profiler_thread("selftest");
+
+    uint64_t started = now_ns();
+    uint64_t end = started + duration_ns;
+    int outstanding = 0;
+
+    for ( int i = 0; i < npairs; i++ )
+    {
+        send_payload(poller, &pairs[i], i);
+        if ( 0 != pairs[i].sent_at )
+            outstanding++;
+    }
+
+    while ( 0 < outstanding && now_ns() < end + SELFTEST_DRAIN_NS )
+    {
+        int nfds = poller_wait(poller, events, MAX_EVENTS, 100);
+        if ( -1 == nfds )
+        {
+            if ( EINTR == errno )
+                continue;
+            break;
+        }
+
+        for ( int i = 0; i < nfds; i++ )
+        {
+            int index = (int) events[i].data.u64;
+            struct selftest_pair *p = &pairs[index];
+            if ( -1 == p->fd )
+                continue;
+
+            if ( ( events[i].events & POLLER_OUT ) && 0 != p->sent_at && p->offset < payload_len )
+            {
+                union poller_data pdata = { .u64 = (uint64_t) index };
+                poller_mod(poller, p->fd, POLLER_IN, pdata);
+                send_rest(poller, p, index);
+                if ( 0 == p->sent_at )
+                    outstanding--;
+            }
+
+            char ack[64];
+            ssize_t received = recv(p->fd, ack, sizeof(ack), 0);
+
+            if ( 0 < received )
+            {
+                // A payload read by the server in more than one part draws an ack for
+                // each, and only the one acknowledging all of it completes it.
+                int completed = 0;
+                p->ack_bytes += received;
+                for ( ; SELFTEST_ACK_LEN <= p->ack_bytes; p->ack_bytes -= SELFTEST_ACK_LEN )
+                {
+                    p->acks++;
+                    if ( payload_acked(p) )
+                        completed = 1;
+                }
+
+                if ( !completed || 0 == p->sent_at || p->offset < payload_len )
+                    continue;
+
+                uint64_t now = now_ns();
+                hist_record(&round_trip, now - p->sent_at);
+                messages++;
+                p->sent_at = 0;
+                outstanding--;
+
+                if ( now < end )
+                {
+                    send_payload(poller, p, index);
+                    if ( 0 != p->sent_at )
+                        outstanding++;
+                }
+            }
+            else if ( 0 == received || ( EAGAIN != errno && EINTR != errno ) )
+            {
+                // closed by the server
+                if ( 0 != p->sent_at )
+                    outstanding--;
+                failures++;
+                poller_del(poller, p->fd);
+                close(p->fd);
+                p->fd = -1;
+            }
+        }
+    }
+
+    elapsed_ns = now_ns() - started;
+    poller_destroy(poller);
+
+    done_fn(done_arg);
+    return NULL;
+}
+
+int selftest_start(const char *data, size_t len, double seconds, void (*done)(void *arg), void *arg)
+{
+    payload = data;
+    payload_len = len;
+    duration_ns = (uint64_t) ( seconds * 1e9 );
+    done_fn = done;
+    done_arg = arg;
+
+    struct poller *poller = poller_create(POLLER_EPOLL);
+    if ( NULL == poller )
+        return -1;
+
+    for ( int i = 0; i < npairs; i++ )
+    {
+        union poller_data pdata = { .u64 = (uint64_t) i };
+        if ( -1 == poller_add(poller, pairs[i].fd, POLLER_IN, pdata) )
+        {
+            int err = errno;
+            poller_destroy(poller);
+            errno = err;
+            return -1;
+        }
+    }
+
+    // signals are left to the event loop thread, the generator inherits the mask
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+
+    int err = pthread_create(&generator, NULL, generate, poller);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if ( 0 != err )
+    {
+        poller_destroy(poller);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+void selftest_print_stats(FILE *out)
+{
+    double elapsed = elapsed_ns / 1e9;
+
+    fprintf(out, "selftest: pairs:%d, payload:%zu, messages:%lu, failures:%lu, elapsed:%.3fs, "
+                 "throughput:%.2fMB/s, messages/s:%.0f\n",
+            npairs, payload_len, messages, failures, elapsed,
+            ( 0 < elapsed ) ? messages * payload_len / elapsed / 1e6 : 0.0,
+            ( 0 < elapsed ) ? messages / elapsed : 0.0);
+    hist_print(out, "round trip", &round_trip, 1000.0, "us");
+}
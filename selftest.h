@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A load generator inside the server, to profile the event loop without the network in
+ * the way: each connection is one end of a socketpair, and a thread drives the other
+ * ends as the client does, sending a payload and waiting for its ack before sending the
+ * next one. The whole path, from the receive to the ack, then runs in one process.
+ */
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Creates npairs non-blocking socketpairs and returns the ends the server is to serve in
+// fds. Returns -1 with errno set on failure.
+int selftest_create(int npairs, int *fds);
+
+// Called by whatever acks the server's end fd of a pair, before it sends an ack that
+// acknowledges the given bytes, so that the generator can tell which ack completes each
+// payload. Other descriptors are ignored.
+void selftest_acking(int fd, unsigned long bytes);
+
+// Starts the thread that sends the payload over the other ends for the given time, and
+// calls done(arg) once it stopped and the last acks came back or timed out.
+int selftest_start(const char *payload, size_t len, double seconds, void (*done)(void *arg), void *arg);
+
+void selftest_print_stats(FILE *out);
+
+#endif // SELFTEST_H
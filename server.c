@@ -2,25 +2,166 @@
  * Copyright (c) Seungyeob Choi
  *
  * A TCP server that manages client connections and handles all read and write operations
- * in a single thread using epoll.
+ * in a single thread using epoll. The event loop itself is in libserver.c, which can be
+ * embedded in other programs; this file is what the server does with the connections.
+ *
+ * With --workers N the server runs in prefork mode: the master process creates the
+ * listener and forks N worker processes, each running its own event loop on the shared
+ * listener. A worker that dies only takes its own connections down; the master restarts
+ * it and aggregates the workers' counters through shared memory.
+ *
+ * With --control PATH the server accepts commands on a UNIX socket ("stats", "upgrade").
+ * A new server started with --inherit PATH takes over the running one: it receives the
+ * listening socket, and in single-process mode its idle connections along with their
+ * state, over SCM_RIGHTS. The old server then drains its remaining connections and exits,
+ * so that a deploy does not make every client reconnect at once. The handoff carries its
+ * version and the size of a connection's state, so that two different builds can still
+ * hand over to each other.
+ *
+ * With --offload N the event loop only receives data, and the handler (the sanitization
+ * of the received bytes) runs on a pool of N worker threads; see offload.h. With --steal
+ * the workers steal connections from each other instead of having a fixed share of them.
+ *
+ * With --staged R,P,W the event loop only accepts, and the connections go through a
+ * pipeline of read, process and write stages with R, P and W threads; see staged.h.
+ * "stage NAME N" on the control socket changes the number of threads of a stage.
+ *
+ * With --batch the buffers received from all the connections that were ready in one
+ * epoll_wait() iteration are gathered, processed together, then written out in order.
+ *
+ * With --backend NAME the event loop waits with poll or io_uring instead of epoll; see
+ * poller.h. The stats report the system calls made per ack, whichever the backend.
+ *
+ * With --c1m the server is set up for a million mostly idle connections: it raises its
+ * descriptor limit as far as it is allowed to, accepts with a full backlog, and caps the
+ * socket buffers of the connections so that an idle one costs the kernel little. The
+ * stats then report the resident memory per open connection; see client --c1m.
+ *
+ * With --capture PATH the server records when each connection opened, received data and
+ * closed, with the sizes and hashes of the data, or with --capture-payload the data
+ * itself, for client --replay to reproduce the same load; see capture.h.
+ *
+ * With --selftest N the server does not listen: it serves N socketpairs whose other ends
+ * a thread of its own drives for --duration seconds, sending --payload and waiting for
+ * the ack, so that the whole path can be profiled in one process without the network.
+ * It then reports the throughput, and the time the event loop took to handle the events
+ * of each wakeup; see selftest.h.
+ *
+ * The accept, receive, handler, ack and close paths carry USDT probes for bpftrace and
+ * perf to attach to; see probes.h and trace/.
+ *
+ * With --profile the server counts the cycles each thread spends waiting, receiving,
+ * in the handler, writing out what it received and sending acks, and with --counters
+ * the instructions and cache misses as well, and prints them with the stats; see
+ * phases.h.
+ *
+ * With --watchdog MS a thread reports each iteration of the event loop that takes longer
+ * than MS, with the stack of the loop, the phase it is in and the connection it serves,
+ * and the stats show how long every iteration took; see watchdog.h.
+ *
+ * A flight recorder is always on, unless --no-recorder: the event loop, and the stages
+ * of --staged, record when each connection was accepted, first received data, was
+ * acked, had sends queued and drained, hit an error and closed, in binary rings in the
+ * file PATH.PID of each process, which is still there after a crash for trace/flight to
+ * decode into a timeline and per-connection waterfalls; see recorder.h. PATH is
+ * /tmp/server.flight unless given with --recorder, and that default file is removed
+ * when the process exits cleanly, so that every run does not leave one behind.
+ *
+ * With --tcp-info MS the event loop samples getsockopt(TCP_INFO) of a bounded number of
+ * its connections every MS, and of each one as it closes, and the stats show their
+ * round-trip times, delivery rates, retransmissions and the time they were held back by
+ * the peer's receive window or their send buffer; see tcpinfo.h.
+ *
+ * With --sample PATH a profiler samples the stacks of the server's threads --sample-rate
+ * times per second of CPU time, where perf cannot be run, off ITIMER_PROF or with
+ * --sample-perf a perf event per thread, and writes them as folded stacks for
+ * flamegraph.pl to PATH on SIGUSR1 and at exit, or to the control socket on "flame"; see
+ * profiler.h. The stacks go through the server's own functions only when it is built
+ * with frame pointers.
+ *
+ * With --tuning NAME the listener, and so the connections it accepts, get a profile of
+ * TCP options, "latency", "throughput" or "bulk-wan": buffer sizes, TCP_NODELAY or
+ * TCP_CORK, TCP_NOTSENT_LOWAT, TCP_QUICKACK and the congestion control; see tuning.h.
+ *
+ * Build: cc -O2 -fno-omit-frame-pointer -pthread -rdynamic -o server server.c libserver.c poller.c offload.c staged.c selftest.c phases.c watchdog.c recorder.c profiler.c
  */
+#define _GNU_SOURCE     // accept4(), ppoll()
 #include <errno.h>
-#include <fcntl.h>
+#include <fcntl.h>      // fcntl()
+#include <getopt.h>     // getopt_long()
+#include <limits.h>     // INT_MAX
 #include <netinet/in.h> // struct sockaddr_in
 #include <signal.h>     // sigaction()
 #include <stdio.h>
+#include <poll.h>       // ppoll()
+#include <stdint.h>
 #include <stdlib.h>     // exit()
-#include <sys/epoll.h>
-#include <unistd.h>     // read(), write(), close()
+#include <string.h>     // strncmp()
+#include <sys/ioctl.h>  // FIONREAD
+#include <sys/mman.h>   // mmap()
+#include <sys/resource.h> // getrlimit(), setrlimit()
+#include <sys/socket.h>
+#include <sys/timerfd.h> // timerfd_create()
+#include <sys/un.h>     // struct sockaddr_un
+#include <sys/wait.h>   // waitpid()
+#include <time.h>
+#include <unistd.h>     // read(), write(), close(), fork()
+
+#include "capture.h"
+#include "histogram.h"
+#include "libserver.h"
+#include "offload.h"
+#include "phases.h"
+#include "poller.h"
+#include "probes.h"
+#include "profiler.h"
+#include "recorder.h"
+#include "selftest.h"
+#include "staged.h"
+#include "tcpinfo.h"
+#include "tuning.h"
+#include "watchdog.h"
 
 #define BUFLEN 512
 #define PORT 8080
 
-// max number of events that can be returned by epoll at a time
-#define MAX_EVENTS 20
+// capacity of the batch of buffers processed together with --batch
+#define BATCH_BUFFERS 256
+
+// capacity of each offload worker's queue
+#define OFFLOAD_QUEUE_DEPTH 256
 
 void signal_handler(int signo);
 
+// the last signal caught, inspected by the event loop and the master after EINTR
+static volatile sig_atomic_t last_signal = 0;
+
+// max number of connections handed over to a successor in one message
+#define HANDOFF_BATCH 64
+
+#define HANDOFF_MAGIC 0x48414e44 // "HAND"
+#define HANDOFF_VERSION 1
+
+// flags of a handoff message
+#define HANDOFF_LISTENER 0x1     // the first descriptor is the listening socket
+#define HANDOFF_LAST     0x2     // no more messages follow
+
+// the largest connection record a successor accepts
+#define HANDOFF_MAX_RECORD 256
+
+// Each handoff message starts with this header, followed by nconns connection records
+// of record_size bytes each. The version changes when the meaning of a field changes.
+// Appending fields to struct connection does not change it: a successor takes the part
+// of each record it knows about and zeroes the rest.
+struct handoff_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t nconns;
+    uint32_t record_size;
+};
+
 // The backlog argument defines the maximum length to which the
 // queue of pending connections for sockfd may grow. If a
 // connection request arrives when the queue is full, the client may
@@ -29,6 +170,16 @@ void signal_handler(int signo);
 // ignored so that a later reattempt at connection succeeds.
 #define MAX_BACKLOG 3
 
+// largest payload of --selftest, which must fit in the socket buffer
+#define SELFTEST_MAX_PAYLOAD 65536
+
+// stdio buffer of the capture file, so that the event loop rarely waits on the disk
+#define CAPTURE_BUFFER ( 1 << 20 )
+
+// With --c1m, the send and receive buffers of each connection, which the kernel doubles.
+// Fixing them also turns off their autotuning, which would grow them past this.
+#define C1M_SOCKET_BUFFER 4096
+
 void signal_handler(int signo)
 {
     //# Signal      Default     Comment                              POSIX
@@ -81,421 +232,2169 @@ void signal_handler(int signo)
             fprintf(stderr, "signal received: %d\n", signo);
             break;
     }
+
+    last_signal = signo;
+}
+
+// per-process counters
+// In prefork mode, each worker owns one slot in a shared memory array and is its only
+// writer, and the master reads all slots to aggregate them.
+struct worker_stats
+{
+    pid_t pid;
+    time_t started;
+    unsigned long restarts;
+    unsigned long connections;
+    unsigned long bytes_in;
+    unsigned long acks;
+    unsigned long batches;
+    unsigned long batched;      // buffers processed in batches
+    unsigned long lines;
+    uint32_t checksum;          // sum of the processed bytes
+    unsigned long syscalls;     // made by the event loop
+    unsigned long open;         // connections currently open
+    unsigned long rejected;     // connections shed for lack of descriptors
+    struct tcp_health tcp;      // with --tcp-info
+};
+
+// handler offload pool, created by the event loop if offload_threads is set
+static int offload_threads = 0;
+static enum offload_policy offload_policy = OFFLOAD_STATIC;
+static struct offload_pool *offload = NULL;
+
+// I/O backend of the event loop
+static int backend = POLLER_EPOLL;
+
+// set up for a million connections, see --c1m
+static int c1m = 0;
+
+// the self-test load, see --selftest
+static int selftest_pairs = 0;
+static char *selftest_payload = NULL;
+static size_t selftest_len = BUFLEN;
+static double selftest_seconds = 5;
+
+// time taken to handle the events of each wakeup, measured with --selftest
+static struct histogram wakeup_latency;
+static uint64_t woken_at = 0;
+
+// the threshold of --watchdog, 0 without it
+static int watchdog_ms = 0;
+
+// the period of --tcp-info, 0 without it, and the descriptor sampled last
+static int tcpinfo_ms = 0;
+static int tcpinfo_cursor = -1;
+
+// the profile of --tuning, NULL without it
+static const struct tuning *tuning = NULL;
+
+// where --sample writes the folded stacks, and how often it samples
+static const char *sample_path = NULL;
+static int sample_rate = PROFILER_HZ;
+static int sample_per_thread = 0;
+
+// the flight recorder's file is this with the pid of the process appended, NULL with
+// --no-recorder; one named with --recorder is kept after a clean exit
+#define RECORDER_PATH "/tmp/server.flight"
+static const char *recorder_path = RECORDER_PATH;
+static int recorder_named = 0;
+
+// the traffic capture, see --capture
+static FILE *capture = NULL;
+static int capture_payload = 0;
+static uint64_t capture_started = 0;
+
+// staged pipeline, started by the event loop if staged_threads[STAGE_READ] is set
+static int staged_threads[STAGE_COUNT] = { 0 };
+
+// number of extra hashing passes over each received buffer, to emulate a heavier
+// handler (parsing, compression, storage...) in benchmarks
+static int handler_work = 0;
+
+// Every counter has a single writer, so a relaxed load/store pair is enough
+// and avoids a locked instruction on the hot path.
+#define STAT_ADD(stats, field, n) \
+    __atomic_store_n(&(stats)->field, (stats)->field + (n), __ATOMIC_RELAXED)
+
+// the resident set size of a process in KB, 0 if it is gone
+static unsigned long process_rss(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+
+    FILE *fp = fopen(path, "r");
+    if ( NULL == fp )
+        return 0;
+
+    unsigned long rss = 0;
+    char line[128];
+    while ( NULL != fgets(line, sizeof(line), fp) )
+    {
+        if ( 1 == sscanf(line, "VmRSS: %lu", &rss) )
+            break;
+    }
+
+    fclose(fp);
+    return rss;
 }
 
-// should be called when the connection is closed by the peer
-static int handle_close(int epollfd, int connfd)
+static void print_stats(FILE *out, struct worker_stats *stats, int nworkers)
 {
-    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_DEL, connfd, NULL) )
+    unsigned long connections = 0, bytes_in = 0, acks = 0, restarts = 0;
+    unsigned long batches = 0, batched = 0, lines = 0, syscalls = 0;
+    uint32_t checksum = 0;
+
+    for ( int i = 0; i < nworkers; i++ )
     {
-        switch ( errno )
+        unsigned long c = __atomic_load_n(&stats[i].connections, __ATOMIC_RELAXED);
+        unsigned long b = __atomic_load_n(&stats[i].bytes_in, __ATOMIC_RELAXED);
+        unsigned long a = __atomic_load_n(&stats[i].acks, __ATOMIC_RELAXED);
+
+        if ( 1 < nworkers )
         {
-            case EBADF:
-            case EEXIST:
-            case EINVAL:
-            case ENOENT:
-            case ENOMEM:
-            case ENOSPC:
-            case EPERM:
-            default:
-                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
-                exit(1);
+            fprintf(out, "worker %d (pid %d): connections:%lu, bytes_in:%lu, acks:%lu, restarts:%lu\n",
+                    i, (int) stats[i].pid, c, b, a, stats[i].restarts);
         }
+
+        connections += c;
+        bytes_in += b;
+        acks += a;
+        restarts += stats[i].restarts;
+        batches += __atomic_load_n(&stats[i].batches, __ATOMIC_RELAXED);
+        batched += __atomic_load_n(&stats[i].batched, __ATOMIC_RELAXED);
+        lines += __atomic_load_n(&stats[i].lines, __ATOMIC_RELAXED);
+        checksum += __atomic_load_n(&stats[i].checksum, __ATOMIC_RELAXED);
+        syscalls += __atomic_load_n(&stats[i].syscalls, __ATOMIC_RELAXED);
+    }
+
+    fprintf(out, "total: connections:%lu, bytes_in:%lu, acks:%lu, restarts:%lu\n",
+            connections, bytes_in, acks, restarts);
+
+    fprintf(out, "backend %s: syscalls:%lu, syscalls/ack:%.2f\n",
+            poller_name(backend), syscalls, ( 0 < acks ) ? (double) syscalls / acks : 0.0);
+
+    if ( 0 < batches )
+    {
+        fprintf(out, "batches:%lu, buffers/batch:%.1f, lines:%lu, checksum:%08x\n",
+                batches, (double) batched / batches, lines, checksum);
     }
 
-    if ( -1 == close(connfd) )
+    if ( c1m )
     {
-        switch ( errno )
+        unsigned long rss = 0, open = 0, rejected = 0;
+        for ( int i = 0; i < nworkers; i++ )
         {
-            case EBADF:
-            case EINTR:
-            case EIO:
-            default:
-                fprintf(stderr, "socket close error (%d)\n", errno);
-                exit(1);
+            rss += process_rss(stats[i].pid);
+            open += __atomic_load_n(&stats[i].open, __ATOMIC_RELAXED);
+            rejected += __atomic_load_n(&stats[i].rejected, __ATOMIC_RELAXED);
         }
+
+        fprintf(out, "memory: rss:%luKB, open:%lu, rss/connection:%.0fB, rejected:%lu\n",
+                rss, open, ( 0 < open ) ? rss * 1024.0 / open : 0.0, rejected);
+    }
+
+    if ( NULL != offload )
+        offload_print_stats(offload, out);
+
+    if ( 0 < staged_threads[STAGE_READ] )
+        staged_print_stats(out);
+
+    if ( 0 < tcpinfo_ms )
+    {
+        static struct tcp_health tcp;
+        memset(&tcp, 0, sizeof(tcp));
+        for ( int i = 0; i < nworkers; i++ )
+            tcp_health_merge(&tcp, &stats[i].tcp);
+        tcp_health_print(out, &tcp);
     }
 
-    return 0;
+    phases_print(out);
+    watchdog_print_stats(out);
+    recorder_print_stats(out);
+    profiler_print_stats(out);
 }
 
-int main(void)
+// writes the folded stacks of --sample, over those written before
+static void write_samples(void)
 {
-    signal(SIGINT,  signal_handler);
-    signal(SIGTERM, signal_handler);
-    signal(SIGUSR1, signal_handler);
-    signal(SIGUSR2, signal_handler);
+    if ( NULL == sample_path )
+        return;
 
-    // create a listener socket
+    FILE *fp = fopen(sample_path, "w");
+    if ( NULL == fp || -1 == profiler_write(fp) )
+        fprintf(stderr, "sample write error (%d)\n", errno);
+    if ( NULL != fp )
+        fclose(fp);
+}
 
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if ( -1 == listenfd )
+// replaces control characters other than newline so that the output stays readable
+static void sanitize(char *buffer, size_t len)
+{
+    char *p = buffer;
+    for ( size_t i = 0; i < len; i++ )
     {
-        switch ( errno )
-        {
-            case EACCES:
-            case EAFNOSUPPORT:
-            case EINVAL:
-            case ENFILE:
-            case ENOBUFS:
-            case ENOMEM:
-            case EPROTONOSUPPORT:
-            default:
-                fprintf(stderr, "socket creation error (%d)\n", errno);
-                exit(1);
-        }
+        if ( *p < ' ' && *p != '\n' ) *p = '.';
+        p++;
     }
+}
+
+// the handler
+static void process(char *buffer, size_t len)
+{
+    struct phase_mark mark;
+    phase_begin(&mark, PHASE_SANITIZE);
+
+    PROBE0(server, sanitize_start);
+    sanitize(buffer, len);
+    PROBE2(server, sanitize_end, 1, len);
 
-    int reuse = 1;
-    if ( -1 == setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) )
+    uint32_t hash = 2166136261u;
+    for ( int round = 0; round < handler_work; round++ )
     {
-        switch ( errno )
+        for ( size_t i = 0; i < len; i++ )
+            hash = ( hash ^ (unsigned char) buffer[i] ) * 16777619u;
+    }
+
+    // keep the compiler from dropping the work
+    __asm__ volatile ( "" : : "r" ( hash ) );
+
+    phase_end(&mark);
+}
+
+// Buffers received during one event loop iteration, kept without copying until they
+// are processed together.
+struct batch
+{
+    int count;
+    struct server_buffer *buffers[BATCH_BUFFERS];
+};
+
+// allocated if --batch is given
+static struct batch *batch = NULL;
+
+// sanitizes a block of bytes, and sums them and counts the lines for the stats
+static inline void sanitize_block(signed char *data, size_t len, uint32_t *sum, unsigned int *lines)
+{
+    for ( size_t i = 0; i < len; i++ )
+    {
+        signed char c = data[i];
+        c = ( c < ' ' && c != '\n' ) ? '.' : c;
+        data[i] = c;
+        *sum += (unsigned char) c;
+        *lines += ( c == '\n' );
+    }
+}
+
+// The handler over a whole batch. The loop has no branch the compiler cannot turn into
+// a select, and runs over fixed-size blocks, so that it is vectorized even at -O2.
+static void process_batch(struct batch *b, struct worker_stats *stats)
+{
+    uint32_t sum = 0;
+    unsigned int lines = 0;
+    uint32_t hash = 2166136261u;
+    size_t bytes = 0;
+
+    struct phase_mark mark;
+    phase_begin(&mark, PHASE_SANITIZE);
+    PROBE0(server, sanitize_start);
+
+    for ( int n = 0; n < b->count; n++ )
+    {
+        // locals, as stores through a char pointer could otherwise alias them
+        signed char *data = (signed char *) b->buffers[n]->data;
+        size_t len = b->buffers[n]->len;
+        bytes += len;
+
+        size_t i = 0;
+        for ( ; i + 64 <= len; i += 64 )
+            sanitize_block(data + i, 64, &sum, &lines);
+        sanitize_block(data + i, len - i, &sum, &lines);
+
+        for ( int round = 0; round < handler_work; round++ )
         {
-            case EBADF:
-            case EDOM:
-            case EINVAL:
-            case EISCONN:
-            case ENOPROTOOPT:
-            case ENOTSOCK:
-            case ENOMEM:
-            case ENOBUFS:
-            default:
-                fprintf(stderr, "socket setsockopt error (%d)\n", errno);
-                exit(1);
+            for ( i = 0; i < len; i++ )
+                hash = ( hash ^ (unsigned char) data[i] ) * 16777619u;
         }
     }
+    __asm__ volatile ( "" : : "r" ( hash ) );
+
+    PROBE2(server, sanitize_end, b->count, bytes);
+    phase_end(&mark);
+
+    STAT_ADD(stats, batches, 1);
+    STAT_ADD(stats, batched, b->count);
+    STAT_ADD(stats, lines, lines);
+    STAT_ADD(stats, checksum, sum);
+}
+
+// processes the batch and writes each buffer out, in the order they were received
+static void flush_batch(struct batch *b, struct worker_stats *stats)
+{
+    if ( 0 == b->count )
+        return;
+
+    process_batch(b, stats);
+
+    struct phase_mark mark;
+    phase_begin(&mark, PHASE_OUTPUT);
+    for ( int i = 0; i < b->count; i++ )
+    {
+        fwrite(b->buffers[i]->data, 1, b->buffers[i]->len, stdout);
+        server_buffer_release(b->buffers[i]);
+    }
+    fflush(stdout);
+    phase_end(&mark);
+
+    b->count = 0;
+}
+
+// runs on an offload worker
+static void process_job(struct offload_job *job)
+{
+    process(job->data, job->len);
+}
+
+// runs on the event loop once a job has been handled, in the order of its connection
+static void output_job(struct offload_job *job, void *arg)
+{
+    (void) arg;
+
+    struct phase_mark mark;
+    phase_begin(&mark, PHASE_OUTPUT);
+    printf("%.*s", (int) job->len, job->data);
+    fflush(stdout);
+    phase_end(&mark);
+
+    server_buffer_release((struct server_buffer *) job->buffer);
+}
+
+// runs on the write stage, in the order of the connection
+static void output_staged(int fd, char *buffer, size_t len)
+{
+    (void) fd;
 
-    // bind
+    struct phase_mark mark;
+    phase_begin(&mark, PHASE_OUTPUT);
+    printf("%.*s", (int) len, buffer);
+    fflush(stdout);
+    phase_end(&mark);
+}
 
-    struct sockaddr_in servaddr;
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(PORT);
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    if ( -1 == bind(listenfd, (struct sockaddr*) &servaddr, sizeof(servaddr)) )
+static void open_capture(const char *path)
+{
+    capture = fopen(path, "wb");
+    if ( NULL == capture )
     {
-        switch (errno )
-        {
-            case EADDRINUSE:
-                fprintf(stderr, "The given address is already in use.\n");
-                exit(1);
+        fprintf(stderr, "capture open error (%d)\n", errno);
+        exit(1);
+    }
+    setvbuf(capture, NULL, _IOFBF, CAPTURE_BUFFER);
 
-            case EACCES:
-            case EBADF:
-            case EINVAL:
-            case ENOTSOCK:
-            default:
-                fprintf(stderr, "socket bind error (%d)\n", errno);
-                exit(1);
-        }
+    struct capture_header header = { CAPTURE_MAGIC, CAPTURE_VERSION, capture_payload ? CAPTURE_PAYLOAD : 0,
+                                     clock_ns(CLOCK_REALTIME) };
+    capture_started = clock_ns(CLOCK_MONOTONIC);
+
+    if ( 1 != fwrite(&header, sizeof(header), 1, capture) )
+    {
+        fprintf(stderr, "capture write error (%d)\n", errno);
+        exit(1);
     }
+}
+
+// records an event of a connection; a capture that cannot be written is given up on,
+// rather than the server
+static void capture_event(int type, unsigned long conn, const char *data, size_t len)
+{
+    if ( NULL == capture )
+        return;
 
-    // listen
+    struct capture_record record = { clock_ns(CLOCK_MONOTONIC) - capture_started, (uint32_t) conn,
+                                     (uint32_t) len, 0, (uint16_t) type, 0 };
+    if ( CAPTURE_DATA == type )
+        record.hash = capture_hash(data, len);
 
-    if ( -1 == listen(listenfd, MAX_BACKLOG) )
+    if ( 1 != fwrite(&record, sizeof(record), 1, capture)
+         || ( CAPTURE_DATA == type && capture_payload && 1 != fwrite(data, len, 1, capture) ) )
     {
-        switch ( errno )
-        {
-            case EADDRINUSE:
-            case EBADF:
-            case ENOTSOCK:
-            case EOPNOTSUPP:
-            default:
-                fprintf(stderr, "socket listen error (%d)\n", errno);
-                exit(1);
-        }
+        fprintf(stderr, "capture write error (%d), capture stopped\n", errno);
+        fclose(capture);
+        capture = NULL;
+    }
+}
+
+// per-connection state, indexed by file descriptor
+// This is what gets serialized when a connection is handed over to a successor.
+struct connection
+{
+    unsigned long id;       // 0 if the descriptor is not an open connection
+    time_t accepted;
+    unsigned long bytes_in;
+    unsigned long unacked;  // bytes received since the last ack
+};
+
+static struct connection *connections = NULL;
+static int max_connections = 0;
+static int open_connections = 0;
+static int highest_fd = -1;
+static unsigned long next_connection_id = 1;
+
+// set once the server stopped accepting and is waiting for its connections to close
+static int draining = 0;
+
+// the event loop of this process
+static struct server *loop = NULL;
+
+// connections received from the predecessor, to be registered by the event loop
+static int *inherited_fds = NULL;
+static int inherited_cnt = 0;
+
+// The table is sized to the descriptor limit up front. It is an anonymous mapping,
+// so only the pages of descriptors actually in use get backed by memory.
+static void init_connection_table(void)
+{
+    struct rlimit rl;
+    if ( -1 == getrlimit(RLIMIT_NOFILE, &rl) )
+    {
+        fprintf(stderr, "getrlimit error (%d)\n", errno);
+        exit(1);
     }
 
-    // epoll
+    max_connections = ( RLIM_INFINITY == rl.rlim_cur || 1048576 < rl.rlim_cur ) ? 1048576 : (int) rl.rlim_cur;
 
-    int epollfd = epoll_create1(0);
-    if ( -1 == epollfd )
+    connections = mmap(NULL, max_connections * sizeof(struct connection),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( MAP_FAILED == connections )
     {
         switch ( errno )
         {
+            case EAGAIN:
             case EINVAL:
-            case EMFILE:
             case ENFILE:
             case ENOMEM:
             default:
-                fprintf(stderr, "epoll create1 error (%d)\n", errno);
+                fprintf(stderr, "mmap error (%d)\n", errno);
                 exit(1);
         }
     }
+}
+
+static void open_connection(int connfd, unsigned long id, time_t accepted, unsigned long bytes_in)
+{
+    if ( max_connections <= connfd )
+    {
+        fprintf(stderr, "connection table overflow (%d)\n", connfd);
+        exit(1);
+    }
+
+    connections[connfd].id = id;
+    connections[connfd].accepted = accepted;
+    connections[connfd].bytes_in = bytes_in;
+    connections[connfd].unacked = 0;
+    record(RECORD_ACCEPT, id, connfd, 0);
+
+    if ( next_connection_id <= id )
+        next_connection_id = id + 1;
+
+    if ( highest_fd < connfd )
+        highest_fd = connfd;
+
+    open_connections++;
+}
+
+// removes a connection from the table once it is closed or handed over
+static void forget_connection(int connfd)
+{
+    if ( connfd < max_connections && 0 != connections[connfd].id )
+    {
+        capture_event(CAPTURE_CLOSE, connections[connfd].id, NULL, 0);
+        connections[connfd].id = 0;
+        open_connections--;
+    }
+}
+
+// closes a connection that has been handed over, without telling the peer
+static void hand_over(int connfd)
+{
+    server_detach(loop, connfd);
+    close(connfd);
+    forget_connection(connfd);
+}
+
+// sends one handoff message: a header, the state of nconns connections and their descriptors
+static void send_handoff(int sockfd, unsigned int flags, int *fds, int nfds, struct connection *conns, int nconns)
+{
+    struct handoff_header header =
+    {
+        HANDOFF_MAGIC, HANDOFF_VERSION, (uint16_t) flags, (uint32_t) nconns, sizeof(struct connection)
+    };
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = conns;
+    iov[1].iov_len = nconns * sizeof(struct connection);
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * ( HANDOFF_BATCH + 1 ))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg = { 0 };
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ( 0 < nconns ) ? 2 : 1;
 
-    // register listener socket
+    if ( 0 < nfds )
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = listenfd;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
 
-    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev) )
+    if ( -1 == sendmsg(sockfd, &msg, MSG_NOSIGNAL) )
     {
         switch ( errno )
         {
+            case EAGAIN:
             case EBADF:
-            case EEXIST:
+            case ECONNRESET:
+            case EINTR:
             case EINVAL:
-            case ENOENT:
+            case EMSGSIZE:
+            case ENOBUFS:
             case ENOMEM:
-            case ENOSPC:
-            case EPERM:
+            case ENOTCONN:
+            case EPIPE:
             default:
-                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+                fprintf(stderr, "handoff sendmsg error (%d)\n", errno);
                 exit(1);
         }
     }
+}
 
-    struct epoll_event events[MAX_EVENTS];
+// Hands the listener over to the successor on sockfd, along with every idle connection
+// of the event loop if with_connections is set. A connection is idle when it has no
+// unread data and no ack partly sent, so that nothing the peer already sent is lost and
+// no ack is cut in two between the two processes. An ack that is only owed goes along
+// with the connection, and the successor sends it. The connections that are handed over
+// are closed here; the rest stay with this process until they close.
+static void handoff(int sockfd, int with_connections, int listenfd)
+{
+    send_handoff(sockfd, HANDOFF_LISTENER, &listenfd, 1, NULL, 0);
 
-    // event loop
+    int handed = 0;
 
-    while ( 1 )
+    if ( with_connections )
     {
-        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
-        if ( -1 == nfds )
+        int fds[HANDOFF_BATCH];
+        struct connection conns[HANDOFF_BATCH];
+        int n = 0;
+
+        for ( int fd = 0; fd <= highest_fd; fd++ )
         {
-            switch ( errno )
-            {
-                case EINTR:
-                    // A signal was caught
-                    fprintf(stderr, "shutting down...\n");
-                    if ( -1 == close(listenfd) )
-                    {
-                        switch ( errno )
-                        {
-                            case EBADF:
-                            case EINTR:
-                            case EIO:
-                            default:
-                                fprintf(stderr, "socket close error (%d)", errno);
-                                exit(1);
-                        }
-                    }
-                    exit(0);
+            if ( 0 == connections[fd].id )
+                continue;
 
-                case EBADF:
-                case EFAULT:
-                case EINVAL:
-                default:
-                    fprintf(stderr, "epoll_wait error (%d)\n", errno);
-                    exit(1);
-            }
-        }
+            int unread = 0;
+            if ( -1 == ioctl(fd, FIONREAD, &unread) || 0 != unread || server_pending(loop, fd) )
+                continue;
 
-        for ( int i = 0; i < nfds; i++ )
-        {
-            // This is declared here to pass it from EPOLLIN to EPOLLOUT in this test implementation.
-            // In most other cases, it would likely be placed inside EPOLLIN block.
-            size_t total_bytes_in = 0;
+            fds[n] = fd;
+            conns[n] = connections[fd];
+            n++;
 
-            if ( events[i].data.fd == listenfd )
+            if ( HANDOFF_BATCH == n )
             {
-                if ( events[i].events & EPOLLIN )
-                {
-                    socklen_t addr_size = sizeof(struct sockaddr_in);
-                    struct sockaddr_in client_addr;
-                    int connfd = accept(listenfd, (struct sockaddr*) &client_addr, &addr_size);
-                    if ( -1 == connfd )
-                    {
-                        switch ( errno )
-                        {
-                            case EWOULDBLOCK:
-                            case EBADF:
-                            case ECONNABORTED:
-                            case EFAULT:
-                            case EINTR:
-                            case EINVAL:
-                            case ENFILE:
-                            case ENOBUFS:
-                            case ENOMEM:
-                            case ENOTSOCK:
-                            case EOPNOTSUPP:
-                            case EPERM:
-                            case EPROTO:
-                            default:
-                                fprintf(stderr, "socket accept error (%d)\n", errno);
-                                exit(1);
-                        }
-                    }
+                send_handoff(sockfd, 0, fds, n, conns, n);
+                for ( int j = 0; j < n; j++ )
+                    hand_over(fds[j]);
+                handed += n;
+                n = 0;
+            }
+        }
 
-                    // set non-blocking
+        if ( 0 < n )
+        {
+            send_handoff(sockfd, 0, fds, n, conns, n);
+            for ( int j = 0; j < n; j++ )
+                hand_over(fds[j]);
+            handed += n;
+        }
+    }
 
-                    int flags = fcntl(connfd, F_GETFL, 0);
-                    if ( -1 == flags )
-                    {
-                        switch ( errno )
-                        {
-                            case EACCES:
-                            case EAGAIN:
-                            case EBADF:
-                            case EINTR:
-                            case EINVAL:
-                            case EMFILE:
-                            case ENOLCK:
-                            case EOVERFLOW:
-                            default:
-                                fprintf(stderr, "select fcntl error (%d)\n", errno);
-                                exit(1);
-                        }
-                    }
+    send_handoff(sockfd, HANDOFF_LAST, NULL, 0, NULL, 0);
 
-                    if ( -1 == fcntl(connfd, F_SETFL, flags | O_NONBLOCK) )
-                    {
-                        switch ( errno )
-                        {
-                            case EACCES:
-                            case EAGAIN:
-                            case EBADF:
-                            case EINTR:
-                            case EINVAL:
-                            case EMFILE:
-                            case ENOLCK:
-                            case EOVERFLOW:
-                            default:
-                                fprintf(stderr, "select fcntl error (%d)\n", errno);
-                                exit(1);
-                        }
-                    }
+    fprintf(stderr, "handed over the listener and %d connections, draining %d\n", handed, open_connections);
+}
 
-                    // register the new connection to the rpoll
+// Takes over from the server listening on the control socket at path.
+// Returns the inherited listener; inherited connections are added to the connection table.
+static int inherit(const char *path, int listener_only)
+{
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ( -1 == sockfd )
+    {
+        fprintf(stderr, "socket creation error (%d)\n", errno);
+        exit(1);
+    }
 
-                    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-                    ev.data.fd = connfd;
-                    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, connfd, &ev) )
-                    {
-                        switch ( errno )
-                        {
-                            case EBADF:
-                            case EEXIST:
-                            case EINVAL:
-                            case ENOENT:
-                            case ENOMEM:
-                            case ENOSPC:
-                            case EPERM:
-                            default:
-                                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
-                                exit(1);
-                        }
-                    }
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
 
+    if ( -1 == connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) )
+    {
+        switch ( errno )
+        {
+            case ECONNREFUSED:
+            case ENOENT:
+                fprintf(stderr, "no server to inherit from at %s\n", path);
+                exit(1);
+
+            default:
+                fprintf(stderr, "socket connect error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    const char *command = listener_only ? "upgrade listener\n" : "upgrade\n";
+    if ( -1 == send(sockfd, command, strlen(command), MSG_NOSIGNAL) )
+    {
+        fprintf(stderr, "socket send error (%d)\n", errno);
+        exit(1);
+    }
+
+    int listenfd = -1;
+    int capacity = 0;
+
+    while ( 1 )
+    {
+        struct handoff_header header = { 0 };
+        static char records[HANDOFF_BATCH * HANDOFF_MAX_RECORD];
+
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(int) * ( HANDOFF_BATCH + 1 ))];
+            struct cmsghdr align;
+        } control;
+
+        struct iovec iov = { &header, sizeof(header) };
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        // the descriptors arrive with the first byte of the header
+        ssize_t received = recvmsg(sockfd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        if ( received < 0 )
+        {
+            fprintf(stderr, "handoff recvmsg error (%d)\n", errno);
+            exit(1);
+        }
+
+        // taken before anything is checked, so that none is left open whatever is wrong
+        int fds[HANDOFF_BATCH + 1];
+        int nfds = 0;
+
+        for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+        {
+            if ( SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type )
+                continue;
+
+            int n = ( cmsg->cmsg_len - CMSG_LEN(0) ) / sizeof(int);
+            int *data = (int *) CMSG_DATA(cmsg);
+            for ( int j = 0; j < n; j++ )
+            {
+                if ( nfds < HANDOFF_BATCH + 1 )
+                    fds[nfds++] = data[j];
+                else
+                    close(data[j]);
+            }
+        }
+
+        const char *invalid = NULL;
+        if ( msg.msg_flags & MSG_CTRUNC )
+            invalid = "descriptors were dropped, out of descriptors?";
+        else if ( sizeof(header) != received || HANDOFF_MAGIC != header.magic )
+            invalid = "not a handoff message";
+        else if ( HANDOFF_VERSION != header.version )
+            invalid = "unsupported version";
+        else if ( HANDOFF_BATCH < header.nconns || 0 == header.record_size || HANDOFF_MAX_RECORD < header.record_size )
+            invalid = "invalid header";
+        else if ( ( header.flags & HANDOFF_LISTENER ) && -1 != listenfd )
+            invalid = "second listener";
+        else if ( nfds - !!( header.flags & HANDOFF_LISTENER ) != (int) header.nconns )
+            invalid = "as many descriptors as connections expected";
+
+        size_t length = header.nconns * header.record_size;
+        if ( NULL == invalid && 0 < length && (ssize_t) length != recv(sockfd, records, length, MSG_WAITALL) )
+            invalid = "truncated records";
+
+        if ( NULL != invalid )
+        {
+            for ( int j = 0; j < nfds; j++ )
+                close(fds[j]);
+            fprintf(stderr, "invalid handoff message: %s (version %u, %d descriptors)\n",
+                    invalid, (unsigned) header.version, nfds);
+            exit(1);
+        }
+
+        int first = 0;
+        if ( header.flags & HANDOFF_LISTENER )
+        {
+            listenfd = fds[0];
+            first = 1;
+        }
+
+        for ( int j = 0; j < (int) header.nconns; j++ )
+        {
+            // what this binary knows of the record, the rest of its own fields zeroed
+            struct connection conn = { 0 };
+            size_t known = ( header.record_size < sizeof(conn) ) ? header.record_size : sizeof(conn);
+            memcpy(&conn, records + j * header.record_size, known);
+
+            int connfd = fds[first + j];
+            open_connection(connfd, conn.id, conn.accepted, conn.bytes_in);
+
+            // sent once the event loop finds the connection writable, which it does first
+            connections[connfd].unacked = conn.unacked;
+
+            if ( capacity <= inherited_cnt )
+            {
+                capacity = ( 0 == capacity ) ? HANDOFF_BATCH : capacity * 2;
+                inherited_fds = realloc(inherited_fds, capacity * sizeof(int));
+                if ( NULL == inherited_fds )
+                {
+                    fprintf(stderr, "out of memory\n");
+                    exit(1);
+                }
+            }
+            inherited_fds[inherited_cnt++] = connfd;
+        }
+
+        if ( header.flags & HANDOFF_LAST )
+            break;
+    }
+
+    close(sockfd);
+
+    if ( -1 == listenfd )
+    {
+        fprintf(stderr, "no listener received from %s\n", path);
+        exit(1);
+    }
+
+    fprintf(stderr, "inherited the listener and %d connections from %s\n", inherited_cnt, path);
+    return listenfd;
+}
+
+// creates the UNIX socket on which the server accepts commands
+static int create_control_socket(const char *path)
+{
+    int controlfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( -1 == controlfd )
+    {
+        fprintf(stderr, "socket creation error (%d)\n", errno);
+        exit(1);
+    }
+
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    // a stale socket, or the one of the predecessor we have just taken over from
+    unlink(path);
+
+    if ( -1 == bind(controlfd, (struct sockaddr*) &addr, sizeof(addr)) )
+    {
+        fprintf(stderr, "control socket bind error (%d)\n", errno);
+        exit(1);
+    }
+
+    if ( -1 == listen(controlfd, MAX_BACKLOG) )
+    {
+        fprintf(stderr, "control socket listen error (%d)\n", errno);
+        exit(1);
+    }
+
+    return controlfd;
+}
+
+// Answers the command received on the blocking control connection ctlfd, and returns
+// the connection if it asked for an upgrade, in which case the caller hands over once
+// it is safe to do so. Other commands are answered here, and their connection is closed.
+// listener_only is set if the successor does not want the connections.
+static int answer_control(int ctlfd, const char *command, struct worker_stats *stats, int nworkers,
+                          int *listener_only)
+{
+    if ( 0 == strncmp(command, "upgrade", 7) )
+    {
+        if ( draining )
+        {
+            close(ctlfd);
+            return -1;
+        }
+        *listener_only = ( NULL != strstr(command, "listener") );
+        return ctlfd;
+    }
+
+    // do not let a peer that does not read its answer stall the server
+    struct timeval timeout = { 1, 0 };
+    setsockopt(ctlfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    FILE *out = fdopen(ctlfd, "w");
+    if ( NULL == out )
+    {
+        close(ctlfd);
+        return -1;
+    }
+
+    if ( 0 == strncmp(command, "stats", 5) )
+    {
+        print_stats(out, stats, nworkers);
+        fprintf(out, "open connections: %d\n",
+                ( 0 < staged_threads[STAGE_READ] ) ? staged_connections() : open_connections);
+    }
+    else if ( 0 == strncmp(command, "stage ", 6) && 0 < staged_threads[STAGE_READ] )
+    {
+        // stage NAME N
+        char name[16];
+        int nthreads;
+        int stage;
+
+        if ( 2 != sscanf(command + 6, "%15s %d", name, &nthreads) || -1 == ( stage = staged_find(name) ) )
+            fprintf(out, "unknown stage\n");
+        else if ( -1 == staged_set_threads(stage, nthreads) )
+            fprintf(out, "invalid number of threads for stage %s: %d\n", name, nthreads);
+        else
+            fprintf(out, "stage %s: %d threads\n", name, nthreads);
+    }
+    else if ( 0 == strncmp(command, "flame", 5) )
+    {
+        if ( -1 == profiler_write(out) )
+            fprintf(out, "sampler not running\n");
+    }
+    else
+    {
+        fprintf(out, "unknown command\n");
+    }
+
+    fclose(out);
+    return -1;
+}
+
+// Accepts a command on the control socket and answers it as answer_control() does.
+// This waits for the command, which is for the master only: it serves no connection
+// that a silent peer could hold up.
+static int accept_control(int controlfd, struct worker_stats *stats, int nworkers, int *listener_only)
+{
+    int ctlfd = accept4(controlfd, NULL, NULL, SOCK_CLOEXEC);
+    if ( -1 == ctlfd )
+    {
+        fprintf(stderr, "control socket accept error (%d)\n", errno);
+        return -1;
+    }
+
+    struct timeval timeout = { 1, 0 };
+    setsockopt(ctlfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char command[64];
+    ssize_t received = recv(ctlfd, command, sizeof(command) - 1, 0);
+    if ( 0 >= received )
+    {
+        close(ctlfd);
+        return -1;
+    }
+    command[received] = '\0';
+
+    return answer_control(ctlfd, command, stats, nworkers, listener_only);
+}
+
+// stops accepting; the process exits once its open connections are closed
+static void start_draining(void)
+{
+    if ( draining )
+        return;
+
+    draining = 1;
+    server_close_listener(loop);
+
+    // The staged pipeline closes connections on its own threads, so a draining
+    // event loop has to look at the count now and then.
+    if ( 0 < staged_threads[STAGE_READ] )
+        server_set_timeout(loop, 100);
+}
+
+// Lifts the descriptor limit up to fs.nr_open, or if the process is not allowed to raise
+// its hard limit, up to that. Must be called before the connection tables are sized.
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if ( -1 == getrlimit(RLIMIT_NOFILE, &rl) )
+    {
+        fprintf(stderr, "getrlimit error (%d)\n", errno);
+        exit(1);
+    }
+
+    struct rlimit raised = rl;
+
+    FILE *fp = fopen("/proc/sys/fs/nr_open", "r");
+    if ( NULL != fp )
+    {
+        unsigned long nr_open;
+        if ( 1 == fscanf(fp, "%lu", &nr_open) )
+            raised.rlim_cur = raised.rlim_max = nr_open;
+        fclose(fp);
+    }
+
+    if ( -1 == setrlimit(RLIMIT_NOFILE, &raised) )
+    {
+        switch ( errno )
+        {
+            case EPERM:
+                // not privileged, the hard limit is as far as it goes
+                raised.rlim_cur = raised.rlim_max = rl.rlim_max;
+                if ( 0 == setrlimit(RLIMIT_NOFILE, &raised) )
+                    break;
+                // fall through
+
+            case EFAULT:
+            case EINVAL:
+            default:
+                fprintf(stderr, "setrlimit error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    fprintf(stderr, "descriptor limit: %lu\n", (unsigned long) raised.rlim_cur);
+}
+
+// creates the listener socket shared by all workers
+// It is non-blocking: in prefork mode several workers may be woken for the same
+// connection, and the ones that lose the race must not block in accept().
+static int create_listener(void)
+{
+    int listenfd = server_create_listener(PORT, c1m ? SOMAXCONN : MAX_BACKLOG);
+    if ( -1 == listenfd )
+    {
+        switch ( errno )
+        {
+            case EADDRINUSE:
+                fprintf(stderr, "The given address is already in use.\n");
+                exit(1);
+
+            case EACCES:
+            case EAFNOSUPPORT:
+            case EINVAL:
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+            default:
+                fprintf(stderr, "socket listener error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    // accepted connections inherit the buffer sizes of the listener
+    if ( c1m )
+    {
+        int size = C1M_SOCKET_BUFFER;
+        if ( -1 == setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size))
+             || -1 == setsockopt(listenfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) )
+        {
+            fprintf(stderr, "setsockopt error (%d)\n", errno);
+            exit(1);
+        }
+    }
+
+    return listenfd;
+}
+
+// what the callbacks of the event loop share
+struct loop_context
+{
+    struct worker_stats *stats;
+    int prefork;
+    int controlfd;
+
+    // set when a successor asked to take over, handled once all events of the iteration are
+    int upgradefd;
+    int listener_only;
+
+    int drained;
+};
+
+static void on_connect(struct server *srv, int connfd, void *arg)
+{
+    struct loop_context *ctx = (struct loop_context *) arg;
+
+    STAT_ADD(ctx->stats, connections, 1);
+    tuning_rearm(tuning, connfd);
+
+    if ( 0 < staged_threads[STAGE_READ] )
+    {
+        // the pipeline owns the connection from now on, and records the rest of it
+        unsigned long id = next_connection_id++;
+        record(RECORD_ACCEPT, id, connfd, 0);
+        server_detach(srv, connfd);
+        staged_add_connection(connfd, id);
+        return;
+    }
+
+    open_connection(connfd, next_connection_id, time(NULL), 0);
+    capture_event(CAPTURE_OPEN, connections[connfd].id, NULL, 0);
+}
+
+static void on_data(struct server *srv, int connfd, struct server_buffer *buf, void *arg)
+{
+    struct loop_context *ctx = (struct loop_context *) arg;
+    (void) srv;
+
+    // as received, before the handler sanitizes it
+    capture_event(CAPTURE_DATA, connections[connfd].id, buf->data, buf->len);
+
+    if ( 0 == connections[connfd].bytes_in )
+        record(RECORD_FIRST_BYTE, connections[connfd].id, connfd, buf->len);
+
+    tuning_rearm(tuning, connfd);
+
+    STAT_ADD(ctx->stats, bytes_in, buf->len);
+    connections[connfd].bytes_in += buf->len;
+    connections[connfd].unacked += buf->len;
+
+    if ( NULL != offload )
+    {
+        // hand the buffer to the workers, it is released once written out
+
+        struct offload_job *job = offload_get(offload, output_job, NULL);
+
+        server_buffer_retain(buf);
+        job->fd = connfd;
+        job->conn_id = connections[connfd].id;
+        job->data = buf->data;
+        job->len = buf->len;
+        job->buffer = buf;
+        offload_submit(offload, job, output_job, NULL);
+    }
+    else if ( NULL != batch )
+    {
+        // keep the buffer until the batch is processed at the end of the iteration
+
+        if ( BATCH_BUFFERS == batch->count )
+            flush_batch(batch, ctx->stats);
+
+        server_buffer_retain(buf);
+        batch->buffers[batch->count++] = buf;
+    }
+    else
+    {
+        process(buf->data, buf->len);
+
+        struct phase_mark mark;
+        phase_begin(&mark, PHASE_OUTPUT);
+        printf("%.*s", (int) buf->len, buf->data);
+        fflush(stdout);
+        phase_end(&mark);
+    }
+}
+
+// acknowledges what was received since the last time the connection was writable
+static void on_writable(struct server *srv, int connfd, void *arg)
+{
+    struct loop_context *ctx = (struct loop_context *) arg;
+
+    if ( 0 == connections[connfd].unacked )
+        return;
+
+    static char ack[] = "Ack\n";
+
+    unsigned long unacked = connections[connfd].unacked;
+    connections[connfd].unacked = 0;
+    if ( 0 < selftest_pairs )
+        selftest_acking(connfd, unacked);
+    if ( 0 == server_send(srv, connfd, ack, sizeof(ack)) )
+    {
+        tuning_push(tuning, connfd);
+        PROBE2(server, ack, connfd, unacked);
+        record(RECORD_ACK, connections[connfd].id, connfd, unacked);
+        STAT_ADD(ctx->stats, acks, 1);
+    }
+}
+
+static void on_close(struct server *srv, int connfd, void *arg)
+{
+    struct loop_context *ctx = (struct loop_context *) arg;
+    (void) srv;
+
+    // still open, with what it went through over its whole life
+    if ( 0 < tcpinfo_ms )
+        tcp_health_sample(&ctx->stats->tcp, connfd, 1);
+
+    PROBE4(server, close, connfd, connections[connfd].id, connections[connfd].bytes_in, connections[connfd].accepted);
+    record(RECORD_CLOSE, connections[connfd].id, connfd, connections[connfd].bytes_in);
+    forget_connection(connfd);
+}
+
+// a control connection, watched until its command arrives
+static void on_command(struct server *srv, int ctlfd, void *arg)
+{
+    struct loop_context *ctx = (struct loop_context *) arg;
+
+    char command[64];
+    ssize_t received = recv(ctlfd, command, sizeof(command) - 1, 0);
+    if ( -1 == received && ( EAGAIN == errno || EINTR == errno ) )
+        return;
+
+    server_unwatch(srv, ctlfd);
+    if ( 0 >= received )
+    {
+        close(ctlfd);
+        return;
+    }
+    command[received] = '\0';
+
+    // the answer, or the handoff, is written whole
+    int flags = fcntl(ctlfd, F_GETFL, 0);
+    if ( -1 == flags || -1 == fcntl(ctlfd, F_SETFL, flags & ~O_NONBLOCK) )
+    {
+        close(ctlfd);
+        return;
+    }
+
+    int listener_only = 0;
+    int fd = answer_control(ctlfd, command, ctx->stats, 1, &listener_only);
+    if ( -1 == fd )
+        return;
+
+    // one successor at a time
+    if ( -1 != ctx->upgradefd )
+    {
+        close(fd);
+        return;
+    }
+
+    ctx->upgradefd = fd;
+    ctx->listener_only = listener_only;
+}
+
+// Accepts a connection on the control socket. Its command is read once it arrives, so
+// that a peer that connects and stays silent holds up nothing.
+static void on_control(struct server *srv, int controlfd, void *arg)
+{
+    int ctlfd = accept4(controlfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if ( -1 == ctlfd )
+    {
+        fprintf(stderr, "control socket accept error (%d)\n", errno);
+        return;
+    }
+
+    if ( -1 == server_watch(srv, ctlfd, on_command, arg) )
+    {
+        fprintf(stderr, "control socket watch error (%d)\n", errno);
+        close(ctlfd);
+    }
+}
+
+// samples the next connections in turn, as many as the budget allows whatever their number
+static void on_tcpinfo(struct server *srv, int timerfd, void *arg)
+{
+    struct loop_context *ctx = (struct loop_context *) arg;
+    (void) srv;
+
+    uint64_t expirations;
+    if ( -1 == read(timerfd, &expirations, sizeof(expirations)) )
+        return;
+
+    int sampled = 0;
+    for ( int scanned = 0; scanned < TCPINFO_SCAN && sampled < TCPINFO_BUDGET && 0 < open_connections; scanned++ )
+    {
+        if ( highest_fd < ++tcpinfo_cursor )
+            tcpinfo_cursor = 0;
+
+        if ( 0 != connections[tcpinfo_cursor].id )
+        {
+            tcp_health_sample(&ctx->stats->tcp, tcpinfo_cursor, 0);
+            sampled++;
+        }
+    }
+}
+
+static void on_offload(struct server *srv, int fd, void *arg)
+{
+    (void) srv;
+    (void) fd;
+    (void) arg;
+
+    offload_complete(offload, output_job, NULL);
+}
+
+// called once the events of an iteration, if any, have been handled
+// The pipeline receives and acks without on_data() and on_writable(), and keeps its own
+// totals, which take the place of theirs.
+static void staged_counters(struct worker_stats *stats)
+{
+    if ( 0 == staged_threads[STAGE_READ] )
+        return;
+
+    unsigned long bytes_in, acks;
+    staged_get_totals(&bytes_in, &acks);
+    __atomic_store_n(&stats->bytes_in, bytes_in, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->acks, acks, __ATOMIC_RELAXED);
+}
+
+static void on_iteration(struct server *srv, void *arg)
+{
+    struct loop_context *ctx = (struct loop_context *) arg;
+
+    if ( NULL != batch )
+        flush_batch(batch, ctx->stats);
+
+    if ( 0 < selftest_pairs )
+        hist_record(&wakeup_latency, clock_ns(CLOCK_MONOTONIC) - woken_at);
+
+    struct server_counters counters;
+    server_get_counters(srv, &counters);
+    __atomic_store_n(&ctx->stats->syscalls, counters.syscalls, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->stats->rejected, counters.rejected, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->stats->open, ( 0 < staged_threads[STAGE_READ] ) ? staged_connections() : open_connections,
+                     __ATOMIC_RELAXED);
+    staged_counters(ctx->stats);
+
+    if ( 0 != last_signal )
+    {
+        // A signal was caught
+
+        int signo = last_signal;
+        last_signal = 0;
+
+        switch ( signo )
+        {
+            case SIGUSR1:
+                // dump the counters and keep going
+                // in prefork mode, the master reports for all workers
+                if ( !ctx->prefork )
+                    print_stats(stderr, ctx->stats, 1);
+                write_samples();
+                break;
+
+            case SIGUSR2:
+                // stop accepting and exit once the open connections are closed
+                start_draining();
+                break;
+
+            default:
+                fprintf(stderr, "shutting down...\n");
+                server_stop(srv);
+                watchdog_idle();
+                return;
+        }
+    }
+
+    // The handoff waits until all events of this iteration have been handled,
+    // as the remaining ones may refer to connections that are handed over.
+
+    if ( -1 != ctx->upgradefd )
+    {
+        // connections owned by the pipeline cannot be handed over
+        handoff(ctx->upgradefd, !ctx->listener_only && 0 == staged_threads[STAGE_READ], server_listener(srv));
+        close(ctx->upgradefd);
+        ctx->upgradefd = -1;
+
+        server_unwatch(srv, ctx->controlfd);
+        close(ctx->controlfd);
+        ctx->controlfd = -1;
+
+        start_draining();
+    }
+
+    if ( draining && 0 == open_connections && 0 == staged_connections() )
+    {
+        ctx->drained = 1;
+        server_stop(srv);
+    }
+
+    // last, so that the work above counts as busy if it stalls the loop
+    watchdog_idle();
+}
+
+static void on_wakeup(struct server *srv, int nevents, void *arg)
+{
+    (void) srv;
+    (void) nevents;
+    (void) arg;
+
+    if ( 0 < selftest_pairs )
+        woken_at = clock_ns(CLOCK_MONOTONIC);
+
+    watchdog_busy();
+}
+
+// the self-test generator is done, called on its thread
+static void selftest_done(void *arg)
+{
+    server_stop((struct server *) arg);
+}
+
+// Loads the payload of --selftest: N generated bytes, or the contents of a file with
+// @PATH. Generated payloads are lines of letters, as the client sends.
+static void load_selftest_payload(const char *arg)
+{
+    selftest_payload = (char *) malloc(SELFTEST_MAX_PAYLOAD);
+    if ( NULL == selftest_payload )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    if ( '@' == arg[0] )
+    {
+        FILE *fp = fopen(arg + 1, "rb");
+        if ( NULL == fp )
+        {
+            fprintf(stderr, "payload open error (%d)\n", errno);
+            exit(1);
+        }
+        selftest_len = fread(selftest_payload, 1, SELFTEST_MAX_PAYLOAD, fp);
+        fclose(fp);
+    }
+    else
+    {
+        selftest_len = strtoul(arg, NULL, 10);
+        for ( size_t i = 0; i < selftest_len && i < SELFTEST_MAX_PAYLOAD; i++ )
+            selftest_payload[i] = ( 63 == i % 64 ) ? '\n' : 'a' + i % 26;
+        if ( 0 < selftest_len && selftest_len <= SELFTEST_MAX_PAYLOAD )
+            selftest_payload[selftest_len - 1] = '\n';
+    }
+
+    if ( 0 == selftest_len || SELFTEST_MAX_PAYLOAD < selftest_len )
+    {
+        fprintf(stderr, "invalid payload: %s\n", arg);
+        exit(1);
+    }
+}
+
+// creates the socketpairs of --selftest, serves one end of each, and starts the
+// generator on the others
+static void start_selftest(struct worker_stats *stats)
+{
+    if ( NULL == selftest_payload )
+        load_selftest_payload("512");
+
+    int *fds = (int *) malloc(selftest_pairs * sizeof(int));
+    if ( NULL == fds || -1 == selftest_create(selftest_pairs, fds) )
+    {
+        fprintf(stderr, "socketpair error (%d)\n", errno);
+        exit(1);
+    }
+
+    for ( int i = 0; i < selftest_pairs; i++ )
+    {
+        STAT_ADD(stats, connections, 1);
+
+        if ( 0 < staged_threads[STAGE_READ] )
+        {
+            unsigned long id = next_connection_id++;
+            record(RECORD_ACCEPT, id, fds[i], 0);
+            staged_add_connection(fds[i], id);
+            continue;
+        }
+
+        if ( -1 == server_adopt(loop, fds[i]) )
+        {
+            fprintf(stderr, "event registration error (%d)\n", errno);
+            exit(1);
+        }
+        open_connection(fds[i], next_connection_id, time(NULL), 0);
+    }
+
+    free(fds);
+
+    if ( -1 == selftest_start(selftest_payload, selftest_len, selftest_seconds, selftest_done, loop) )
+    {
+        fprintf(stderr, "selftest start error (%d)\n", errno);
+        exit(1);
+    }
+}
+
+// runs the event loop on the given listener until a signal shuts it down
+static void run_event_loop(int listenfd, int controlfd, int prefork, struct worker_stats *stats)
+{
+    static struct loop_context ctx;
+    ctx.stats = stats;
+    ctx.prefork = prefork;
+    ctx.controlfd = controlfd;
+    ctx.upgradefd = -1;
+
+    static const struct server_callbacks callbacks =
+    {
+        .on_connect = on_connect,
+        .on_data = on_data,
+        .on_writable = on_writable,
+        .on_close = on_close,
+        .on_iteration = on_iteration,
+        .on_wakeup = on_wakeup,
+    };
+
+    loop = server_create();
+    if ( NULL == loop )
+    {
+        fprintf(stderr, "event loop creation error (%d)\n", errno);
+        exit(1);
+    }
+
+    if ( -1 == server_set_backend(loop, backend) )
+    {
+        fprintf(stderr, "%s backend error (%d)\n", poller_name(backend), errno);
+        exit(1);
+    }
+
+    server_set_callbacks(loop, &callbacks, &ctx);
+    server_set_buffer_size(loop, BUFLEN);
+
+    // a file per process, so that workers and restarts do not overwrite each other's
+    if ( NULL != recorder_path )
+    {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.%d", recorder_path, (int) getpid());
+        if ( -1 == recorder_open(path) )
+        {
+            fprintf(stderr, "recorder open error (%d)\n", errno);
+            if ( recorder_named )
+                exit(1);
+        }
+    }
+
+    // in each worker with --workers, as threads do not survive fork()
+    if ( 0 < watchdog_ms && -1 == watchdog_start(loop, watchdog_ms) )
+    {
+        fprintf(stderr, "watchdog creation error (%d)\n", errno);
+        exit(1);
+    }
+
+    // With EPOLLEXCLUSIVE, only one of the workers waiting on the shared listener
+    // is woken for each incoming connection instead of all of them. The other
+    // backends wake them all.
+
+    if ( -1 != listenfd && -1 == server_set_listener(loop, listenfd, prefork) )
+    {
+        fprintf(stderr, "event registration error (%d)\n", errno);
+        exit(1);
+    }
+
+    // register offload completions
+
+    if ( 0 < offload_threads )
+    {
+        offload = offload_create(offload_threads, OFFLOAD_QUEUE_DEPTH, offload_policy, process_job);
+        if ( NULL == offload )
+        {
+            fprintf(stderr, "offload pool creation error (%d)\n", errno);
+            exit(1);
+        }
+
+        if ( -1 == server_watch(loop, offload_eventfd(offload), on_offload, NULL) )
+        {
+            fprintf(stderr, "event registration error (%d)\n", errno);
+            exit(1);
+        }
+    }
+
+    // sample the connections every --tcp-info
+
+    if ( 0 < tcpinfo_ms )
+    {
+        int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if ( -1 == timerfd )
+        {
+            fprintf(stderr, "timerfd_create error (%d)\n", errno);
+            exit(1);
+        }
+
+        struct itimerspec its = { { tcpinfo_ms / 1000, tcpinfo_ms % 1000 * 1000000L },
+                                  { tcpinfo_ms / 1000, tcpinfo_ms % 1000 * 1000000L } };
+        if ( -1 == timerfd_settime(timerfd, 0, &its, NULL) )
+        {
+            fprintf(stderr, "timerfd_settime error (%d)\n", errno);
+            exit(1);
+        }
+
+        if ( -1 == server_watch(loop, timerfd, on_tcpinfo, &ctx) )
+        {
+            fprintf(stderr, "event registration error (%d)\n", errno);
+            exit(1);
+        }
+    }
+
+    // start the staged pipeline
+
+    if ( 0 < staged_threads[STAGE_READ] )
+    {
+        if ( -1 == staged_start(staged_threads[STAGE_READ], staged_threads[STAGE_PROCESS],
+                                staged_threads[STAGE_WRITE], process, output_staged,
+                                ( 0 < selftest_pairs ) ? selftest_acking : NULL) )
+        {
+            fprintf(stderr, "staged pipeline creation error (%d)\n", errno);
+            exit(1);
+        }
+    }
+
+    // register control socket
+
+    if ( -1 != controlfd && -1 == server_watch(loop, controlfd, on_control, &ctx) )
+    {
+        fprintf(stderr, "event registration error (%d)\n", errno);
+        exit(1);
+    }
+
+    // register connections inherited from the predecessor
+
+    for ( int i = 0; i < inherited_cnt; i++ )
+    {
+        if ( -1 == server_adopt(loop, inherited_fds[i]) )
+        {
+            fprintf(stderr, "event registration error (%d)\n", errno);
+            exit(1);
+        }
+    }
+
+    free(inherited_fds);
+    inherited_fds = NULL;
+    inherited_cnt = 0;
+
+    if ( 0 < selftest_pairs )
+        start_selftest(stats);
+
+    // event loop
+
+    if ( -1 == server_run(loop) )
+    {
+        fprintf(stderr, "event loop error (%d)\n", errno);
+        exit(1);
+    }
+
+    if ( NULL != offload )
+        offload_flush(offload, output_job, NULL);
+
+    write_samples();
+
+    if ( !recorder_named )
+        recorder_discard();
+
+    if ( ctx.drained )
+    {
+        fprintf(stderr, "drained, exiting\n");
+        exit(0);
+    }
+
+    server_close_listener(loop);
+    if ( 0 < selftest_pairs )
+    {
+        selftest_print_stats(stderr);
+        hist_print(stderr, "wakeup", &wakeup_latency, 1000.0, "us");
+    }
+    if ( !prefork )
+    {
+        staged_counters(stats);
+        print_stats(stderr, stats, 1);
+    }
+    exit(0);
+}
+
+// forks a worker process that serves the shared listener
+static pid_t spawn_worker(int listenfd, int controlfd, struct worker_stats *stats)
+{
+    pid_t pid = fork();
+    if ( -1 == pid )
+    {
+        switch ( errno )
+        {
+            case EAGAIN:
+            case ENOMEM:
+            case ENOSYS:
+            default:
+                fprintf(stderr, "fork error (%d)\n", errno);
+                return -1;
+        }
+    }
+
+    if ( 0 == pid )
+    {
+        // the worker only counts its own activity; the master keeps pid and restarts
+        last_signal = 0;
+
+        // the control socket belongs to the master
+        if ( -1 != controlfd )
+            close(controlfd);
+
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        run_event_loop(listenfd, -1, 1, stats);
+        exit(0);
+    }
+
+    stats->pid = pid;
+    stats->started = time(NULL);
+    return pid;
+}
+
+// only there to interrupt ppoll() in the master
+static void sigchld_handler(int signo)
+{
+    (void) signo;
+}
+
+// Supervises the workers: restarts the ones that die and stops them all on shutdown.
+// After an upgrade, the workers are told to drain instead, and the master exits
+// with the last of them.
+static void run_master(int listenfd, int controlfd, int nworkers, struct worker_stats *stats)
+{
+    // SIGCHLD is only let through while waiting in ppoll(), so that a worker
+    // dying between the reaping and the wait cannot be missed.
+
+    struct sigaction sa;
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    sigset_t blocked, unblocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &unblocked);
+    sigdelset(&unblocked, SIGCHLD);
+
+    for ( int i = 0; i < nworkers; i++ )
+    {
+        if ( -1 == spawn_worker(listenfd, controlfd, &stats[i]) )
+            exit(1);
+    }
+
+    fprintf(stderr, "master (pid %d) started %d workers\n", (int) getpid(), nworkers);
+
+    int running = nworkers;
+
+    while ( 1 )
+    {
+        int status;
+        pid_t pid;
+
+        while ( 0 < ( pid = waitpid(-1, &status, WNOHANG) ) )
+        {
+            for ( int i = 0; i < nworkers; i++ )
+            {
+                if ( stats[i].pid != pid )
+                    continue;
+
+                if ( draining )
+                {
+                    running--;
+                    break;
                 }
 
-                continue;
+                if ( WIFSIGNALED(status) )
+                    fprintf(stderr, "worker %d (pid %d) killed by signal %d, restarting\n", i, (int) pid, WTERMSIG(status));
+                else
+                    fprintf(stderr, "worker %d (pid %d) exited with status %d, restarting\n", i, (int) pid, WEXITSTATUS(status));
+
+                // a worker that dies right after starting would otherwise be restarted in a tight loop
+                if ( time(NULL) - stats[i].started < 1 )
+                    sleep(1);
+
+                stats[i].restarts++;
+                if ( -1 == spawn_worker(listenfd, controlfd, &stats[i]) )
+                    exit(1);
+                break;
             }
+        }
+
+        if ( draining && 0 == running )
+        {
+            print_stats(stderr, stats, nworkers);
+            fprintf(stderr, "drained, exiting\n");
+            exit(0);
+        }
 
-            if ( events[i].events & EPOLLIN )
+        struct pollfd pfd = { controlfd, POLLIN, 0 };
+        int nready = ppoll(&pfd, ( -1 != controlfd ) ? 1 : 0, NULL, &unblocked);
+        if ( -1 == nready )
+        {
+            switch ( errno )
             {
-                // socket has data to read
+                case EINTR:
+                    // A signal was caught
+                    if ( 0 == last_signal )
+                    {
+                        // SIGCHLD, reaped above
+                        continue;
+                    }
 
-                char buffer[BUFLEN];
-                ssize_t received;
+                    if ( SIGUSR1 == last_signal )
+                    {
+                        last_signal = 0;
+                        print_stats(stderr, stats, nworkers);
+                        continue;
+                    }
 
-                while ( 0 < ( received = recv(events[i].data.fd, buffer, sizeof(buffer), 0) ) )
-                {
-                    char *p = buffer;
-                    for ( int i = 0; i < received; i++ )
+                    if ( SIGUSR2 == last_signal )
                     {
-                        if ( *p < ' ' && *p != '\n' ) *p = '.';
-                        p++;
+                        last_signal = 0;
+                        draining = 1;
+                        for ( int i = 0; i < nworkers; i++ )
+                            kill(stats[i].pid, SIGUSR2);
+                        continue;
                     }
-                    printf("%.*s", (int) received, buffer);
-                    fflush(stdout);
 
-                    total_bytes_in += received;
-                }
+                    fprintf(stderr, "shutting down...\n");
+                    for ( int i = 0; i < nworkers; i++ )
+                        kill(stats[i].pid, SIGTERM);
+                    while ( 0 < waitpid(-1, NULL, 0) || EINTR == errno )
+                        ;
+                    print_stats(stderr, stats, nworkers);
+                    exit(0);
 
-                switch ( received )
-                {
-                    case -1:
-                        switch ( errno )
-                        {
-                            case EAGAIN:
-                                // no data available right now, try again later...
-                                break;
-
-                            case ECONNRESET:
-                                // connection reset by the peer
-                                handle_close(epollfd, events[i].data.fd);
-                                break;
-
-                            case EBADF:
-                            case ECONNREFUSED:
-                            case EFAULT:
-                            case EINTR:
-                            case EINVAL:
-                            case ENOMEM:
-                            case ENOTCONN:
-                            case ENOTSOCK:
-                            default:
-                                fprintf(stderr, "socket recv error (%d)\n", errno);
-                                exit(1);
-                        }
-                        break;
-
-                    default:
-                        if ( 0 == total_bytes_in )
-                        {
-                            // The stream socket peer has performed an orderly shutdown.
-                            // recv returning 0 is a socket-closed notification.
-
-                            handle_close(epollfd, events[i].data.fd);
-                        }
-                }
+                case EFAULT:
+                case EINVAL:
+                case ENOMEM:
+                default:
+                    fprintf(stderr, "ppoll error (%d)\n", errno);
+                    exit(1);
             }
+        }
 
-            if ( events[i].events & EPOLLOUT )
+        if ( 0 < nready )
+        {
+            int listener_only;
+            int upgradefd = accept_control(controlfd, stats, nworkers, &listener_only);
+            if ( -1 != upgradefd )
             {
-                // socket is ready for writing
+                // The workers own the connections, so only the listener is handed over,
+                // and the workers drain theirs.
 
-                if ( 0 != total_bytes_in )
+                handoff(upgradefd, 0, listenfd);
+                close(upgradefd);
+                close(controlfd);
+                controlfd = -1;
+                close(listenfd);
+
+                draining = 1;
+                for ( int i = 0; i < nworkers; i++ )
+                    kill(stats[i].pid, SIGUSR2);
+            }
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-w|--workers N] [-o|--offload N [-s|--steal] | -S|--staged R,P,W | -b|--batch]\n"
+                    "          [-k|--work N] [-e|--backend NAME] [-M|--c1m]\n"
+                    "          [-C|--capture PATH [-P|--capture-payload]]\n"
+                    "          [-t|--selftest N [-z|--payload N|@PATH] [-d|--duration S]]\n"
+                    "          [-c|--control PATH] [-i|--inherit PATH] [-p|--profile [-H|--counters]]\n"
+                    "          [-W|--watchdog MS] [-R|--recorder PATH | -N|--no-recorder] [-K|--tcp-info MS]\n"
+                    "          [-g|--sample PATH [-G|--sample-rate HZ] [-j|--sample-perf]]\n"
+                    "          [-T|--tuning NAME]\n", prog);
+    fprintf(stderr, "  -w, --workers N     prefork N worker processes sharing the listener\n");
+    fprintf(stderr, "  -o, --offload N     run the handler on a pool of N threads\n");
+    fprintf(stderr, "  -s, --steal         let idle offload threads steal connections from busy ones\n");
+    fprintf(stderr, "  -S, --staged R,P,W  run read, process and write stages on R, P and W threads\n");
+    fprintf(stderr, "  -b, --batch         process the buffers of each event loop iteration in one pass\n");
+    fprintf(stderr, "  -k, --work N        add N hashing passes over each buffer to the handler\n");
+    fprintf(stderr, "  -e, --backend NAME  wait for events with epoll (default), poll or io_uring\n");
+    fprintf(stderr, "  -M, --c1m           raise the descriptor limit, accept with a full backlog\n");
+    fprintf(stderr, "                      and keep idle connections small, for a million of them\n");
+    fprintf(stderr, "  -C, --capture PATH  record the traffic to PATH, for client --replay\n");
+    fprintf(stderr, "  -P, --capture-payload\n");
+    fprintf(stderr, "                      record the data itself rather than its size and hash\n");
+    fprintf(stderr, "  -t, --selftest N    serve N socketpairs driven by a thread of the server\n");
+    fprintf(stderr, "                      instead of listening, then report and exit\n");
+    fprintf(stderr, "  -z, --payload N     bytes sent at a time by --selftest (default %d), or with\n", BUFLEN);
+    fprintf(stderr, "                      @PATH the contents of a file\n");
+    fprintf(stderr, "  -d, --duration S    how long --selftest runs (default 5)\n");
+    fprintf(stderr, "  -c, --control PATH  accept commands (stats, upgrade,\n");
+    fprintf(stderr, "                      stage NAME N) on a UNIX socket\n");
+    fprintf(stderr, "  -i, --inherit PATH  take over the listener and idle connections of the\n");
+    fprintf(stderr, "                      server whose control socket is PATH\n");
+    fprintf(stderr, "  -p, --profile       count the cycles spent in each phase of the loop, printed\n");
+    fprintf(stderr, "                      with the stats on SIGUSR1 and at exit\n");
+    fprintf(stderr, "  -H, --counters      --profile with instructions and cache misses as well\n");
+    fprintf(stderr, "  -W, --watchdog MS   report event loop iterations longer than MS, with the\n");
+    fprintf(stderr, "                      stack of the loop, and the time every iteration took\n");
+    fprintf(stderr, "  -R, --recorder PATH record the events of each connection to PATH.PID rather\n");
+    fprintf(stderr, "                      than to %s.PID, and keep it after exit, for\n", RECORDER_PATH);
+    fprintf(stderr, "                      trace/flight to decode\n");
+    fprintf(stderr, "  -N, --no-recorder   do not record the events of the connections\n");
+    fprintf(stderr, "  -K, --tcp-info MS   sample TCP_INFO of %d connections every MS and of each one\n", TCPINFO_BUDGET);
+    fprintf(stderr, "                      at close, shown with the stats\n");
+    fprintf(stderr, "  -g, --sample PATH   sample the stacks of the threads and write them to PATH as\n");
+    fprintf(stderr, "                      folded stacks on SIGUSR1 and at exit\n");
+    fprintf(stderr, "  -G, --sample-rate HZ\n");
+    fprintf(stderr, "                      samples per second of CPU time (default %d)\n", PROFILER_HZ);
+    fprintf(stderr, "  -j, --sample-perf   sample each thread with a perf event of its own where\n");
+    fprintf(stderr, "                      permitted, past the kernel's tick, at a cost to every\n");
+    fprintf(stderr, "                      context switch\n");
+    fprintf(stderr, "  -T, --tuning NAME   set the TCP options of a profile on the listener and so on\n");
+    fprintf(stderr, "                      the accepted connections: ");
+    tuning_names(stderr);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int nworkers = 0;
+    const char *control_path = NULL;
+    const char *inherit_path = NULL;
+    const char *capture_path = NULL;
+    int profile = 0;
+    int counters = 0;
+
+    static const struct option long_options[] =
+    {
+        { "workers",         required_argument, NULL, 'w' },
+        { "offload",         required_argument, NULL, 'o' },
+        { "steal",           no_argument,       NULL, 's' },
+        { "staged",          required_argument, NULL, 'S' },
+        { "batch",           no_argument,       NULL, 'b' },
+        { "work",            required_argument, NULL, 'k' },
+        { "backend",         required_argument, NULL, 'e' },
+        { "c1m",             no_argument,       NULL, 'M' },
+        { "capture",         required_argument, NULL, 'C' },
+        { "capture-payload", no_argument,       NULL, 'P' },
+        { "selftest",        required_argument, NULL, 't' },
+        { "payload",         required_argument, NULL, 'z' },
+        { "duration",        required_argument, NULL, 'd' },
+        { "control",         required_argument, NULL, 'c' },
+        { "inherit",         required_argument, NULL, 'i' },
+        { "profile",         no_argument,       NULL, 'p' },
+        { "counters",        no_argument,       NULL, 'H' },
+        { "watchdog",        required_argument, NULL, 'W' },
+        { "recorder",        required_argument, NULL, 'R' },
+        { "no-recorder",     no_argument,       NULL, 'N' },
+        { "tcp-info",        required_argument, NULL, 'K' },
+        { "sample",          required_argument, NULL, 'g' },
+        { "sample-rate",     required_argument, NULL, 'G' },
+        { "sample-perf",     no_argument,       NULL, 'j' },
+        { "tuning",          required_argument, NULL, 'T' },
+        { "help",            no_argument,       NULL, 'h' },
+        { NULL,              0,                 NULL, 0   }
+    };
+
+    int opt;
+    while ( -1 != ( opt = getopt_long(argc, argv, "w:o:sS:bk:e:MC:Pt:z:d:c:i:pHW:R:NK:g:G:jT:h", long_options, NULL) ) )
+    {
+        switch ( opt )
+        {
+            case 'w':
+                nworkers = atoi(optarg);
+                if ( nworkers < 1 )
+                {
+                    fprintf(stderr, "invalid number of workers: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'o':
+                offload_threads = atoi(optarg);
+                if ( offload_threads < 1 )
                 {
-                    static char ack[] = "Ack\n";
+                    fprintf(stderr, "invalid number of offload threads: %s\n", optarg);
+                    exit(1);
+                }
+                break;
 
-                    int sent = send(events[i].data.fd, ack, sizeof(ack), 0);
+            case 's':
+                offload_policy = OFFLOAD_STEAL;
+                break;
 
-                    if ( -1 == sent )
-                    {
-                        switch ( errno )
-                        {
-                            case EBADF:
-                                // bad file descriptor
-                                // the connection was already closed while reading
-                                break;
-
-                            case ECONNRESET:
-                                // connection reset by the peer
-                                handle_close(epollfd, events[i].data.fd);
-                                break;
-
-                            case EACCES:
-                            case EAGAIN:
-                            case EALREADY:
-                            case EDESTADDRREQ:
-                            case EFAULT:
-                            case EINTR:
-                            case EINVAL:
-                            case EISCONN:
-                            case EMSGSIZE:
-                            case ENOBUFS:
-                            case ENOMEM:
-                            case ENOTCONN:
-                            case ENOTSOCK:
-                            case EOPNOTSUPP:
-                            case EPIPE:
-                            default:
-                                fprintf(stderr, "socket send error (%d)", errno);
-                                exit(1);
-                        }
-                    }
+            case 'S':
+                if ( 3 != sscanf(optarg, "%d,%d,%d", &staged_threads[STAGE_READ],
+                                 &staged_threads[STAGE_PROCESS], &staged_threads[STAGE_WRITE])
+                     || staged_threads[STAGE_READ] < 1 || staged_threads[STAGE_READ] > STAGED_MAX_THREADS
+                     || staged_threads[STAGE_PROCESS] < 1 || staged_threads[STAGE_PROCESS] > STAGED_MAX_THREADS
+                     || staged_threads[STAGE_WRITE] < 1 || staged_threads[STAGE_WRITE] > STAGED_MAX_THREADS )
+                {
+                    fprintf(stderr, "invalid stage threads: %s\n", optarg);
+                    exit(1);
                 }
-            }
+                break;
+
+            case 'b':
+                batch = (struct batch *) calloc(1, sizeof(struct batch));
+                if ( NULL == batch )
+                {
+                    fprintf(stderr, "out of memory\n");
+                    exit(1);
+                }
+                break;
 
-            if ( events[i].events & EPOLLERR )
+            case 'k':
             {
-                // error condition
-                fprintf(stderr, "EPOLLERR\n");
+                char *end;
+                long work = strtol(optarg, &end, 10);
+                if ( end == optarg || '\0' != *end || work < 0 || INT_MAX < work )
+                {
+                    fprintf(stderr, "invalid amount of handler work: %s\n", optarg);
+                    exit(1);
+                }
+                handler_work = (int) work;
+                break;
             }
+
+            case 'e':
+                backend = poller_find(optarg);
+                if ( -1 == backend )
+                {
+                    fprintf(stderr, "invalid backend: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'M':
+                c1m = 1;
+                break;
+
+            case 'C':
+                capture_path = optarg;
+                break;
+
+            case 'P':
+                capture_payload = 1;
+                break;
+
+            case 't':
+                selftest_pairs = atoi(optarg);
+                if ( selftest_pairs < 1 )
+                {
+                    fprintf(stderr, "invalid number of socketpairs: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'z':
+                load_selftest_payload(optarg);
+                break;
+
+            case 'd':
+                selftest_seconds = atof(optarg);
+                if ( selftest_seconds <= 0 )
+                {
+                    fprintf(stderr, "invalid duration: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'c':
+                control_path = optarg;
+                break;
+
+            case 'i':
+                inherit_path = optarg;
+                break;
+
+            case 'p':
+                profile = 1;
+                break;
+
+            case 'H':
+                profile = 1;
+                counters = 1;
+                break;
+
+            case 'W':
+                watchdog_ms = atoi(optarg);
+                if ( watchdog_ms < 1 )
+                {
+                    fprintf(stderr, "invalid watchdog threshold: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'R':
+                recorder_path = optarg;
+                recorder_named = 1;
+                break;
+
+            case 'N':
+                recorder_path = NULL;
+                recorder_named = 0;
+                break;
+
+            case 'K':
+                tcpinfo_ms = atoi(optarg);
+                if ( tcpinfo_ms < 1 )
+                {
+                    fprintf(stderr, "invalid sampling period: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'g':
+                sample_path = optarg;
+                break;
+
+            case 'G':
+                sample_rate = atoi(optarg);
+                if ( sample_rate < 1 || 1000000 < sample_rate )
+                {
+                    fprintf(stderr, "invalid sample rate: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'j':
+                sample_per_thread = 1;
+                break;
+
+            case 'T':
+                tuning = tuning_find(optarg);
+                if ( NULL == tuning )
+                {
+                    fprintf(stderr, "unknown tuning profile: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if ( 1 < ( 0 < offload_threads ) + ( 0 < staged_threads[STAGE_READ] ) + ( NULL != batch ) )
+    {
+        fprintf(stderr, "--offload, --staged and --batch cannot be combined\n");
+        exit(1);
+    }
+
+    // the data of the staged pipeline and of the workers never goes through this event loop
+    if ( NULL != capture_path && ( 0 < nworkers || 0 < staged_threads[STAGE_READ] ) )
+    {
+        fprintf(stderr, "--capture cannot be combined with --workers or --staged\n");
+        exit(1);
+    }
+
+    if ( 0 < selftest_pairs && ( 0 < nworkers || NULL != inherit_path ) )
+    {
+        fprintf(stderr, "--selftest cannot be combined with --workers or --inherit\n");
+        exit(1);
+    }
+
+    // the connections of the pipeline are not in the table, and socketpairs are not TCP
+    if ( 0 < tcpinfo_ms && ( 0 < staged_threads[STAGE_READ] || 0 < selftest_pairs ) )
+    {
+        fprintf(stderr, "--tcp-info cannot be combined with --staged or --selftest\n");
+        exit(1);
+    }
+
+    // the pipeline sends its acks without pushing them, --c1m sizes the buffers itself,
+    // and socketpairs are not TCP
+    if ( NULL != tuning && ( 0 < staged_threads[STAGE_READ] || c1m || 0 < selftest_pairs ) )
+    {
+        fprintf(stderr, "--tuning cannot be combined with --staged, --c1m or --selftest\n");
+        exit(1);
+    }
+
+    // the tables are per process, and the master only sees the workers' shared counters
+    if ( ( profile || NULL != sample_path ) && 0 < nworkers )
+    {
+        fprintf(stderr, "--profile and --sample cannot be combined with --workers\n");
+        exit(1);
+    }
+
+    if ( NULL != capture_path )
+        open_capture(capture_path);
+
+    // before any thread starts, so that they all see it
+    if ( profile )
+        phases_enable(counters, stderr);
+
+    if ( NULL != sample_path && -1 == profiler_start(sample_rate, sample_per_thread) )
+    {
+        fprintf(stderr, "sampler start error (%d)\n", errno);
+        exit(1);
+    }
+
+    // Without SA_RESTART, a signal interrupts epoll_wait() in the event loop and
+    // ppoll() in the master, so that both can react to it.
+
+    struct sigaction sa;
+    sa.sa_handler = signal_handler;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    if ( c1m )
+        raise_fd_limit();
+
+    init_connection_table();
+
+    // in prefork mode, connections cannot be shared by the workers, so only the listener is taken
+    int listenfd = ( 0 < selftest_pairs ) ? -1
+                 : ( NULL != inherit_path ) ? inherit(inherit_path, 0 < nworkers) : create_listener();
+    int controlfd = ( NULL != control_path ) ? create_control_socket(control_path) : -1;
+
+    // the accepted sockets inherit the options of the listener, an inherited one included
+    if ( NULL != tuning )
+    {
+        if ( -1 == tuning_set_buffers(tuning, listenfd) || -1 == tuning_apply(tuning, listenfd) )
+        {
+            fprintf(stderr, "setsockopt error (%d)\n", errno);
+            exit(1);
+        }
+        tuning_print(stderr, tuning, listenfd);
+    }
+
+    // The counters live in shared memory so that the master can read what the
+    // workers write, and so that they survive a worker being restarted.
+
+    int nslots = ( 0 < nworkers ) ? nworkers : 1;
+    struct worker_stats *stats = mmap(NULL, nslots * sizeof(struct worker_stats),
+                                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( MAP_FAILED == stats )
+    {
+        switch ( errno )
+        {
+            case EAGAIN:
+            case EINVAL:
+            case ENFILE:
+            case ENOMEM:
+            default:
+                fprintf(stderr, "mmap error (%d)\n", errno);
+                exit(1);
         }
     }
+
+    if ( 0 < nworkers )
+    {
+        run_master(listenfd, controlfd, nworkers, stats);
+    }
+    else
+    {
+        stats->pid = getpid();
+        stats->started = time(NULL);
+        run_event_loop(listenfd, controlfd, 0, stats);
+    }
 }
@@ -0,0 +1,853 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A staged (SEDA) pipeline. See staged.h.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>      // sched_yield()
+#include <signal.h>     // pthread_sigmask()
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h> // getrlimit()
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "phases.h"
+#include "profiler.h"
+#include "queue.h"
+#include "recorder.h"
+#include "staged.h"
+
+#define STAGED_BUFLEN 512
+
+// max number of events that can be returned by epoll at a time
+#define MAX_EVENTS 20
+
+// number of buffers in flight across all stages
+#define STAGED_JOBS 8192
+
+// Number of connection tasks per stage. Connections whose descriptors collide
+// share a task, which serializes them with each other but never reorders anything.
+#define STAGED_TASKS 4096
+
+// max number of buffers a thread handles for a task before moving on to another one
+#define STAGED_TASK_BUDGET 32
+
+// capacity of the queue of accepted connections
+#define STAGED_ACCEPT_QUEUE 1024
+
+// how long an idle read thread waits before checking whether it has been parked
+#define STAGED_READ_TIMEOUT_MS 100
+
+enum job_kind
+{
+    JOB_DATA,
+    JOB_CLOSE,
+    JOB_FLUSH           // the connection can take the rest of its ack
+};
+
+struct stage_job
+{
+    struct mpsc_link link;
+    int fd;
+    int kind;
+    int ack;                // the last buffer of a burst, which gets acknowledged
+    size_t len;
+    uint64_t queued_ns;
+    char data[STAGED_BUFLEN];
+};
+
+struct stage_task
+{
+    struct mpsc_list jobs;
+
+    // set while the task is runnable or being run
+    int scheduled;
+};
+
+struct stage_thread
+{
+    struct stage *stage;
+    pthread_t thread;
+    int index;
+
+    // time spent handling items, and time spent not parked
+    uint64_t busy_ns;
+    uint64_t running_ns;
+    uint64_t running_since;
+    int parked;
+
+    struct histogram service;
+};
+
+struct stage
+{
+    const char *name;
+    void *(*main)(void *);
+
+    // threads with an index at or above active are parked
+    int active;
+    int created;
+    pthread_mutex_t lock;
+    pthread_cond_t resized;
+    struct stage_thread threads[STAGED_MAX_THREADS];
+
+    // process and write: connections with queued buffers
+    struct stage_task *tasks;
+    struct mpmc_queue runnable;
+    int wakefd;
+    int nsleeping;
+
+    // items waiting for the stage
+    long queued;
+    unsigned long items;
+
+    // write: acks that had to wait for the connection to be writable, and that failed
+    unsigned long delayed;
+    unsigned long failed;
+
+    // read: bytes received; write: acks sent in full
+    unsigned long bytes;
+    unsigned long acks;
+};
+
+// The ack of a connection, which the write stage sends once the connection can take it.
+// Only the write thread that has the connection's task touches it.
+struct ack_state
+{
+    uint8_t left;           // bytes of the ack being sent that are not sent yet
+    uint8_t owed;           // another ack is due once that one is sent
+    uint8_t delayed;        // the ack waits for the connection to be writable
+
+    // for the recorder: bytes written out since the last ack was asked for, those the
+    // owed ack acknowledges, and those the ack being sent does
+    uint32_t unacked;
+    uint32_t owed_bytes;
+    uint32_t acking;
+};
+
+// What the recorder is told of a connection besides its acks: its id, set before the
+// connection is queued for the read stage, and the bytes received, counted by the read
+// thread that has the connection and read by the write stage once it is closed.
+struct conn_state
+{
+    uint32_t id;
+    uint64_t bytes_in;
+};
+
+static struct stage stages[STAGE_COUNT];
+
+static staged_handler handler;
+static staged_output output;
+static staged_acking acking;
+
+static struct mpmc_queue free_jobs;
+
+// accepted connections, waiting to be registered by a read thread
+static struct mpmc_queue accepted;
+static int accept_eventfd;
+static struct histogram accept_service;
+
+static int read_epollfd;
+
+// connections waiting to be writable to send the rest of their ack, watched by the
+// read threads through read_epollfd
+static int write_epollfd;
+
+// indexed by descriptor
+static struct ack_state *acks;
+static struct conn_state *conns;
+static int max_acks;
+
+static int connections = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// waits for a free buffer, which is what bounds the whole pipeline
+static struct stage_job *get_job(void)
+{
+    struct stage_job *job;
+    while ( NULL == ( job = (struct stage_job *) mpmc_pop(&free_jobs) ) )
+        sched_yield();
+    return job;
+}
+
+static void put_job(struct stage_job *job)
+{
+    // cannot be full, it has room for every job
+    while ( -1 == mpmc_push(&free_jobs, job) )
+        sched_yield();
+}
+
+static void wake_one(struct stage *s)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ( 0 == __atomic_load_n(&s->nsleeping, __ATOMIC_RELAXED) )
+        return;
+
+    uint64_t one = 1;
+    if ( -1 == write(s->wakefd, &one, sizeof(one)) )
+    {
+        fprintf(stderr, "staged eventfd write error (%d)\n", errno);
+        exit(1);
+    }
+}
+
+static void make_runnable(struct stage *s, struct stage_task *task)
+{
+    // cannot be full, a task is never in it twice
+    while ( -1 == mpmc_push(&s->runnable, task) )
+        sched_yield();
+    wake_one(s);
+}
+
+// queues a buffer on its connection's task, and makes the task runnable if no thread has it
+static void submit(struct stage *s, struct stage_job *job)
+{
+    struct stage_task *task = &s->tasks[(unsigned int) job->fd % STAGED_TASKS];
+
+    job->queued_ns = now_ns();
+    __atomic_fetch_add(&s->queued, 1, __ATOMIC_RELAXED);
+
+    mpsc_push(&task->jobs, &job->link);
+    if ( 0 == __atomic_exchange_n(&task->scheduled, 1, __ATOMIC_ACQ_REL) )
+        make_runnable(s, task);
+}
+
+// parks the thread while the stage has fewer active threads than its index
+static void park_if_needed(struct stage_thread *t)
+{
+    struct stage *s = t->stage;
+
+    if ( t->index < __atomic_load_n(&s->active, __ATOMIC_RELAXED) )
+        return;
+
+    pthread_mutex_lock(&s->lock);
+
+    HIST_STORE(t->running_ns, t->running_ns + ( now_ns() - t->running_since ));
+    HIST_STORE(t->parked, 1);
+
+    while ( t->index >= s->active )
+        pthread_cond_wait(&s->resized, &s->lock);
+
+    t->running_since = now_ns();
+    HIST_STORE(t->parked, 0);
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void handle_process(struct stage_job *job)
+{
+    if ( JOB_DATA == job->kind )
+        handler(job->data, job->len);
+
+    submit(&stages[STAGE_WRITE], job);
+}
+
+// has the read threads tell the write stage once the connection is writable
+static void watch_writable(int fd)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLONESHOT;
+    ev.data.fd = fd;
+
+    if ( -1 == epoll_ctl(write_epollfd, EPOLL_CTL_MOD, fd, &ev)
+         && ( ENOENT != errno || -1 == epoll_ctl(write_epollfd, EPOLL_CTL_ADD, fd, &ev) ) )
+    {
+        fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+        exit(1);
+    }
+}
+
+// Sends what is owed of the acks of a connection. What the connection cannot take now
+// is sent by a flush job once it is writable again.
+static void send_acks(int fd)
+{
+    static char ack[] = "Ack\n";
+    struct stage *s = &stages[STAGE_WRITE];
+    struct ack_state *a = &acks[fd];
+
+    struct phase_mark mark;
+    phase_begin(&mark, PHASE_SEND);
+
+    while ( 0 < a->left || a->owed )
+    {
+        if ( 0 == a->left )
+        {
+            a->left = sizeof(ack);
+            a->owed = 0;
+            a->acking = a->owed_bytes;
+            a->owed_bytes = 0;
+            if ( NULL != acking )
+                acking(fd, a->acking);
+        }
+
+        ssize_t sent = send(fd, ack + sizeof(ack) - a->left, a->left, MSG_NOSIGNAL);
+        if ( -1 == sent )
+        {
+            if ( EINTR == errno )
+                continue;
+
+            if ( EAGAIN == errno || EWOULDBLOCK == errno )
+            {
+                __atomic_fetch_add(&s->delayed, 1, __ATOMIC_RELAXED);
+                if ( !a->delayed )
+                    record(RECORD_EAGAIN, conns[fd].id, fd, a->left);
+                a->delayed = 1;
+                watch_writable(fd);
+            }
+            else
+            {
+                // a peer that is gone is taken care of by the close that follows
+                __atomic_fetch_add(&s->failed, 1, __ATOMIC_RELAXED);
+                record(RECORD_ERROR, conns[fd].id, fd, errno);
+                a->left = 0;
+                a->owed = 0;
+                a->delayed = 0;
+            }
+            break;
+        }
+
+        a->left -= sent;
+        if ( 0 == a->left )
+        {
+            __atomic_fetch_add(&s->acks, 1, __ATOMIC_RELAXED);
+            record(RECORD_ACK, conns[fd].id, fd, a->acking);
+            if ( a->delayed )
+                record(RECORD_DRAINED, conns[fd].id, fd, 0);
+            a->delayed = 0;
+        }
+    }
+
+    phase_end(&mark);
+}
+
+static void handle_write(struct stage_job *job)
+{
+    if ( JOB_DATA == job->kind )
+    {
+        output(job->fd, job->data, job->len);
+        acks[job->fd].unacked += job->len;
+
+        if ( job->ack )
+        {
+            // One ack acknowledges everything received before it, so one still being
+            // sent only leaves another owed after it.
+            acks[job->fd].owed = 1;
+            acks[job->fd].owed_bytes += acks[job->fd].unacked;
+            acks[job->fd].unacked = 0;
+            if ( 0 == acks[job->fd].left )
+                send_acks(job->fd);
+        }
+    }
+    else if ( JOB_FLUSH == job->kind )
+    {
+        // the descriptor may have been closed and reused since, which only sends
+        // what the new connection owes, if anything
+        send_acks(job->fd);
+    }
+    else
+    {
+        // the read stage no longer watches the connection, and everything before the
+        // close has been written, so nothing refers to the descriptor any more
+        record(RECORD_CLOSE, conns[job->fd].id, job->fd, conns[job->fd].bytes_in);
+        memset(&acks[job->fd], 0, sizeof(struct ack_state));
+        close(job->fd);
+        __atomic_fetch_sub(&connections, 1, __ATOMIC_RELAXED);
+    }
+
+    put_job(job);
+}
+
+// main of the process and write threads
+static void *task_stage_main(void *arg)
+{
+    struct stage_thread *t = (struct stage_thread *) arg;
+    struct stage *s = t->stage;
+    void (*handle)(struct stage_job *) = ( &stages[STAGE_PROCESS] == s ) ? handle_process : handle_write;
+    char name[16];
+    snprintf(name, sizeof(name), "stage-%s", s->name);
+    profiler_thread(name);
+
+    while ( 1 )
+    {
+        park_if_needed(t);
+
+        struct stage_task *task = (struct stage_task *) mpmc_pop(&s->runnable);
+        if ( NULL == task )
+        {
+            // announce that we are going to sleep, then look again
+            __atomic_fetch_add(&s->nsleeping, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            task = (struct stage_task *) mpmc_pop(&s->runnable);
+            if ( NULL == task )
+            {
+                uint64_t value;
+                if ( -1 == read(s->wakefd, &value, sizeof(value)) && EINTR != errno )
+                {
+                    fprintf(stderr, "staged eventfd read error (%d)\n", errno);
+                    exit(1);
+                }
+            }
+
+            __atomic_fetch_sub(&s->nsleeping, 1, __ATOMIC_SEQ_CST);
+
+            if ( NULL == task )
+                continue;
+        }
+
+        uint64_t started = now_ns();
+        int n = 0;
+        struct mpsc_link *link;
+
+        while ( n < STAGED_TASK_BUDGET && NULL != ( link = mpsc_pop(&task->jobs) ) )
+        {
+            struct stage_job *job = (struct stage_job *) link;
+            uint64_t begin = now_ns();
+
+            __atomic_fetch_sub(&s->queued, 1, __ATOMIC_RELAXED);
+            handle(job);
+
+            hist_record(&t->service, now_ns() - begin);
+            n++;
+        }
+
+        __atomic_fetch_add(&s->items, n, __ATOMIC_RELAXED);
+        HIST_STORE(t->busy_ns, t->busy_ns + ( now_ns() - started ));
+
+        if ( STAGED_TASK_BUDGET == n )
+        {
+            // let the other connections have their turn
+            make_runnable(s, task);
+            continue;
+        }
+
+        // give the task up, then look again for a buffer queued in between
+        __atomic_store_n(&task->scheduled, 0, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if ( mpsc_pending(&task->jobs) && 0 == __atomic_exchange_n(&task->scheduled, 1, __ATOMIC_ACQ_REL) )
+            make_runnable(s, task);
+    }
+
+    return NULL;
+}
+
+// registers the connections queued by the accept stage
+static void register_accepted(void)
+{
+    uint64_t value;
+    if ( -1 == read(accept_eventfd, &value, sizeof(value)) && EAGAIN != errno )
+    {
+        fprintf(stderr, "staged eventfd read error (%d)\n", errno);
+        exit(1);
+    }
+
+    void *item;
+    while ( NULL != ( item = mpmc_pop(&accepted) ) )
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.fd = (int) (intptr_t) item - 1;
+
+        if ( -1 == epoll_ctl(read_epollfd, EPOLL_CTL_ADD, ev.data.fd, &ev) )
+        {
+            fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+            exit(1);
+        }
+    }
+}
+
+// hands the connections that became writable over to the write stage
+static void flush_writable(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    int nfds = epoll_wait(write_epollfd, events, MAX_EVENTS, 0);
+    for ( int i = 0; i < nfds; i++ )
+    {
+        struct stage_job *job = get_job();
+        job->fd = events[i].data.fd;
+        job->kind = JOB_FLUSH;
+        job->ack = 0;
+        job->len = 0;
+        submit(&stages[STAGE_WRITE], job);
+    }
+}
+
+// receives until EAGAIN and passes the buffers on, the last one with an ack
+static void read_connection(int fd)
+{
+    struct stage_job *pending = NULL;
+    ssize_t received;
+    unsigned long bytes = 0;
+
+    while ( 1 )
+    {
+        struct stage_job *job = get_job();
+
+        struct phase_mark mark;
+        phase_begin(&mark, PHASE_RECV);
+        received = recv(fd, job->data, sizeof(job->data), 0);
+        phase_end(&mark);
+        if ( 0 >= received )
+        {
+            put_job(job);
+            break;
+        }
+
+        job->fd = fd;
+        job->kind = JOB_DATA;
+        job->ack = 0;
+        job->len = received;
+        if ( 0 == conns[fd].bytes_in + bytes )
+            record(RECORD_FIRST_BYTE, conns[fd].id, fd, received);
+        bytes += received;
+
+        if ( NULL != pending )
+            submit(&stages[STAGE_PROCESS], pending);
+        pending = job;
+    }
+
+    if ( NULL != pending )
+    {
+        pending->ack = 1;
+        submit(&stages[STAGE_PROCESS], pending);
+    }
+
+    if ( 0 < bytes )
+    {
+        conns[fd].bytes_in += bytes;
+        __atomic_fetch_add(&stages[STAGE_READ].bytes, bytes, __ATOMIC_RELAXED);
+    }
+
+    if ( -1 == received && EAGAIN != errno && EINTR != errno )
+        record(RECORD_ERROR, conns[fd].id, fd, errno);
+
+    if ( -1 == received && ( EAGAIN == errno || EINTR == errno ) )
+    {
+        // rearm, so that the next data is picked up by whichever read thread is free
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.fd = fd;
+
+        if ( -1 == epoll_ctl(read_epollfd, EPOLL_CTL_MOD, fd, &ev) )
+        {
+            fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+            exit(1);
+        }
+        return;
+    }
+
+    // closed or reset by the peer: the write stage closes the descriptor after
+    // everything before it has been written
+
+    if ( -1 == epoll_ctl(read_epollfd, EPOLL_CTL_DEL, fd, NULL) )
+    {
+        fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+        exit(1);
+    }
+
+    struct stage_job *job = get_job();
+    job->fd = fd;
+    job->kind = JOB_CLOSE;
+    job->ack = 0;
+    job->len = 0;
+    submit(&stages[STAGE_PROCESS], job);
+}
+
+static void *read_stage_main(void *arg)
+{
+    struct stage_thread *t = (struct stage_thread *) arg;
+    struct stage *s = t->stage;
+    struct epoll_event events[MAX_EVENTS];
+    profiler_thread("stage-read");
+
+    while ( 1 )
+    {
+        park_if_needed(t);
+
+        struct phase_mark mark;
+        phase_begin(&mark, PHASE_WAIT);
+        int nfds = epoll_wait(read_epollfd, events, MAX_EVENTS, STAGED_READ_TIMEOUT_MS);
+        phase_end(&mark);
+        if ( -1 == nfds )
+        {
+            if ( EINTR == errno )
+                continue;
+            fprintf(stderr, "epoll_wait error (%d)\n", errno);
+            exit(1);
+        }
+
+        uint64_t started = now_ns();
+
+        for ( int i = 0; i < nfds; i++ )
+        {
+            if ( events[i].data.fd == accept_eventfd )
+            {
+                register_accepted();
+                continue;
+            }
+
+            if ( events[i].data.fd == write_epollfd )
+            {
+                flush_writable();
+                continue;
+            }
+
+            uint64_t begin = now_ns();
+            read_connection(events[i].data.fd);
+            hist_record(&t->service, now_ns() - begin);
+        }
+
+        __atomic_fetch_add(&s->items, nfds, __ATOMIC_RELAXED);
+        HIST_STORE(t->busy_ns, t->busy_ns + ( now_ns() - started ));
+    }
+
+    return NULL;
+}
+
+static int init_stage(struct stage *s, const char *name, void *(*main)(void *), int with_tasks)
+{
+    s->name = name;
+    s->main = main;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->resized, NULL);
+
+    if ( with_tasks )
+    {
+        s->tasks = (struct stage_task *) calloc(STAGED_TASKS, sizeof(struct stage_task));
+        if ( NULL == s->tasks || -1 == mpmc_init(&s->runnable, STAGED_TASKS) )
+            return -1;
+
+        for ( int i = 0; i < STAGED_TASKS; i++ )
+            mpsc_init(&s->tasks[i].jobs);
+
+        s->wakefd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+        if ( -1 == s->wakefd )
+            return -1;
+    }
+
+    return 0;
+}
+
+int staged_start(int read_threads, int process_threads, int write_threads,
+                 staged_handler handler_fn, staged_output output_fn, staged_acking acking_fn)
+{
+    handler = handler_fn;
+    output = output_fn;
+    acking = acking_fn;
+
+    if ( -1 == mpmc_init(&free_jobs, STAGED_JOBS) || -1 == mpmc_init(&accepted, STAGED_ACCEPT_QUEUE) )
+        return -1;
+
+    struct stage_job *jobs = (struct stage_job *) calloc(STAGED_JOBS, sizeof(struct stage_job));
+    if ( NULL == jobs )
+        return -1;
+    for ( int i = 0; i < STAGED_JOBS; i++ )
+        mpmc_push(&free_jobs, &jobs[i]);
+
+    stages[STAGE_ACCEPT].name = "accept";
+    stages[STAGE_ACCEPT].active = stages[STAGE_ACCEPT].created = 1;
+
+    if ( -1 == init_stage(&stages[STAGE_READ], "read", read_stage_main, 0)
+         || -1 == init_stage(&stages[STAGE_PROCESS], "process", task_stage_main, 1)
+         || -1 == init_stage(&stages[STAGE_WRITE], "write", task_stage_main, 1) )
+    {
+        return -1;
+    }
+
+    // an ack state for every descriptor the process may have
+    struct rlimit rl;
+    if ( -1 == getrlimit(RLIMIT_NOFILE, &rl) )
+        return -1;
+    max_acks = ( RLIM_INFINITY == rl.rlim_cur || 1048576 < rl.rlim_cur ) ? 1048576 : (int) rl.rlim_cur;
+    acks = (struct ack_state *) calloc(max_acks, sizeof(struct ack_state));
+    conns = (struct conn_state *) calloc(max_acks, sizeof(struct conn_state));
+    if ( NULL == acks || NULL == conns )
+        return -1;
+
+    read_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    write_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    accept_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( -1 == read_epollfd || -1 == write_epollfd || -1 == accept_eventfd )
+        return -1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = accept_eventfd;
+    if ( -1 == epoll_ctl(read_epollfd, EPOLL_CTL_ADD, accept_eventfd, &ev) )
+        return -1;
+
+    ev.data.fd = write_epollfd;
+    if ( -1 == epoll_ctl(read_epollfd, EPOLL_CTL_ADD, write_epollfd, &ev) )
+        return -1;
+
+    if ( -1 == staged_set_threads(STAGE_WRITE, write_threads)
+         || -1 == staged_set_threads(STAGE_PROCESS, process_threads)
+         || -1 == staged_set_threads(STAGE_READ, read_threads) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+void staged_add_connection(int connfd, unsigned long id)
+{
+    uint64_t begin = now_ns();
+
+    // beyond the ack states, which only a raised descriptor limit allows
+    if ( max_acks <= connfd )
+    {
+        fprintf(stderr, "staged connection overflow (%d)\n", connfd);
+        close(connfd);
+        return;
+    }
+
+    __atomic_fetch_add(&connections, 1, __ATOMIC_RELAXED);
+    conns[connfd].id = (uint32_t) id;
+    conns[connfd].bytes_in = 0;
+
+    // 0 would read as an empty queue, hence the offset
+    while ( -1 == mpmc_push(&accepted, (void *) (intptr_t) ( connfd + 1 )) )
+        sched_yield();
+
+    uint64_t one = 1;
+    if ( -1 == write(accept_eventfd, &one, sizeof(one)) )
+    {
+        fprintf(stderr, "staged eventfd write error (%d)\n", errno);
+        exit(1);
+    }
+
+    stages[STAGE_ACCEPT].items++;
+    hist_record(&accept_service, now_ns() - begin);
+}
+
+int staged_connections(void)
+{
+    return __atomic_load_n(&connections, __ATOMIC_RELAXED);
+}
+
+void staged_get_totals(unsigned long *bytes_in, unsigned long *acks)
+{
+    *bytes_in = __atomic_load_n(&stages[STAGE_READ].bytes, __ATOMIC_RELAXED);
+    *acks = __atomic_load_n(&stages[STAGE_WRITE].acks, __ATOMIC_RELAXED);
+}
+
+int staged_find(const char *name)
+{
+    for ( int i = 0; i < STAGE_COUNT; i++ )
+    {
+        if ( NULL != stages[i].name && 0 == strcmp(stages[i].name, name) )
+            return i;
+    }
+    return -1;
+}
+
+int staged_set_threads(int stage, int nthreads)
+{
+    if ( STAGE_READ != stage && STAGE_PROCESS != stage && STAGE_WRITE != stage )
+        return -1;
+    if ( nthreads < 1 || STAGED_MAX_THREADS < nthreads )
+        return -1;
+
+    struct stage *s = &stages[stage];
+
+    pthread_mutex_lock(&s->lock);
+
+    // signals are left to the event loop thread, the new threads inherit the mask
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+
+    while ( s->created < nthreads )
+    {
+        struct stage_thread *t = &s->threads[s->created];
+        t->stage = s;
+        t->index = s->created;
+        t->running_since = now_ns();
+
+        int err = pthread_create(&t->thread, NULL, s->main, t);
+        if ( 0 != err )
+        {
+            pthread_sigmask(SIG_SETMASK, &saved, NULL);
+            pthread_mutex_unlock(&s->lock);
+            errno = err;
+            return -1;
+        }
+        s->created++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    __atomic_store_n(&s->active, nthreads, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&s->resized);
+
+    pthread_mutex_unlock(&s->lock);
+
+    // sleeping threads only notice that they are to be parked once woken
+    if ( 0 != s->wakefd )
+    {
+        uint64_t n = s->created;
+        if ( -1 == write(s->wakefd, &n, sizeof(n)) )
+            return -1;
+    }
+
+    return 0;
+}
+
+void staged_print_stats(FILE *out)
+{
+    uint64_t now = now_ns();
+
+    fprintf(out, "stage accept: threads:1, queue:%lu, items:%lu\n",
+            (unsigned long) mpmc_size(&accepted), stages[STAGE_ACCEPT].items);
+    hist_print(out, "stage accept service", &accept_service, 1000.0, "us");
+
+    for ( int i = STAGE_READ; i < STAGE_COUNT; i++ )
+    {
+        struct stage *s = &stages[i];
+        struct histogram service = { 0 };
+        uint64_t busy = 0, running = 0;
+
+        for ( int j = 0; j < s->created; j++ )
+        {
+            struct stage_thread *t = &s->threads[j];
+
+            hist_merge(&service, &t->service);
+            busy += HIST_LOAD(t->busy_ns);
+            running += HIST_LOAD(t->running_ns);
+            if ( !HIST_LOAD(t->parked) )
+                running += now - t->running_since;
+        }
+
+        long queued = ( STAGE_READ == i ) ? (long) mpmc_size(&accepted) : __atomic_load_n(&s->queued, __ATOMIC_RELAXED);
+
+        fprintf(out, "stage %s: threads:%d, queue:%ld, items:%lu, occupancy:%.1f%%\n",
+                s->name, __atomic_load_n(&s->active, __ATOMIC_RELAXED), queued,
+                __atomic_load_n(&s->items, __ATOMIC_RELAXED),
+                ( 0 < running ) ? 100.0 * busy / running : 0.0);
+
+        char name[64];
+        snprintf(name, sizeof(name), "stage %s service", s->name);
+        hist_print(out, name, &service, 1000.0, "us");
+    }
+
+    fprintf(out, "stage write acks: delayed:%lu, failed:%lu\n",
+            __atomic_load_n(&stages[STAGE_WRITE].delayed, __ATOMIC_RELAXED),
+            __atomic_load_n(&stages[STAGE_WRITE].failed, __ATOMIC_RELAXED));
+}
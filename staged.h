@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A staged (SEDA) pipeline: accept, read, process and write each run on their own
+ * threads, connected by bounded lock-free queues.
+ *
+ *   accept   the event loop thread, which accepts connections and queues them
+ *   read     receives from connections registered with EPOLLONESHOT in an epoll
+ *            instance shared by the read threads, so any of them can serve any
+ *            connection, but only one at a time
+ *   process  runs the handler on the received buffers
+ *   write    outputs the processed buffers, sends the acks and closes connections;
+ *            the rest of an ack a connection could not take is sent once the read
+ *            threads see that it is writable
+ *
+ * Between process and write, buffers are queued per connection, and a connection is
+ * scheduled on at most one thread of a stage at a time, so that its buffers stay in
+ * order whatever the number of threads.
+ *
+ * The stages record what happens to each connection in the flight recorder, as the event
+ * loop does, under the id it was handed over with; see recorder.h.
+ *
+ * Each stage reports its queue length, its service time per item and its occupancy
+ * (the share of its threads' time spent working), and the number of threads of the
+ * read, process and write stages can be changed while running.
+ */
+#ifndef STAGED_H
+#define STAGED_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define STAGED_MAX_THREADS 16
+
+enum stage_id
+{
+    STAGE_ACCEPT,
+    STAGE_READ,
+    STAGE_PROCESS,
+    STAGE_WRITE,
+    STAGE_COUNT
+};
+
+typedef void (*staged_handler)(char *buffer, size_t len);
+typedef void (*staged_output)(int fd, char *buffer, size_t len);
+typedef void (*staged_acking)(int fd, unsigned long bytes);
+
+// Starts the read, process and write threads. acking, if not NULL, is called by the
+// write stage before it sends each ack, with the bytes the ack acknowledges.
+int staged_start(int read_threads, int process_threads, int write_threads,
+                 staged_handler handler, staged_output output, staged_acking acking);
+
+// hands an accepted, non-blocking connection over to the read stage, under the id the
+// flight recorder knows it by
+void staged_add_connection(int connfd, unsigned long id);
+
+// number of connections not closed yet
+int staged_connections(void);
+
+// bytes received by the read stage and acks sent by the write stage, so far
+void staged_get_totals(unsigned long *bytes_in, unsigned long *acks);
+
+// returns the stage of the given name, or -1
+int staged_find(const char *name);
+
+// changes the number of threads of the read, process or write stage
+int staged_set_threads(int stage, int nthreads);
+
+void staged_print_stats(FILE *out);
+
+#endif // STAGED_H
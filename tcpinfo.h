@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The health of TCP connections as the kernel sees it, read with getsockopt(TCP_INFO):
+ * the round-trip time and the delivery rate each time a connection is sampled, and at
+ * its close the segments it retransmitted and how long its sends were held back by the
+ * peer's receive window or by its own send buffer. Together they tell a slow transfer
+ * caused by the network from one caused by either end.
+ *
+ * A caller samples at most TCPINFO_BUDGET connections per period, taking turns over all
+ * of them, so that the cost of sampling stays the same however many there are, and
+ * samples each connection once more when it closes.
+ *
+ * Like histogram.h, a struct tcp_health has a single writer, and those of different
+ * threads or processes are combined with tcp_health_merge().
+ */
+#ifndef TCPINFO_H
+#define TCPINFO_H
+
+#include <linux/tcp.h>  // struct tcp_info, newer than that of netinet/tcp.h
+#include <netinet/in.h> // IPPROTO_TCP
+#include <stddef.h>     // offsetof()
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "histogram.h"
+
+// connections sampled per period at most, and looked at for them, open or not
+#define TCPINFO_BUDGET 64
+#define TCPINFO_SCAN 4096
+
+struct tcp_health
+{
+    unsigned long samples;
+    unsigned long closes;
+    unsigned long failures;         // sockets that are not TCP, or already reset
+    uint64_t segments;              // sent by the connections sampled at close
+    uint64_t retransmitted;
+    uint64_t busy;                  // time they had data to send, in us
+    uint64_t rwnd_limited;
+    uint64_t sndbuf_limited;
+    struct histogram rtt;           // in ns
+    struct histogram delivery_rate; // in bytes per second
+    struct histogram retransmits;   // per connection, at close
+    struct histogram rwnd_time;     // per connection, at close, in ns
+    struct histogram sndbuf_time;
+};
+
+// whether the kernel filled in a field, older ones returning a shorter struct tcp_info
+#define TCPINFO_HAS(len, field) \
+    ( (len) >= offsetof(struct tcp_info, field) + sizeof(((struct tcp_info *) 0)->field) )
+
+// Samples a connection, with what only makes sense over its lifetime if it is closing.
+// Returns -1 with errno set if the socket could not be sampled.
+static inline int tcp_health_sample(struct tcp_health *h, int fd, int closing)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if ( -1 == getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) )
+    {
+        HIST_STORE(h->failures, h->failures + 1);
+        return -1;
+    }
+
+    HIST_STORE(h->samples, h->samples + 1);
+
+    // nothing was measured before the first ack
+    if ( 0 != info.tcpi_rtt )
+        hist_record(&h->rtt, (uint64_t) info.tcpi_rtt * 1000);
+    if ( TCPINFO_HAS(len, tcpi_delivery_rate) && 0 != info.tcpi_delivery_rate )
+        hist_record(&h->delivery_rate, info.tcpi_delivery_rate);
+
+    if ( !closing )
+        return 0;
+
+    HIST_STORE(h->closes, h->closes + 1);
+    hist_record(&h->retransmits, info.tcpi_total_retrans);
+    HIST_STORE(h->retransmitted, h->retransmitted + info.tcpi_total_retrans);
+    if ( TCPINFO_HAS(len, tcpi_segs_out) )
+        HIST_STORE(h->segments, h->segments + info.tcpi_segs_out);
+
+    if ( TCPINFO_HAS(len, tcpi_sndbuf_limited) )
+    {
+        HIST_STORE(h->busy, h->busy + info.tcpi_busy_time);
+        HIST_STORE(h->rwnd_limited, h->rwnd_limited + info.tcpi_rwnd_limited);
+        HIST_STORE(h->sndbuf_limited, h->sndbuf_limited + info.tcpi_sndbuf_limited);
+        hist_record(&h->rwnd_time, info.tcpi_rwnd_limited * 1000);
+        hist_record(&h->sndbuf_time, info.tcpi_sndbuf_limited * 1000);
+    }
+
+    return 0;
+}
+
+static inline void tcp_health_merge(struct tcp_health *to, struct tcp_health *from)
+{
+    to->samples += HIST_LOAD(from->samples);
+    to->closes += HIST_LOAD(from->closes);
+    to->failures += HIST_LOAD(from->failures);
+    to->segments += HIST_LOAD(from->segments);
+    to->retransmitted += HIST_LOAD(from->retransmitted);
+    to->busy += HIST_LOAD(from->busy);
+    to->rwnd_limited += HIST_LOAD(from->rwnd_limited);
+    to->sndbuf_limited += HIST_LOAD(from->sndbuf_limited);
+
+    hist_merge(&to->rtt, &from->rtt);
+    hist_merge(&to->delivery_rate, &from->delivery_rate);
+    hist_merge(&to->retransmits, &from->retransmits);
+    hist_merge(&to->rwnd_time, &from->rwnd_time);
+    hist_merge(&to->sndbuf_time, &from->sndbuf_time);
+}
+
+static inline void tcp_health_print(FILE *out, struct tcp_health *h)
+{
+    uint64_t segments = HIST_LOAD(h->segments), busy = HIST_LOAD(h->busy);
+
+    fprintf(out, "tcp: samples:%lu, closes:%lu, failures:%lu, retransmitted:%lu/%lu segments (%.3f%%), "
+                 "busy:%.1fms, rwnd limited:%.1f%%, sndbuf limited:%.1f%%\n",
+            HIST_LOAD(h->samples), HIST_LOAD(h->closes), HIST_LOAD(h->failures),
+            (unsigned long) HIST_LOAD(h->retransmitted), (unsigned long) segments,
+            ( 0 < segments ) ? 100.0 * HIST_LOAD(h->retransmitted) / segments : 0.0, busy / 1000.0,
+            ( 0 < busy ) ? 100.0 * HIST_LOAD(h->rwnd_limited) / busy : 0.0,
+            ( 0 < busy ) ? 100.0 * HIST_LOAD(h->sndbuf_limited) / busy : 0.0);
+    hist_print(out, "rtt", &h->rtt, 1000.0, "us");
+    hist_print(out, "delivery rate", &h->delivery_rate, 1e6, "MB/s");
+    hist_print(out, "retransmits", &h->retransmits, 1.0, "");
+    hist_print(out, "rwnd limited", &h->rwnd_time, 1e6, "ms");
+    hist_print(out, "sndbuf limited", &h->sndbuf_time, 1e6, "ms");
+}
+
+#endif // TCPINFO_H
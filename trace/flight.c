@@ -0,0 +1,539 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Decodes the files written by server --recorder (see recorder.h), which are still
+ * complete after the server crashed or was killed. For each file it prints the process,
+ * and for each thread how many events it recorded and how many of them its ring kept,
+ * then:
+ *
+ *   --timeline    every event, of all the files merged in the order they happened, with
+ *                 its time since the first one
+ *   --waterfall   one line per connection: when it was accepted, how long until its first
+ *                 byte, its acks, how many times its sends were queued and for how long,
+ *                 its errors and its lifetime, with a bar placing its events on the time
+ *                 axis of all the connections shown
+ *
+ * --conn ID restricts both to one connection, and --limit N to the first N lines. The
+ * events of libserver.c carry only the descriptor, and are attributed to the connection
+ * that was last accepted on it by the same thread; those from before the oldest event
+ * kept for that descriptor show a connection of "?".
+ *
+ * Usage: trace/flight [-t] [-w] [-c ID] [-n N] /var/tmp/server.flight.*
+ *
+ * Build: cc -O2 -o trace/flight trace/flight.c
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>     // getopt_long()
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>   // mmap()
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../recorder.h"
+
+// columns of the bars of --waterfall
+#define BAR_WIDTH 60
+
+static const char *type_names[RECORD_TYPES] = { "?", "accept", "first-byte", "ack", "eagain", "drained", "error",
+                                                "close" };
+
+struct event
+{
+    uint64_t ns;                // wall clock time, in ns since the epoch
+    uint32_t conn;              // 0 if it could not be attributed
+    int32_t fd;
+    uint32_t arg;
+    uint16_t type;
+    int pid;
+    int tid;
+};
+
+struct connection
+{
+    int pid;
+    uint32_t conn;
+    int fd;
+    uint64_t first;             // the first and last events kept
+    uint64_t last;
+    uint64_t accepted;          // 0 if not kept
+    uint64_t first_byte;
+    uint64_t closed;
+    unsigned long acks;
+    unsigned long acked;
+    unsigned long bursts;
+    uint64_t queued;            // time spent with sends queued, in ns
+    unsigned long errors;
+    uint32_t bytes;             // received, known at close
+    size_t begin;               // its events in the array sorted by connection
+    size_t end;
+};
+
+static struct event *events = NULL;
+static size_t nevents = 0;
+static size_t capacity = 0;
+
+static uint32_t only_conn = 0;
+static long limit = -1;
+
+static void add_event(struct event *e)
+{
+    if ( nevents == capacity )
+    {
+        capacity = ( 0 == capacity ) ? 65536 : capacity * 2;
+        events = (struct event *) realloc(events, capacity * sizeof(struct event));
+        if ( NULL == events )
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    events[nevents++] = *e;
+}
+
+// the connection last accepted on each descriptor, while a ring is read
+static uint32_t *fd_conns = NULL;
+static size_t fd_capacity = 0;
+
+static uint32_t *fd_conn(int fd)
+{
+    if ( (size_t) fd >= fd_capacity )
+    {
+        size_t n = ( 0 == fd_capacity ) ? 1024 : fd_capacity;
+        while ( n <= (size_t) fd )
+            n *= 2;
+
+        fd_conns = (uint32_t *) realloc(fd_conns, n * sizeof(uint32_t));
+        if ( NULL == fd_conns )
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        memset(fd_conns + fd_capacity, 0, ( n - fd_capacity ) * sizeof(uint32_t));
+        fd_capacity = n;
+    }
+
+    return &fd_conns[fd];
+}
+
+static void print_time(FILE *out, uint64_t ns)
+{
+    char when[32];
+    struct tm tm;
+    time_t sec = ns / 1000000000;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&sec, &tm));
+    fprintf(out, "%s.%06lu", when, (unsigned long) ( ns % 1000000000 / 1000 ));
+}
+
+// reads the events kept by the rings of a file, and prints what the file holds
+static void load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if ( -1 == fd )
+    {
+        fprintf(stderr, "%s: open error (%d)\n", path, errno);
+        exit(1);
+    }
+
+    struct stat st;
+    if ( -1 == fstat(fd, &st) )
+    {
+        fprintf(stderr, "%s: stat error (%d)\n", path, errno);
+        exit(1);
+    }
+
+    if ( (size_t) st.st_size < sizeof(struct recorder_header) )
+    {
+        fprintf(stderr, "%s: not a recorder file\n", path);
+        exit(1);
+    }
+
+    void *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( MAP_FAILED == file )
+    {
+        fprintf(stderr, "%s: mmap error (%d)\n", path, errno);
+        exit(1);
+    }
+
+    struct recorder_header *header = (struct recorder_header *) file;
+    if ( RECORDER_MAGIC != header->magic || RECORDER_VERSION != header->version
+         || RECORDER_THREADS != header->threads || RECORDER_EVENTS != header->events
+         || (size_t) st.st_size < RECORDER_FILE_SIZE )
+    {
+        fprintf(stderr, "%s: not a recorder file of version %d\n", path, RECORDER_VERSION);
+        exit(1);
+    }
+
+    uint32_t rings = ( RECORDER_THREADS < header->rings ) ? RECORDER_THREADS : header->rings;
+
+    printf("%s: pid:%d, started:", path, header->pid);
+    print_time(stdout, header->started);
+    printf(", tsc:%.2fGHz, threads:%u\n", header->tsc_per_ns, rings);
+
+    for ( uint32_t r = 0; r < rings; r++ )
+    {
+        struct recorder_ring *ring = recorder_ring_at(file, r);
+        struct recorder_event *ring_events = recorder_events(ring);
+
+        // Once the ring has wrapped, its oldest slot is the one that was being
+        // overwritten when the recording stopped, which may be torn.
+        uint64_t head = ring->head;
+        uint64_t first = ( RECORDER_EVENTS <= head ) ? head - RECORDER_EVENTS + 1 : 0;
+
+        memset(fd_conns, 0, fd_capacity * sizeof(uint32_t));
+
+        uint64_t from = 0, to = 0;
+        for ( uint64_t i = first; i < head; i++ )
+        {
+            struct recorder_event *re = &ring_events[i & ( RECORDER_EVENTS - 1 )];
+
+            struct event e;
+            e.ns = header->started + (int64_t) ( (int64_t) ( re->tsc - header->started_tsc ) / header->tsc_per_ns );
+            e.conn = re->conn;
+            e.fd = re->fd;
+            e.arg = re->arg;
+            e.type = ( 0 < re->type && re->type < RECORD_TYPES ) ? re->type : 0;
+            e.pid = header->pid;
+            e.tid = ring->tid;
+
+            if ( 0 <= e.fd )
+            {
+                uint32_t *conn = fd_conn(e.fd);
+                if ( RECORD_ACCEPT == e.type )
+                    *conn = e.conn;
+                else if ( 0 == e.conn )
+                    e.conn = *conn;
+                if ( RECORD_CLOSE == e.type )
+                    *conn = 0;
+            }
+
+            if ( i == first )
+                from = e.ns;
+            to = e.ns;
+            add_event(&e);
+        }
+
+        printf("  thread %d (%s): recorded:%lu, kept:%lu, span:%.3fms\n", ring->tid, ring->name,
+               (unsigned long) head, (unsigned long) ( head - first ), ( to - from ) / 1e6);
+    }
+
+    munmap(file, st.st_size);
+}
+
+static int by_time(const void *a, const void *b)
+{
+    const struct event *x = (const struct event *) a, *y = (const struct event *) b;
+    return ( x->ns > y->ns ) - ( x->ns < y->ns );
+}
+
+static int by_connection(const void *a, const void *b)
+{
+    const struct event *x = (const struct event *) a, *y = (const struct event *) b;
+    if ( x->pid != y->pid )
+        return ( x->pid > y->pid ) - ( x->pid < y->pid );
+    if ( x->conn != y->conn )
+        return ( x->conn > y->conn ) - ( x->conn < y->conn );
+    return by_time(a, b);
+}
+
+static int by_start(const void *a, const void *b)
+{
+    const struct connection *x = (const struct connection *) a, *y = (const struct connection *) b;
+    return ( x->first > y->first ) - ( x->first < y->first );
+}
+
+static void print_timeline(void)
+{
+    qsort(events, nevents, sizeof(struct event), by_time);
+
+    long lines = 0;
+    for ( size_t i = 0; i < nevents && lines != limit; i++ )
+    {
+        struct event *e = &events[i];
+        if ( 0 != only_conn && e->conn != only_conn )
+            continue;
+
+        printf("%14.6fms  pid:%d, tid:%d, ", ( e->ns - events[0].ns ) / 1e6, e->pid, e->tid);
+        if ( 0 != e->conn )
+            printf("conn:%u, ", e->conn);
+        else if ( 0 <= e->fd )
+            printf("conn:?, ");
+        printf("fd:%d, %s", e->fd, type_names[e->type]);
+
+        switch ( e->type )
+        {
+            case RECORD_FIRST_BYTE:
+            case RECORD_ACK:
+                printf(" %u bytes", e->arg);
+                break;
+
+            case RECORD_EAGAIN:
+                printf(" %u bytes queued", e->arg);
+                break;
+
+            case RECORD_ERROR:
+                printf(" %s (%u)", strerror((int) e->arg), e->arg);
+                break;
+
+            case RECORD_CLOSE:
+                printf(" %u bytes received", e->arg);
+                break;
+        }
+        printf("\n");
+        lines++;
+    }
+}
+
+// the events of a connection placed on the time axis, the more telling ones on top
+static void draw_bar(char *bar, struct connection *c, uint64_t from, uint64_t span)
+{
+    static const char marks[RECORD_TYPES] = { '?', 'A', 'F', 'a', 'e', '-', 'x', 'C' };
+    static const int ranks[RECORD_TYPES] = { 0, 5, 4, 2, 3, 1, 7, 6 };
+
+    memset(bar, ' ', BAR_WIDTH);
+    bar[BAR_WIDTH] = '\0';
+
+    int begin = (int) ( ( c->first - from ) * ( BAR_WIDTH - 1 ) / span );
+    int end = (int) ( ( c->last - from ) * ( BAR_WIDTH - 1 ) / span );
+    for ( int i = begin; i <= end; i++ )
+        bar[i] = '-';
+
+    // still open when the recording stopped
+    if ( 0 == c->closed && end < BAR_WIDTH - 1 )
+        bar[end + 1] = '>';
+
+    int rank[BAR_WIDTH] = { 0 };
+    for ( size_t i = c->begin; i < c->end; i++ )
+    {
+        struct event *e = &events[i];
+        int col = (int) ( ( e->ns - from ) * ( BAR_WIDTH - 1 ) / span );
+        if ( rank[col] <= ranks[e->type] )
+        {
+            rank[col] = ranks[e->type];
+            bar[col] = marks[e->type];
+        }
+    }
+}
+
+static void print_waterfall(void)
+{
+    qsort(events, nevents, sizeof(struct event), by_connection);
+
+    struct connection *conns = NULL;
+    size_t nconns = 0;
+
+    for ( size_t i = 0; i < nevents; )
+    {
+        struct event *e = &events[i];
+        if ( 0 == e->conn || ( 0 != only_conn && e->conn != only_conn ) )
+        {
+            i++;
+            continue;
+        }
+
+        if ( 0 == nconns % 1024 )
+        {
+            conns = (struct connection *) realloc(conns, ( nconns + 1024 ) * sizeof(struct connection));
+            if ( NULL == conns )
+            {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+
+        struct connection *c = &conns[nconns++];
+        memset(c, 0, sizeof(*c));
+        c->pid = e->pid;
+        c->conn = e->conn;
+        c->fd = e->fd;
+        c->first = e->ns;
+        c->begin = i;
+
+        uint64_t burst = 0;
+        for ( ; i < nevents && events[i].pid == c->pid && events[i].conn == c->conn; i++ )
+        {
+            e = &events[i];
+            c->last = e->ns;
+
+            switch ( e->type )
+            {
+                case RECORD_ACCEPT:
+                    c->accepted = e->ns;
+                    break;
+
+                case RECORD_FIRST_BYTE:
+                    c->first_byte = e->ns;
+                    break;
+
+                case RECORD_ACK:
+                    c->acks++;
+                    c->acked += e->arg;
+                    break;
+
+                case RECORD_EAGAIN:
+                    c->bursts++;
+                    burst = e->ns;
+                    break;
+
+                case RECORD_DRAINED:
+                    if ( 0 != burst )
+                        c->queued += e->ns - burst;
+                    burst = 0;
+                    break;
+
+                case RECORD_ERROR:
+                    c->errors++;
+                    break;
+
+                case RECORD_CLOSE:
+                    c->closed = e->ns;
+                    c->bytes = e->arg;
+                    break;
+            }
+        }
+        c->end = i;
+    }
+
+    if ( 0 == nconns )
+    {
+        printf("no connections\n");
+        free(conns);
+        return;
+    }
+
+    qsort(conns, nconns, sizeof(struct connection), by_start);
+
+    size_t shown = ( 0 <= limit && (size_t) limit < nconns ) ? (size_t) limit : nconns;
+
+    uint64_t from = conns[0].first, to = 0;
+    for ( size_t i = 0; i < shown; i++ )
+    {
+        if ( to < conns[i].last )
+            to = conns[i].last;
+    }
+    uint64_t span = ( to > from ) ? to - from : 1;
+
+    printf("waterfall: connections:%lu, span:%.3fms, A accept, F first byte, a ack, e sends queued,"
+           " - until drained, x error, C close, > still open\n", (unsigned long) nconns, span / 1e6);
+    printf("%8s %7s %6s %12s %10s %6s %6s %10s %6s %11s %10s\n", "conn", "pid", "fd", "start(ms)", "first(us)",
+           "acks", "queued", "queued(ms)", "errors", "life(ms)", "bytes");
+
+    char bar[BAR_WIDTH + 1];
+    for ( size_t i = 0; i < shown; i++ )
+    {
+        struct connection *c = &conns[i];
+        draw_bar(bar, c, from, span);
+
+        printf("%8u %7d %6d %12.3f ", c->conn, c->pid, c->fd, ( c->first - from ) / 1e6);
+        if ( 0 != c->accepted && 0 != c->first_byte )
+            printf("%10.1f ", ( c->first_byte - c->accepted ) / 1e3);
+        else
+            printf("%10s ", "-");
+        printf("%6lu %6lu %10.3f %6lu ", c->acks, c->bursts, c->queued / 1e6, c->errors);
+        if ( 0 != c->accepted && 0 != c->closed )
+            printf("%11.3f ", ( c->closed - c->accepted ) / 1e6);
+        else
+            printf("%11s ", "-");
+        if ( 0 != c->closed )
+            printf("%10u", c->bytes);
+        else
+            printf("%10s", "-");
+        printf(" |%s|\n", bar);
+    }
+
+    free(conns);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t|--timeline] [-w|--waterfall] [-c|--conn ID] [-n|--limit N] FILE...\n", prog);
+    fprintf(stderr, "  -t, --timeline      print every event in the order they happened\n");
+    fprintf(stderr, "  -w, --waterfall     print one line per connection, with its events on a bar\n");
+    fprintf(stderr, "  -c, --conn ID       only the events of connection ID\n");
+    fprintf(stderr, "  -n, --limit N       at most N lines of the timeline and of the waterfall\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int timeline = 0;
+    int waterfall = 0;
+
+    static const struct option long_options[] =
+    {
+        { "timeline",  no_argument,       NULL, 't' },
+        { "waterfall", no_argument,       NULL, 'w' },
+        { "conn",      required_argument, NULL, 'c' },
+        { "limit",     required_argument, NULL, 'n' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL,        0,                 NULL, 0   }
+    };
+
+    int opt;
+    while ( -1 != ( opt = getopt_long(argc, argv, "twc:n:h", long_options, NULL) ) )
+    {
+        switch ( opt )
+        {
+            case 't':
+                timeline = 1;
+                break;
+
+            case 'w':
+                waterfall = 1;
+                break;
+
+            case 'c':
+                only_conn = (uint32_t) strtoul(optarg, NULL, 10);
+                if ( 0 == only_conn )
+                {
+                    fprintf(stderr, "invalid connection id: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'n':
+                limit = atol(optarg);
+                if ( limit < 1 )
+                {
+                    fprintf(stderr, "invalid limit: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if ( optind == argc )
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    for ( int i = optind; i < argc; i++ )
+        load(argv[i]);
+
+    if ( timeline )
+        print_timeline();
+
+    if ( waterfall )
+    {
+        if ( timeline )
+            printf("\n");
+        print_waterfall();
+    }
+
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Named profiles of TCP socket options, for the server's listener and the sockets it
+ * accepts and for those the client connects:
+ *
+ *   latency     TCP_NODELAY, TCP_QUICKACK, a short unsent queue (TCP_NOTSENT_LOWAT)
+ *               so that what is written goes out fresh, and the buffers left to the
+ *               kernel's autotuning
+ *   throughput  TCP_CORK, so that only full segments are sent until a message is
+ *               complete, and large buffers
+ *   bulk-wan    the same, with larger buffers for a long fat path, a bounded unsent
+ *               queue, and BBR, which does not take a loss for congestion
+ *
+ * The buffer sizes have to be set before the connection is set up, on the listener or
+ * on the socket before connect(), for the window scale to allow for them; setting them
+ * turns the kernel's autotuning off for the socket. They are capped by
+ * net.core.rmem_max and wmem_max unless the process may force them past it, and the
+ * kernel doubles them for its bookkeeping. A congestion control the process may not
+ * use (net.ipv4.tcp_allowed_congestion_control) leaves that of the system; tuning_print()
+ * shows what a socket actually got.
+ *
+ * Two of the options need the caller's help: a corked socket holds the tail of what was
+ * written until tuning_push() once a message is complete, and the kernel leaves quick
+ * ack mode on its own, so tuning_rearm() rearms it after each read. Both cost system
+ * calls each time they do something.
+ */
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <linux/tcp.h>  // TCP_NOTSENT_LOWAT, TCP_CONGESTION, newer than netinet/tcp.h
+#include <netinet/in.h> // IPPROTO_TCP
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+struct tuning
+{
+    const char *name;
+    int rcvbuf;                 // in bytes, 0 to leave it to autotuning
+    int sndbuf;
+    int nodelay;
+    int cork;
+    int notsent_lowat;          // in bytes, 0 to leave it unset
+    int quickack;
+    const char *congestion;     // NULL to leave that of the system
+};
+
+static const struct tuning tunings[] =
+{
+    { "latency",    0,                0,                1, 0, 16384,  1, NULL  },
+    { "throughput", 4 * 1024 * 1024,  4 * 1024 * 1024,  0, 1, 0,      0, NULL  },
+    { "bulk-wan",   16 * 1024 * 1024, 16 * 1024 * 1024, 0, 1, 131072, 0, "bbr" },
+};
+
+#define TUNINGS ( sizeof(tunings) / sizeof(tunings[0]) )
+
+// the profile of the given name, or NULL
+static inline const struct tuning *tuning_find(const char *name)
+{
+    for ( size_t i = 0; i < TUNINGS; i++ )
+    {
+        if ( 0 == strcmp(tunings[i].name, name) )
+            return &tunings[i];
+    }
+
+    return NULL;
+}
+
+// the names of the profiles, for usage()
+static inline void tuning_names(FILE *out)
+{
+    for ( size_t i = 0; i < TUNINGS; i++ )
+        fprintf(out, "%s%s", ( 0 < i ) ? ", " : "", tunings[i].name);
+}
+
+static inline int tuning_set_buffer(int fd, int force, int option, int size)
+{
+    if ( 0 == size )
+        return 0;
+
+    // past net.core.rmem_max or wmem_max where the process has CAP_NET_ADMIN
+    if ( 0 == setsockopt(fd, SOL_SOCKET, force, &size, sizeof(size)) )
+        return 0;
+
+    return setsockopt(fd, SOL_SOCKET, option, &size, sizeof(size));
+}
+
+// Sets the buffer sizes, on a listener or a socket not connected yet. Returns -1 with
+// errno set.
+static inline int tuning_set_buffers(const struct tuning *t, int fd)
+{
+    if ( -1 == tuning_set_buffer(fd, SO_RCVBUFFORCE, SO_RCVBUF, t->rcvbuf)
+         || -1 == tuning_set_buffer(fd, SO_SNDBUFFORCE, SO_SNDBUF, t->sndbuf) )
+        return -1;
+
+    return 0;
+}
+
+// Sets the other options, on a connected socket or on a listener, whose accepted sockets
+// inherit all of them but quick ack mode. Returns -1 with errno set.
+static inline int tuning_apply(const struct tuning *t, int fd)
+{
+    int on = 1;
+
+    if ( t->nodelay && -1 == setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) )
+        return -1;
+    if ( t->cork && -1 == setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) )
+        return -1;
+    if ( t->quickack && -1 == setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on)) )
+        return -1;
+
+    if ( 0 < t->notsent_lowat
+         && -1 == setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &t->notsent_lowat, sizeof(t->notsent_lowat)) )
+        return -1;
+
+    // not available, or not allowed: the system's is kept, as tuning_print() shows
+    if ( NULL != t->congestion )
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, t->congestion, strlen(t->congestion));
+
+    return 0;
+}
+
+// sends what a corked socket holds back, once a message is complete
+static inline void tuning_push(const struct tuning *t, int fd)
+{
+    if ( NULL == t || !t->cork )
+        return;
+
+    int off = 0, on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// rearms quick ack mode, as a connection opens and after each read
+static inline void tuning_rearm(const struct tuning *t, int fd)
+{
+    if ( NULL == t || !t->quickack )
+        return;
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+}
+
+// prints the options a socket actually has under a profile
+static inline void tuning_print(FILE *out, const struct tuning *t, int fd)
+{
+    int rcvbuf = 0, sndbuf = 0, nodelay = 0, cork = 0, lowat = 0;
+    char congestion[16] = "?";
+    socklen_t len;
+
+    len = sizeof(rcvbuf);
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+    len = sizeof(sndbuf);
+    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    len = sizeof(nodelay);
+    getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+    len = sizeof(cork);
+    getsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, &len);
+    len = sizeof(lowat);
+    getsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, &len);
+    len = sizeof(congestion) - 1;
+    if ( 0 == getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, congestion, &len) )
+        congestion[len] = '\0';
+
+    fprintf(out, "tuning: profile:%s, rcvbuf:%d, sndbuf:%d, nodelay:%d, cork:%d, notsent_lowat:%d, quickack:%d, "
+                 "congestion:%s",
+            t->name, rcvbuf, sndbuf, nodelay, cork, lowat, t->quickack, congestion);
+    if ( NULL != t->congestion && 0 != strcmp(t->congestion, congestion) )
+        fprintf(out, " (%s not allowed)", t->congestion);
+    fprintf(out, "\n");
+}
+
+#endif // TUNING_H
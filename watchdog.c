@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A watchdog over the event loop. See watchdog.h.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <execinfo.h>   // backtrace()
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "phases.h"
+#include "watchdog.h"
+
+// the stalls kept, the latest ones
+#define WATCHDOG_RING 64
+
+// frames of each stack
+#define WATCHDOG_FRAMES 32
+
+// how long the watchdog waits for the loop's thread to take its stack
+#define WATCHDOG_CAPTURE_MS 100
+
+// the signal the loop's thread takes its stack on
+#define WATCHDOG_SIGNAL ( SIGRTMIN + 1 )
+
+struct stall
+{
+    time_t at;                  // when it was caught, in seconds of the epoch
+    unsigned long iteration;
+    uint64_t caught;            // how long the iteration had run when it was caught, in ns
+    uint64_t lasted;            // how long it ran in the end, 0 until it is over
+    enum phase phase;
+    int fd;
+    int nframes;
+    void *frames[WATCHDOG_FRAMES];
+};
+
+static struct server *watched = NULL;
+static pthread_t loop_thread;
+static pthread_t watchdog_thread;
+static uint64_t threshold_ns;
+static int threshold;
+
+// the heartbeat: when the current iteration started, 0 while the loop waits
+static uint64_t busy_since = 0;
+static unsigned long iterations = 0;
+
+// written by the loop's thread only, in its signal handler for the ring
+static struct histogram loop_lag;
+static struct stall ring[WATCHDOG_RING];
+static unsigned long stalls = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// runs on the loop's thread, interrupted in the middle of the stalled iteration
+static void take_stack(int signo)
+{
+    (void) signo;
+    int err = errno;
+
+    uint64_t since = __atomic_load_n(&busy_since, __ATOMIC_RELAXED);
+    struct stall *s = &ring[stalls % WATCHDOG_RING];
+
+    s->at = time(NULL);
+    s->iteration = iterations;
+    s->caught = ( 0 != since ) ? now_ns() - since : 0;
+    s->lasted = 0;
+    s->phase = phase_current;
+    s->fd = server_current_fd(watched);
+    s->nframes = backtrace(s->frames, WATCHDOG_FRAMES);
+
+    __atomic_store_n(&stalls, stalls + 1, __ATOMIC_RELEASE);
+    errno = err;
+}
+
+static void print_stall(FILE *out, struct stall *s)
+{
+    char when[32];
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&s->at, &tm));
+
+    fprintf(out, "stall: at:%s, iteration:%lu, phase:%s, fd:%d, caught:%.1fms", when, s->iteration,
+            phase_name(s->phase), s->fd, s->caught / 1e6);
+    if ( 0 != s->lasted )
+        fprintf(out, ", lasted:%.1fms", s->lasted / 1e6);
+    fprintf(out, "\n");
+
+    // the first frame is the signal handler
+    char **symbols = backtrace_symbols(s->frames + 1, s->nframes - 1);
+    for ( int i = 0; i < s->nframes - 1; i++ )
+    {
+        if ( NULL != symbols )
+            fprintf(out, "    %s\n", symbols[i]);
+        else
+            fprintf(out, "    %p\n", s->frames[i + 1]);
+    }
+    free(symbols);
+}
+
+static void *watch(void *arg)
+{
+    (void) arg;
+
+    unsigned long reported = 0;
+
+    // looking a few times per threshold catches a stall at most a quarter late
+    long period = threshold_ns / 4;
+    if ( period < 1000000 )
+        period = 1000000;
+
+    while ( 1 )
+    {
+        struct timespec ts = { period / 1000000000, period % 1000000000 };
+        nanosleep(&ts, NULL);
+
+        uint64_t since = __atomic_load_n(&busy_since, __ATOMIC_RELAXED);
+        unsigned long iteration = __atomic_load_n(&iterations, __ATOMIC_RELAXED);
+        if ( 0 == since || iteration == reported || now_ns() - since < threshold_ns )
+            continue;
+
+        // once per iteration, however long it stalls
+        reported = iteration;
+
+        unsigned long caught = __atomic_load_n(&stalls, __ATOMIC_ACQUIRE);
+        if ( 0 != pthread_kill(loop_thread, WATCHDOG_SIGNAL) )
+            continue;
+
+        for ( int waited = 0; waited < WATCHDOG_CAPTURE_MS; waited++ )
+        {
+            if ( caught != __atomic_load_n(&stalls, __ATOMIC_ACQUIRE) )
+            {
+                struct stall s = ring[caught % WATCHDOG_RING];
+                print_stall(stderr, &s);
+                break;
+            }
+
+            struct timespec ms = { 0, 1000000 };
+            nanosleep(&ms, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int watchdog_start(struct server *srv, int threshold_ms)
+{
+    watched = srv;
+    loop_thread = pthread_self();
+    threshold = threshold_ms;
+    threshold_ns = (uint64_t) threshold_ms * 1000000;
+
+    // the first call loads what backtrace() needs, which is not safe in a signal handler
+    void *frames[1];
+    backtrace(frames, 1);
+
+    phases_track();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = take_stack;
+
+    // the write the loop may be stuck in goes on after the handler
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if ( -1 == sigaction(WATCHDOG_SIGNAL, &sa, NULL) )
+        return -1;
+
+    // the watchdog's thread must not take the signals meant for the loop
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&watchdog_thread, NULL, watch, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if ( 0 != err )
+    {
+        errno = err;
+        return -1;
+    }
+
+    pthread_detach(watchdog_thread);
+    return 0;
+}
+
+void watchdog_busy(void)
+{
+    if ( NULL == watched )
+        return;
+
+    __atomic_store_n(&iterations, iterations + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&busy_since, now_ns(), __ATOMIC_RELAXED);
+}
+
+void watchdog_idle(void)
+{
+    if ( NULL == watched )
+        return;
+
+    uint64_t lasted = now_ns() - busy_since;
+    __atomic_store_n(&busy_since, 0, __ATOMIC_RELAXED);
+    hist_record(&loop_lag, lasted);
+
+    // the stall caught in this iteration, if any, now knows how long it was
+    unsigned long caught = __atomic_load_n(&stalls, __ATOMIC_ACQUIRE);
+    if ( 0 < caught && iterations == ring[( caught - 1 ) % WATCHDOG_RING].iteration )
+        ring[( caught - 1 ) % WATCHDOG_RING].lasted = lasted;
+}
+
+void watchdog_print_stats(FILE *out)
+{
+    if ( NULL == watched )
+        return;
+
+    unsigned long caught = __atomic_load_n(&stalls, __ATOMIC_ACQUIRE);
+
+    fprintf(out, "watchdog: threshold:%dms, iterations:%lu, stalls:%lu\n", threshold,
+            __atomic_load_n(&iterations, __ATOMIC_RELAXED), caught);
+    hist_print(out, "loop lag", &loop_lag, 1000.0, "us");
+
+    unsigned long first = ( WATCHDOG_RING < caught ) ? caught - WATCHDOG_RING : 0;
+    for ( unsigned long i = first; i < caught; i++ )
+    {
+        struct stall s = ring[i % WATCHDOG_RING];
+        print_stall(out, &s);
+    }
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A watchdog over the event loop. The loop marks when it wakes up with events and when
+ * it is done with them; a thread of the watchdog looks at that heartbeat a few times per
+ * threshold, and when an iteration has run past the threshold it signals the loop's
+ * thread, whose handler takes its stack with backtrace() along with the phase it is in
+ * (see phases.h) and the descriptor whose event it is handling.
+ *
+ * Each stall is reported on stderr as it is caught, and kept in a ring of the latest
+ * ones, printed with the time every iteration took, the loop lag, by
+ * watchdog_print_stats(). Function names need the program linked with -rdynamic.
+ */
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdio.h>
+
+#include "libserver.h"
+
+// Starts watching the event loop of srv, run on the calling thread, for iterations
+// longer than threshold_ms. Returns -1 with errno set.
+int watchdog_start(struct server *srv, int threshold_ms);
+
+// called by the loop when it wakes up, and once it is done with the events
+void watchdog_busy(void);
+void watchdog_idle(void);
+
+// prints nothing unless the watchdog was started in this process
+void watchdog_print_stats(FILE *out);
+
+#endif // WATCHDOG_H